@@ -7,10 +7,18 @@ MANPAGES = \
 	docs/man/telemetrics.conf.5
 
 MANLINKS = \
+	docs/man/tm_close_session.3 \
 	docs/man/tm_create_record.3 \
+	docs/man/tm_flush_async.3 \
+	docs/man/tm_get_async_stats.3 \
+	docs/man/tm_open_session.3 \
 	docs/man/tm_send_record.3 \
+	docs/man/tm_send_record_async.3 \
+	docs/man/tm_send_records.3 \
+	docs/man/tm_session_send.3 \
 	docs/man/tm_set_config_file.3 \
-	docs/man/tm_set_payload.3
+	docs/man/tm_set_payload.3 \
+	docs/man/tm_set_payload_len.3
 
 manpages:
 	for MANPAGE in $(MANPAGES); do \
@@ -0,0 +1,119 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer_pool.h"
+
+static inline size_t class_size(size_t class)
+{
+        return (size_t)BUFFER_POOL_MIN_SIZE << class;
+}
+
+/**
+ * Find the smallest class holding size bytes
+ *
+ * @param pool The pool
+ * @param size Number of bytes needed
+ *
+ * @return The class, or pool->nclasses if size is too large for the pool
+ */
+static size_t size_class(struct buffer_pool *pool, size_t size)
+{
+        size_t class = 0;
+
+        while (class < pool->nclasses && class_size(class) < size) {
+                class++;
+        }
+
+        return class;
+}
+
+void buffer_pool_init(struct buffer_pool *pool, size_t max_size)
+{
+        memset(pool, 0, sizeof(*pool));
+
+        pool->nclasses = 1;
+        while (pool->nclasses < BUFFER_POOL_MAX_CLASSES &&
+               class_size(pool->nclasses - 1) < max_size) {
+                pool->nclasses++;
+        }
+}
+
+void *buffer_pool_get(struct buffer_pool *pool, size_t size, size_t *alloc)
+{
+        size_t class = size_class(pool, size);
+        void *buf;
+
+        if (class == pool->nclasses) {
+                pool->stats.misses++;
+                *alloc = size;
+                return malloc(size);
+        }
+
+        if (pool->count[class] > 0) {
+                pool->stats.hits++;
+                pool->stats.cached_bytes -= class_size(class);
+                *alloc = class_size(class);
+                return pool->free[class][--pool->count[class]];
+        }
+
+        pool->stats.misses++;
+        buf = malloc(class_size(class));
+        if (buf) {
+                *alloc = class_size(class);
+        }
+
+        return buf;
+}
+
+void buffer_pool_put(struct buffer_pool *pool, void *buf, size_t alloc)
+{
+        size_t class;
+
+        if (buf == NULL) {
+                return;
+        }
+
+        class = size_class(pool, alloc);
+        if (class == pool->nclasses || class_size(class) != alloc ||
+            pool->count[class] == BUFFER_POOL_DEPTH) {
+                free(buf);
+                return;
+        }
+
+        pool->free[class][pool->count[class]++] = buf;
+        pool->stats.cached_bytes += alloc;
+}
+
+size_t buffer_pool_trim(struct buffer_pool *pool)
+{
+        size_t freed = 0;
+
+        for (size_t class = 0; class < pool->nclasses; class++) {
+                while (pool->count[class] > 0) {
+                        free(pool->free[class][--pool->count[class]]);
+                        freed += class_size(class);
+                }
+        }
+        pool->stats.cached_bytes = 0;
+        pool->stats.trimmed_bytes += freed;
+
+        return freed;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,93 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Smallest buffer handed out; the classes above it double in size */
+#define BUFFER_POOL_MIN_SIZE 4096
+
+#define BUFFER_POOL_MAX_CLASSES 8
+
+/* Free buffers kept per class. Connections beyond that many release their
+ * buffers to malloc. */
+#define BUFFER_POOL_DEPTH 16
+
+struct buffer_pool_stats {
+        /* Requests served from a cached buffer */
+        uint64_t hits;
+        /* Requests that had to allocate */
+        uint64_t misses;
+        /* Bytes held in cached buffers */
+        uint64_t cached_bytes;
+        /* Bytes handed back to malloc by buffer_pool_trim() */
+        uint64_t trimmed_bytes;
+};
+
+/* Single-threaded cache of receive buffers, grouped in power of two size
+ * classes from BUFFER_POOL_MIN_SIZE up to the largest record size, so that
+ * connections reuse the buffers of the ones that went before them instead of
+ * going back to malloc each time.
+ */
+struct buffer_pool {
+        size_t nclasses;
+        size_t count[BUFFER_POOL_MAX_CLASSES];
+        void *free[BUFFER_POOL_MAX_CLASSES][BUFFER_POOL_DEPTH];
+        struct buffer_pool_stats stats;
+};
+
+/**
+ * Initialize a pool
+ *
+ * @param pool The pool
+ * @param max_size Largest buffer the pool caches. Larger requests are
+ *    served by malloc and freed on release.
+ */
+void buffer_pool_init(struct buffer_pool *pool, size_t max_size);
+
+/**
+ * Get a buffer of at least size bytes
+ *
+ * @param pool The pool
+ * @param size Number of bytes needed
+ * @param alloc Set to the size of the buffer returned, which must be passed
+ *    back to buffer_pool_put()
+ *
+ * @return The buffer, or NULL if out of memory
+ */
+void *buffer_pool_get(struct buffer_pool *pool, size_t size, size_t *alloc);
+
+/**
+ * Give a buffer back to the pool, or to malloc if its class is full
+ *
+ * @param pool The pool
+ * @param buf The buffer, may be NULL
+ * @param alloc The size returned along with buf by buffer_pool_get()
+ */
+void buffer_pool_put(struct buffer_pool *pool, void *buf, size_t alloc);
+
+/**
+ * Free all cached buffers
+ *
+ * @param pool The pool
+ *
+ * @return The number of bytes freed
+ */
+size_t buffer_pool_trim(struct buffer_pool *pool);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -21,29 +21,40 @@
 
 #include "common.h"
 
+#define HEADER_NAME(s) { s, sizeof(s) - 1 }
+
 /*Record headers to be sent in the following order */
-static const char *header_names[] = {
-        TM_RECORD_VERSION_STR,
-        TM_CLASSIFICATION_STR,
-        TM_SEVERITY_STR,
-        TM_MACHINE_ID_STR,
-        TM_TIMESTAMP_STR,
-        TM_ARCH_STR,
-        TM_HOST_TYPE_STR,
-        TM_SYSTEM_BUILD_STR,
-        TM_KERNEL_VERSION_STR,
-        TM_PAYLOAD_VERSION_STR,
-        TM_SYSTEM_NAME_STR,
-        TM_BOARD_NAME_STR,
-        TM_CPU_MODEL_STR,
-        TM_BIOS_VERSION_STR,
-        TM_EVENT_ID_STR
+static const struct {
+        const char *name;
+        size_t len;
+} header_names[] = {
+        HEADER_NAME(TM_RECORD_VERSION_STR),
+        HEADER_NAME(TM_CLASSIFICATION_STR),
+        HEADER_NAME(TM_SEVERITY_STR),
+        HEADER_NAME(TM_MACHINE_ID_STR),
+        HEADER_NAME(TM_TIMESTAMP_STR),
+        HEADER_NAME(TM_ARCH_STR),
+        HEADER_NAME(TM_HOST_TYPE_STR),
+        HEADER_NAME(TM_SYSTEM_BUILD_STR),
+        HEADER_NAME(TM_KERNEL_VERSION_STR),
+        HEADER_NAME(TM_PAYLOAD_VERSION_STR),
+        HEADER_NAME(TM_SYSTEM_NAME_STR),
+        HEADER_NAME(TM_BOARD_NAME_STR),
+        HEADER_NAME(TM_CPU_MODEL_STR),
+        HEADER_NAME(TM_BIOS_VERSION_STR),
+        HEADER_NAME(TM_EVENT_ID_STR)
 };
 
 const char *get_header_name(int ind)
 {
         assert(ind >= 0 && ind < NUM_HEADERS);
-        return header_names[ind];
+        return header_names[ind].name;
+}
+
+size_t get_header_name_len(int ind)
+{
+        assert(ind >= 0 && ind < NUM_HEADERS);
+        return header_names[ind].len;
 }
 
 /* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
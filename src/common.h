@@ -19,6 +19,7 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #define SMALL_LINE_BUF 80
@@ -115,9 +116,13 @@ struct telem_record {
         char *payload;
         size_t header_size;
         size_t payload_size;
+        bool payload_borrowed;
 };
 
 const char *get_header_name(int ind);
 
+/* Length of get_header_name(ind), without computing it */
+size_t get_header_name_len(int ind);
+
 
 /* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
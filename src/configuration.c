@@ -44,7 +44,9 @@ static const char *config_key_str[] = { "server",
                                         "spool_dir",
                                         "rate_limit_strategy",
                                         "cainfo",
-                                        "tidheader"};
+                                        "tidheader",
+                                        "staging_sync",
+                                        "post_compression" };
 
 static const char *config_key_int[] = { "record_expiry",
                                         "spool_max_size",
@@ -52,24 +54,45 @@ static const char *config_key_int[] = { "record_expiry",
                                         "record_window_length",
                                         "byte_window_length",
                                         "record_burst_limit",
-                                        "byte_burst_limit" };
+                                        "byte_burst_limit",
+                                        "idle_trim_time",
+                                        "staging_sync_interval",
+                                        "worker_threads",
+                                        "peer_record_rate",
+                                        "peer_byte_rate",
+                                        "inflight_max_size",
+                                        "post_parallelism",
+                                        "batch_max_records",
+                                        "batch_max_size",
+                                        "batch_max_delay",
+                                        "post_compression_threshold" };
 
 static const char *config_key_bool[] = { "rate_limit_enabled",
                                          "daemon_recycling_enabled",
                                          "record_retention_enabled",
-                                         "record_server_delivery_enabled" };
+                                         "record_server_delivery_enabled",
+                                         "shm_transport_enabled",
+                                         "record_stream_enabled",
+                                         "io_uring_enabled",
+                                         "batch_delivery_enabled" };
 
 static const char *config_str_default[] = { DEFAULT_SERVER_ADDR,
                                             DEFAULT_SOCKET_PATH,
                                             DEFAULT_SPOOL_DIR,
                                             DEFAULT_RATE_LIMIT_STRATEGY,
                                             DEFAULT_CAINFO,
-                                            DEFAULT_TIDHEADER };
+                                            DEFAULT_TIDHEADER,
+                                            DEFAULT_STAGING_SYNC,
+                                            DEFAULT_POST_COMPRESSION };
 
 static const bool config_bool_default[] = { DEFAULT_RATE_LIMIT_ENABLED,
                                             DEFAULT_DAEMON_RECYCLING_ENABLED,
                                             DEFAULT_RECORD_RETENTION_ENABLED,
-                                            DEFAULT_RECORD_SERVER_DELIVERY_ENABLED };
+                                            DEFAULT_RECORD_SERVER_DELIVERY_ENABLED,
+                                            DEFAULT_SHM_TRANSPORT_ENABLED,
+                                            DEFAULT_RECORD_STREAM_ENABLED,
+                                            DEFAULT_IO_URING_ENABLED,
+                                            DEFAULT_BATCH_DELIVERY_ENABLED };
 
 static const int config_int_default[] = { DEFAULT_RECORD_EXPIRY,
                                           DEFAULT_SPOOL_MAX_SIZE,
@@ -77,11 +100,38 @@ static const int config_int_default[] = { DEFAULT_RECORD_EXPIRY,
                                           DEFAULT_RECORD_WINDOW_LENGTH,
                                           DEFAULT_BYTE_WINDOW_LENGTH,
                                           DEFAULT_RECORD_BURST_LIMIT,
-                                          DEFAULT_BYTE_BURST_LIMIT };
+                                          DEFAULT_BYTE_BURST_LIMIT,
+                                          DEFAULT_IDLE_TRIM_TIME,
+                                          DEFAULT_STAGING_SYNC_INTERVAL,
+                                          DEFAULT_WORKER_THREADS,
+                                          DEFAULT_PEER_RECORD_RATE,
+                                          DEFAULT_PEER_BYTE_RATE,
+                                          DEFAULT_INFLIGHT_MAX_SIZE,
+                                          DEFAULT_POST_PARALLELISM,
+                                          DEFAULT_BATCH_MAX_RECORDS,
+                                          DEFAULT_BATCH_MAX_SIZE,
+                                          DEFAULT_BATCH_MAX_DELAY,
+                                          DEFAULT_POST_COMPRESSION_THRESHOLD };
 
 
 static struct configuration config = { { 0 }, { 0 }, { 0 }, false, NULL };
 
+/* A parsed configuration file, kept until the file changes */
+struct config_cache_entry {
+        /* NULL for an unused entry */
+        char *path;
+        dev_t dev;
+        ino_t ino;
+        struct timespec mtime;
+        /* Count of lookups at the last use of the entry, to evict the least
+         * recently used */
+        uint64_t last_use;
+        struct configuration config;
+};
+
+static struct config_cache_entry config_cache[CONFIG_CACHE_SIZE];
+static uint64_t config_cache_lookups = 0;
+
 static int validate_config_file(const char *f)
 {
         struct stat sbuf;
@@ -164,71 +214,85 @@ void free_config_struct(struct configuration *config)
         }
 }
 
-bool read_config_from_file(char *config_file, struct configuration *config)
+/**
+ * Set the values of a configuration from a parsed file, or their defaults
+ * for those the file does not set
+ *
+ * @param file The parsed file
+ * @param config The configuration
+ *
+ * @return true if successful, false if a value is not valid
+ */
+static bool read_config_values(NcHashmap *file, struct configuration *config)
 {
-        if (keyfile != NULL) {
-                nc_hashmap_free(keyfile);
-        }
-
-        keyfile = nc_ini_file_parse(config_file);
-        if (!keyfile) {
-                telem_log(LOG_ERR, "Failed to read config file\n");
-                return false;
-        } else {
-                for (int i = 0; i < CONF_STR_MAX; i++) {
-                        char *ptr;
-                        ptr = nc_hashmap_get(nc_hashmap_get(keyfile, "settings"), config_key_str[i]);
-                        if (ptr) {
-                                config->strValues[i] = strdup(ptr);
-                                if (config->strValues[i] == NULL) {
-                                        telem_log(LOG_ERR, "Could not set config item %s: %s\n",
-                                                  config_key_str[i], strerror(errno));
-                                        return false;
-                                }
-                        } else {
-                                config->strValues[i] = strdup(config_str_default[i]);
+        for (int i = 0; i < CONF_STR_MAX; i++) {
+                char *ptr;
+                ptr = nc_hashmap_get(nc_hashmap_get(file, "settings"), config_key_str[i]);
+                if (ptr) {
+                        config->strValues[i] = strdup(ptr);
+                        if (config->strValues[i] == NULL) {
+                                telem_log(LOG_ERR, "Could not set config item %s: %s\n",
+                                          config_key_str[i], strerror(errno));
+                                return false;
                         }
-
+                } else {
+                        config->strValues[i] = strdup(config_str_default[i]);
                 }
 
-                for (int i = 0; i < CONF_INT_MAX; i++) {
-                        char *ptr;
-                        ptr = nc_hashmap_get(nc_hashmap_get(keyfile, "settings"), config_key_int[i]);
-                        if (ptr) {
-                                errno = 0;
-                                config->intValues[i] = strtoll(ptr, NULL, 10);
-                                if (errno != 0) {
-                                        telem_log(LOG_ERR, "Error while parsing value of option %s: %s\n",
-                                                  config_key_int[i], strerror(errno));
-                                        return false;
-                                }
-                        } else {
-                                config->intValues[i] = config_int_default[i];
+        }
+
+        for (int i = 0; i < CONF_INT_MAX; i++) {
+                char *ptr;
+                ptr = nc_hashmap_get(nc_hashmap_get(file, "settings"), config_key_int[i]);
+                if (ptr) {
+                        errno = 0;
+                        config->intValues[i] = strtoll(ptr, NULL, 10);
+                        if (errno != 0) {
+                                telem_log(LOG_ERR, "Error while parsing value of option %s: %s\n",
+                                          config_key_int[i], strerror(errno));
+                                return false;
                         }
+                } else {
+                        config->intValues[i] = config_int_default[i];
                 }
+        }
 
-                for (int i = 0; i < CONF_BOOL_MAX; i++) {
-                        char *ptr;
-                        ptr = nc_hashmap_get(nc_hashmap_get(keyfile, "settings"), config_key_bool[i]);
-                        if (ptr) {
-                                if ((strcasecmp(ptr, "TRUE") == 0) || (strcmp(ptr, "1") == 0)) {
-                                        config->boolValues[i] = true;
-                                } else if ((strcasecmp(ptr, "FALSE") == 0) || (strcmp(ptr, "0") == 0)) {
-                                        config->boolValues[i] = false;
-                                } else {
-                                        telem_log(LOG_ERR, "Configuration item '%s' requires a boolean value\n",
-                                                  config_key_bool[i]);
-                                        return false;
-                                }
+        for (int i = 0; i < CONF_BOOL_MAX; i++) {
+                char *ptr;
+                ptr = nc_hashmap_get(nc_hashmap_get(file, "settings"), config_key_bool[i]);
+                if (ptr) {
+                        if ((strcasecmp(ptr, "TRUE") == 0) || (strcmp(ptr, "1") == 0)) {
+                                config->boolValues[i] = true;
+                        } else if ((strcasecmp(ptr, "FALSE") == 0) || (strcmp(ptr, "0") == 0)) {
+                                config->boolValues[i] = false;
                         } else {
-                                config->boolValues[i] = config_bool_default[i];
+                                telem_log(LOG_ERR, "Configuration item '%s' requires a boolean value\n",
+                                          config_key_bool[i]);
+                                return false;
                         }
+                } else {
+                        config->boolValues[i] = config_bool_default[i];
                 }
         }
 
         return true;
 }
 
+bool read_config_from_file(char *config_file, struct configuration *config)
+{
+        if (keyfile != NULL) {
+                nc_hashmap_free(keyfile);
+        }
+
+        keyfile = nc_ini_file_parse(config_file);
+        if (!keyfile) {
+                telem_log(LOG_ERR, "Failed to read config file\n");
+                return false;
+        }
+
+        return read_config_values(keyfile, config);
+}
+
 static void initialize_config(void)
 {
         if (config.initialized) {
@@ -271,9 +335,94 @@ void reload_config(void)
         initialize_config();
 }
 
+const struct configuration *current_config(void)
+{
+        initialize_config();
+        return &config;
+}
+
+/**
+ * Free the configuration of a cache entry, and make it unused
+ *
+ * @param entry The entry
+ */
+static void config_cache_evict(struct config_cache_entry *entry)
+{
+        for (int i = 0; i < CONF_STR_MAX; i++) {
+                free(entry->config.strValues[i]);
+        }
+        free(entry->path);
+        memset(entry, 0, sizeof(*entry));
+}
+
+const struct configuration *config_cache_get(const char *filename)
+{
+        struct config_cache_entry *entry = NULL;
+        NcHashmap *file;
+        struct stat st;
+        bool ok;
+
+        if (filename[0] != '/' || stat(filename, &st) != 0 || !S_ISREG(st.st_mode)) {
+                return NULL;
+        }
+        config_cache_lookups++;
+
+        for (int i = 0; i < CONFIG_CACHE_SIZE; i++) {
+                struct config_cache_entry *e = &config_cache[i];
+
+                if (e->path != NULL && strcmp(e->path, filename) == 0) {
+                        if (e->dev == st.st_dev && e->ino == st.st_ino &&
+                            e->mtime.tv_sec == st.st_mtim.tv_sec &&
+                            e->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                                e->last_use = config_cache_lookups;
+                                return &e->config;
+                        }
+                        /* Changed since it was parsed */
+                        entry = e;
+                        break;
+                }
+                if (entry == NULL || (entry->path != NULL &&
+                                      (e->path == NULL || e->last_use < entry->last_use))) {
+                        entry = e;
+                }
+        }
+
+        config_cache_evict(entry);
+        file = nc_ini_file_parse(filename);
+        if (!file) {
+                telem_log(LOG_ERR, "Failed to read config file %s\n", filename);
+                return NULL;
+        }
+        ok = read_config_values(file, &entry->config);
+        nc_hashmap_free(file);
+        entry->path = strdup(filename);
+        if (!ok || entry->path == NULL) {
+                config_cache_evict(entry);
+                return NULL;
+        }
+
+        entry->dev = st.st_dev;
+        entry->ino = st.st_ino;
+        entry->mtime = st.st_mtim;
+        entry->last_use = config_cache_lookups;
+        entry->config.initialized = true;
+        entry->config.config_file = entry->path;
+
+        return &entry->config;
+}
+
+void config_cache_release(void)
+{
+        for (int i = 0; i < CONFIG_CACHE_SIZE; i++) {
+                config_cache_evict(&config_cache[i]);
+        }
+}
+
 __attribute__((destructor))
 void free_configuration(void)
 {
+        config_cache_release();
+
         if (!config.initialized) {
                 return;
         }
@@ -295,10 +444,14 @@ void free_config_file(void)
         }
 }
 
+const char *config_server_addr(const struct configuration *c)
+{
+        return (const char *)c->strValues[CONF_SERVER_ADDR];
+}
+
 const char *server_addr_config()
 {
-        initialize_config();
-        return (const char *)config.strValues[CONF_SERVER_ADDR];
+        return config_server_addr(current_config());
 }
 
 const char *socket_path_config()
@@ -313,16 +466,24 @@ const char *spool_dir_config()
         return (const char *)config.strValues[CONF_SPOOL_DIR];
 }
 
+const char *config_cainfo(const struct configuration *c)
+{
+        return (const char *)c->strValues[CONF_CAINFO];
+}
+
 const char *get_cainfo_config()
 {
-        initialize_config();
-        return (const char *)config.strValues[CONF_CAINFO];
+        return config_cainfo(current_config());
+}
+
+const char *config_tidheader(const struct configuration *c)
+{
+        return (const char *)c->strValues[CONF_TIDHEADER];
 }
 
 const char *get_tidheader_config()
 {
-        initialize_config();
-        return (const char *)config.strValues[CONF_TIDHEADER];
+        return config_tidheader(current_config());
 }
 
 int64_t record_expiry_config()
@@ -417,6 +578,233 @@ int byte_window_length_config()
         return (val < 0 || val >= TM_MAX_WINDOW_LENGTH) ? -1 : (int)val;
 }
 
+int idle_trim_time_config()
+{
+        initialize_config();
+        int64_t val = 0;
+
+        val = config.intValues[CONF_IDLE_TRIM_TIME];
+
+        /* Negative values disable trimming, like 0 */
+        if (val < 0) {
+                val = 0;
+        } else if (val > INT_MAX / 1000) {
+                /* Converted to milliseconds for poll timeouts */
+                val = INT_MAX / 1000;
+        }
+
+        return (int)val;
+}
+
+/**
+ * Find which of the values a string setting may take it is set to, ignoring
+ * case. The configuration, which may be shared by threads, is not changed.
+ *
+ * @param val The value of the setting
+ * @param names The values it may take, ending with NULL
+ * @param def The value to use if it is set to none of them
+ *
+ * @return The value, as spelled in names, or def
+ */
+static const char *match_name(const char *val, const char *const names[],
+                              const char *def)
+{
+        for (int i = 0; names[i] != NULL; i++) {
+                if (strcasecmp(val, names[i]) == 0) {
+                        return names[i];
+                }
+        }
+
+        return def;
+}
+
+const char *staging_sync_config()
+{
+        static const char *const modes[] = { "none", "fdatasync", "group", NULL };
+
+        initialize_config();
+
+        return match_name(config.strValues[CONF_STAGING_SYNC], modes,
+                          DEFAULT_STAGING_SYNC);
+}
+
+int staging_sync_interval_config()
+{
+        initialize_config();
+        int64_t val = 0;
+
+        val = config.intValues[CONF_STAGING_SYNC_INTERVAL];
+
+        /* Records should not wait longer than the spool loop interval */
+        if (val < 1) {
+                val = 1;
+        } else if (val > TM_SPOOL_RUN_MIN * 1000) {
+                val = TM_SPOOL_RUN_MIN * 1000;
+        }
+
+        return (int)val;
+}
+
+int worker_threads_config()
+{
+        initialize_config();
+        int64_t val = 0;
+
+        val = config.intValues[CONF_WORKER_THREADS];
+
+        /* 64 is the most telemprobd starts */
+        if (val < 0) {
+                val = 0;
+        } else if (val > 64) {
+                val = 64;
+        }
+
+        return (int)val;
+}
+
+int64_t peer_record_rate_config()
+{
+        initialize_config();
+        int64_t val = 0;
+
+        val = config.intValues[CONF_PEER_RECORD_RATE];
+
+        /* A rate of 0 would hold back every record, so it means no limit
+         * like negative values */
+        return (val <= 0) ? -1 : val;
+}
+
+int64_t peer_byte_rate_config()
+{
+        initialize_config();
+        int64_t val = 0;
+        int64_t clamp = LONG_MAX / 1024;
+
+        val = config.intValues[CONF_PEER_BYTE_RATE];
+
+        /* Converted to bytes */
+        if (val > clamp) {
+                val = clamp;
+        }
+
+        return (val <= 0) ? -1 : val;
+}
+
+int64_t inflight_max_size_config()
+{
+        initialize_config();
+        int64_t val = 0;
+        int64_t clamp = LONG_MAX / 1024;
+
+        val = config.intValues[CONF_INFLIGHT_MAX_SIZE];
+
+        /* Converted to bytes */
+        if (val > clamp) {
+                val = clamp;
+        }
+
+        return (val <= 0) ? -1 : val;
+}
+
+int post_parallelism_config()
+{
+        initialize_config();
+        int64_t val = 0;
+
+        val = config.intValues[CONF_POST_PARALLELISM];
+
+        /* 64 is the most posts telempostd runs at once */
+        if (val < 1) {
+                val = 1;
+        } else if (val > 64) {
+                val = 64;
+        }
+
+        return (int)val;
+}
+
+int batch_max_records_config()
+{
+        initialize_config();
+        int64_t val = 0;
+
+        val = config.intValues[CONF_BATCH_MAX_RECORDS];
+
+        /* 256 is the most records a batch holds */
+        if (val < 1) {
+                val = 1;
+        } else if (val > 256) {
+                val = 256;
+        }
+
+        return (int)val;
+}
+
+int64_t batch_max_size_config()
+{
+        initialize_config();
+        int64_t val = 0;
+
+        val = config.intValues[CONF_BATCH_MAX_SIZE];
+
+        if (val < 1) {
+                val = 1;
+        } else if (val > 16384) {
+                val = 16384;
+        }
+
+        return val;
+}
+
+int batch_max_delay_config()
+{
+        initialize_config();
+        int64_t val = 0;
+
+        val = config.intValues[CONF_BATCH_MAX_DELAY];
+
+        if (val < 0) {
+                val = 0;
+        } else if (val > 60000) {
+                val = 60000;
+        }
+
+        return (int)val;
+}
+
+const char *config_post_compression(const struct configuration *c)
+{
+        static const char *const encodings[] = { "none", "gzip", "zstd", NULL };
+
+        return match_name(c->strValues[CONF_POST_COMPRESSION], encodings,
+                          DEFAULT_POST_COMPRESSION);
+}
+
+const char *post_compression_config()
+{
+        return config_post_compression(current_config());
+}
+
+int config_post_compression_threshold(const struct configuration *c)
+{
+        int64_t val = 0;
+
+        val = c->intValues[CONF_POST_COMPRESSION_THRESHOLD];
+
+        if (val < 0) {
+                val = 0;
+        } else if (val > INT_MAX) {
+                val = INT_MAX;
+        }
+
+        return (int)val;
+}
+
+int post_compression_threshold_config()
+{
+        return config_post_compression_threshold(current_config());
+}
+
 bool rate_limit_enabled_config()
 {
         initialize_config();
@@ -462,4 +850,29 @@ bool record_server_delivery_enabled_config(void)
         initialize_config();
         return config.boolValues[CONF_RECORD_SERVER_DELIVERY_ENABLED];
 }
+
+bool shm_transport_enabled_config(void)
+{
+        initialize_config();
+        return config.boolValues[CONF_SHM_TRANSPORT_ENABLED];
+}
+
+bool record_stream_enabled_config(void)
+{
+        initialize_config();
+        return config.boolValues[CONF_RECORD_STREAM_ENABLED];
+}
+
+bool io_uring_enabled_config(void)
+{
+        initialize_config();
+        return config.boolValues[CONF_IO_URING_ENABLED];
+}
+
+bool batch_delivery_enabled_config(void)
+{
+        initialize_config();
+        return config.boolValues[CONF_BATCH_DELIVERY_ENABLED];
+}
+
 /* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
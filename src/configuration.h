@@ -25,6 +25,8 @@
 #define DEFAULT_RATE_LIMIT_STRATEGY "spool"
 #define DEFAULT_CAINFO ""
 #define DEFAULT_TIDHEADER "X-Telemetry-TID: 6907c830-eed9-4ce9-81ae-76daf8d88f0f"
+#define DEFAULT_STAGING_SYNC "none"
+#define DEFAULT_POST_COMPRESSION "none"
 
 #define DEFAULT_RECORD_EXPIRY 1200
 #define DEFAULT_SPOOL_MAX_SIZE 5120
@@ -33,11 +35,26 @@
 #define DEFAULT_BYTE_WINDOW_LENGTH 20
 #define DEFAULT_RECORD_BURST_LIMIT 1000
 #define DEFAULT_BYTE_BURST_LIMIT -1
+#define DEFAULT_IDLE_TRIM_TIME 60
+#define DEFAULT_STAGING_SYNC_INTERVAL 100
+#define DEFAULT_WORKER_THREADS 2
+#define DEFAULT_PEER_RECORD_RATE 0
+#define DEFAULT_PEER_BYTE_RATE 0
+#define DEFAULT_INFLIGHT_MAX_SIZE 0
+#define DEFAULT_POST_PARALLELISM 1
+#define DEFAULT_BATCH_MAX_RECORDS 32
+#define DEFAULT_BATCH_MAX_SIZE 64
+#define DEFAULT_BATCH_MAX_DELAY 100
+#define DEFAULT_POST_COMPRESSION_THRESHOLD 1024
 
 #define DEFAULT_RATE_LIMIT_ENABLED true
 #define DEFAULT_DAEMON_RECYCLING_ENABLED true
 #define DEFAULT_RECORD_RETENTION_ENABLED false
 #define DEFAULT_RECORD_SERVER_DELIVERY_ENABLED true
+#define DEFAULT_SHM_TRANSPORT_ENABLED false
+#define DEFAULT_RECORD_STREAM_ENABLED true
+#define DEFAULT_IO_URING_ENABLED true
+#define DEFAULT_BATCH_DELIVERY_ENABLED false
 
 #define TM_MAX_WINDOW_LENGTH (1 /*h*/ * 60 /*m*/)
 
@@ -48,6 +65,8 @@ enum config_str_keys {
         CONF_RATE_LIMIT_STRATEGY,
         CONF_CAINFO,
         CONF_TIDHEADER,
+        CONF_STAGING_SYNC,
+        CONF_POST_COMPRESSION,
         CONF_STR_MAX
 };
 
@@ -59,6 +78,17 @@ enum config_int_keys {
         CONF_BYTE_WINDOW_LENGTH,
         CONF_RECORD_BURST_LIMIT,
         CONF_BYTE_BURST_LIMIT,
+        CONF_IDLE_TRIM_TIME,
+        CONF_STAGING_SYNC_INTERVAL,
+        CONF_WORKER_THREADS,
+        CONF_PEER_RECORD_RATE,
+        CONF_PEER_BYTE_RATE,
+        CONF_INFLIGHT_MAX_SIZE,
+        CONF_POST_PARALLELISM,
+        CONF_BATCH_MAX_RECORDS,
+        CONF_BATCH_MAX_SIZE,
+        CONF_BATCH_MAX_DELAY,
+        CONF_POST_COMPRESSION_THRESHOLD,
         CONF_INT_MAX
 };
 
@@ -67,6 +97,10 @@ enum config_bool_keys {
         CONF_DAEMON_RECYCLING_ENABLED,
         CONF_RECORD_RETENTION_ENABLED,
         CONF_RECORD_SERVER_DELIVERY_ENABLED,
+        CONF_SHM_TRANSPORT_ENABLED,
+        CONF_RECORD_STREAM_ENABLED,
+        CONF_IO_URING_ENABLED,
+        CONF_BATCH_DELIVERY_ENABLED,
         CONF_BOOL_MAX
 };
 
@@ -96,11 +130,32 @@ bool read_config_from_file(char *filename, struct configuration *config);
 /* Causes the daemon to read the configuration file */
 void reload_config(void);
 
+/* Gets the configuration currently in use */
+const struct configuration *current_config(void);
+
+/* Most configuration files kept parsed by config_cache_get() */
+#define CONFIG_CACHE_SIZE 8
+
+/*
+ * Gets the configuration of a file given by absolute path, such as the cfg
+ * file of a record, without changing the one in use. Files are parsed once,
+ * and parsed again only when their inode or modification time changes. The
+ * configuration must not be modified, and stays valid until the next call.
+ * Returns NULL if the file cannot be read or is not valid.
+ */
+const struct configuration *config_cache_get(const char *filename);
+
+/* Frees the configurations kept by config_cache_get() */
+void config_cache_release(void);
+
 /* Getters for the configuration values */
 
 /* Gets the server address to send the telemetry records */
 const char *server_addr_config(void);
 
+/* Gets the server address of a given configuration */
+const char *config_server_addr(const struct configuration *c);
+
 /* Gets the path for the unix domain socket */
 const char *socket_path_config(void);
 
@@ -131,6 +186,64 @@ int64_t byte_burst_limit_config(void);
 /* Gets the byte window length */
 int byte_window_length_config(void);
 
+/*
+ * Gets the number of seconds a daemon waits without activity before
+ * returning its free memory to the system, 0 if it never does
+ */
+int idle_trim_time_config(void);
+
+/*
+ * Gets how staged records are made durable: "none", "fdatasync" for each
+ * record, or "group" for records synced together
+ */
+const char *staging_sync_config(void);
+
+/* Gets the longest time in ms a record waits for a group sync */
+int staging_sync_interval_config(void);
+
+/* Gets the number of telemprobd threads staging records, 0 for none */
+int worker_threads_config(void);
+
+/* Gets the records per second telemprobd accepts from each user, or -1 for
+ * no limit */
+int64_t peer_record_rate_config(void);
+
+/* Gets the KiB per second telemprobd accepts from each user, or -1 for no
+ * limit */
+int64_t peer_byte_rate_config(void);
+
+/* Gets the most KiB of records telemprobd holds before staging them, or -1
+ * for no limit */
+int64_t inflight_max_size_config(void);
+
+/* Gets the most records telempostd posts at once, 1 to post them one after
+ * the other */
+int post_parallelism_config(void);
+
+/* Gets the most records telempostd sends in a batch */
+int batch_max_records_config(void);
+
+/* Gets the most KiB of records telempostd sends in a batch */
+int64_t batch_max_size_config(void);
+
+/* Gets how many ms telempostd gathers records in a batch before sending it */
+int batch_max_delay_config(void);
+
+/*
+ * Gets how telempostd compresses the bodies it posts: "none", "gzip" or
+ * "zstd"
+ */
+const char *post_compression_config(void);
+
+/* Gets how telempostd compresses the bodies of a given configuration */
+const char *config_post_compression(const struct configuration *c);
+
+/* Gets the size in bytes from which telempostd compresses a body */
+int post_compression_threshold_config(void);
+
+/* Gets the compression threshold of a given configuration */
+int config_post_compression_threshold(const struct configuration *c);
+
 /* Gets whether rate limiting is enabled */
 bool rate_limit_enabled_config(void);
 
@@ -140,9 +253,15 @@ const char *rate_limit_strategy_config(void);
 /* Gets CAINFO */
 const char *get_cainfo_config(void);
 
+/* Gets the CAINFO of a given configuration */
+const char *config_cainfo(const struct configuration *c);
+
 /* Gets tidheader */
 const char *get_tidheader_config(void);
 
+/* Gets the tidheader of a given configuration */
+const char *config_tidheader(const struct configuration *c);
+
 /* Gets whether recycling is enabled */
 bool daemon_recycling_enabled_config(void);
 
@@ -152,4 +271,16 @@ bool record_retention_enabled_config(void);
 /* Gets whether records should be sent to server_addr */
 bool record_server_delivery_enabled_config(void);
 
+/* Gets whether records may be sent through a shared memory ring */
+bool shm_transport_enabled_config(void);
+
+/* Gets whether telemprobd hands records to telempostd over a socket */
+bool record_stream_enabled_config(void);
+
+/* Gets whether the daemons may batch file operations through io_uring */
+bool io_uring_enabled_config(void);
+
+/* Gets whether telempostd sends records in batches */
+bool batch_delivery_enabled_config(void);
+
 /* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
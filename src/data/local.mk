@@ -14,6 +14,7 @@ EXTRA_DIST += \
 	%D%/example.conf \
 	%D%/example.1.conf \
 	%D%/example.2.conf \
+	%D%/example.3.conf \
 	%D%/hprobe.service.in \
 	%D%/hprobe.timer \
 	%D%/journal-probe.service.in \
@@ -0,0 +1,494 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "config.h"
+#include "io_batch.h"
+#include "log.h"
+
+/* Results of the operations not completed yet, which are never positive
+ * otherwise: to run synchronously, or submitted to io_uring */
+#define OP_PENDING 1
+#define OP_SUBMITTED 2
+
+/**
+ * Unmap and close the rings of a batch, if any
+ *
+ * @param ring The rings
+ */
+static void free_ring(struct io_ring *ring)
+{
+        if (ring->sqes != NULL) {
+                munmap(ring->sqes, ring->sqes_len);
+        }
+        if (ring->cq_map != NULL && ring->cq_map != ring->sq_map) {
+                munmap(ring->cq_map, ring->cq_map_len);
+        }
+        if (ring->sq_map != NULL) {
+                munmap(ring->sq_map, ring->sq_map_len);
+        }
+        if (ring->fd >= 0) {
+                close(ring->fd);
+        }
+        memset(ring, 0, sizeof(*ring));
+        ring->fd = -1;
+}
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+
+/* Opcode of each operation */
+static const uint8_t uring_opcodes[IO_OP_TYPES] = {
+        [IO_OP_FSYNC] = IORING_OP_FSYNC,
+        [IO_OP_FDATASYNC] = IORING_OP_FSYNC,
+        [IO_OP_CLOSE] = IORING_OP_CLOSE,
+        [IO_OP_STATX] = IORING_OP_STATX,
+        [IO_OP_UNLINKAT] = IORING_OP_UNLINKAT,
+        [IO_OP_LINKAT] = IORING_OP_LINKAT,
+};
+
+/**
+ * Find out which operations the kernel runs through io_uring
+ *
+ * @param ring The rings
+ */
+static void probe_ring(struct io_ring *ring)
+{
+        struct io_uring_probe *probe;
+        size_t nops = 256;
+
+        probe = calloc(1, sizeof(*probe) + nops * sizeof(struct io_uring_probe_op));
+        if (probe == NULL) {
+                return;
+        }
+
+        /* Kernels without IORING_REGISTER_PROBE have none of the opcodes
+         * used besides IORING_OP_FSYNC, which is not worth a ring */
+        if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE,
+                    probe, nops) == 0) {
+                for (int i = 0; i < IO_OP_TYPES; i++) {
+                        uint8_t op = uring_opcodes[i];
+
+                        ring->supported[i] = op < probe->ops_len &&
+                                             (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+                }
+        }
+        /* io_uring always hands statx to a kernel worker, which costs more
+         * than the system call when the inode is cached, as it is while
+         * scanning a directory */
+        ring->supported[IO_OP_STATX] = false;
+        free(probe);
+}
+
+/**
+ * Set up the rings of a batch
+ *
+ * @param ring Set to the rings
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ */
+static int setup_ring(struct io_ring *ring)
+{
+        struct io_uring_params p;
+        int ret;
+
+        memset(&p, 0, sizeof(p));
+        ring->fd = (int)syscall(__NR_io_uring_setup, IO_BATCH_MAX, &p);
+        if (ring->fd < 0) {
+                ring->fd = -1;
+                return -errno;
+        }
+
+        ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        ring->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                if (ring->cq_map_len > ring->sq_map_len) {
+                        ring->sq_map_len = ring->cq_map_len;
+                }
+                ring->cq_map_len = 0;
+        }
+
+        ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+        if (ring->sq_map == MAP_FAILED) {
+                ring->sq_map = NULL;
+                goto error;
+        }
+        if (ring->cq_map_len == 0) {
+                ring->cq_map = ring->sq_map;
+        } else {
+                ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, ring->fd,
+                                    IORING_OFF_CQ_RING);
+                if (ring->cq_map == MAP_FAILED) {
+                        ring->cq_map = NULL;
+                        goto error;
+                }
+        }
+        ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+        ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+        if (ring->sqes == MAP_FAILED) {
+                ring->sqes = NULL;
+                goto error;
+        }
+
+        ring->sq_head = (unsigned *)((char *)ring->sq_map + p.sq_off.head);
+        ring->sq_tail = (unsigned *)((char *)ring->sq_map + p.sq_off.tail);
+        ring->sq_mask = (unsigned *)((char *)ring->sq_map + p.sq_off.ring_mask);
+        ring->sq_array = (unsigned *)((char *)ring->sq_map + p.sq_off.array);
+        ring->cq_head = (unsigned *)((char *)ring->cq_map + p.cq_off.head);
+        ring->cq_tail = (unsigned *)((char *)ring->cq_map + p.cq_off.tail);
+        ring->cq_mask = (unsigned *)((char *)ring->cq_map + p.cq_off.ring_mask);
+        ring->cqes = (char *)ring->cq_map + p.cq_off.cqes;
+
+        probe_ring(ring);
+
+        return 0;
+
+error:
+        ret = -errno;
+        free_ring(ring);
+        return ret;
+}
+
+/**
+ * Fill in the submission entry of an operation
+ *
+ * @param sqe The entry
+ * @param op The operation
+ * @param index The index of the operation, returned with its completion
+ */
+static void prep_sqe(struct io_uring_sqe *sqe, const struct io_op *op,
+                     size_t index)
+{
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = uring_opcodes[op->type];
+        sqe->fd = op->fd;
+        sqe->user_data = index;
+
+        switch (op->type) {
+        case IO_OP_FDATASYNC:
+                sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+                break;
+        case IO_OP_STATX:
+                sqe->addr = (uintptr_t)op->path;
+                sqe->len = STATX_BASIC_STATS;
+                sqe->addr2 = (uintptr_t)op->stx;
+                sqe->statx_flags = (uint32_t)op->flags;
+                break;
+        case IO_OP_UNLINKAT:
+                sqe->addr = (uintptr_t)op->path;
+                sqe->unlink_flags = (uint32_t)op->flags;
+                break;
+        case IO_OP_LINKAT:
+                sqe->addr = (uintptr_t)op->path;
+                sqe->len = (uint32_t)op->newfd;
+                sqe->addr2 = (uintptr_t)op->newpath;
+                sqe->hardlink_flags = (uint32_t)op->flags;
+                break;
+        case IO_OP_FSYNC:
+        case IO_OP_CLOSE:
+        default:
+                break;
+        }
+}
+
+/**
+ * Collect the completions available
+ *
+ * @param b The batch
+ *
+ * @return The number of completions collected
+ */
+static unsigned reap_ring(struct io_batch *b)
+{
+        struct io_ring *ring = &b->ring;
+        struct io_uring_cqe *cqes = ring->cqes;
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        unsigned n = 0;
+
+        for (; head != tail; head++, n++) {
+                struct io_uring_cqe *cqe = &cqes[head & *ring->cq_mask];
+
+                if (cqe->user_data < b->nops) {
+                        b->ops[cqe->user_data].res = cqe->res;
+                }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        return n;
+}
+
+/**
+ * Run the operations of a batch the kernel supports through io_uring. The
+ * ones it did not take are left OP_PENDING, to run synchronously.
+ *
+ * @param b The batch
+ */
+static void run_ring(struct io_batch *b)
+{
+        struct io_ring *ring = &b->ring;
+        struct io_uring_sqe *sqes = ring->sqes;
+        unsigned tail = *ring->sq_tail;
+        unsigned to_submit = 0;
+        unsigned inflight = 0;
+        bool backoff = false;
+
+        for (size_t i = 0; i < b->nops; i++) {
+                unsigned index = tail & *ring->sq_mask;
+
+                if (!ring->supported[b->ops[i].type]) {
+                        continue;
+                }
+                prep_sqe(&sqes[index], &b->ops[i], i);
+                ring->sq_array[index] = index;
+                tail++;
+                to_submit++;
+                b->ops[i].res = OP_SUBMITTED;
+        }
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+        while (to_submit > 0 || inflight > 0) {
+                unsigned submit = backoff ? 0 : to_submit;
+                /* Submit everything first, then wait for all of it */
+                unsigned wait = submit > 0 ? 0 : (backoff ? 1 : inflight);
+                long ret;
+
+                ret = syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+                              IORING_ENTER_GETEVENTS, NULL, 0);
+                backoff = false;
+                if (ret >= 0) {
+                        to_submit -= submit > 0 ? (unsigned)ret : 0;
+                        inflight += submit > 0 ? (unsigned)ret : 0;
+                } else if (errno == EINTR) {
+                        /* Nothing to do but try again */
+                } else if ((errno == EAGAIN || errno == EBUSY) && inflight > 0) {
+                        /* Out of resources: let some complete first */
+                        backoff = true;
+                } else if (submit > 0) {
+                        /* Take back the entries the kernel did not consume,
+                         * and run their operations synchronously */
+                        telem_log(LOG_WARNING, "io_uring submission failed: %s\n",
+                                  strerror(errno));
+                        for (unsigned h = *ring->sq_head; h != tail; h++) {
+                                unsigned index = ring->sq_array[h & *ring->sq_mask];
+
+                                b->ops[sqes[index].user_data].res = OP_PENDING;
+                        }
+                        *ring->sq_tail = tail = *ring->sq_head;
+                        to_submit = 0;
+                } else {
+                        /* Waiting does not fail otherwise; give up on the
+                         * rings rather than reuse them */
+                        telem_log(LOG_ERR, "io_uring wait failed: %s\n",
+                                  strerror(errno));
+                        free_ring(ring);
+                        for (size_t i = 0; i < b->nops; i++) {
+                                if (b->ops[i].res == OP_SUBMITTED) {
+                                        b->ops[i].res = -EIO;
+                                }
+                        }
+                        return;
+                }
+
+                inflight -= reap_ring(b);
+        }
+}
+#endif
+
+void io_batch_init(struct io_batch *b, bool use_uring)
+{
+        memset(b, 0, sizeof(*b));
+        b->ring.fd = -1;
+
+#ifdef HAVE_IO_URING
+        if (use_uring) {
+                int ret = setup_ring(&b->ring);
+
+                if (ret < 0) {
+                        telem_log(LOG_INFO, "io_uring not available (%s), running"
+                                  " file operations synchronously\n", strerror(-ret));
+                }
+        }
+#else
+        (void)use_uring;
+#endif
+}
+
+void io_batch_free(struct io_batch *b)
+{
+        free_ring(&b->ring);
+}
+
+bool io_batch_uses_uring(const struct io_batch *b)
+{
+        return b->ring.fd >= 0;
+}
+
+bool io_batch_full(const struct io_batch *b)
+{
+        return b->nops == IO_BATCH_MAX;
+}
+
+/**
+ * Add an operation to a batch
+ *
+ * @param b The batch, which must not be full
+ * @param type The operation
+ * @param fd The file or directory it applies to
+ *
+ * @return The operation, to fill in
+ */
+static struct io_op *add_op(struct io_batch *b, enum io_op_type type, int fd)
+{
+        struct io_op *op;
+
+        assert(b->nops < IO_BATCH_MAX);
+        op = &b->ops[b->nops++];
+        memset(op, 0, sizeof(*op));
+        op->type = type;
+        op->fd = fd;
+
+        return op;
+}
+
+size_t io_batch_fsync(struct io_batch *b, int fd, bool datasync)
+{
+        add_op(b, datasync ? IO_OP_FDATASYNC : IO_OP_FSYNC, fd);
+
+        return b->nops - 1;
+}
+
+size_t io_batch_close(struct io_batch *b, int fd)
+{
+        add_op(b, IO_OP_CLOSE, fd);
+
+        return b->nops - 1;
+}
+
+size_t io_batch_statx(struct io_batch *b, int dirfd, const char *path,
+                      int flags, struct statx *stx)
+{
+        struct io_op *op = add_op(b, IO_OP_STATX, dirfd);
+
+        op->path = path;
+        op->flags = flags;
+        op->stx = stx;
+
+        return b->nops - 1;
+}
+
+size_t io_batch_unlinkat(struct io_batch *b, int dirfd, const char *path,
+                         int flags)
+{
+        struct io_op *op = add_op(b, IO_OP_UNLINKAT, dirfd);
+
+        op->path = path;
+        op->flags = flags;
+
+        return b->nops - 1;
+}
+
+size_t io_batch_linkat(struct io_batch *b, int olddirfd, const char *oldpath,
+                       int newdirfd, const char *newpath, int flags)
+{
+        struct io_op *op = add_op(b, IO_OP_LINKAT, olddirfd);
+
+        op->path = oldpath;
+        op->newfd = newdirfd;
+        op->newpath = newpath;
+        op->flags = flags;
+
+        return b->nops - 1;
+}
+
+/**
+ * Run an operation with the usual system call
+ *
+ * @param op The operation
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ */
+static int run_sync(struct io_op *op)
+{
+        int ret;
+
+        switch (op->type) {
+        case IO_OP_FSYNC:
+                ret = fsync(op->fd);
+                break;
+        case IO_OP_FDATASYNC:
+                ret = fdatasync(op->fd);
+                break;
+        case IO_OP_CLOSE:
+                ret = close(op->fd);
+                break;
+        case IO_OP_STATX:
+                ret = statx(op->fd, op->path, op->flags, STATX_BASIC_STATS,
+                            op->stx);
+                break;
+        case IO_OP_UNLINKAT:
+                ret = unlinkat(op->fd, op->path, op->flags);
+                break;
+        case IO_OP_LINKAT:
+                ret = linkat(op->fd, op->path, op->newfd, op->newpath,
+                             op->flags);
+                break;
+        default:
+                return -EINVAL;
+        }
+
+        return ret < 0 ? -errno : 0;
+}
+
+void io_batch_run(struct io_batch *b)
+{
+        for (size_t i = 0; i < b->nops; i++) {
+                b->ops[i].res = OP_PENDING;
+        }
+
+#ifdef HAVE_IO_URING
+        if (b->ring.fd >= 0) {
+                run_ring(b);
+        }
+#endif
+
+        for (size_t i = 0; i < b->nops; i++) {
+                if (b->ops[i].res == OP_PENDING) {
+                        b->ops[i].res = run_sync(&b->ops[i]);
+                }
+        }
+}
+
+void io_batch_reset(struct io_batch *b)
+{
+        b->nops = 0;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,207 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+/*
+ * Batches of file operations that do not depend on each other.
+ *
+ * Operations are added to a batch, then run together by io_batch_run().
+ * With io_uring, they are submitted to the kernel at once and run
+ * concurrently, so that the syncs of a group of records overlap instead of
+ * waiting for one another, as do the links and unlinks that update the
+ * directory. Where io_uring is not available, because the kernel is too
+ * old, it is disabled or filtered out, or it was not built in, the
+ * operations run one after the other with the usual system calls. So do
+ * the operations the running kernel does not support through io_uring, and
+ * those that are faster without it.
+ *
+ * The paths and buffers given to a batch must stay valid until
+ * io_batch_run() returns.
+ */
+
+/* Most operations in a batch */
+#define IO_BATCH_MAX 64
+
+enum io_op_type {
+        IO_OP_FSYNC,
+        IO_OP_FDATASYNC,
+        IO_OP_CLOSE,
+        IO_OP_STATX,
+        IO_OP_UNLINKAT,
+        IO_OP_LINKAT,
+        IO_OP_TYPES
+};
+
+struct io_op {
+        enum io_op_type type;
+        /* The file, or the directory of path */
+        int fd;
+        const char *path;
+        /* The directory of newpath, and newpath, for IO_OP_LINKAT */
+        int newfd;
+        const char *newpath;
+        int flags;
+        struct statx *stx;
+        /* Once run, 0 or a negative errno-style value */
+        int res;
+};
+
+/* Rings shared with the kernel, when io_uring is used */
+struct io_ring {
+        int fd;
+        void *sq_map;
+        size_t sq_map_len;
+        void *cq_map;
+        size_t cq_map_len;
+        void *sqes;
+        size_t sqes_len;
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned *sq_mask;
+        unsigned *sq_array;
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned *cq_mask;
+        void *cqes;
+        /* Operations the kernel runs through io_uring */
+        bool supported[IO_OP_TYPES];
+};
+
+struct io_batch {
+        /* fd is -1 when operations run synchronously */
+        struct io_ring ring;
+        struct io_op ops[IO_BATCH_MAX];
+        size_t nops;
+};
+
+/**
+ * Initialize an empty batch
+ *
+ * @param b The batch
+ * @param use_uring Whether to run operations through io_uring when
+ *    possible, rather than always synchronously
+ */
+void io_batch_init(struct io_batch *b, bool use_uring);
+
+/**
+ * Release the rings of a batch. The batch runs synchronously afterwards.
+ *
+ * @param b The batch
+ */
+void io_batch_free(struct io_batch *b);
+
+/**
+ * Tell whether a batch runs its operations through io_uring
+ *
+ * @param b The batch
+ *
+ * @return true if it has io_uring rings
+ */
+bool io_batch_uses_uring(const struct io_batch *b);
+
+/**
+ * Tell whether a batch has room for no more operations
+ *
+ * @param b The batch
+ *
+ * @return true if it holds IO_BATCH_MAX operations
+ */
+bool io_batch_full(const struct io_batch *b);
+
+/**
+ * Add a fsync() or fdatasync() to a batch, which must not be full
+ *
+ * @param b The batch
+ * @param fd The file
+ * @param datasync Whether to only sync the data, as fdatasync() does
+ *
+ * @return The index of the operation in the batch
+ */
+size_t io_batch_fsync(struct io_batch *b, int fd, bool datasync);
+
+/**
+ * Add a close() to a batch, which must not be full
+ *
+ * @param b The batch
+ * @param fd The file
+ *
+ * @return The index of the operation in the batch
+ */
+size_t io_batch_close(struct io_batch *b, int fd);
+
+/**
+ * Add a statx() of the basic fields to a batch, which must not be full
+ *
+ * @param b The batch
+ * @param dirfd The directory of path
+ * @param path The file
+ * @param flags AT_* flags of statx()
+ * @param stx Set to the attributes of the file
+ *
+ * @return The index of the operation in the batch
+ */
+size_t io_batch_statx(struct io_batch *b, int dirfd, const char *path,
+                      int flags, struct statx *stx);
+
+/**
+ * Add an unlinkat() to a batch, which must not be full
+ *
+ * @param b The batch
+ * @param dirfd The directory of path
+ * @param path The file
+ * @param flags AT_* flags of unlinkat()
+ *
+ * @return The index of the operation in the batch
+ */
+size_t io_batch_unlinkat(struct io_batch *b, int dirfd, const char *path,
+                         int flags);
+
+/**
+ * Add a linkat() to a batch, which must not be full
+ *
+ * @param b The batch
+ * @param olddirfd The directory of oldpath
+ * @param oldpath The file
+ * @param newdirfd The directory of newpath
+ * @param newpath The new name of the file
+ * @param flags AT_* flags of linkat()
+ *
+ * @return The index of the operation in the batch
+ */
+size_t io_batch_linkat(struct io_batch *b, int olddirfd, const char *oldpath,
+                       int newdirfd, const char *newpath, int flags);
+
+/**
+ * Run the operations of a batch, and wait for them all to complete. Their
+ * results are kept in b->ops until io_batch_reset().
+ *
+ * @param b The batch
+ */
+void io_batch_run(struct io_batch *b);
+
+/**
+ * Empty a batch, to add new operations
+ *
+ * @param b The batch
+ */
+void io_batch_reset(struct io_batch *b);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -15,6 +15,8 @@
  */
 
 #define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -41,30 +43,29 @@ bool _fgets(char *s, int n, FILE *stream)
         return true;
 }
 
-bool read_record(char *fullpath, char *headers[], char **body, char **cfg_file)
+/**
+ * Parse a text record from a stream, which is closed once done
+ *
+ * @param fp The stream holding the record
+ * @param size The length of the record
+ * @param rec Set to copies of the fields of the record
+ *
+ * @return true if successful otherwise false
+ */
+static bool parse_record(FILE *fp, long size, struct record_view *rec)
 {
         int i = 0;
         bool result = false;
-        FILE *fp = NULL;
         long offset;
 #if (LINE_MAX > PATH_MAX)
         char line[LINE_MAX+1] = { 0 };
 #else
         char line[PATH_MAX+1] = { 0 };
 #endif
-        long size;
         uint32_t cfg_prefix = 0;
 
-        fp = fopen(fullpath, "r");
-        if (fp == NULL) {
-                telem_log(LOG_ERR, "Unable to open file %s in staging\n", fullpath);
-                return false;
-        }
-
-        // Get the file size
-        fseek(fp, 0 , SEEK_END);
-        size = ftell(fp);
-        fseek(fp, 0 , SEEK_SET);
+        memset(rec, 0, sizeof(*rec));
+        rec->copied = true;
 
         // First line may contain configuration file path
         if (fread(&cfg_prefix, CFG_PREFIX_LENGTH, 1, fp) != 1) {
@@ -78,17 +79,14 @@ bool read_record(char *fullpath, char *headers[], char **body, char **cfg_file)
                         goto read_error;
                 }
 
-                size_t pathlen = strlen(line);
-                *cfg_file = malloc(pathlen + 1);
-                if (*cfg_file == NULL) {
+                rec->cfg_file = strdup(line);
+                if (rec->cfg_file == NULL) {
                         telem_log(LOG_ERR, "Could not allocate memory for config file path\n");
                         goto read_error;
                 }
-                strcpy (*cfg_file, line);
-                telem_debug("DEBUG: cfg_file specified: %s\n", *cfg_file);
+                telem_debug("DEBUG: cfg_file specified: %s\n", rec->cfg_file);
         } else {
                 telem_debug("DEBUG: no user cfg file specified, cfg_prefix: %08x\n", cfg_prefix);
-                *cfg_file = NULL;
                 rewind(fp);
         }
 
@@ -96,11 +94,11 @@ bool read_record(char *fullpath, char *headers[], char **body, char **cfg_file)
                 const char *header_name = get_header_name(i);
                 if (!_fgets(line, sizeof(line), fp)) {
                         telem_log(LOG_ERR, "Error while parsing staged record\n");
-                        fclose(fp);
-                        return false;
+                        result = false;
+                        goto read_error;
                 }
                 //Get rid of trailing newline
-                result = get_header(line, header_name, &headers[i]);
+                result = get_header(line, header_name, &rec->headers[i]);
                 if (!result) {
                         telem_log(LOG_ERR, "read_record: Incorrect"
                                   " headers in record\n");
@@ -116,17 +114,17 @@ bool read_record(char *fullpath, char *headers[], char **body, char **cfg_file)
         }
 
         size = size - offset + 1;
-        *body = malloc((size_t)size);
-        if (*body == NULL) {
+        rec->body = malloc((size_t)size);
+        if (rec->body == NULL) {
                 telem_log(LOG_ERR, "Could not allocate memory for payload from staged file\n");
                 result = false;
                 goto read_error;
         }
-        memset(*body, 0, (size_t)size);
+        memset(rec->body, 0, (size_t)size);
 
         //read rest of file
-        size_t newlen = fread(*body, sizeof(char), (size_t)size, fp);
-        if (newlen == 0) {
+        rec->body_len = fread(rec->body, sizeof(char), (size_t)size, fp);
+        if (rec->body_len == 0) {
                 telem_perror("Error reading staged file");
                 result = false;
                 goto read_error;
@@ -138,6 +136,86 @@ read_error:
         if (fp) {
                 fclose(fp);
         }
+        if (!result) {
+                release_record(rec);
+        }
 
         return result;
 }
+
+bool read_record(char *fullpath, struct record_view *rec)
+{
+        FILE *fp = NULL;
+        long size;
+        int fd;
+        int ret;
+
+        fd = open(fullpath, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                telem_log(LOG_ERR, "Unable to open file %s in staging\n", fullpath);
+                return false;
+        }
+
+        ret = record_view_map(rec, fd);
+        if (ret != -ENOTSUP) {
+                close(fd);
+                if (ret < 0) {
+                        telem_log(LOG_ERR, "Unable to read record %s: %s\n",
+                                  fullpath, strerror(-ret));
+                        return false;
+                }
+                return true;
+        }
+
+        /* Staged before the binary format, read as text */
+        fp = fdopen(fd, "r");
+        if (fp == NULL) {
+                telem_perror("Unable to read staged record");
+                close(fd);
+                return false;
+        }
+
+        // Get the file size
+        fseek(fp, 0 , SEEK_END);
+        size = ftell(fp);
+        fseek(fp, 0 , SEEK_SET);
+
+        return parse_record(fp, size, rec);
+}
+
+bool read_record_buffer(char *buf, size_t len, struct record_view *rec)
+{
+        FILE *fp = NULL;
+        int ret;
+
+        if (record_file_is_binary(buf, len)) {
+                if ((ret = record_view_parse(rec, buf, len)) < 0) {
+                        telem_log(LOG_ERR, "Unable to read streamed record: %s\n",
+                                  strerror(-ret));
+                        return false;
+                }
+                return true;
+        }
+
+        fp = fmemopen(buf, len, "r");
+        if (fp == NULL) {
+                telem_perror("Unable to read streamed record");
+                return false;
+        }
+
+        return parse_record(fp, (long)len, rec);
+}
+
+void release_record(struct record_view *rec)
+{
+        if (rec->copied) {
+                for (int i = 0; i < NUM_HEADERS; i++) {
+                        free(rec->headers[i]);
+                }
+                free(rec->body);
+                free(rec->cfg_file);
+        } else {
+                record_view_unmap(rec);
+        }
+        memset(rec, 0, sizeof(*rec));
+}
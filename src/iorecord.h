@@ -16,13 +16,36 @@
 
 #include <stdbool.h>
 
+#include "record_file.h"
+
 /**
- * Reads a telemetry record
+ * Reads a telemetry record. Binary records are mapped and read in place,
+ * text records are copied.
  *
  * @param fullpath pointer to full path file name
- * @param headers pointer to array of headers and values
- * @param body record message content
+ * @param rec set to the fields of the record, to be released with
+ *    release_record() once successful
  *
  * @return true if successful otherwise false
  */
-bool read_record(char *fullpath, char *headers[], char **body, char **cfg);
+bool read_record(char *fullpath, struct record_view *rec);
+
+/**
+ * Reads a telemetry record held in memory, in the same format as on disk.
+ * The fields of a binary record point into buf.
+ *
+ * @param buf the record
+ * @param len the length of the record
+ * @param rec set to the fields of the record, to be released with
+ *    release_record() once successful
+ *
+ * @return true if successful otherwise false
+ */
+bool read_record_buffer(char *buf, size_t len, struct record_view *rec);
+
+/**
+ * Releases a record read by read_record() or read_record_buffer()
+ *
+ * @param rec the record
+ */
+void release_record(struct record_view *rec);
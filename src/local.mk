@@ -17,12 +17,18 @@ bin_PROGRAMS = \
 	%D%/probe.c \
 	%D%/telemdaemon.c \
 	%D%/telemdaemon.h \
+	%D%/worker_pool.c \
+	%D%/worker_pool.h \
+	%D%/peer_table.c \
+	%D%/peer_table.h \
 	%D%/journal/journal.c \
 	%D%/journal/journal.h
 
 %C%_telemprobd_LDADD = $(CURL_LIBS) \
+	%D%/libtelem-daemon.la \
 	%D%/libtelem-shared.la \
-	%D%/libtelemetry.la
+	%D%/libtelemetry.la \
+	-lpthread
 
 %C%_telemprobd_CFLAGS = \
 	$(AM_CFLAGS)
@@ -52,6 +58,12 @@ endif
 	%D%/post.c \
 	%D%/telempostdaemon.c \
 	%D%/telempostdaemon.h \
+	%D%/post_batch.c \
+	%D%/post_batch.h \
+	%D%/post_engine.c \
+	%D%/post_engine.h \
+	%D%/post_encoding.c \
+	%D%/post_encoding.h \
 	%D%/journal/journal.c \
 	%D%/journal/journal.h \
 	%D%/spool.h \
@@ -62,11 +74,16 @@ endif
 	%D%/iorecord.h
 
 %C%_telempostd_LDADD = $(CURL_LIBS) \
+	$(ZLIB_LIBS) \
+	$(ZSTD_LIBS) \
+	%D%/libtelem-daemon.la \
 	%D%/libtelem-shared.la \
 	%D%/libtelemetry.la
 
 %C%_telempostd_CFLAGS = \
-	$(AM_CFLAGS)
+	$(AM_CFLAGS) \
+	$(ZLIB_CFLAGS) \
+	$(ZSTD_CFLAGS)
 
 %C%_telempostd_LDFLAGS = \
 	$(AM_LDFLAGS) \
@@ -89,11 +106,13 @@ endif
 endif
 
 # set library version info
-SHAREDLIB_CURRENT=4
-SHAREDLIB_REVISION=1
-SHAREDLIB_AGE=0
+SHAREDLIB_CURRENT=5
+SHAREDLIB_REVISION=0
+SHAREDLIB_AGE=1
 
-noinst_LTLIBRARIES = %D%/libtelem-shared.la
+noinst_LTLIBRARIES = \
+	%D%/libtelem-shared.la \
+	%D%/libtelem-daemon.la
 
 %C%_libtelem_shared_la_SOURCES = \
 	%D%/util.c \
@@ -103,7 +122,13 @@ noinst_LTLIBRARIES = %D%/libtelem-shared.la
 	%D%/nica/hashmap.c \
 	%D%/configuration.h \
 	%D%/common.c \
-	%D%/common.h
+	%D%/common.h \
+	%D%/payload.c \
+	%D%/payload.h \
+	%D%/mpmc_queue.c \
+	%D%/mpmc_queue.h \
+	%D%/shm_ring.c \
+	%D%/shm_ring.h
 
 %C%_libtelem_shared_la_CFLAGS = \
 	$(AM_CFLAGS)
@@ -111,6 +136,29 @@ noinst_LTLIBRARIES = %D%/libtelem-shared.la
 %C%_libtelem_shared_la_LDFLAGS = \
 	$(AM_LDFLAGS)
 
+# Code only the daemons and their tests use, kept out of libtelemetry
+%C%_libtelem_daemon_la_SOURCES = \
+	%D%/buffer_pool.c \
+	%D%/buffer_pool.h \
+	%D%/mem_policy.c \
+	%D%/mem_policy.h \
+	%D%/record_file.c \
+	%D%/record_file.h \
+	%D%/io_batch.c \
+	%D%/io_batch.h \
+	%D%/staging.c \
+	%D%/staging.h \
+	%D%/stats.c \
+	%D%/stats.h \
+	%D%/stream.c \
+	%D%/stream.h
+
+%C%_libtelem_daemon_la_CFLAGS = \
+	$(AM_CFLAGS)
+
+%C%_libtelem_daemon_la_LDFLAGS = \
+	$(AM_LDFLAGS)
+
 lib_LTLIBRARIES = \
 	%D%/libtelemetry.la
 
@@ -134,6 +182,7 @@ EXTRA_DIST += \
 
 %C%_libtelemetry_la_LIBADD = \
 	%D%/libtelem-shared.la \
-	-ldl
+	-ldl \
+	-lpthread
 
 # vim: filetype=automake tabstop=8 shiftwidth=8 noexpandtab
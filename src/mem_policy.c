@@ -0,0 +1,189 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "log.h"
+#include "mem_policy.h"
+
+static int64_t elapsed_ms(const struct timespec *since)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return (int64_t)(now.tv_sec - since->tv_sec) * 1000 +
+               (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static uint64_t timeval_usec(const struct timeval *tv)
+{
+        return (uint64_t)tv->tv_sec * 1000000 + (uint64_t)tv->tv_usec;
+}
+
+/**
+ * Read the resident set size of the process
+ *
+ * @return The resident set size in KiB, or 0 if it cannot be read
+ */
+static uint64_t read_rss_kb(void)
+{
+        FILE *fp;
+        unsigned long size, resident;
+        long page_size = sysconf(_SC_PAGESIZE);
+        uint64_t rss = 0;
+
+        fp = fopen("/proc/self/statm", "re");
+        if (fp == NULL) {
+                return 0;
+        }
+        if (fscanf(fp, "%lu %lu", &size, &resident) == 2 && page_size > 0) {
+                rss = (uint64_t)resident * (uint64_t)page_size / 1024;
+        }
+        fclose(fp);
+
+        return rss;
+}
+
+void mem_policy_init(struct mem_policy *policy, int idle_time,
+                     struct buffer_pool *pool)
+{
+        memset(policy, 0, sizeof(*policy));
+        policy->idle_time = idle_time > 0 ? idle_time : 0;
+        policy->pool = pool;
+        clock_gettime(CLOCK_MONOTONIC, &policy->last_activity);
+}
+
+void mem_policy_set_release(struct mem_policy *policy,
+                            void (*release)(void *arg), void *arg)
+{
+        policy->release = release;
+        policy->release_arg = arg;
+}
+
+void mem_policy_busy(struct mem_policy *policy)
+{
+        policy->dirty = true;
+        clock_gettime(CLOCK_MONOTONIC, &policy->last_activity);
+}
+
+int mem_policy_timeout(struct mem_policy *policy, int timeout_ms)
+{
+        int64_t remaining;
+
+        if (!policy->dirty || policy->idle_time == 0) {
+                return timeout_ms;
+        }
+
+        remaining = (int64_t)policy->idle_time * 1000 -
+                    elapsed_ms(&policy->last_activity);
+        if (remaining < 0) {
+                remaining = 0;
+        }
+        if (timeout_ms < 0 || remaining < timeout_ms) {
+                return (int)remaining;
+        }
+
+        return timeout_ms;
+}
+
+bool mem_policy_idle(struct mem_policy *policy)
+{
+        if (!policy->dirty || policy->idle_time == 0) {
+                return false;
+        }
+
+        if (elapsed_ms(&policy->last_activity) < (int64_t)policy->idle_time * 1000) {
+                return false;
+        }
+
+        mem_policy_trim(policy);
+
+        return true;
+}
+
+void mem_policy_trim(struct mem_policy *policy)
+{
+        struct timespec start, end;
+        uint64_t rss_before, rss_after;
+
+        rss_before = read_rss_kb();
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+
+        if (policy->release) {
+                policy->release(policy->release_arg);
+        }
+        if (policy->pool) {
+                buffer_pool_trim(policy->pool);
+        }
+        malloc_trim(0);
+
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+        rss_after = read_rss_kb();
+
+        policy->dirty = false;
+        policy->stats.trims++;
+        policy->stats.trim_usec += (uint64_t)((end.tv_sec - start.tv_sec) * 1000000 +
+                                              (end.tv_nsec - start.tv_nsec) / 1000);
+        if (rss_before > rss_after) {
+                policy->stats.trimmed_kb += rss_before - rss_after;
+        }
+
+        telem_log(LOG_DEBUG, "Trimmed heap after %d s idle: rss %" PRIu64
+                  " KiB -> %" PRIu64 " KiB\n", policy->idle_time, rss_before,
+                  rss_after);
+}
+
+void mem_policy_sample(struct mem_policy *policy)
+{
+        struct rusage usage;
+
+        policy->stats.rss_kb = read_rss_kb();
+        if (getrusage(RUSAGE_SELF, &usage) == 0) {
+                policy->stats.peak_rss_kb = (uint64_t)usage.ru_maxrss;
+                policy->stats.user_usec = timeval_usec(&usage.ru_utime);
+                policy->stats.system_usec = timeval_usec(&usage.ru_stime);
+        }
+}
+
+void mem_policy_log_stats(struct mem_policy *policy)
+{
+        struct mem_stats *s = &policy->stats;
+
+        mem_policy_sample(policy);
+
+        telem_log(LOG_INFO, "Memory: rss %" PRIu64 " KiB (peak %" PRIu64
+                  " KiB), cpu user %" PRIu64 " us system %" PRIu64 " us, %"
+                  PRIu64 " trims taking %" PRIu64 " us and releasing %" PRIu64
+                  " KiB\n", s->rss_kb, s->peak_rss_kb, s->user_usec,
+                  s->system_usec, s->trims, s->trim_usec, s->trimmed_kb);
+
+        if (policy->pool) {
+                struct buffer_pool_stats *p = &policy->pool->stats;
+
+                telem_log(LOG_INFO, "Buffer pool: %" PRIu64 " hits, %" PRIu64
+                          " misses, %" PRIu64 " bytes cached\n", p->hits,
+                          p->misses, p->cached_bytes);
+        }
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,130 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "buffer_pool.h"
+
+/* Memory and CPU counters of a daemon */
+struct mem_stats {
+        /* Resident set size when last sampled, and its peak */
+        uint64_t rss_kb;
+        uint64_t peak_rss_kb;
+        /* CPU time used by the process */
+        uint64_t user_usec;
+        uint64_t system_usec;
+        /* Number of heap trims, the CPU time they took and the resident
+         * memory they gave back */
+        uint64_t trims;
+        uint64_t trim_usec;
+        uint64_t trimmed_kb;
+};
+
+/* Decides when a daemon gives its free heap back to the kernel. Trimming
+ * after every event makes the next allocations fault the same pages back in,
+ * so the heap is only trimmed once the daemon has had nothing to do for a
+ * while.
+ */
+struct mem_policy {
+        /* Seconds without activity before trimming; 0 disables trimming */
+        int idle_time;
+        /* Set by activity since the last trim */
+        bool dirty;
+        struct timespec last_activity;
+        /* Pool emptied before the heap is trimmed, if any */
+        struct buffer_pool *pool;
+        /* Called before the heap is trimmed, to free what is only worth
+         * keeping while busy, if set */
+        void (*release)(void *arg);
+        void *release_arg;
+        struct mem_stats stats;
+};
+
+/**
+ * Initialize a policy
+ *
+ * @param policy The policy
+ * @param idle_time Seconds without activity before trimming, or 0 to never
+ *    trim
+ * @param pool Pool to empty before trimming, or NULL
+ */
+void mem_policy_init(struct mem_policy *policy, int idle_time,
+                     struct buffer_pool *pool);
+
+/**
+ * Set a function to call before the heap is trimmed
+ *
+ * @param policy The policy
+ * @param release The function, or NULL
+ * @param arg Passed to the function
+ */
+void mem_policy_set_release(struct mem_policy *policy,
+                            void (*release)(void *arg), void *arg);
+
+/**
+ * Record that the daemon did some work, which restarts the idle period
+ *
+ * @param policy The policy
+ */
+void mem_policy_busy(struct mem_policy *policy);
+
+/**
+ * Shorten a poll timeout so that the daemon wakes up when the idle period
+ * ends
+ *
+ * @param policy The policy
+ * @param timeout_ms The timeout the daemon would use otherwise, in ms
+ *
+ * @return The timeout to use, in ms
+ */
+int mem_policy_timeout(struct mem_policy *policy, int timeout_ms);
+
+/**
+ * Trim the heap if the idle period has ended and there was activity since
+ * the last trim
+ *
+ * @param policy The policy
+ *
+ * @return true if the heap was trimmed
+ */
+bool mem_policy_idle(struct mem_policy *policy);
+
+/**
+ * Trim the heap now, whatever the idle period
+ *
+ * @param policy The policy
+ */
+void mem_policy_trim(struct mem_policy *policy);
+
+/**
+ * Refresh the resident set size and CPU time counters
+ *
+ * @param policy The policy
+ */
+void mem_policy_sample(struct mem_policy *policy);
+
+/**
+ * Log the counters, refreshed first
+ *
+ * @param policy The policy
+ */
+void mem_policy_log_stats(struct mem_policy *policy);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
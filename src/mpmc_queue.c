@@ -0,0 +1,124 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "mpmc_queue.h"
+
+/*
+ * Bounded MPMC queue after Dmitry Vyukov's design. Cell i starts with
+ * sequence number i. A producer may fill the cell at position pos when its
+ * sequence equals pos, and publishes it by setting the sequence to pos + 1.
+ * A consumer may empty it when the sequence equals pos + 1, and hands it back
+ * to producers of the next lap by setting it to pos + capacity.
+ */
+
+int mpmc_queue_init(struct mpmc_queue *q, size_t capacity)
+{
+        if (capacity < 2 || (capacity & (capacity - 1)) != 0) {
+                return -EINVAL;
+        }
+
+        q->cells = calloc(capacity, sizeof(struct mpmc_cell));
+        if (q->cells == NULL) {
+                return -ENOMEM;
+        }
+
+        for (size_t i = 0; i < capacity; i++) {
+                q->cells[i].seq = i;
+        }
+        q->mask = capacity - 1;
+        q->enqueue_pos = 0;
+        q->dequeue_pos = 0;
+
+        return 0;
+}
+
+void mpmc_queue_free(struct mpmc_queue *q)
+{
+        free(q->cells);
+        q->cells = NULL;
+}
+
+bool mpmc_queue_push(struct mpmc_queue *q, void *data)
+{
+        struct mpmc_cell *cell;
+        size_t pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+
+        while (1) {
+                size_t seq;
+                intptr_t diff;
+
+                cell = &q->cells[pos & q->mask];
+                seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+                diff = (intptr_t)seq - (intptr_t)pos;
+
+                if (diff == 0) {
+                        if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1,
+                                                        true, __ATOMIC_RELAXED,
+                                                        __ATOMIC_RELAXED)) {
+                                break;
+                        }
+                } else if (diff < 0) {
+                        /* The consumer has not emptied this cell yet */
+                        return false;
+                } else {
+                        pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+                }
+        }
+
+        cell->data = data;
+        __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+        return true;
+}
+
+bool mpmc_queue_pop(struct mpmc_queue *q, void **data)
+{
+        struct mpmc_cell *cell;
+        size_t pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+
+        while (1) {
+                size_t seq;
+                intptr_t diff;
+
+                cell = &q->cells[pos & q->mask];
+                seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+                diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+                if (diff == 0) {
+                        if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1,
+                                                        true, __ATOMIC_RELAXED,
+                                                        __ATOMIC_RELAXED)) {
+                                break;
+                        }
+                } else if (diff < 0) {
+                        /* No producer has filled this cell yet */
+                        return false;
+                } else {
+                        pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+                }
+        }
+
+        *data = cell->data;
+        __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+
+        return true;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,81 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MPMC_CACHE_LINE 64
+
+struct mpmc_cell {
+        size_t seq;
+        void *data;
+};
+
+/* Bounded lock-free queue of pointers, safe for any number of producer and
+ * consumer threads. Each cell carries a sequence number telling producers
+ * and consumers whose turn it is, so a push or pop is one compare-and-swap
+ * on the shared position in the common case.
+ */
+struct mpmc_queue {
+        struct mpmc_cell *cells;
+        size_t mask;
+        char pad0[MPMC_CACHE_LINE];
+        size_t enqueue_pos;
+        char pad1[MPMC_CACHE_LINE];
+        size_t dequeue_pos;
+        char pad2[MPMC_CACHE_LINE];
+};
+
+/**
+ * Initialize a queue
+ *
+ * @param q The queue
+ * @param capacity Number of entries, must be a power of two of at least 2
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int mpmc_queue_init(struct mpmc_queue *q, size_t capacity);
+
+/**
+ * Release the memory used by a queue. Entries still queued are not freed.
+ *
+ * @param q The queue
+ */
+void mpmc_queue_free(struct mpmc_queue *q);
+
+/**
+ * Add an entry at the tail of the queue
+ *
+ * @param q The queue
+ * @param data The entry
+ *
+ * @return true on success, false if the queue is full
+ */
+bool mpmc_queue_push(struct mpmc_queue *q, void *data);
+
+/**
+ * Remove the entry at the head of the queue
+ *
+ * @param q The queue
+ * @param data Set to the entry removed
+ *
+ * @return true on success, false if the queue is empty
+ */
+bool mpmc_queue_pop(struct mpmc_queue *q, void **data);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
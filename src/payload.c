@@ -0,0 +1,172 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "payload.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define PAYLOAD_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+/*
+ * A payload byte is valid if it is printable ascii (0x20 - 0x7e) or one of
+ * the whitespace characters \t \n \v \f \r (0x09 - 0x0d). This is exactly
+ * isprint(c) || isspace(c) in the C locale, without the per-byte locale
+ * lookup.
+ */
+static inline bool char_valid(uint8_t c)
+{
+        return (c >= 0x20 && c < 0x7f) || (c >= 0x09 && c <= 0x0d);
+}
+
+static bool chars_valid_bytes(const uint8_t *p, size_t len)
+{
+        for (size_t i = 0; i < len; i++) {
+                if (!char_valid(p[i])) {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+/*
+ * Adding (0x80 - n) to a byte whose high bit is clear sets the high bit if
+ * and only if the byte is >= n. The sum never exceeds 0xff, so no carry leaks
+ * into the neighbouring byte and every lane is exact.
+ */
+#define BYTES_GE(low7, n) (((low7) + (0x80 - (n)) * ONES) & HIGHS)
+
+static inline bool word_valid(uint64_t w)
+{
+        uint64_t low7 = w & ~HIGHS;
+        uint64_t printable = BYTES_GE(low7, 0x20) & ~BYTES_GE(low7, 0x7f);
+        uint64_t space = BYTES_GE(low7, 0x09) & ~BYTES_GE(low7, 0x0e);
+        /* Bytes >= 0x80 are never valid, whatever their low bits say */
+        uint64_t bad = (w & HIGHS) | (~(printable | space) & HIGHS);
+
+        return bad == 0;
+}
+
+bool payload_chars_valid_word(const char *payload, size_t len)
+{
+        const uint8_t *p = (const uint8_t *)payload;
+        uint64_t w;
+
+        while (len >= sizeof(w)) {
+                memcpy(&w, p, sizeof(w));
+                if (!word_valid(w)) {
+                        return false;
+                }
+                p += sizeof(w);
+                len -= sizeof(w);
+        }
+
+        return chars_valid_bytes(p, len);
+}
+
+#ifdef PAYLOAD_X86_SIMD
+
+/*
+ * The vector versions compare bytes as signed values, so that bytes >= 0x80
+ * (negative) fall below 0x20 and are rejected along with the control
+ * characters. Whitespace is detected by shifting 0x09 - 0x0d to the bottom of
+ * the signed range: c + 0x77 lies in -128 .. -124 only for those five bytes.
+ */
+static bool payload_chars_valid_sse2(const char *payload, size_t len)
+{
+        const __m128i space = _mm_set1_epi8(0x20);
+        const __m128i del = _mm_set1_epi8(0x7f);
+        const __m128i ws_shift = _mm_set1_epi8(0x77);
+        const __m128i ws_limit = _mm_set1_epi8((char)0x85);  /* -123 */
+
+        while (len >= sizeof(__m128i)) {
+                __m128i v = _mm_loadu_si128((const __m128i *)payload);
+                __m128i low = _mm_cmpgt_epi8(space, v);
+                __m128i ws = _mm_cmpgt_epi8(ws_limit, _mm_add_epi8(v, ws_shift));
+                __m128i bad = _mm_or_si128(_mm_andnot_si128(ws, low),
+                                           _mm_cmpeq_epi8(v, del));
+
+                if (_mm_movemask_epi8(bad) != 0) {
+                        return false;
+                }
+                payload += sizeof(__m128i);
+                len -= sizeof(__m128i);
+        }
+
+        return payload_chars_valid_word(payload, len);
+}
+
+__attribute__((target("avx2")))
+static bool payload_chars_valid_avx2(const char *payload, size_t len)
+{
+        const __m256i space = _mm256_set1_epi8(0x20);
+        const __m256i del = _mm256_set1_epi8(0x7f);
+        const __m256i ws_shift = _mm256_set1_epi8(0x77);
+        const __m256i ws_limit = _mm256_set1_epi8((char)0x85);  /* -123 */
+
+        while (len >= sizeof(__m256i)) {
+                __m256i v = _mm256_loadu_si256((const __m256i *)payload);
+                __m256i low = _mm256_cmpgt_epi8(space, v);
+                __m256i ws = _mm256_cmpgt_epi8(ws_limit, _mm256_add_epi8(v, ws_shift));
+                __m256i bad = _mm256_or_si256(_mm256_andnot_si256(ws, low),
+                                              _mm256_cmpeq_epi8(v, del));
+
+                if (_mm256_movemask_epi8(bad) != 0) {
+                        return false;
+                }
+                payload += sizeof(__m256i);
+                len -= sizeof(__m256i);
+        }
+
+        return payload_chars_valid_sse2(payload, len);
+}
+
+bool payload_chars_valid(const char *payload, size_t len)
+{
+        static bool (*impl)(const char *, size_t) = NULL;
+        bool (*fn)(const char *, size_t) = __atomic_load_n(&impl, __ATOMIC_RELAXED);
+
+        /* Racing callers all store the same pointer, so no lock is needed */
+        if (fn == NULL) {
+                __builtin_cpu_init();
+                if (__builtin_cpu_supports("avx2")) {
+                        fn = payload_chars_valid_avx2;
+                } else {
+                        fn = payload_chars_valid_sse2;
+                }
+                __atomic_store_n(&impl, fn, __ATOMIC_RELAXED);
+        }
+
+        return fn(payload, len);
+}
+
+#else
+
+bool payload_chars_valid(const char *payload, size_t len)
+{
+        return payload_chars_valid_word(payload, len);
+}
+
+#endif
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,31 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Checks that every byte of a payload is printable ascii or whitespace, as
+ * isprint() || isspace() would in the C locale. Uses the widest vector unit
+ * available on the running cpu.
+ */
+bool payload_chars_valid(const char *payload, size_t len);
+
+/* Portable implementation, checking one machine word at a time */
+bool payload_chars_valid_word(const char *payload, size_t len);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
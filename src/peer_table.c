@@ -0,0 +1,212 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "peer_table.h"
+
+/**
+ * Set the rate of a bucket, and fill it. Buckets hold one second of tokens,
+ * and at least one token.
+ *
+ * @param bucket The bucket
+ * @param rate Tokens per second, or 0 for no limit
+ * @param now_ms The time, in ms of CLOCK_MONOTONIC
+ */
+static void bucket_init(struct token_bucket *bucket, double rate, int64_t now_ms)
+{
+        bucket->rate = rate;
+        bucket->burst = rate > 1.0 ? rate : 1.0;
+        bucket->tokens = bucket->burst;
+        bucket->refilled_ms = now_ms;
+}
+
+/**
+ * Refill a bucket, and tell how long to wait before it allows cost tokens
+ * to be taken. A cost larger than the bucket is allowed once the bucket is
+ * full, and paid for by the tokens that follow.
+ *
+ * @param bucket The bucket
+ * @param cost Tokens needed
+ * @param now_ms The time, in ms of CLOCK_MONOTONIC
+ *
+ * @return 0 if the tokens can be taken now, or the number of ms to wait
+ */
+static int64_t bucket_wait(struct token_bucket *bucket, double cost,
+                           int64_t now_ms)
+{
+        double needed = cost < bucket->burst ? cost : bucket->burst;
+
+        if (bucket->rate <= 0.0) {
+                return 0;
+        }
+
+        if (now_ms > bucket->refilled_ms) {
+                bucket->tokens += bucket->rate * (double)(now_ms - bucket->refilled_ms) / 1000.0;
+                if (bucket->tokens > bucket->burst) {
+                        bucket->tokens = bucket->burst;
+                }
+                bucket->refilled_ms = now_ms;
+        }
+
+        if (bucket->tokens >= needed) {
+                return 0;
+        }
+
+        /* Round up, so that the tokens are there when the wait is over */
+        return (int64_t)((needed - bucket->tokens) * 1000.0 / bucket->rate) + 1;
+}
+
+static void bucket_take(struct token_bucket *bucket, double cost)
+{
+        if (bucket->rate > 0.0) {
+                bucket->tokens -= cost;
+        }
+}
+
+int64_t peer_table_now_ms(void)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void peer_table_init(struct peer_table *table)
+{
+        LIST_INIT(&table->peers);
+        table->npeers = 0;
+        table->record_rate = 0.0;
+        table->byte_rate = 0.0;
+}
+
+void peer_table_configure(struct peer_table *table, int64_t record_rate,
+                          int64_t byte_rate)
+{
+        int64_t now_ms = peer_table_now_ms();
+        struct peer *peer;
+
+        table->record_rate = record_rate > 0 ? (double)record_rate : 0.0;
+        table->byte_rate = byte_rate > 0 ? (double)byte_rate : 0.0;
+
+        LIST_FOREACH(peer, &table->peers, peer_ptrs) {
+                bucket_init(&peer->records, table->record_rate, now_ms);
+                bucket_init(&peer->bytes, table->byte_rate, now_ms);
+        }
+}
+
+struct peer *peer_table_get(struct peer_table *table, uid_t uid, pid_t pid)
+{
+        int64_t now_ms;
+        struct peer *peer;
+
+        LIST_FOREACH(peer, &table->peers, peer_ptrs) {
+                if (peer->uid == uid) {
+                        break;
+                }
+        }
+
+        if (peer == NULL) {
+                peer = calloc(1, sizeof(struct peer));
+                if (peer == NULL) {
+                        return NULL;
+                }
+                now_ms = peer_table_now_ms();
+                peer->uid = uid;
+                bucket_init(&peer->records, table->record_rate, now_ms);
+                bucket_init(&peer->bytes, table->byte_rate, now_ms);
+                LIST_INSERT_HEAD(&table->peers, peer, peer_ptrs);
+                table->npeers++;
+        }
+
+        peer->pid = pid;
+        peer->stats.clients++;
+        peer->stats.connections++;
+
+        return peer;
+}
+
+void peer_table_put(struct peer_table *table, struct peer *peer)
+{
+        peer->stats.clients--;
+
+        /* A peer forgotten while over its quotas starts again with full
+         * buckets, so peers are kept as long as the table has room */
+        if (peer->stats.clients == 0 && table->npeers > PEER_TABLE_MAX) {
+                LIST_REMOVE(peer, peer_ptrs);
+                table->npeers--;
+                free(peer);
+        }
+}
+
+int64_t peer_admit(struct peer *peer, size_t size, int64_t now_ms)
+{
+        int64_t wait_ms;
+        int64_t bytes_wait_ms;
+
+        wait_ms = bucket_wait(&peer->records, 1.0, now_ms);
+        bytes_wait_ms = bucket_wait(&peer->bytes, (double)size, now_ms);
+        if (bytes_wait_ms > wait_ms) {
+                wait_ms = bytes_wait_ms;
+        }
+        if (wait_ms > 0) {
+                peer->stats.throttled++;
+                return wait_ms;
+        }
+
+        bucket_take(&peer->records, 1.0);
+        bucket_take(&peer->bytes, (double)size);
+        peer->stats.records++;
+        peer->stats.bytes += size;
+
+        return 0;
+}
+
+void peer_table_log_stats(struct peer_table *table)
+{
+        struct peer *peer;
+
+        LIST_FOREACH(peer, &table->peers, peer_ptrs) {
+                struct peer_stats *s = &peer->stats;
+
+                telem_log(LOG_INFO, "Peer uid %u (last pid %d): %" PRIu64
+                          " clients, %" PRIu64 " connections, %" PRIu64
+                          " records, %" PRIu64 " bytes, %" PRIu64
+                          " throttled, %" PRIu64 " rejected\n",
+                          (unsigned)peer->uid, (int)peer->pid, s->clients,
+                          s->connections, s->records, s->bytes, s->throttled,
+                          s->rejected);
+        }
+}
+
+void peer_table_free(struct peer_table *table)
+{
+        struct peer *peer;
+
+        while ((peer = LIST_FIRST(&table->peers)) != NULL) {
+                LIST_REMOVE(peer, peer_ptrs);
+                free(peer);
+        }
+        table->npeers = 0;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,152 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/queue.h>
+#include <sys/types.h>
+
+/* Peers without clients are forgotten once the table holds more than this */
+#define PEER_TABLE_MAX 256
+
+/* Refills at rate tokens per second, up to burst tokens */
+struct token_bucket {
+        double tokens;
+        double rate;
+        double burst;
+        /* When the bucket was last refilled, in ms of CLOCK_MONOTONIC */
+        int64_t refilled_ms;
+};
+
+/* Counters of the records received from a peer */
+struct peer_stats {
+        /* Clients connected now, and since the peer was first seen */
+        uint64_t clients;
+        uint64_t connections;
+        /* Records accepted, and their size */
+        uint64_t records;
+        uint64_t bytes;
+        /* Times a client was held back by the quotas */
+        uint64_t throttled;
+        /* Records dropped because the quotas were exceeded by a client that
+         * could no longer be held back */
+        uint64_t rejected;
+};
+
+/*
+ * The processes of one user, identified by the SO_PEERCRED credentials of
+ * their connections. Quotas apply to a user rather than to a process, since
+ * a process can always fork to get a new pid.
+ */
+struct peer {
+        uid_t uid;
+        /* Process that connected last */
+        pid_t pid;
+        struct token_bucket records;
+        struct token_bucket bytes;
+        struct peer_stats stats;
+        LIST_ENTRY(peer) peer_ptrs;
+};
+
+typedef LIST_HEAD (peer_list_head, peer) peer_list_head;
+
+/* Peers of a daemon, and the quotas they share */
+struct peer_table {
+        peer_list_head peers;
+        size_t npeers;
+        /* Records and bytes per second allowed to each peer, 0 for no
+         * limit */
+        double record_rate;
+        double byte_rate;
+};
+
+/**
+ * Initialize an empty table, without quotas
+ *
+ * @param table The table
+ */
+void peer_table_init(struct peer_table *table);
+
+/**
+ * Set the quotas, for the peers in the table and the ones to come. The
+ * buckets of existing peers start full.
+ *
+ * @param table The table
+ * @param record_rate Records per second allowed to each peer, or 0 or less
+ *    for no limit
+ * @param byte_rate Bytes per second allowed to each peer, or 0 or less for
+ *    no limit
+ */
+void peer_table_configure(struct peer_table *table, int64_t record_rate,
+                          int64_t byte_rate);
+
+/**
+ * Find the peer of a new client, adding it if needed, and count the client
+ *
+ * @param table The table
+ * @param uid User of the client
+ * @param pid Process of the client
+ *
+ * @return The peer, or NULL if it could not be allocated
+ */
+struct peer *peer_table_get(struct peer_table *table, uid_t uid, pid_t pid);
+
+/**
+ * Uncount a client that went away. Its peer is freed if it has no client
+ * left and the table is full.
+ *
+ * @param table The table
+ * @param peer The peer of the client
+ */
+void peer_table_put(struct peer_table *table, struct peer *peer);
+
+/**
+ * Take a record of a peer out of its quotas, and count it
+ *
+ * @param peer The peer
+ * @param size Size of the record
+ * @param now_ms The time, in ms of CLOCK_MONOTONIC
+ *
+ * @return 0 if the record is accepted, or the number of ms after which the
+ *    quotas allow it
+ */
+int64_t peer_admit(struct peer *peer, size_t size, int64_t now_ms);
+
+/**
+ * Log the counters of each peer
+ *
+ * @param table The table
+ */
+void peer_table_log_stats(struct peer_table *table);
+
+/**
+ * Free all peers. The table is left empty.
+ *
+ * @param table The table
+ */
+void peer_table_free(struct peer_table *table);
+
+/**
+ * Read CLOCK_MONOTONIC
+ *
+ * @return The time, in ms
+ */
+int64_t peer_table_now_ms(void);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -33,7 +33,8 @@
  *  using pointer to a fake function.
  */
 
-bool (*post_record_ptr)(char *[], char *, char *) = post_record_http;
+bool (*post_record_ptr)(char *[], char *, const struct configuration *,
+                        const char *) = post_record_http;
 
 void print_usage(char *prog)
 {
@@ -0,0 +1,158 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "post_batch.h"
+
+/* Most digits of the lengths of the framing line */
+#define FRAME_LINE_MAX 48
+
+struct post_batch *post_batch_new(void)
+{
+        return calloc(1, sizeof(struct post_batch));
+}
+
+void post_batch_free(struct post_batch *b)
+{
+        if (b == NULL) {
+                return;
+        }
+        free(b->body);
+        free(b->reply);
+        free(b);
+}
+
+/**
+ * Make room in a buffer
+ *
+ * @return 0 if successful, or -ENOMEM
+ */
+static int reserve(char **buf, size_t *size, size_t needed)
+{
+        size_t new_size = *size ? *size : 4096;
+        char *p;
+
+        if (needed <= *size) {
+                return 0;
+        }
+        while (new_size < needed) {
+                new_size *= 2;
+        }
+        p = realloc(*buf, new_size);
+        if (p == NULL) {
+                return -ENOMEM;
+        }
+        *buf = p;
+        *size = new_size;
+
+        return 0;
+}
+
+static size_t headers_size(char *headers[], int nheaders)
+{
+        size_t len = 0;
+
+        for (int i = 0; i < nheaders; i++) {
+                len += strlen(headers[i]) + 1;
+        }
+
+        return len;
+}
+
+size_t post_batch_framed_size(char *headers[], int nheaders, const char *body)
+{
+        return FRAME_LINE_MAX + headers_size(headers, nheaders) + strlen(body);
+}
+
+int post_batch_add(struct post_batch *b, char *headers[], int nheaders,
+                   const char *body, post_sent_fn sent, void *arg)
+{
+        size_t hlen = headers_size(headers, nheaders);
+        size_t blen = strlen(body);
+        int ret;
+
+        if (b->count == POST_BATCH_MAX) {
+                return -ENOSPC;
+        }
+        /* The body is kept NUL-terminated */
+        ret = reserve(&b->body, &b->size, b->len + FRAME_LINE_MAX + hlen + blen + 1);
+        if (ret < 0) {
+                return ret;
+        }
+
+        b->len += (size_t)sprintf(b->body + b->len, "%zu %zu\n", hlen, blen);
+        for (int i = 0; i < nheaders; i++) {
+                size_t len = strlen(headers[i]);
+
+                memcpy(b->body + b->len, headers[i], len);
+                b->len += len;
+                b->body[b->len++] = '\n';
+        }
+        memcpy(b->body + b->len, body, blen + 1);
+        b->len += blen;
+
+        b->entries[b->count].sent = sent;
+        b->entries[b->count].arg = arg;
+        b->count++;
+
+        return 0;
+}
+
+size_t post_batch_reply(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+        struct post_batch *b = userdata;
+        size_t len = size * nmemb;
+
+        if (reserve(&b->reply, &b->reply_size, b->reply_len + len + 1) < 0) {
+                return 0;
+        }
+        memcpy(b->reply + b->reply_len, ptr, len);
+        b->reply_len += len;
+        b->reply[b->reply_len] = '\0';
+
+        return len;
+}
+
+long post_batch_status(const struct post_batch *b, int index)
+{
+        const char *line = b->reply;
+        const char *end = b->reply + b->reply_len;
+
+        if (line == NULL) {
+                return 0;
+        }
+        for (int i = 0; i < index; i++) {
+                line = memchr(line, '\n', (size_t)(end - line));
+                if (line == NULL) {
+                        return 0;
+                }
+                line++;
+        }
+
+        /* Not a status if the line was cut short */
+        if (memchr(line, '\n', (size_t)(end - line)) == NULL) {
+                return 0;
+        }
+
+        return strtol(line, NULL, 10);
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
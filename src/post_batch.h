@@ -0,0 +1,137 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Batches of records sent to the backend in a single post.
+ *
+ * The body of a batch post is the records one after the other, each framed
+ * as a line giving the length in bytes of its headers and of its body, in
+ * decimal and separated by a space, followed by its headers, each on its
+ * own line as in a record file, then by its body:
+ *
+ *   <headers length> <body length>\n
+ *   <name>: <value>\n    (one line per header)
+ *   <body>
+ *
+ * The post is sent with the Content-Type application/x-telemetry-batch.
+ * The backend answers 200 with one line per record, in the same order,
+ * holding the HTTP status the record would have been answered with on its
+ * own: 200 or 201 if it was accepted, an error status if not. Records the
+ * answer has no line for are not accepted, and neither are any of them if
+ * the post fails or is answered with another status.
+ */
+
+/* Most records in a batch */
+#define POST_BATCH_MAX 256
+
+/* Content-Type of batch posts */
+#define POST_BATCH_CONTENT_TYPE "application/x-telemetry-batch"
+
+/**
+ * Called once the post of a record completed
+ *
+ * @param sent true if the record was accepted by the backend
+ * @param arg The argument given with the record
+ */
+typedef void (*post_sent_fn)(bool sent, void *arg);
+
+struct post_batch_entry {
+        post_sent_fn sent;
+        void *arg;
+};
+
+struct post_batch {
+        /* The body of the post */
+        char *body;
+        size_t len;
+        size_t size;
+        /* The records in the body, and whom to tell once it is posted */
+        struct post_batch_entry entries[POST_BATCH_MAX];
+        int count;
+        /* The answer of the backend */
+        char *reply;
+        size_t reply_len;
+        size_t reply_size;
+};
+
+/**
+ * Create an empty batch
+ *
+ * @return The batch, to be freed with post_batch_free()
+ */
+struct post_batch *post_batch_new(void);
+
+/**
+ * Free a batch
+ *
+ * @param b The batch, or NULL
+ */
+void post_batch_free(struct post_batch *b);
+
+/**
+ * Tell how many bytes a record takes in the body of a batch
+ *
+ * @param headers The headers of the record
+ * @param nheaders The number of headers
+ * @param body The body of the record
+ *
+ * @return The size of the framed record
+ */
+size_t post_batch_framed_size(char *headers[], int nheaders, const char *body);
+
+/**
+ * Append a record to a batch, which must hold fewer than POST_BATCH_MAX
+ *
+ * @param b The batch
+ * @param headers The headers of the record
+ * @param nheaders The number of headers
+ * @param body The body of the record
+ * @param sent Called once the batch is posted
+ * @param arg Passed to sent
+ *
+ * @return 0 if successful, or a negative errno-style value if not
+ */
+int post_batch_add(struct post_batch *b, char *headers[], int nheaders,
+                   const char *body, post_sent_fn sent, void *arg);
+
+/**
+ * Keep the answer of the backend, as a CURLOPT_WRITEFUNCTION
+ *
+ * @param ptr The data received
+ * @param size Always 1
+ * @param nmemb The size of the data
+ * @param userdata The batch
+ *
+ * @return nmemb, or 0 if it could not be kept
+ */
+size_t post_batch_reply(char *ptr, size_t size, size_t nmemb, void *userdata);
+
+/**
+ * Get the status the backend answered for a record of a batch
+ *
+ * @param b The batch, with its answer
+ * @param index The index of the record
+ *
+ * @return The HTTP status, or 0 if the answer has none for the record
+ */
+long post_batch_status(const struct post_batch *b, int index);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
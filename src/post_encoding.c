@@ -0,0 +1,416 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+#include "config.h"
+#include "post_encoding.h"
+#include "record_file.h"
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+
+/* The default of the zstd command, fast and still well ahead of gzip */
+#define ZSTD_LEVEL 3
+#endif
+
+/* Window of 2^15 bytes, plus 16 for a gzip wrapper rather than zlib's */
+#define GZIP_WINDOW_BITS (15 + 16)
+
+int post_encoding_from_name(const char *name, enum post_encoding *encoding)
+{
+        if (strcmp(name, "none") == 0) {
+                *encoding = POST_ENCODING_NONE;
+        } else if (strcmp(name, "gzip") == 0) {
+                *encoding = POST_ENCODING_GZIP;
+        } else if (strcmp(name, "zstd") == 0) {
+                *encoding = POST_ENCODING_ZSTD;
+        } else {
+                return -EINVAL;
+        }
+
+        return 0;
+}
+
+const char *post_encoding_name(enum post_encoding encoding)
+{
+        switch (encoding) {
+        case POST_ENCODING_GZIP:
+                return "gzip";
+        case POST_ENCODING_ZSTD:
+                return "zstd";
+        default:
+                return NULL;
+        }
+}
+
+bool post_encoding_supported(enum post_encoding encoding)
+{
+        switch (encoding) {
+        case POST_ENCODING_GZIP:
+                return true;
+        case POST_ENCODING_ZSTD:
+#ifdef HAVE_ZSTD
+                return true;
+#else
+                return false;
+#endif
+        default:
+                return false;
+        }
+}
+
+/**
+ * Compress a body with gzip, into a buffer no larger than the body
+ *
+ * @return The compressed length, or a negative errno-style value
+ */
+static ssize_t gzip_encode(const char *body, size_t len, char *out)
+{
+        z_stream zs;
+        ssize_t ret;
+
+        if (len > UINT_MAX) {
+                return -EOVERFLOW;
+        }
+
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                         GZIP_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                return -ENOMEM;
+        }
+        zs.next_in = (Bytef *)body;
+        zs.avail_in = (uInt)len;
+        zs.next_out = (Bytef *)out;
+        zs.avail_out = (uInt)len;
+
+        /* Runs out of room unless the body gets smaller */
+        ret = deflate(&zs, Z_FINISH) == Z_STREAM_END ? (ssize_t)zs.total_out : -E2BIG;
+        deflateEnd(&zs);
+
+        return ret;
+}
+
+#ifdef HAVE_ZSTD
+/**
+ * Compress a body with zstd, into a buffer no larger than the body
+ *
+ * @return The compressed length, or a negative errno-style value
+ */
+static ssize_t zstd_encode(const char *body, size_t len, char *out)
+{
+        size_t ret = ZSTD_compress(out, len, body, len, ZSTD_LEVEL);
+
+        /* Fails when out is too small, as it is to compress the body */
+        if (ZSTD_isError(ret)) {
+                return -E2BIG;
+        }
+
+        return (ssize_t)ret;
+}
+#endif
+
+int post_encode(enum post_encoding encoding, const char *body, size_t len,
+                struct encoded_body *eb)
+{
+        ssize_t ret = -EINVAL;
+        char *out;
+
+        encoded_body_free(eb);
+        if (len == 0) {
+                return -E2BIG;
+        }
+        out = malloc(len);
+        if (!out) {
+                return -ENOMEM;
+        }
+
+        if (encoding == POST_ENCODING_GZIP) {
+                ret = gzip_encode(body, len, out);
+#ifdef HAVE_ZSTD
+        } else if (encoding == POST_ENCODING_ZSTD) {
+                ret = zstd_encode(body, len, out);
+#endif
+        }
+        if (ret < 0) {
+                free(out);
+                return (int)ret;
+        }
+
+        eb->encoding = encoding;
+        eb->data = out;
+        eb->len = (size_t)ret;
+
+        return 0;
+}
+
+void encoded_body_free(struct encoded_body *eb)
+{
+        if (eb->encoding != POST_ENCODING_NONE) {
+                free(eb->data);
+        }
+        eb->encoding = POST_ENCODING_NONE;
+        eb->data = NULL;
+        eb->len = 0;
+        eb->cached = false;
+}
+
+/**
+ * Get the path of the cache file of a record, in the cache directory next
+ * to it
+ *
+ * @return The path, to free, or NULL if out of memory
+ */
+static char *cache_path(const char *record_path)
+{
+        const char *name = strrchr(record_path, '/');
+        char *path = NULL;
+        int dir_len;
+
+        if (name == NULL) {
+                name = record_path;
+                dir_len = 0;
+        } else {
+                name++;
+                dir_len = (int)(name - record_path);
+        }
+
+        if (asprintf(&path, "%.*s" POST_ENCODING_CACHE_DIR "/%s", dir_len,
+                     record_path, name) < 0) {
+                return NULL;
+        }
+
+        return path;
+}
+
+/**
+ * Read exactly len bytes from a file, at an offset
+ *
+ * @return 0 if successful, or a negative errno-style value if not
+ */
+static int read_at(int fd, void *buf, size_t len, off_t offset)
+{
+        char *p = buf;
+
+        while (len > 0) {
+                ssize_t n = pread(fd, p, len, offset);
+
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return -errno;
+                } else if (n == 0) {
+                        return -ESTALE;
+                }
+                p += n;
+                len -= (size_t)n;
+                offset += n;
+        }
+
+        return 0;
+}
+
+int encoded_body_load(const char *record_path, enum post_encoding encoding,
+                      const char *body, size_t len, struct encoded_body *eb)
+{
+        struct encoded_body_header hdr;
+        struct stat st;
+        char *path = cache_path(record_path);
+        char *data = NULL;
+        int ret;
+        int fd;
+
+        encoded_body_free(eb);
+        if (!path) {
+                return -ENOMEM;
+        }
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        free(path);
+        if (fd < 0) {
+                return -errno;
+        }
+
+        if (fstat(fd, &st) < 0) {
+                ret = -errno;
+                goto out;
+        }
+        ret = read_at(fd, &hdr, sizeof(hdr), 0);
+        if (ret < 0) {
+                goto out;
+        }
+
+        /* A file cut short while it was written fails the size check */
+        if (memcmp(hdr.magic, ENCODED_BODY_MAGIC, ENCODED_BODY_MAGIC_LEN) != 0 ||
+            hdr.version != ENCODED_BODY_VERSION || hdr.encoding != encoding ||
+            hdr.body_len != len || hdr.len == 0 ||
+            (uint64_t)st.st_size != sizeof(hdr) + hdr.len ||
+            hdr.body_crc != record_file_crc(0, body, len)) {
+                ret = -ESTALE;
+                goto out;
+        }
+
+        data = malloc(hdr.len);
+        if (!data) {
+                ret = -ENOMEM;
+                goto out;
+        }
+        ret = read_at(fd, data, hdr.len, sizeof(hdr));
+        if (ret < 0) {
+                free(data);
+                goto out;
+        }
+
+        eb->encoding = encoding;
+        eb->data = data;
+        eb->len = hdr.len;
+        eb->cached = true;
+out:
+        close(fd);
+
+        return ret;
+}
+
+int encoded_body_save(const char *record_path, const char *body, size_t len,
+                      const struct encoded_body *eb)
+{
+        struct encoded_body_header hdr;
+        struct iovec iov[2];
+        char *path = cache_path(record_path);
+        char *slash;
+        ssize_t written;
+        int ret = 0;
+        int fd;
+
+        if (!path) {
+                return -ENOMEM;
+        }
+        if (eb->encoding == POST_ENCODING_NONE || len > UINT32_MAX ||
+            eb->len > UINT32_MAX) {
+                free(path);
+                return -EINVAL;
+        }
+
+        /* The cache directory is created with the first file */
+        slash = strrchr(path, '/');
+        *slash = '\0';
+        if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+                ret = -errno;
+                free(path);
+                return ret;
+        }
+        *slash = '/';
+
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        free(path);
+        if (fd < 0) {
+                return -errno;
+        }
+
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, ENCODED_BODY_MAGIC, ENCODED_BODY_MAGIC_LEN);
+        hdr.version = ENCODED_BODY_VERSION;
+        hdr.encoding = (uint16_t)eb->encoding;
+        hdr.body_len = (uint32_t)len;
+        hdr.body_crc = record_file_crc(0, body, len);
+        hdr.len = (uint32_t)eb->len;
+        iov[0].iov_base = &hdr;
+        iov[0].iov_len = sizeof(hdr);
+        iov[1].iov_base = eb->data;
+        iov[1].iov_len = eb->len;
+
+        /* Not synced: a cache lost in a crash is made again */
+        written = writev(fd, iov, 2);
+        if (written < 0) {
+                ret = -errno;
+        } else if ((size_t)written != sizeof(hdr) + eb->len) {
+                ret = -ENOSPC;
+        }
+        close(fd);
+
+        return ret;
+}
+
+void encoded_body_remove(const char *record_path)
+{
+        char *path = cache_path(record_path);
+
+        if (path != NULL) {
+                unlink(path);
+                free(path);
+        }
+}
+
+int encoded_body_sweep(const char *spool_dir)
+{
+        struct dirent *entry;
+        int removed = 0;
+        int dirfd;
+        int cachefd;
+        DIR *d;
+
+        dirfd = open(spool_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirfd < 0) {
+                return -errno;
+        }
+        cachefd = openat(dirfd, POST_ENCODING_CACHE_DIR,
+                         O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (cachefd < 0) {
+                int ret = errno == ENOENT ? 0 : -errno;
+
+                close(dirfd);
+                return ret;
+        }
+        d = fdopendir(cachefd);
+        if (!d) {
+                int ret = -errno;
+
+                close(cachefd);
+                close(dirfd);
+                return ret;
+        }
+
+        while ((entry = readdir(d)) != NULL) {
+                struct stat st;
+
+                if (entry->d_name[0] == '.') {
+                        continue;
+                }
+                if (fstatat(dirfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 &&
+                    errno == ENOENT &&
+                    unlinkat(cachefd, entry->d_name, 0) == 0) {
+                        removed++;
+                }
+        }
+
+        closedir(d);
+        close(dirfd);
+
+        return removed;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,166 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Compression of the bodies telempostd posts, sent with a Content-Encoding
+ * header.
+ *
+ * The compressed body of a record kept in the spool directory is cached in
+ * the POST_ENCODING_CACHE_DIR subdirectory, under the name of the record, so
+ * that its next attempts do not compress it again. The cache file starts
+ * with a struct encoded_body_header, which ties it to the body it was made
+ * from. Cache files whose record went away are removed by
+ * encoded_body_sweep().
+ */
+
+/* Hidden, so that the spool scans skip it */
+#define POST_ENCODING_CACHE_DIR ".encoded"
+
+#define ENCODED_BODY_MAGIC "\177TMZ"
+#define ENCODED_BODY_MAGIC_LEN 4
+#define ENCODED_BODY_VERSION 1
+
+enum post_encoding {
+        POST_ENCODING_NONE = 0,
+        POST_ENCODING_GZIP,
+        POST_ENCODING_ZSTD,
+};
+
+struct encoded_body_header {
+        char magic[ENCODED_BODY_MAGIC_LEN];
+        uint16_t version;
+        /* enum post_encoding */
+        uint16_t encoding;
+        /* Length and CRC-32C of the body before compression */
+        uint32_t body_len;
+        uint32_t body_crc;
+        /* Length of the compressed body that follows */
+        uint32_t len;
+};
+
+struct encoded_body {
+        /* POST_ENCODING_NONE if the body is sent as is */
+        enum post_encoding encoding;
+        /* Owned by the struct, unless encoding is POST_ENCODING_NONE */
+        char *data;
+        size_t len;
+        /* Whether data was read from the cache */
+        bool cached;
+};
+
+/**
+ * Get the encoding of a name of the post_compression setting
+ *
+ * @param name "none", "gzip" or "zstd"
+ * @param encoding Set to the encoding
+ *
+ * @return 0 if successful, or -EINVAL if the name is unknown
+ */
+int post_encoding_from_name(const char *name, enum post_encoding *encoding);
+
+/**
+ * Get the Content-Encoding token of an encoding
+ *
+ * @param encoding The encoding
+ *
+ * @return The token, or NULL for POST_ENCODING_NONE
+ */
+const char *post_encoding_name(enum post_encoding encoding);
+
+/**
+ * Tell whether telempostd was built with an encoding
+ *
+ * @param encoding The encoding
+ *
+ * @return true if bodies can be compressed with it
+ */
+bool post_encoding_supported(enum post_encoding encoding);
+
+/**
+ * Compress a body
+ *
+ * @param encoding The encoding, which must be supported
+ * @param body The body
+ * @param len The length of the body
+ * @param eb Set to the compressed body, to free with encoded_body_free()
+ *
+ * @return 0 if successful, -E2BIG if the body does not get smaller, or
+ *    another negative errno-style value if it cannot be compressed
+ */
+int post_encode(enum post_encoding encoding, const char *body, size_t len,
+                struct encoded_body *eb);
+
+/**
+ * Free the compressed body of an encoded body, and reset it to send a body
+ * as is
+ *
+ * @param eb The encoded body
+ */
+void encoded_body_free(struct encoded_body *eb);
+
+/**
+ * Read the cached compressed body of a spooled record
+ *
+ * @param record_path The path of the record
+ * @param encoding The encoding wanted
+ * @param body The body of the record
+ * @param len The length of the body
+ * @param eb Set to the cached body, to free with encoded_body_free()
+ *
+ * @return 0 if successful, -ENOENT if the record has no cached body, or
+ *    -ESTALE if it was made with another encoding or from another body
+ */
+int encoded_body_load(const char *record_path, enum post_encoding encoding,
+                      const char *body, size_t len, struct encoded_body *eb);
+
+/**
+ * Cache the compressed body of a record kept in the spool directory
+ *
+ * @param record_path The path of the record
+ * @param body The body of the record
+ * @param len The length of the body
+ * @param eb The compressed body
+ *
+ * @return 0 if successful, or a negative errno-style value if not
+ */
+int encoded_body_save(const char *record_path, const char *body, size_t len,
+                      const struct encoded_body *eb);
+
+/**
+ * Remove the cached compressed body of a record, if it has one
+ *
+ * @param record_path The path of the record
+ */
+void encoded_body_remove(const char *record_path);
+
+/**
+ * Remove the cached compressed bodies of the records no longer in a spool
+ * directory
+ *
+ * @param spool_dir The spool directory
+ *
+ * @return The number of cache files removed, or a negative errno-style value
+ *    if the cache could not be read
+ */
+int encoded_body_sweep(const char *spool_dir);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,238 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "post_engine.h"
+
+static int64_t now_ms(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Keep track of the sockets libcurl waits on, as it asks
+ *
+ * @return 0 if successful, or -1 if there are too many sockets
+ */
+static int socket_callback(CURL *curl, curl_socket_t s, int what, void *userp,
+                           void *socketp)
+{
+        struct post_engine *engine = userp;
+        size_t i = 0;
+
+        while (i < engine->nfds && engine->fds[i].fd != s) {
+                i++;
+        }
+
+        if (what == CURL_POLL_REMOVE) {
+                if (i < engine->nfds) {
+                        engine->fds[i] = engine->fds[--engine->nfds];
+                }
+                return 0;
+        }
+
+        if (i == engine->nfds) {
+                if (engine->nfds == POST_ENGINE_MAX_FDS) {
+                        telem_log(LOG_ERR, "Too many sockets for the posts in flight\n");
+                        return -1;
+                }
+                engine->fds[engine->nfds++].fd = s;
+        }
+        engine->fds[i].events = (short)(((what & CURL_POLL_IN) ? POLLIN : 0) |
+                                        ((what & CURL_POLL_OUT) ? POLLOUT : 0));
+        engine->fds[i].revents = 0;
+
+        return 0;
+}
+
+/**
+ * Keep track of when libcurl wants its timeout handled
+ *
+ * @return 0
+ */
+static int timer_callback(CURLM *multi, long timeout_ms, void *userp)
+{
+        struct post_engine *engine = userp;
+
+        engine->deadline_ms = timeout_ms < 0 ? -1 : now_ms() + timeout_ms;
+
+        return 0;
+}
+
+void post_engine_init(struct post_engine *engine, int max_inflight,
+                      post_done_fn done, void *arg)
+{
+        memset(engine, 0, sizeof(*engine));
+        if (max_inflight < 1) {
+                max_inflight = 1;
+        } else if (max_inflight > POST_ENGINE_MAX) {
+                max_inflight = POST_ENGINE_MAX;
+        }
+        engine->max_inflight = max_inflight;
+        engine->deadline_ms = -1;
+        engine->done = done;
+        engine->done_arg = arg;
+}
+
+void post_engine_release(struct post_engine *engine)
+{
+        if (engine->multi == NULL || engine->inflight > 0) {
+                return;
+        }
+
+        curl_multi_cleanup(engine->multi);
+        engine->multi = NULL;
+        engine->nfds = 0;
+        engine->deadline_ms = -1;
+}
+
+bool post_engine_full(const struct post_engine *engine)
+{
+        return engine->inflight >= engine->max_inflight;
+}
+
+bool post_engine_busy(const struct post_engine *engine)
+{
+        return engine->inflight > 0;
+}
+
+int post_engine_add(struct post_engine *engine, CURL *curl)
+{
+        if (engine->multi == NULL) {
+                engine->multi = curl_multi_init();
+                if (engine->multi == NULL) {
+                        return -ENOMEM;
+                }
+                curl_multi_setopt(engine->multi, CURLMOPT_SOCKETFUNCTION, socket_callback);
+                curl_multi_setopt(engine->multi, CURLMOPT_SOCKETDATA, engine);
+                curl_multi_setopt(engine->multi, CURLMOPT_TIMERFUNCTION, timer_callback);
+                curl_multi_setopt(engine->multi, CURLMOPT_TIMERDATA, engine);
+                curl_multi_setopt(engine->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                                  (long)engine->max_inflight);
+        }
+
+        if (curl_multi_add_handle(engine->multi, curl) != CURLM_OK) {
+                return -EINVAL;
+        }
+        engine->inflight++;
+
+        return 0;
+}
+
+size_t post_engine_pollfds(const struct post_engine *engine,
+                           struct pollfd *fds, size_t max)
+{
+        size_t n = engine->nfds < max ? engine->nfds : max;
+
+        memcpy(fds, engine->fds, n * sizeof(struct pollfd));
+
+        return n;
+}
+
+int post_engine_timeout(const struct post_engine *engine, int timeout_ms)
+{
+        int64_t remaining;
+
+        if (engine->deadline_ms < 0) {
+                return timeout_ms;
+        }
+
+        remaining = engine->deadline_ms - now_ms();
+        if (remaining < 0) {
+                remaining = 0;
+        }
+        if (timeout_ms < 0 || remaining < timeout_ms) {
+                return (int)remaining;
+        }
+
+        return timeout_ms;
+}
+
+void post_engine_dispatch(struct post_engine *engine, const struct pollfd *fds,
+                          size_t nfds)
+{
+        CURLMsg *msg;
+        int running;
+        int pending;
+
+        if (engine->multi == NULL) {
+                return;
+        }
+
+        for (size_t i = 0; i < nfds; i++) {
+                int mask = 0;
+
+                if (fds[i].revents == 0) {
+                        continue;
+                }
+                /* A hang up is seen by libcurl when it reads */
+                if (fds[i].revents & (POLLIN | POLLHUP)) {
+                        mask |= CURL_CSELECT_IN;
+                }
+                if (fds[i].revents & POLLOUT) {
+                        mask |= CURL_CSELECT_OUT;
+                }
+                if (fds[i].revents & POLLERR) {
+                        mask |= CURL_CSELECT_ERR;
+                }
+                curl_multi_socket_action(engine->multi, fds[i].fd, mask, &running);
+        }
+
+        if (engine->deadline_ms >= 0 && now_ms() >= engine->deadline_ms) {
+                engine->deadline_ms = -1;
+                curl_multi_socket_action(engine->multi, CURL_SOCKET_TIMEOUT, 0,
+                                         &running);
+        }
+
+        while ((msg = curl_multi_info_read(engine->multi, &pending)) != NULL) {
+                CURL *curl = msg->easy_handle;
+                CURLcode res = msg->data.result;
+
+                if (msg->msg != CURLMSG_DONE) {
+                        continue;
+                }
+                curl_multi_remove_handle(engine->multi, curl);
+                engine->inflight--;
+                engine->done(curl, res, engine->done_arg);
+        }
+}
+
+void post_engine_wait(struct post_engine *engine, int max_inflight)
+{
+        struct pollfd fds[POST_ENGINE_MAX_FDS];
+
+        while (engine->inflight > 0 && engine->inflight >= max_inflight) {
+                size_t nfds = post_engine_pollfds(engine, fds, POST_ENGINE_MAX_FDS);
+
+                if (poll(fds, nfds, post_engine_timeout(engine, 1000)) < 0 &&
+                    errno != EINTR) {
+                        telem_perror("Failed to poll posts in flight");
+                        return;
+                }
+                post_engine_dispatch(engine, fds, nfds);
+        }
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,158 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <curl/curl.h>
+
+/*
+ * Runs several posts at once with the libcurl multi interface, from the
+ * daemon's event loop.
+ *
+ * The daemon adds easy handles, set up for their post, up to the most
+ * posts allowed in flight. Before polling, it appends the sockets libcurl
+ * waits on to its poll set with post_engine_pollfds(), and shortens its
+ * timeout with post_engine_timeout(). After polling, post_engine_dispatch()
+ * lets libcurl progress, and calls the done function of the engine for
+ * each post that completed, after removing its handle from the engine.
+ *
+ * The multi handle is created with the first post, and freed by
+ * post_engine_release() once nothing is in flight, so that an idle daemon
+ * holds no libcurl state.
+ */
+
+/* Most posts in flight */
+#define POST_ENGINE_MAX 64
+
+/* Most sockets libcurl waits on, counting those of the DNS resolver */
+#define POST_ENGINE_MAX_FDS (2 * POST_ENGINE_MAX)
+
+/**
+ * Called when a post completes
+ *
+ * @param curl The easy handle of the post, no longer in the engine
+ * @param res The result of the transfer
+ * @param arg The argument given to post_engine_init()
+ */
+typedef void (*post_done_fn)(CURL *curl, CURLcode res, void *arg);
+
+struct post_engine {
+        /* NULL until the first post */
+        CURLM *multi;
+        int max_inflight;
+        int inflight;
+        /* Sockets libcurl waits on, and the events it waits for */
+        struct pollfd fds[POST_ENGINE_MAX_FDS];
+        size_t nfds;
+        /* When libcurl wants its timeout handled, in ms of CLOCK_MONOTONIC,
+         * or -1 */
+        int64_t deadline_ms;
+        post_done_fn done;
+        void *done_arg;
+};
+
+/**
+ * Initialize an engine
+ *
+ * @param engine The engine
+ * @param max_inflight Most posts in flight, from 1 to POST_ENGINE_MAX
+ * @param done Called for each post that completes
+ * @param arg Passed to done
+ */
+void post_engine_init(struct post_engine *engine, int max_inflight,
+                      post_done_fn done, void *arg);
+
+/**
+ * Free the multi handle of an engine, which must have no post in flight.
+ * The next post creates it again.
+ *
+ * @param engine The engine
+ */
+void post_engine_release(struct post_engine *engine);
+
+/**
+ * Tell whether an engine has as many posts in flight as it allows
+ *
+ * @param engine The engine
+ *
+ * @return true if no post can be added
+ */
+bool post_engine_full(const struct post_engine *engine);
+
+/**
+ * Tell whether an engine has posts in flight
+ *
+ * @param engine The engine
+ *
+ * @return true if posts are in flight
+ */
+bool post_engine_busy(const struct post_engine *engine);
+
+/**
+ * Start a post, which must not make the engine go over its limit
+ *
+ * @param engine The engine
+ * @param curl The easy handle, set up for the post
+ *
+ * @return 0 if successful, or a negative errno-style value if not
+ */
+int post_engine_add(struct post_engine *engine, CURL *curl);
+
+/**
+ * Copy the sockets libcurl waits on into a poll set
+ *
+ * @param engine The engine
+ * @param fds Where to copy them
+ * @param max Room in fds
+ *
+ * @return The number of entries copied
+ */
+size_t post_engine_pollfds(const struct post_engine *engine,
+                           struct pollfd *fds, size_t max);
+
+/**
+ * Shorten a poll timeout so that the daemon wakes up for libcurl's timeout
+ *
+ * @param engine The engine
+ * @param timeout_ms The timeout the daemon would use otherwise, in ms
+ *
+ * @return The timeout to use, in ms
+ */
+int post_engine_timeout(const struct post_engine *engine, int timeout_ms);
+
+/**
+ * Let libcurl handle the events of its sockets and its timeout, and
+ * complete the posts that are done
+ *
+ * @param engine The engine
+ * @param fds The entries filled by post_engine_pollfds(), once polled
+ * @param nfds The number of entries
+ */
+void post_engine_dispatch(struct post_engine *engine, const struct pollfd *fds,
+                          size_t nfds);
+
+/**
+ * Run the engine until it has fewer posts in flight than a limit
+ *
+ * @param engine The engine
+ * @param max_inflight The limit, 1 to wait for all posts to complete
+ */
+void post_engine_wait(struct post_engine *engine, int max_inflight);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
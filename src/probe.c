@@ -29,7 +29,6 @@
 #include <unistd.h>
 #include <sys/signalfd.h>
 #include <signal.h>
-#include <malloc.h>
 
 #include "telemetry.h"
 #include "config.h"
@@ -51,6 +50,9 @@
 #include "telemdaemon.h"
 #include "configuration.h"
 
+/* Maximum number of events handled per epoll_wait() call */
+#define TM_MAX_EVENTS 64
+
 void print_usage(char *prog)
 {
         printf("%s: Usage\n", prog);
@@ -65,9 +67,13 @@ int main(int argc, char **argv)
         int sockfd, fd, sigfd;
         int ret = 0;
         TelemDaemon daemon;
-        nfds_t i;
+        struct epoll_event events[TM_MAX_EVENTS];
+        daemon_watch signal_watch = { WATCH_SIGNAL, NULL };
+        daemon_watch listener_watch = { WATCH_LISTENER, NULL };
+        daemon_watch drain_watch = { WATCH_DRAIN, NULL };
+        daemon_watch stats_watch = { WATCH_STATS, NULL };
+        int i;
         client *cl = NULL;
-        client *current_client = NULL;
         int c;
         int opt_index = 0;
         sigset_t mask;
@@ -139,7 +145,9 @@ int main(int argc, char **argv)
                 telem_perror("Error creating the signalfd");
                 exit(EXIT_FAILURE);
         }
-        add_pollfd(&daemon, sigfd, POLLIN);
+        add_epoll_fd(&daemon, sigfd, EPOLLIN, &signal_watch);
+        /* Signalled by the workers when clients may be resumed */
+        add_epoll_fd(&daemon, daemon.drain_efd, EPOLLIN, &drain_watch);
 
 #ifdef HAVE_SYSTEMD_SD_DAEMON_H
         ret = sd_listen_fds(0);
@@ -152,10 +160,10 @@ int main(int argc, char **argv)
                 /* Check if the socket is of correct type */
                 if (sd_is_socket_unix(fd, SOCK_STREAM, 1, socket_path_config(), 0)) {
                         telem_log(LOG_INFO, "Socket of type AF_UNIX passed by systemd\n");
-                        add_pollfd(&daemon, fd, POLLIN | POLLPRI);
+                        add_epoll_fd(&daemon, fd, EPOLLIN | EPOLLPRI, &listener_watch);
                 } else if (sd_is_socket(fd, AF_UNSPEC, 0, -1)) {
                         telem_log(LOG_INFO, "Socket of type SOCKET passed by systemd\n");
-                        add_pollfd(&daemon, fd, POLLIN | POLLPRI);
+                        add_epoll_fd(&daemon, fd, EPOLLIN | EPOLLPRI, &listener_watch);
                 } else {
                         telem_log(LOG_ERR, "File descriptor other than socket passed by systemd\n");
                         exit(EXIT_FAILURE);
@@ -200,8 +208,8 @@ int main(int argc, char **argv)
                         exit(EXIT_FAILURE);
                 }
 
-                /*Add listener fd to array of pollfds */
-                add_pollfd(&daemon, sockfd, POLLIN | POLLPRI);
+                /* Watch the listener fd */
+                add_epoll_fd(&daemon, sockfd, EPOLLIN | EPOLLPRI, &listener_watch);
         }
 
         telem_log(LOG_INFO, "Listening on socket...\n");
@@ -210,28 +218,51 @@ int main(int argc, char **argv)
         int spool_process_time = spool_process_time_config();
         time_t last_record_received = time(NULL);
 
-        ret = update_machine_id();
+        /* Read the static machine id file if it exists, before the machine
+         * id is loaded for records */
+        daemon.machine_id_override = read_machine_id_override();
+
+        ret = update_machine_id(&daemon);
         if (ret == -1) {
                 telem_log(LOG_ERR, "Unable to update machine id\n");
         }
 
-        /* Read the static machine id file if it exists.*/
-        daemon.machine_id_override = read_machine_id_override();
-
         time_t last_refresh_time = time(NULL);
 
+        mem_policy_init(&daemon.mem, idle_trim_time_config(), &daemon.pool);
+        configure_quotas(&daemon);
+
+        daemon.stats_fd = stats_listen(spool_dir_config(), STATS_PROBD_SOCKET_NAME);
+        if (daemon.stats_fd < 0) {
+                /* Not needed to handle records */
+                telem_log(LOG_WARNING, "Unable to create stats endpoint: %s\n",
+                          strerror(-daemon.stats_fd));
+        } else {
+                add_epoll_fd(&daemon, daemon.stats_fd, EPOLLIN, &stats_watch);
+        }
+        /* Records are staged by the loop itself if this fails */
+        start_workers(&daemon, worker_threads_config());
+
         /* Loop to accept clients */
         while (1) {
-                malloc_trim(0);
-                ret = poll(daemon.pollfds, daemon.nfds, spool_process_time * 1000);
+                int wait_ms = mem_policy_timeout(&daemon.mem,
+                                                 spool_process_time * 1000);
+
+                /* Wake up in time for the next group sync of staged records */
+                wait_ms = staging_timeout(&daemon.staging, wait_ms);
+                /* and for the clients held back by their quotas */
+                wait_ms = paused_clients_timeout(&daemon, wait_ms);
+                ret = epoll_wait(daemon.epoll_fd, events, TM_MAX_EVENTS, wait_ms);
                 if (ret == -1) {
-                        telem_perror("Failed to poll daemon file descriptors");
+                        telem_perror("Failed to wait for daemon file descriptors");
                         break;
                 } else if (ret != 0) {
-                        for (i = 0; i < daemon.nfds; i++) {
+                        for (i = 0; i < ret; i++) {
+                                daemon_watch *watch = events[i].data.ptr;
 
-                                /* Check if a signal was received */
-                                if (daemon.pollfds[0].revents != 0) {
+                                switch (watch->type) {
+                                case WATCH_SIGNAL: {
+                                        /* Check if a signal was received */
                                         struct signalfd_siginfo fdsi;
                                         ssize_t s;
 
@@ -250,18 +281,23 @@ int main(int argc, char **argv)
 
                                         if (fdsi.ssi_signo == SIGHUP) {
                                                 telem_log(LOG_INFO, "Received a SIGHUP signal\n");
+                                                /* Workers use the configuration */
+                                                stop_workers(&daemon);
                                                 /* reload configuration file */
                                                 reload_config();
+                                                daemon.mem.idle_time = idle_trim_time_config();
+                                                /* Reopened with the new settings
+                                                 * for the next record */
+                                                staging_close(&daemon.staging);
+                                                close_record_stream(&daemon);
+                                                configure_quotas(&daemon);
+                                                start_workers(&daemon, worker_threads_config());
                                         }
+                                        break;
                                 }
-
-                                if (daemon.pollfds[i].revents == 0) {
-                                        continue;
-                                }
-
-                                /* Accept connection if data arrives on listening socket */
-                                if (daemon.pollfds[i].fd == sockfd) {
-                                        if ((fd = accept(daemon.pollfds[i].fd, NULL, NULL)) == -1) {
+                                case WATCH_LISTENER:
+                                        /* Accept connection if data arrives on listening socket */
+                                        if ((fd = accept(sockfd, NULL, NULL)) == -1) {
                                                 telem_perror("Failed to accept socket");
                                                 //exit(EXIT_FAILURE);
                                                 break;
@@ -284,41 +320,60 @@ int main(int argc, char **argv)
                                                 telem_perror("Failed to set socket timeout");
                                         }
 
-                                        /* Add the fd to the client list */
-                                        if (!add_client(&(daemon.client_head), fd)) {
-                                                telem_log(LOG_ERR, "Unable to add the client to list\n");
+                                        /* Add the fd to the client table */
+                                        if (!(cl = add_client(&daemon, fd))) {
+                                                telem_log(LOG_ERR, "Unable to add the client to table\n");
                                                 exit(EXIT_FAILURE);
                                         }
 
-                                        /* Add fd to the poll array */
-                                        add_pollfd(&daemon, fd, POLLIN | POLLPRI);
-                                } else if (i != 0) {
-                                        /* Lookup client and handle data on client */
-                                        LIST_FOREACH(cl, &(daemon.client_head), client_ptrs) {
-                                                if (cl->fd == daemon.pollfds[i].fd) {
-                                                        current_client = cl;
-                                                        telem_log(LOG_INFO, "Client found: %d\n",
-                                                                  current_client->fd);
-                                                }
+                                        /* Watch the client's connection */
+                                        add_epoll_fd(&daemon, fd, EPOLLIN | EPOLLPRI, &cl->sock_watch);
+                                        break;
+                                case WATCH_DRAIN:
+                                        /* The clients are resumed below */
+                                        break;
+                                case WATCH_STATS:
+                                        serve_stats(&daemon);
+                                        break;
+                                case WATCH_CLIENT:
+                                case WATCH_RING:
+                                        /* Skip clients terminated or paused
+                                         * earlier in this batch */
+                                        if (watch->cl->fd < 0 || watch->cl->paused) {
+                                                break;
+                                        }
+                                        if (watch->type == WATCH_RING) {
+                                                handle_ring(&daemon, watch->cl);
+                                        } else {
+                                                handle_client(&daemon, watch->cl);
                                         }
-                                        assert(current_client);
-                                        handle_client(&daemon, i, current_client);
                                         last_record_received = time(NULL);
+                                        mem_policy_busy(&daemon.mem);
+                                        break;
                                 }
                         }
                 } else {
                         time_t now = time(NULL);
-                        /* time to recycle the daemon has elapsed*/
+                        /* time to recycle the daemon has elapsed, and no
+                         * client holds records back */
                         if (daemon_recycling_enabled &&
+                            LIST_EMPTY(&daemon.paused_clients) &&
                             difftime(now, last_record_received) >= TM_DAEMON_EXIT_TIME) {
                                 /* Exit */
                                 telem_log(LOG_INFO, "Daemon exiting for recycling\n");
                                 goto clean_exit;
                         }
                 }
+                resume_clients(&daemon);
+                reap_clients(&daemon);
+                staging_tick(&daemon.staging);
+                if (mem_policy_idle(&daemon.mem)) {
+                        mem_policy_log_stats(&daemon.mem);
+                        peer_table_log_stats(&daemon.peers);
+                }
                 time_t now = time(NULL);
                 if (difftime(now, last_refresh_time) >= TM_REFRESH_RATE) {
-                        int ret = update_machine_id();
+                        int ret = update_machine_id(&daemon);
                         if (ret == -1) {
                                 telem_log(LOG_ERR, "Unable to update machine id\n");
                         }
@@ -329,13 +384,28 @@ int main(int argc, char **argv)
 clean_exit:
 
         /* Free memory before exiting */
-        while ((cl = LIST_FIRST(&(daemon.client_head))) != NULL) {
-                remove_client(&(daemon.client_head), cl);
+        for (fd = 0; (size_t)fd < daemon.clients_alloc / sizeof(client *); fd++) {
+                if ((cl = get_client(&daemon, fd)) != NULL) {
+                        close_client_ring(&daemon, cl);
+                        remove_client(&daemon, cl);
+                }
         }
-        free(daemon.pollfds);
+        reap_clients(&daemon);
+        stop_workers(&daemon);
+        staging_close(&daemon.staging);
+        close_record_stream(&daemon);
+        mem_policy_log_stats(&daemon.mem);
+        peer_table_log_stats(&daemon.peers);
+        peer_table_free(&daemon.peers);
+        stats_close(daemon.stats_fd, spool_dir_config(), STATS_PROBD_SOCKET_NAME);
+        buffer_pool_trim(&daemon.pool);
+        free(daemon.clients);
+        free(daemon.ring_record);
+        close(daemon.drain_efd);
+        close(daemon.epoll_fd);
         free(daemon.machine_id_override);
-        if (LIST_EMPTY(&(daemon.client_head))) {
-                telem_log(LOG_INFO, "Client list cleared\n");
+        if (is_client_table_empty(&daemon)) {
+                telem_log(LOG_INFO, "Client table cleared\n");
         }
 
         return 0;
@@ -69,6 +69,34 @@ static void add_to_payload(const void *data, size_t length)
         }
 }
 
+/* Records queued while draining the journal, sent together by flush_data() */
+#define JOURNAL_BATCH_SIZE 32
+static struct telem_ref *batch[JOURNAL_BATCH_SIZE];
+static size_t batch_len = 0;
+
+static bool flush_data(void)
+{
+        int ret;
+        bool sent = true;
+
+        if (batch_len == 0) {
+                return true;
+        }
+
+        if ((ret = tm_send_records(batch, batch_len)) < 0) {
+                telem_log(LOG_ERR, "Failed to send records: %s\n", strerror(-ret));
+                sent = false;
+        }
+
+        for (size_t i = 0; i < batch_len; i++) {
+                tm_free_record(batch[i]);
+                batch[i] = NULL;
+        }
+        batch_len = 0;
+
+        return sent;
+}
+
 static bool send_data(char *class)
 {
         struct telem_ref *handle = NULL;
@@ -94,13 +122,11 @@ static bool send_data(char *class)
 
         free(payload_str);
 
-        if ((ret = tm_send_record(handle)) < 0) {
-                telem_log(LOG_ERR, "Failed to send record: %s\n", strerror(-ret));
-                tm_free_record(handle);
-                goto fail;
+        batch[batch_len++] = handle;
+        if (batch_len == JOURNAL_BATCH_SIZE) {
+                return flush_data();
         }
 
-        tm_free_record(handle);
         return true;
 fail:
         return false;
@@ -117,24 +143,31 @@ static int read_new_entries(sd_journal *journal)
                 ret = sd_journal_get_data(journal, "MESSAGE", &data, &length);
                 if (ret < 0) {
                         tm_journal_err("Failed to read journal entry", ret);
+                        flush_data();
                         return -1;
                 }
 
                 add_to_payload(data, length);
 
-                // For now, we send one record per log message, in case the
+                // For now, we create one record per log message, in case the
                 // there is a large backlog of messages and we exceed the
-                // payload size limit (8KB). And ignore errors, hoping that it's
-                // a transient problem.
+                // payload size limit (8KB). Records are queued and sent in
+                // batches over a single connection. And ignore errors, hoping
+                // that it's a transient problem.
 
                 if (!send_data(error_class)) {
                         telem_log(LOG_ERR, "Failed to send data. Ignoring.\n");
+                        flush_data();
                         return num_entries;
                 }
 
                 num_entries++;
         }
 
+        if (!flush_data()) {
+                telem_log(LOG_ERR, "Failed to send data. Ignoring.\n");
+        }
+
         /* Since the newest entry in the journal might not match our filters,
          * the 0 return code either indicates that we've processed the last
          * journal entry, or it was skipped, and we're now positioned at the
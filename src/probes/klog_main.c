@@ -20,11 +20,13 @@
 #include <stdio.h>
 #include <sys/klog.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
-#include <malloc.h>
 #include <signal.h>
 
 #include "log.h"
+#include "mem_policy.h"
 #include "oops_parser.h"
 #include "klog_scanner.h"
 
@@ -32,11 +34,16 @@
 #define SYSLOG_ACTION_SIZE_BUFFER 10
 #define MAX_BUF 8192
 
+/* Seconds without kernel messages before the heap is trimmed */
+#define KLOG_IDLE_TRIM_TIME 60
+
 int main(void)
 {
         int log_size = 0;
         char *bufp = NULL;
         size_t buflen = 0;
+        int kmsg_fd;
+        struct mem_policy mem;
 
         oops_parser_init(klog_process_oops_msgs);
 
@@ -63,10 +70,28 @@ int main(void)
         // Gets the contents of the kernel ring buffer
         bufp = (char *)malloc(buflen);
 
+        /* klogctl() blocks until messages arrive, so /proc/kmsg is polled
+         * first, to trim the heap once no message came for a while */
+        mem_policy_init(&mem, KLOG_IDLE_TRIM_TIME, NULL);
+        kmsg_fd = open("/proc/kmsg", O_RDONLY | O_CLOEXEC);
+        if (kmsg_fd < 0) {
+                telem_log(LOG_WARNING, "Cannot open /proc/kmsg, the heap will"
+                          " not be trimmed\n");
+        }
+
         while (1) {
                 int bytes_read;
- 
-                malloc_trim(0);
+
+                if (kmsg_fd >= 0) {
+                        struct pollfd pfd = { .fd = kmsg_fd, .events = POLLIN };
+                        int ret = poll(&pfd, 1, mem_policy_timeout(&mem, -1));
+
+                        if (ret == 0 || (ret < 0 && errno == EINTR)) {
+                                mem_policy_idle(&mem);
+                                continue;
+                        }
+                }
+
                 memset(bufp, 0, buflen);
                 bytes_read = klogctl(SYSLOG_ACTION_READ, bufp, (int)buflen);
                 if (bytes_read < 0) {
@@ -75,6 +100,7 @@ int main(void)
                 }
 
                 klog_process_buffer(bufp, (size_t)bytes_read);
+                mem_policy_busy(&mem);
         }
 
         // Not reached
@@ -104,6 +104,8 @@ endif
 	%D%/klog_scanner.h \
 	%D%/oops_parser.h \
 	src/nica/nc-string.c \
+	src/buffer_pool.c \
+	src/mem_policy.c \
 	%D%/oops_parser.c
 %C%_klogscanner_CFLAGS = \
         $(AM_CFLAGS)
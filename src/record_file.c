@@ -0,0 +1,253 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "record_file.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define RECORD_FILE_X86_CRC 1
+#include <nmmintrin.h>
+#endif
+
+/* The null byte written after each field */
+static char field_end = '\0';
+
+/* CRC-32C (Castagnoli, reflected) of each nibble */
+static const uint32_t crc_table[16] = {
+        0x00000000, 0x105ec76f, 0x20bd8ede, 0x30e349b1,
+        0x417b1dbc, 0x5125dad3, 0x61c69362, 0x7198540d,
+        0x82f63b78, 0x92a8fc17, 0xa24bb5a6, 0xb21572c9,
+        0xc38d26c4, 0xd3d3e1ab, 0xe330a81a, 0xf36e6f75
+};
+
+uint32_t record_file_crc_nibble(uint32_t crc, const void *buf, size_t len)
+{
+        const uint8_t *p = buf;
+
+        crc = ~crc;
+        for (size_t i = 0; i < len; i++) {
+                crc ^= p[i];
+                crc = (crc >> 4) ^ crc_table[crc & 15];
+                crc = (crc >> 4) ^ crc_table[crc & 15];
+        }
+
+        return ~crc;
+}
+
+#ifdef RECORD_FILE_X86_CRC
+
+/* The crc32 instruction of SSE4.2 computes CRC-32C, eight bytes at a time */
+__attribute__((target("sse4.2")))
+static uint32_t record_file_crc_sse42(uint32_t crc, const void *buf, size_t len)
+{
+        const uint8_t *p = buf;
+        uint64_t c = ~crc;
+
+        while (len >= sizeof(uint64_t)) {
+                uint64_t v;
+
+                memcpy(&v, p, sizeof(v));
+                c = _mm_crc32_u64(c, v);
+                p += sizeof(uint64_t);
+                len -= sizeof(uint64_t);
+        }
+        crc = (uint32_t)c;
+        while (len > 0) {
+                crc = _mm_crc32_u8(crc, *p++);
+                len--;
+        }
+
+        return ~crc;
+}
+
+uint32_t record_file_crc(uint32_t crc, const void *buf, size_t len)
+{
+        static uint32_t (*impl)(uint32_t, const void *, size_t) = NULL;
+        uint32_t (*fn)(uint32_t, const void *, size_t) =
+                __atomic_load_n(&impl, __ATOMIC_RELAXED);
+
+        /* Racing callers all store the same pointer, so no lock is needed */
+        if (fn == NULL) {
+                __builtin_cpu_init();
+                if (__builtin_cpu_supports("sse4.2")) {
+                        fn = record_file_crc_sse42;
+                } else {
+                        fn = record_file_crc_nibble;
+                }
+                __atomic_store_n(&impl, fn, __ATOMIC_RELAXED);
+        }
+
+        return fn(crc, buf, len);
+}
+
+#else
+
+uint32_t record_file_crc(uint32_t crc, const void *buf, size_t len)
+{
+        return record_file_crc_nibble(crc, buf, len);
+}
+
+#endif
+
+size_t record_file_iov(struct record_file_header *hdr,
+                       const struct iovec fields[RECORD_FIELDS],
+                       struct iovec iov[RECORD_FILE_IOVS])
+{
+        size_t offset = sizeof(*hdr);
+        uint32_t crc;
+        int n = 0;
+
+        memset(hdr, 0, sizeof(*hdr));
+        memcpy(hdr->magic, RECORD_FILE_MAGIC, RECORD_FILE_MAGIC_LEN);
+        hdr->version = RECORD_FILE_VERSION;
+        hdr->nfields = RECORD_FIELDS;
+
+        iov[n++] = (struct iovec){ hdr, sizeof(*hdr) };
+        for (int i = 0; i < RECORD_FIELDS; i++) {
+                if (offset + fields[i].iov_len + 1 > UINT32_MAX) {
+                        return 0;
+                }
+                hdr->fields[i].offset = (uint32_t)offset;
+                hdr->fields[i].len = (uint32_t)fields[i].iov_len;
+                iov[n++] = fields[i];
+                iov[n++] = (struct iovec){ &field_end, 1 };
+                offset += fields[i].iov_len + 1;
+        }
+        hdr->size = (uint32_t)offset;
+
+        crc = record_file_crc(0, hdr, offsetof(struct record_file_header, checksum));
+        for (int i = 1; i < n; i++) {
+                crc = record_file_crc(crc, iov[i].iov_base, iov[i].iov_len);
+        }
+        hdr->checksum = crc;
+
+        return offset;
+}
+
+bool record_file_is_binary(const char *buf, size_t len)
+{
+        return len >= RECORD_FILE_MAGIC_LEN &&
+               memcmp(buf, RECORD_FILE_MAGIC, RECORD_FILE_MAGIC_LEN) == 0;
+}
+
+int record_view_parse(struct record_view *view, char *buf, size_t len)
+{
+        struct record_file_header hdr;
+        uint32_t crc;
+
+        memset(view, 0, sizeof(*view));
+
+        if (len < sizeof(hdr) || !record_file_is_binary(buf, len)) {
+                return -EBADMSG;
+        }
+        /* The buffer may not be aligned for the header */
+        memcpy(&hdr, buf, sizeof(hdr));
+        if (hdr.version != RECORD_FILE_VERSION) {
+                return -EPROTONOSUPPORT;
+        }
+        if (hdr.nfields != RECORD_FIELDS || hdr.size != len) {
+                return -EBADMSG;
+        }
+
+        crc = record_file_crc(0, buf, offsetof(struct record_file_header, checksum));
+        crc = record_file_crc(crc, buf + sizeof(hdr), len - sizeof(hdr));
+        if (crc != hdr.checksum) {
+                return -EILSEQ;
+        }
+
+        for (int i = 0; i < RECORD_FIELDS; i++) {
+                struct record_field *f = &hdr.fields[i];
+
+                if (f->offset < sizeof(hdr) || f->offset >= len ||
+                    f->len >= len - f->offset || buf[f->offset + f->len] != '\0') {
+                        return -EBADMSG;
+                }
+        }
+
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                struct record_field *f = &hdr.fields[RECORD_FIELD_HEADERS + i];
+                size_t name_len = get_header_name_len(i);
+
+                if (f->len < name_len ||
+                    strncmp(buf + f->offset, get_header_name(i), name_len) != 0) {
+                        return -EBADMSG;
+                }
+                view->headers[i] = buf + f->offset;
+        }
+
+        if (hdr.fields[RECORD_FIELD_CFG].len > 0) {
+                view->cfg_file = buf + hdr.fields[RECORD_FIELD_CFG].offset;
+        }
+        view->body = buf + hdr.fields[RECORD_FIELD_BODY].offset;
+        view->body_len = hdr.fields[RECORD_FIELD_BODY].len;
+
+        return 0;
+}
+
+int record_view_map(struct record_view *view, int fd)
+{
+        struct stat st;
+        char magic[RECORD_FILE_MAGIC_LEN];
+        void *map;
+        int ret;
+
+        memset(view, 0, sizeof(*view));
+
+        if (fstat(fd, &st) < 0) {
+                return -errno;
+        }
+        /* Text records are read as before */
+        if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+            !record_file_is_binary(magic, sizeof(magic))) {
+                return -ENOTSUP;
+        }
+        if ((size_t)st.st_size < sizeof(struct record_file_header) ||
+            (uint64_t)st.st_size > UINT32_MAX) {
+                return -EBADMSG;
+        }
+
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+                return -errno;
+        }
+
+        if ((ret = record_view_parse(view, map, (size_t)st.st_size)) < 0) {
+                munmap(map, (size_t)st.st_size);
+                return ret;
+        }
+        view->map = map;
+        view->map_len = (size_t)st.st_size;
+
+        return 0;
+}
+
+void record_view_unmap(struct record_view *view)
+{
+        if (view->map != NULL) {
+                munmap(view->map, view->map_len);
+                view->map = NULL;
+                view->map_len = 0;
+        }
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
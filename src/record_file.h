@@ -0,0 +1,166 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "common.h"
+
+/*
+ * Binary format of the records staged by telemprobd, and sent on the record
+ * stream.
+ *
+ * A record starts with a struct record_file_header, which gives the offset
+ * and length of each of its fields: the path of the record's cfg file,
+ * empty if it has none, its NUM_HEADERS header lines in the usual order,
+ * each written "name: value", and its body. Each field is followed by a
+ * null byte that its length does not count, so that readers use the fields
+ * in place as strings. The checksum covers the whole record except itself.
+ * Records never leave the machine, so they are written in host byte order.
+ *
+ * Records staged by earlier versions are text: an optional CFG_PREFIX line,
+ * the header lines and the body. They start with a printable character,
+ * where binary records start with RECORD_FILE_MAGIC.
+ */
+
+#define RECORD_FILE_MAGIC "\177TMR"
+#define RECORD_FILE_MAGIC_LEN 4
+
+/* Bumped when the layout changes; readers reject versions they do not
+ * know */
+#define RECORD_FILE_VERSION 1
+
+/* Index of each field in the header */
+#define RECORD_FIELD_CFG 0
+#define RECORD_FIELD_HEADERS 1
+#define RECORD_FIELD_BODY (RECORD_FIELD_HEADERS + NUM_HEADERS)
+#define RECORD_FIELDS (RECORD_FIELD_BODY + 1)
+
+/* Entries of the iovec array filled by record_file_iov() */
+#define RECORD_FILE_IOVS (1 + 2 * RECORD_FIELDS)
+
+struct record_field {
+        /* From the start of the record */
+        uint32_t offset;
+        /* Without the null byte that follows the field */
+        uint32_t len;
+};
+
+struct record_file_header {
+        char magic[RECORD_FILE_MAGIC_LEN];
+        uint16_t version;
+        /* RECORD_FIELDS */
+        uint16_t nfields;
+        /* Length of the whole record */
+        uint32_t size;
+        struct record_field fields[RECORD_FIELDS];
+        /* CRC-32C of the record, without this field */
+        uint32_t checksum;
+};
+
+/* A record read in place, without copying its fields. The pointers are not
+ * const so that they can be passed to the functions that deliver records,
+ * but the record must not be written to through them. */
+struct record_view {
+        /* NULL if the record has no cfg file */
+        char *cfg_file;
+        char *headers[NUM_HEADERS];
+        char *body;
+        size_t body_len;
+        /* Mapping of the file the record was read from, or NULL */
+        void *map;
+        size_t map_len;
+        /* Set if the fields were copied out of a text record, and are to be
+         * freed */
+        bool copied;
+};
+
+/**
+ * Lay out a record for writev()
+ *
+ * @param hdr Filled in with the header of the record, which iov refers to
+ * @param fields The fields of the record, in the order of the RECORD_FIELD_*
+ *    indexes. The cfg file is left empty if the record has none.
+ * @param iov Filled in with RECORD_FILE_IOVS entries
+ *
+ * @return The length of the record, or 0 if it is too large for the format
+ */
+size_t record_file_iov(struct record_file_header *hdr,
+                       const struct iovec fields[RECORD_FIELDS],
+                       struct iovec iov[RECORD_FILE_IOVS]);
+
+/**
+ * Tell whether a record is in the binary format, rather than in the text
+ * one
+ *
+ * @param buf The start of the record
+ * @param len The length of the record
+ *
+ * @return true if it starts with RECORD_FILE_MAGIC
+ */
+bool record_file_is_binary(const char *buf, size_t len);
+
+/**
+ * Check a binary record held in memory, and point a view at its fields
+ *
+ * @param view Set to the fields of the record, with no mapping
+ * @param buf The record
+ * @param len The length of the record
+ *
+ * @return 0 if successful, -EPROTONOSUPPORT for an unknown version,
+ *    -EILSEQ for a bad checksum, or -EBADMSG if the record is malformed
+ */
+int record_view_parse(struct record_view *view, char *buf, size_t len);
+
+/**
+ * Map a binary record file, check it, and point a view at its fields
+ *
+ * @param view Set to the fields of the record, and to the mapping
+ * @param fd The open record file
+ *
+ * @return 0 if successful, -ENOTSUP if the file is not in the binary format,
+ *    or a negative errno-style value as returned by record_view_parse() or
+ *    by the system calls
+ */
+int record_view_map(struct record_view *view, int fd);
+
+/**
+ * Release the mapping of a view, if any
+ *
+ * @param view The view
+ */
+void record_view_unmap(struct record_view *view);
+
+/**
+ * Compute a CRC-32C, with the crc32 instruction where the running cpu has
+ * it
+ *
+ * @param crc The CRC of the data that precedes buf, or 0
+ * @param buf The data
+ * @param len The length of the data
+ *
+ * @return The CRC of the data up to the end of buf
+ */
+uint32_t record_file_crc(uint32_t crc, const void *buf, size_t len);
+
+/* Portable implementation of record_file_crc(), one nibble at a time */
+uint32_t record_file_crc_nibble(uint32_t crc, const void *buf, size_t len);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,331 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shm_ring.h"
+
+/*
+ * The slots form a bounded queue after Dmitry Vyukov's design, as in
+ * mpmc_queue.c, with the record stored inline in the slot. Producers in the
+ * client claim a slot with a compare-and-swap on enqueue_pos. The daemon is
+ * the only consumer and keeps its own position, so a misbehaving client can
+ * at worst make it read garbage records, which are validated like the ones
+ * received on the socket.
+ *
+ * Once the ring is closed, the daemon claims each published slot with a
+ * compare-and-swap of its sequence from pos + 1 to pos + 2, a value the queue
+ * otherwise never uses. A producer that publishes and then finds the ring
+ * closed tries the same swap to take its record back. Exactly one of them
+ * wins, so a record is neither lost nor delivered twice.
+ */
+
+static inline struct shm_ring_slot *ring_slot(struct shm_ring *ring, uint64_t pos)
+{
+        char *base = (char *)ring->hdr + sizeof(struct shm_ring_header);
+
+        return (struct shm_ring_slot *)(base + (pos & (TM_RING_SLOTS - 1)) *
+                                        TM_RING_SLOT_SIZE);
+}
+
+int shm_ring_create(struct shm_ring *ring, int *memfd)
+{
+        void *map;
+        int fd;
+        int ret;
+
+        fd = memfd_create("telem-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (fd < 0) {
+                return -errno;
+        }
+
+        /* The client must not be able to shrink the file under the daemon's
+         * mapping, which would make the daemon fault on access */
+        if (ftruncate(fd, (off_t)TM_RING_MAP_SIZE) < 0 ||
+            fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+                ret = -errno;
+                goto out_close;
+        }
+
+        map = mmap(NULL, TM_RING_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+        if (map == MAP_FAILED) {
+                ret = -errno;
+                goto out_close;
+        }
+
+        ring->hdr = map;
+        ring->dequeue_pos = 0;
+        ring->closing = false;
+        ring->claimed = false;
+        ring->close_pos = 0;
+        ring->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (ring->efd < 0) {
+                ret = -errno;
+                munmap(map, TM_RING_MAP_SIZE);
+                ring->hdr = NULL;
+                goto out_close;
+        }
+
+        ring->hdr->magic = TM_RING_MAGIC;
+        ring->hdr->version = TM_RING_VERSION;
+        ring->hdr->slots = TM_RING_SLOTS;
+        ring->hdr->slot_size = TM_RING_SLOT_SIZE;
+        ring->hdr->closed = 0;
+        ring->hdr->consumer_waiting = 0;
+        ring->hdr->enqueue_pos = 0;
+        for (uint64_t i = 0; i < TM_RING_SLOTS; i++) {
+                ring_slot(ring, i)->seq = i;
+        }
+
+        *memfd = fd;
+
+        return 0;
+
+out_close:
+        close(fd);
+        return ret;
+}
+
+int shm_ring_attach(struct shm_ring *ring, int memfd, int efd)
+{
+        struct stat st;
+        struct shm_ring_header *hdr;
+        void *map;
+
+        if (fstat(memfd, &st) < 0) {
+                return -errno;
+        }
+
+        if ((size_t)st.st_size != TM_RING_MAP_SIZE) {
+                return -EPROTO;
+        }
+
+        map = mmap(NULL, TM_RING_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   memfd, 0);
+        if (map == MAP_FAILED) {
+                return -errno;
+        }
+
+        hdr = map;
+        if (hdr->magic != TM_RING_MAGIC || hdr->version != TM_RING_VERSION ||
+            hdr->slots != TM_RING_SLOTS || hdr->slot_size != TM_RING_SLOT_SIZE) {
+                munmap(map, TM_RING_MAP_SIZE);
+                return -EPROTO;
+        }
+
+        ring->hdr = hdr;
+        ring->efd = efd;
+        ring->dequeue_pos = 0;
+        ring->closing = false;
+        ring->claimed = false;
+        ring->close_pos = 0;
+
+        return 0;
+}
+
+void shm_ring_detach(struct shm_ring *ring)
+{
+        if (ring->hdr != NULL) {
+                munmap(ring->hdr, TM_RING_MAP_SIZE);
+                ring->hdr = NULL;
+        }
+        if (ring->efd >= 0) {
+                close(ring->efd);
+                ring->efd = -1;
+        }
+}
+
+int shm_ring_push(struct shm_ring *ring, const struct iovec *iov, int iovcnt,
+                  size_t len)
+{
+        struct shm_ring_header *hdr = ring->hdr;
+        struct shm_ring_slot *slot;
+        uint64_t pos;
+        size_t off = 0;
+
+        if (len > TM_RING_SLOT_DATA) {
+                return -EMSGSIZE;
+        }
+
+        if (__atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE)) {
+                return -EPIPE;
+        }
+
+        pos = __atomic_load_n(&hdr->enqueue_pos, __ATOMIC_RELAXED);
+        while (1) {
+                int64_t diff;
+
+                slot = ring_slot(ring, pos);
+                diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+
+                if (diff == 0) {
+                        if (__atomic_compare_exchange_n(&hdr->enqueue_pos, &pos, pos + 1,
+                                                        true, __ATOMIC_RELAXED,
+                                                        __ATOMIC_RELAXED)) {
+                                break;
+                        }
+                } else if (diff < 0) {
+                        return -EAGAIN;
+                } else {
+                        pos = __atomic_load_n(&hdr->enqueue_pos, __ATOMIC_RELAXED);
+                }
+        }
+
+        for (int i = 0; i < iovcnt; i++) {
+                memcpy(slot->data + off, iov[i].iov_base, iov[i].iov_len);
+                off += iov[i].iov_len;
+        }
+        slot->len = (uint32_t)len;
+        __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+        /* Pairs with shm_ring_arm(): either the daemon sees the record before
+         * sleeping, or this producer sees that it has to wake it up. Likewise
+         * with shm_ring_close(): either the daemon's final read finds the
+         * record published, or this producer sees the ring closed. */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&hdr->closed, __ATOMIC_SEQ_CST)) {
+                uint64_t seq = pos + 1;
+
+                /* Take the record back, unless the daemon claimed it first */
+                if (__atomic_compare_exchange_n(&slot->seq, &seq, pos + 2, false,
+                                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                        return -EPIPE;
+                }
+                return 0;
+        }
+        if (__atomic_load_n(&hdr->consumer_waiting, __ATOMIC_SEQ_CST)) {
+                uint64_t one = 1;
+                ssize_t unused __attribute__((unused));
+
+                /* Only fails if the counter would overflow, and then the
+                 * daemon has a wakeup pending anyway */
+                unused = write(ring->efd, &one, sizeof(one));
+        }
+
+        return 0;
+}
+
+/* Claim the next published slot of a closed ring from its producer,
+ * skipping the slots that are not published yet */
+static struct shm_ring_slot *claim_slot(struct shm_ring *ring)
+{
+        while (ring->dequeue_pos < ring->close_pos) {
+                struct shm_ring_slot *slot = ring_slot(ring, ring->dequeue_pos);
+                uint64_t seq = ring->dequeue_pos + 1;
+
+                if (__atomic_compare_exchange_n(&slot->seq, &seq,
+                                                ring->dequeue_pos + 2, false,
+                                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                        return slot;
+                }
+                ring->dequeue_pos++;
+        }
+
+        return NULL;
+}
+
+int shm_ring_peek(struct shm_ring *ring, const char **data, size_t *len)
+{
+        struct shm_ring_slot *slot = ring_slot(ring, ring->dequeue_pos);
+        uint32_t l;
+
+        if (ring->closing) {
+                /* The slot stays claimed until it is released */
+                if (!ring->claimed) {
+                        if ((slot = claim_slot(ring)) == NULL) {
+                                return 0;
+                        }
+                        ring->claimed = true;
+                }
+        } else if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring->dequeue_pos + 1) {
+                return 0;
+        }
+
+        l = __atomic_load_n(&slot->len, __ATOMIC_RELAXED);
+        if (l > TM_RING_SLOT_DATA) {
+                return -EBADMSG;
+        }
+
+        *data = slot->data;
+        *len = l;
+
+        return 1;
+}
+
+void shm_ring_release(struct shm_ring *ring)
+{
+        struct shm_ring_slot *slot = ring_slot(ring, ring->dequeue_pos);
+
+        /* A closed ring is not reused, so its claimed slots are left as is */
+        if (ring->closing) {
+                ring->claimed = false;
+                ring->dequeue_pos++;
+                return;
+        }
+
+        __atomic_store_n(&slot->seq, ring->dequeue_pos + TM_RING_SLOTS,
+                         __ATOMIC_RELEASE);
+        ring->dequeue_pos++;
+}
+
+bool shm_ring_arm(struct shm_ring *ring)
+{
+        struct shm_ring_slot *slot = ring_slot(ring, ring->dequeue_pos);
+
+        __atomic_store_n(&ring->hdr->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+
+        return __atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == ring->dequeue_pos + 1;
+}
+
+void shm_ring_clear_wakeup(struct shm_ring *ring)
+{
+        uint64_t count;
+        ssize_t unused __attribute__((unused));
+
+        __atomic_store_n(&ring->hdr->consumer_waiting, 0, __ATOMIC_RELAXED);
+        unused = read(ring->efd, &count, sizeof(count));
+}
+
+void shm_ring_close(struct shm_ring *ring)
+{
+        uint64_t end;
+
+        /* Nothing in shared memory is waited on: a client could keep any
+         * counter there nonzero, or be killed in the middle of a push */
+        __atomic_store_n(&ring->hdr->closed, 1, __ATOMIC_SEQ_CST);
+
+        /* Pairs with shm_ring_push(): a producer that claims a slot past
+         * this point sees the ring closed after publishing */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        end = __atomic_load_n(&ring->hdr->enqueue_pos, __ATOMIC_SEQ_CST);
+
+        /* The client can store anything in enqueue_pos */
+        if (end - ring->dequeue_pos > TM_RING_SLOTS) {
+                end = ring->dequeue_pos + TM_RING_SLOTS;
+        }
+        ring->close_pos = end;
+        ring->closing = true;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,192 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Shared memory transport between libtelemetry and telemprobd.
+ *
+ * A client asks for a ring by sending TM_RING_REQUEST in place of a record
+ * size on its socket connection. telemprobd answers with a memfd holding the
+ * ring and an eventfd, passed as SCM_RIGHTS ancillary data. The client then
+ * writes records, framed exactly as on the socket, into the ring's slots,
+ * and kicks the eventfd when the daemon is waiting for data. The socket
+ * connection stays open for as long as the ring is in use; closing it
+ * releases the ring.
+ */
+
+/* Sent instead of a record size to ask for a ring ("TSHM"). It is larger
+ * than any valid record size, so daemons without ring support reject it. */
+#define TM_RING_REQUEST 0x4d485354
+
+#define TM_RING_MAGIC 0x676e6952
+#define TM_RING_VERSION 1
+
+/* Number of slots in a ring, a power of two */
+#define TM_RING_SLOTS 64
+
+/* Size of a slot, including its header. Records that do not fit are sent
+ * over the socket instead. */
+#define TM_RING_SLOT_SIZE (16 * 1024)
+
+#define TM_RING_CACHE_LINE 64
+
+struct shm_ring_header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t slots;
+        uint32_t slot_size;
+        /* Set by the daemon when it stops reading the ring */
+        uint32_t closed;
+        /* Set by the daemon before it sleeps, so producers know to kick the
+         * eventfd */
+        uint32_t consumer_waiting;
+        char pad0[TM_RING_CACHE_LINE - 6 * sizeof(uint32_t)];
+        uint64_t enqueue_pos;
+        char pad1[TM_RING_CACHE_LINE - sizeof(uint64_t)];
+};
+
+struct shm_ring_slot {
+        uint64_t seq;
+        uint32_t len;
+        uint32_t reserved;
+        char data[];
+};
+
+#define TM_RING_SLOT_DATA (TM_RING_SLOT_SIZE - sizeof(struct shm_ring_slot))
+
+#define TM_RING_MAP_SIZE (sizeof(struct shm_ring_header) + \
+        (size_t)TM_RING_SLOTS * TM_RING_SLOT_SIZE)
+
+struct shm_ring {
+        struct shm_ring_header *hdr;
+        /* eventfd used to wake up the consumer */
+        int efd;
+        /* Next slot to read; private to the consumer, which does not trust
+         * the positions stored in shared memory */
+        uint64_t dequeue_pos;
+        /* Set by shm_ring_close(), along with the end of the slots claimed
+         * by producers at that point */
+        bool closing;
+        /* Whether the consumer took the slot at dequeue_pos from its
+         * producer, once closing */
+        bool claimed;
+        uint64_t close_pos;
+};
+
+/**
+ * Create a new ring in a sealed memfd, along with its eventfd, for the daemon
+ * side. Both are passed to the client; the daemon keeps the eventfd in
+ * ring->efd and may close the memfd once it has been sent.
+ *
+ * @param ring The ring to initialize
+ * @param memfd Set to the memfd holding the ring
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int shm_ring_create(struct shm_ring *ring, int *memfd);
+
+/**
+ * Map a ring received from the daemon, for the client side
+ *
+ * @param ring The ring to initialize
+ * @param memfd The memfd holding the ring. It may be closed once mapped.
+ * @param efd The eventfd used to wake up the daemon. The ring takes
+ *    ownership of it.
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int shm_ring_attach(struct shm_ring *ring, int memfd, int efd);
+
+/**
+ * Unmap a ring and close its eventfd
+ *
+ * @param ring The ring
+ */
+void shm_ring_detach(struct shm_ring *ring);
+
+/**
+ * Copy a record into the next free slot and publish it. Safe to call from
+ * several threads at once.
+ *
+ * @param ring The ring
+ * @param iov Buffers holding the framed record
+ * @param iovcnt Number of entries in iov
+ * @param len Total number of bytes described by iov
+ *
+ * @return 0 on success, -EMSGSIZE if the record does not fit in a slot,
+ *    -EAGAIN if the ring is full, or -EPIPE if the daemon closed the ring.
+ *    A record published while the daemon closes the ring is either read by
+ *    the daemon, and 0 returned, or taken back and -EPIPE returned, so the
+ *    caller can send it another way.
+ */
+int shm_ring_push(struct shm_ring *ring, const struct iovec *iov, int iovcnt,
+                  size_t len);
+
+/**
+ * Look at the oldest published record, without removing it
+ *
+ * @param ring The ring
+ * @param data Set to the record. The producer can still write to shared
+ *    memory, so the caller must copy the record before validating it.
+ * @param len Set to the record length
+ *
+ * @return 1 if a record is available, 0 if the ring is empty, or -EBADMSG if
+ *    the slot holds an invalid length
+ */
+int shm_ring_peek(struct shm_ring *ring, const char **data, size_t *len);
+
+/**
+ * Hand the slot returned by shm_ring_peek() back to the producers
+ *
+ * @param ring The ring
+ */
+void shm_ring_release(struct shm_ring *ring);
+
+/**
+ * Tell producers that the consumer is about to sleep on the eventfd
+ *
+ * @param ring The ring
+ *
+ * @return true if records were published in the meantime, in which case the
+ *    consumer must read them before sleeping
+ */
+bool shm_ring_arm(struct shm_ring *ring);
+
+/**
+ * Consume the pending wakeups on the eventfd
+ *
+ * @param ring The ring
+ */
+void shm_ring_clear_wakeup(struct shm_ring *ring);
+
+/**
+ * Stop accepting records. It does not wait for producers, since the state
+ * they share with the daemon is under the client's control. shm_ring_peek()
+ * then returns the records already published, claiming each slot from its
+ * producer, and skips the slots still being written; their producers take
+ * the records back and get -EPIPE from shm_ring_push().
+ *
+ * @param ring The ring
+ */
+void shm_ring_close(struct shm_ring *ring);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
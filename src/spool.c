@@ -25,6 +25,7 @@
 #include <limits.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include "spool.h"
 #include "telempostdaemon.h"
@@ -32,10 +33,15 @@
 #include "configuration.h"
 #include "util.h"
 #include "common.h"
+#include "iorecord.h"
+#include "io_batch.h"
+#include "post_encoding.h"
 
 int directory_filter(const struct dirent *entry)
 {
-        if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0)) {
+        /* Hidden files are records being staged, and the record stream's
+         * socket */
+        if (entry->d_name[0] == '.') {
                 return 0;
         } else {
                 return 1;
@@ -74,22 +80,126 @@ bool is_spool_valid()
 
 long get_spool_dir_size()
 {
-        long dir_size = get_directory_size(spool_dir_config());
+        const char *spool_dir = spool_dir_config();
+        long dir_size = get_directory_size(spool_dir);
+        long cache_size;
+        char *cache_dir;
+        struct stat buf;
+
         if (dir_size == -ENOMEM) {
                 exit(EXIT_FAILURE);
+        } else if (dir_size < 0) {
+                return dir_size;
+        }
+
+        /* The compressed bodies of the records count against the spool's
+         * maximum size too */
+        if (asprintf(&cache_dir, "%s/" POST_ENCODING_CACHE_DIR, spool_dir) < 0) {
+                exit(EXIT_FAILURE);
         }
+        if (lstat(cache_dir, &buf) == 0 && S_ISDIR(buf.st_mode)) {
+                cache_size = get_directory_size(cache_dir);
+                if (cache_size == -ENOMEM) {
+                        exit(EXIT_FAILURE);
+                } else if (cache_size > 0) {
+                        dir_size += cache_size;
+                }
+        }
+        free(cache_dir);
+
         return dir_size;
 }
 
-void spool_records_loop(long *current_spool_size)
+/* A spooled record, and its attributes */
+struct spool_entry {
+        struct dirent *dirent;
+        struct statx stx;
+        /* 0, or a negative errno-style value if stx could not be read */
+        int stat_res;
+};
+
+/**
+ * Read the attributes of the spooled records, a batch at a time
+ *
+ * @param io The batch to use
+ * @param dirfd The spool directory
+ * @param entries The records
+ * @param count The number of records
+ */
+static void stat_spool_entries(struct io_batch *io, int dirfd,
+                               struct spool_entry *entries, size_t count)
 {
+        for (size_t start = 0; start < count; start += IO_BATCH_MAX) {
+                size_t n = count - start;
+
+                if (n > IO_BATCH_MAX) {
+                        n = IO_BATCH_MAX;
+                }
+                io_batch_reset(io);
+                for (size_t i = 0; i < n; i++) {
+                        io_batch_statx(io, dirfd, entries[start + i].dirent->d_name,
+                                       0, &entries[start + i].stx);
+                }
+                io_batch_run(io);
+                for (size_t i = 0; i < n; i++) {
+                        entries[start + i].stat_res = io->ops[i].res;
+                }
+        }
+        io_batch_reset(io);
+}
+
+/**
+ * Comparison function used for qsort, to process the oldest records first.
+ * Records whose attributes could not be read come last.
+ *
+ * @param entrya Pointer to a struct spool_entry
+ * @param entryb Pointer to a struct spool_entry
+ *
+ * @return Returns the value of the comparison
+ */
+static int spool_record_compare(const void *entrya, const void *entryb)
+{
+        const struct spool_entry *a = entrya;
+        const struct spool_entry *b = entryb;
+
+        if (a->stat_res < 0 || b->stat_res < 0) {
+                return (a->stat_res < 0) - (b->stat_res < 0);
+        }
+        if (a->stx.stx_mtime.tv_sec != b->stx.stx_mtime.tv_sec) {
+                return a->stx.stx_mtime.tv_sec < b->stx.stx_mtime.tv_sec ? -1 : 1;
+        }
+        if (a->stx.stx_mtime.tv_nsec != b->stx.stx_mtime.tv_nsec) {
+                return a->stx.stx_mtime.tv_nsec < b->stx.stx_mtime.tv_nsec ? -1 : 1;
+        }
+
+        return 0;
+}
+
+void spool_records_loop(TelemPostDaemon *daemon)
+{
+        struct io_batch *io = &daemon->io;
         const char *spool_dir_path;
         int numentries;
         struct dirent **namelist;
+        struct spool_entry *entries;
+        int dirfd;
         int records_processed = 0;
         int records_sent = 0;
+        long spool_size;
+
+        /* Records whose post is in flight are not to be posted again */
+        finish_posts(daemon);
 
         spool_dir_path = spool_dir_config();
+        /* Compressed bodies outlive the records that expired or were dropped
+         * since the last run */
+        encoded_body_sweep(spool_dir_path);
+        /* The size kept up to date as records come and go leaves out the
+         * cache files made since the last run, and the expired records */
+        spool_size = get_spool_dir_size();
+        if (spool_size >= 0) {
+                daemon->current_spool_size = spool_size;
+        }
         numentries = scandir(spool_dir_path, &namelist, directory_filter, NULL);
 
         if (numentries == 0) {
@@ -100,14 +210,39 @@ void spool_records_loop(long *current_spool_size)
                 return;
         }
 
-        qsort_r(namelist, (size_t)numentries, sizeof(struct dirent *),
-                spool_record_compare, (void *)spool_dir_path);
+        entries = calloc((size_t)numentries, sizeof(struct spool_entry));
+        if (!entries) {
+                telem_log(LOG_ERR, "Unable to allocate memory while sorting, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < numentries; i++) {
+                entries[i].dirent = namelist[i];
+                entries[i].stat_res = -EBADF;
+        }
+
+        /* Every record is looked at to sort them, so their attributes are
+         * all read up front, rather than once per comparison */
+        dirfd = open(spool_dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirfd < 0) {
+                telem_perror("Error while scanning spool");
+        } else {
+                stat_spool_entries(io, dirfd, entries, (size_t)numentries);
+                close(dirfd);
+        }
+
+        qsort(entries, (size_t)numentries, sizeof(struct spool_entry),
+              spool_record_compare);
 
         for (int i = 0; i < numentries; i++) {
                 telem_log(LOG_DEBUG, "Processing spool record: %s\n",
-                          namelist[i]->d_name);
-                process_spooled_record(spool_dir_path, namelist[i]->d_name,
-                                       &records_processed, &records_sent, current_spool_size);
+                          entries[i].dirent->d_name);
+                /* Once a record went through, the others are posted
+                 * together, when the daemon allows it */
+                process_spooled_record(daemon, spool_dir_path, entries[i].dirent->d_name,
+                                       entries[i].stat_res == 0 ? &entries[i].stx : NULL,
+                                       &records_processed, &records_sent,
+                                       records_sent > 0 &&
+                                       concurrent_posts_enabled(daemon));
 
                 /* If the first send attempt fails, we assume that future send
                  * attempts may also fail, so abort early.
@@ -121,19 +256,139 @@ void spool_records_loop(long *current_spool_size)
                 }
         }
 
+        /* records_sent is counted until the last post completes */
+        finish_posts(daemon);
+
         for (int i = 0; i < numentries; i++) {
                 free(namelist[i]);
         }
         free(namelist);
+        free(entries);
+}
+
+/**
+ * Count a spooled record that was sent, and deduct it from the size of the
+ * spool directory
+ *
+ * @param daemon The daemon
+ * @param record_name Path of the record
+ * @param size Size of the record
+ * @param disk_size Size of the record on disk
+ * @param records_sent Number of records sent to the backend
+ */
+static void spooled_record_sent(TelemPostDaemon *daemon, const char *record_name,
+                                long size, long disk_size, int *records_sent)
+{
+        long *current_spool_size = &daemon->current_spool_size;
+
+        daemon->stats.delivered++;
+        daemon->stats.bytes_delivered += (uint64_t)size;
+        telem_log(LOG_DEBUG, "Spool record %s transmitted\n", record_name);
+        (*records_sent)++;
+
+        /* if spooled record is sent, deduct from tm_spool_dir_size */
+        if (*current_spool_size > 0) {
+                *current_spool_size -= disk_size;
+        }
+        /*
+         * If getting the directory size failed earlier due to
+         * EMFILE/ENFILE, try to calculate again.
+         * EMFILE - too many file descriptors in use by process
+         * ENFILE - too many files are open in the system
+         */
+        if (*current_spool_size < 0) {
+                *current_spool_size = get_spool_dir_size();
+        }
+}
+
+/* A spooled record whose post is in flight */
+struct spool_post {
+        TelemPostDaemon *daemon;
+        struct record_view rec;
+        char *record_name;
+        long size;
+        long disk_size;
+        /* Whether the record may cache its compressed body */
+        bool cache;
+        int *records_sent;
+        uint64_t start_us;
+};
+
+/**
+ * Finish with a spooled record once its post completed
+ *
+ * @param sent Whether the record was sent
+ * @param arg The struct spool_post of the record
+ */
+static void spooled_record_posted(bool sent, void *arg)
+{
+        struct spool_post *sp = arg;
+        struct post_stats *stats = &sp->daemon->stats;
+
+        stats_histogram_add(&stats->post_latency, stats_now_us() - sp->start_us);
+        if (!sent) {
+                telem_log(LOG_DEBUG, "Unable to connect to the server\n");
+                stats->delivery_failures++;
+                /* Counted as if its compressed body was cached, until the
+                 * next run measures the spool directory again */
+                if (sp->cache) {
+                        sp->daemon->current_spool_size += sp->disk_size;
+                }
+        } else {
+                unlink(sp->record_name);
+                spooled_record_sent(sp->daemon, sp->record_name, sp->size,
+                                    sp->disk_size, sp->records_sent);
+        }
+
+        release_record(&sp->rec);
+        free(sp->record_name);
+        free(sp);
+}
+
+/**
+ * Start the post of a spooled record, alongside the posts in flight
+ *
+ * @param daemon The daemon
+ * @param record_name Path of the record, which the post takes over
+ * @param stx Attributes of the record
+ * @param records_sent Number of records sent to the backend
+ */
+static void post_spooled_record(TelemPostDaemon *daemon, char *record_name,
+                                const struct statx *stx, int *records_sent)
+{
+        struct spool_post *sp = calloc(1, sizeof(struct spool_post));
+
+        if (!sp) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        if (!read_record(record_name, &sp->rec)) {
+                free(record_name);
+                free(sp);
+                return;
+        }
+        sp->daemon = daemon;
+        sp->record_name = record_name;
+        sp->size = (long)stx->stx_size;
+        sp->disk_size = (long)(stx->stx_blocks * 512);
+        sp->cache = spool_cache_fits(daemon, sp->disk_size);
+        sp->records_sent = records_sent;
+        sp->start_us = stats_now_us();
+
+        post_record_async(daemon, sp->rec.headers, sp->rec.body,
+                          record_config(sp->rec.cfg_file),
+                          sp->cache ? sp->record_name : NULL,
+                          spooled_record_posted, sp);
 }
 
-void process_spooled_record(const char *spool_dir, char *name,
+void process_spooled_record(TelemPostDaemon *daemon, const char *spool_dir,
+                            char *name, const struct statx *stx,
                             int *records_processed, int *records_sent,
-                            long *current_spool_size)
+                            bool concurrent)
 {
+        struct post_stats *stats = &daemon->stats;
         char *record_name;
         int ret;
-        struct stat buf;
         time_t current_time = time(NULL);
         bool post_succeeded = true;
 
@@ -149,9 +404,9 @@ void process_spooled_record(const char *spool_dir, char *name,
         }
 
         (*records_processed)++;
-        ret = stat(record_name, &buf);
-        if (ret == -1) {
-                telem_perror("Unable to stat record in spool");
+        stats->records[SOURCE_SPOOL]++;
+        if (!stx) {
+                telem_log(LOG_ERR, "Unable to stat record in spool\n");
                 free(record_name);
                 return;
         }
@@ -165,200 +420,59 @@ void process_spooled_record(const char *spool_dir, char *name,
                 telem_log(LOG_ERR, "Invalid record expiry value\n");
                 exit(EXIT_FAILURE);
         }
-        if (!S_ISREG(buf.st_mode) ||
-            (current_time - buf.st_mtime > (record_expiry_config() * 60)) ||
-            (buf.st_uid  != getuid())) {
+        if (!S_ISREG(stx->stx_mode) ||
+            (current_time - stx->stx_mtime.tv_sec > (record_expiry_config() * 60)) ||
+            (stx->stx_uid != getuid())) {
                 unlink(record_name);
+                stats->dropped[DROP_EXPIRED]++;
         } else if (post_succeeded && *records_sent <= TM_SPOOL_MAX_SEND_RECORDS) {
-                transmit_spooled_record(record_name, &post_succeeded, buf.st_size);
+                long disk_size = (long)(stx->stx_blocks * 512);
+                bool cache;
+                uint64_t start_us;
+
+                if (concurrent) {
+                        /* The post takes record_name over */
+                        post_spooled_record(daemon, record_name, stx, records_sent);
+                        return;
+                }
+
+                start_us = stats_now_us();
+                cache = spool_cache_fits(daemon, disk_size);
+
+                transmit_spooled_record(record_name, cache, &post_succeeded);
+                stats_histogram_add(&stats->post_latency,
+                                    stats_now_us() - start_us);
 
                 if (!post_succeeded) {
                         telem_log(LOG_DEBUG, "Unable to connect to the server\n");
-                } else {
-                        telem_log(LOG_DEBUG, "Spool record %s transmitted\n",
-                                  record_name);
-                        (*records_sent)++;
-
-                        /* if spooled record is sent, deduct from tm_spool_dir_size */
-                        if (*current_spool_size > 0) {
-                                *current_spool_size -= (buf.st_blocks * 512);
-                        }
-                        /*
-                         * If getting the directory size failed earlier due to
-                         * EMFILE/ENFILE, try to calculate again.
-                         * EMFILE - too many file descriptors in use by process
-                         * ENFILE - too many files are open in the system
-                         */
-                        if (*current_spool_size < 0) {
-                                *current_spool_size = get_spool_dir_size();
+                        stats->delivery_failures++;
+                        if (cache) {
+                                daemon->current_spool_size += disk_size;
                         }
+                } else {
+                        spooled_record_sent(daemon, record_name, (long)stx->stx_size,
+                                            disk_size, records_sent);
                 }
         }
         free(record_name);
 }
 
-void transmit_spooled_record(char *record_path, bool *post_succeeded, long size)
+void transmit_spooled_record(char *record_path, bool cache, bool *post_succeeded)
 {
-        FILE *fp = NULL;
-        char *headers[NUM_HEADERS];
-        char *payload = NULL;
-        int num_headers = 0, k;
-#if (LINE_MAX > PATH_MAX)
-        char line[LINE_MAX+1] = { 0 };
-#else
-        char line[PATH_MAX+1] = { 0 };
-#endif
-        long offset;
-        char *cfg_file = NULL;
-        uint32_t cfg_prefix = 0;
-
-        fp = fopen(record_path, "r");
-        if (fp == NULL) {
-                telem_log(LOG_ERR, "Unable to open file %s in spool\n", record_path);
-                return;
-        }
-
-        // First line optionally contains configuration file path
-        if (fread(&cfg_prefix, CFG_PREFIX_LENGTH, 1, fp) != 1) {
-                telem_log(LOG_ERR, "Error while parsing spooled record configuration info.\n");
-                goto read_error;
-        }
-
-        if (cfg_prefix == CFG_PREFIX_32BIT) {
-                size_t pathlen;
-                char *nl;
-
-                if (!fgets(line, sizeof(line), fp)) {
-                        telem_log(LOG_ERR, "Error while parsing record file\n");
-                        goto read_error;
-                }
+        struct record_view rec = { 0 };
 
-                if ((nl = strchr(line, '\n')) != NULL) {
-                        *nl = '\0';
-                }
-
-                pathlen = strlen(line);
-                cfg_file = malloc(pathlen + 1);
-                if (cfg_file == NULL) {
-                        telem_log(LOG_ERR, "Could not allocate memory for config file path\n");
-                        goto read_error;
-                }
-                strcpy (cfg_file, line);
-                telem_debug("DEBUG: cfg_file: %s\n", cfg_file);
-        } else {
-                cfg_file = NULL;
-                rewind(fp);
-        }
-
-        for (num_headers = 0; num_headers < NUM_HEADERS; num_headers++) {
-                const char *header_name = get_header_name(num_headers);
-                if (!fgets(line, sizeof(line), fp)) {
-                        telem_log(LOG_ERR, "Error while parsing record file\n");
-                        goto read_error;
-                }
-                //Get rid of trailing newline
-                strtok(line, "\n");
-                if (get_header(line, header_name, &headers[num_headers])) {
-                        continue;
-                } else {
-                        telem_log(LOG_ERR, "transmit_spooled_record: Incorrect"
-                                  " headers in record\n");
-                        goto read_error;
-                }
-        }
-
-        offset = ftell(fp);
-
-        if (offset == -1) {
-                telem_perror("Failed to get file offset of record payload");
-                goto read_error;
-        }
-
-        size = size - offset + 1;
-        payload = malloc((size_t)size);
-
-        if (!payload) {
-                telem_log(LOG_ERR, "Could not allocate memory for payload\n");
-                goto read_error;
-        }
-        memset(payload, 0, (size_t)size);
-
-        //read rest of file
-        size_t newlen = fread(payload, sizeof(char), (size_t)size, fp);
-        if (newlen == 0) {
-                telem_perror("Error reading spool file");
-                goto read_error;
+        if (!read_record(record_path, &rec)) {
+                return;
         }
 
-        *post_succeeded = post_record_http(headers, payload, cfg_file);
+        *post_succeeded = post_record_ptr(rec.headers, rec.body,
+                                          record_config(rec.cfg_file),
+                                          cache ? record_path : NULL);
         if (*post_succeeded) {
                 unlink(record_path);
         }
-read_error:
-        if (payload) {
-                free(payload);
-        }
-
-        if (fp) {
-                fclose(fp);
-        }
-
-        for (k = 0; k < num_headers; k++) {
-                free(headers[k]);
-        }
-
-        if (cfg_file) {
-                free(cfg_file);
-        }
-}
-
-int spool_record_compare(const void *entrya, const void *entryb, void *path)
-{
-        int ret;
-        struct stat statentrya, statentryb;
-        char *patha, *pathb;
-
-        const struct dirent **direntrya = (const struct dirent **)entrya;
-        const struct dirent **direntryb = (const struct dirent **)entryb;
-
-        const char *dirpath = (const char *)path;
-        ret = asprintf(&patha, "%s/%s", dirpath, (*direntrya)->d_name);
-        if (ret == -1) {
-                telem_log(LOG_ERR, "Unable to allocate memory while sorting, exiting\n");
-                exit(EXIT_FAILURE);
-        }
-
-        ret = stat(patha, &statentrya);
-        if (ret == -1) {
-                telem_log(LOG_ERR, "Unable to stat %s: %s\n", patha, strerror(errno));
-                free(patha);
-                return 0;
-        }
-
-        ret = asprintf(&pathb, "%s/%s", dirpath, (*direntryb)->d_name);
-        if (ret == -1) {
-                telem_log(LOG_ERR, "Unable to allocate memory while sorting, exiting\n");
-                exit(EXIT_FAILURE);
-        }
-
-        ret = stat(pathb, &statentryb);
-        if (ret == -1) {
-                telem_log(LOG_ERR, "Unable to stat %s: %s\n", patha, strerror(errno));
-                free(pathb);
-                return 0;
-        }
-
-        free(patha);
-        free(pathb);
-
-        if (statentrya.st_mtime < statentryb.st_mtime) {
-                return -1;
-        } else if (statentrya.st_mtime > statentryb.st_mtime) {
-                return 1;
-        }
-
-        return 0;
 
+        release_record(&rec);
 }
 
 /* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
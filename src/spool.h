@@ -16,47 +16,54 @@
 
 #pragma once
 
+#include <stdbool.h>
+
+struct statx;
+struct TelemPostDaemon;
+
 /**
  * Run the spool record loop periodically
+ *
+ * @param daemon The daemon, whose spool size and counters are updated as
+ *    records are sent
  */
-void spool_records_loop(long *current_spool_size);
+void spool_records_loop(struct TelemPostDaemon *daemon);
 
 /**
  * Process the spooled record
  *
+ * @param daemon The daemon
  * @param spool_dir Path of the spool directory
  * @param name File name of the spooled record
+ * @param stx Attributes of the spooled record, or NULL if they could not be
+ *    read
  * @param records_processed Number of records processed till now
- * @param records_sent Number of records sent to the backend
+ * @param records_sent Number of records sent to the backend, which must
+ *    stay valid until the posts in flight complete
+ * @param concurrent Whether to post the record alongside the posts in
+ *    flight, rather than wait for it to be sent
  */
-void process_spooled_record(const char *spool_dir, char *name,
+void process_spooled_record(struct TelemPostDaemon *daemon,
+                            const char *spool_dir, char *name,
+                            const struct statx *stx,
                             int *records_processed, int *records_sent,
-                            long *current_spool_size);
+                            bool concurrent);
 
 /**
  * Send the spooled record to the backend
  *
  * @param record_path Path of the spooled record
+ * @param cache Whether the record may use the cache of compressed bodies,
+ *    which is not the case when the spool directory is near its maximum size
  * @param post_succeeded bool indicating if the previous post was successful
- * @param sz Size of the file in bytes
- */
-void transmit_spooled_record(char *record_path, bool *post_succeeded, long sz);
-
-/**
- * Comparison function used for qsort
- *
- * @param entrya Pointer to the spool record file
- * @param entryb Pointer to the spool record file
- * @path path The path to the spool directory
- *
- * @return Returns the value of the comparison
  */
-int spool_record_compare(const void *entrya, const void *entryb, void *path);
+void transmit_spooled_record(char *record_path, bool cache, bool *post_succeeded);
 
 /**
  * Calculates the spool directory size.
  *
- * @return size of the spool directory on disk.
+ * @return size of the spool directory on disk, its cache of compressed
+ *         bodies included.
  *         may return a negative value in case of error.
  */
 long get_spool_dir_size(void);
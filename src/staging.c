@@ -0,0 +1,548 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "io_batch.h"
+#include "log.h"
+#include "staging.h"
+
+/* Attempts at finding a free name before giving up */
+#define STAGING_NAME_TRIES 100
+
+/* Age after which a hidden staging file is taken as left by a crash. A
+ * record is only kept hidden until its group sync, well under a minute. */
+#define STAGING_STALE_AGE (60 * 60)
+
+static const char name_chars[] =
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+
+/**
+ * Generate a random file name of STAGING_NAME_LEN characters, like the ones
+ * mkstemp() used to give staged records
+ *
+ * @param st The staging area
+ * @param name Set to the name, at least STAGING_NAME_LEN + 1 bytes long
+ */
+static void next_name(struct staging *st, char *name)
+{
+        /* xorshift64*; the names only need to be unlikely to collide */
+        uint64_t x = st->name_state;
+
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        st->name_state = x;
+        x *= 0x2545f4914f6cdd1dULL;
+
+        for (int i = 0; i < STAGING_NAME_LEN; i++) {
+                name[i] = name_chars[x % (sizeof(name_chars) - 1)];
+                x /= sizeof(name_chars) - 1;
+        }
+        name[STAGING_NAME_LEN] = '\0';
+}
+
+static void seed_names(struct staging *st)
+{
+        struct timespec now;
+        int fd;
+
+        st->name_state = 0;
+        fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+                if (read(fd, &st->name_state, sizeof(st->name_state)) !=
+                    sizeof(st->name_state)) {
+                        st->name_state = 0;
+                }
+                close(fd);
+        }
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        st->name_state ^= (uint64_t)now.tv_nsec << 20 ^ (uint64_t)now.tv_sec ^
+                          (uint64_t)getpid() << 40;
+        if (st->name_state == 0) {
+                st->name_state = 1;
+        }
+}
+
+/**
+ * Write all of a record, with a single writev() unless the disk is full
+ *
+ * @param fd The file
+ * @param iov The contents of the record
+ * @param iovcnt The number of entries in iov
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ */
+static int write_all(int fd, const struct iovec *iov, int iovcnt)
+{
+        ssize_t len;
+        size_t done;
+
+        do {
+                len = writev(fd, iov, iovcnt);
+        } while (len < 0 && errno == EINTR);
+        if (len < 0) {
+                return -errno;
+        }
+
+        /* Finish a short write one buffer at a time */
+        done = (size_t)len;
+        for (int i = 0; i < iovcnt; i++) {
+                const char *p = (const char *)iov[i].iov_base;
+                size_t left = iov[i].iov_len;
+
+                if (done >= left) {
+                        done -= left;
+                        continue;
+                }
+                p += done;
+                left -= done;
+                done = 0;
+
+                while (left > 0) {
+                        ssize_t n = write(fd, p, left);
+
+                        if (n < 0) {
+                                if (errno == EINTR) {
+                                        continue;
+                                }
+                                return -errno;
+                        }
+                        p += n;
+                        left -= (size_t)n;
+                }
+        }
+
+        return 0;
+}
+
+/**
+ * Create the file a record is written to, unnamed if possible, or under a
+ * hidden name otherwise
+ *
+ * @param st The staging area
+ * @param file Set to the file created
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ */
+static int create_file(struct staging *st, struct staging_file *file)
+{
+        file->tmpname[0] = '\0';
+
+        if (st->use_tmpfile) {
+                file->fd = openat(st->dirfd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC,
+                                  0600);
+                return file->fd < 0 ? -errno : 0;
+        }
+
+        for (int i = 0; i < STAGING_NAME_TRIES; i++) {
+                file->tmpname[0] = '.';
+                next_name(st, file->tmpname + 1);
+                file->fd = openat(st->dirfd, file->tmpname,
+                                  O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0600);
+                if (file->fd >= 0) {
+                        return 0;
+                }
+                if (errno != EEXIST) {
+                        return -errno;
+                }
+        }
+
+        return -EEXIST;
+}
+
+/**
+ * Generate a final name for a record
+ *
+ * @param st The staging area
+ * @param name Set to the name, at least STAGING_NAME_LEN + 2 bytes long
+ */
+static void final_name(struct staging *st, char *name)
+{
+        if (st->prefix != '\0') {
+                name[0] = st->prefix;
+                name++;
+        }
+        next_name(st, name);
+}
+
+/**
+ * Path through which an O_TMPFILE file is linked
+ *
+ * @param file The record
+ * @param path Set to the path
+ * @param size Size of path
+ */
+static void proc_path(struct staging_file *file, char *path, size_t size)
+{
+        snprintf(path, size, "/proc/self/fd/%d", file->fd);
+}
+
+/**
+ * Give a record its final name in the staging directory, which makes it
+ * visible to telempostd. Links never replace an existing file, so a name
+ * already in use is simply skipped. A hidden name is left for close_file().
+ *
+ * @param st The staging area
+ * @param file The record
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ */
+static int link_file(struct staging *st, struct staging_file *file)
+{
+        char path[32];
+        char name[STAGING_NAME_LEN + 2];
+
+        proc_path(file, path, sizeof(path));
+
+        for (int i = 0; i < STAGING_NAME_TRIES; i++) {
+                int ret;
+
+                final_name(st, name);
+                if (file->tmpname[0] == '\0') {
+                        ret = linkat(AT_FDCWD, path, st->dirfd, name,
+                                     AT_SYMLINK_FOLLOW);
+                } else {
+                        ret = linkat(st->dirfd, file->tmpname, st->dirfd, name, 0);
+                }
+                if (ret == 0) {
+                        return 0;
+                }
+                if (errno != EEXIST) {
+                        return -errno;
+                }
+        }
+
+        return -EEXIST;
+}
+
+/**
+ * Close a record, removing its hidden name if it has one. Once linked, the
+ * record keeps its final name.
+ *
+ * @param st The staging area
+ * @param file The record
+ */
+static void close_file(struct staging *st, struct staging_file *file)
+{
+        if (file->tmpname[0] != '\0') {
+                unlinkat(st->dirfd, file->tmpname, 0);
+        }
+        close(file->fd);
+        file->fd = -1;
+}
+
+/**
+ * Tell whether a name is one create_file() gives to hidden files
+ *
+ * @param name The file name
+ *
+ * @return true if it is
+ */
+static bool is_staging_tmpname(const char *name)
+{
+        return name[0] == '.' && strlen(name) == STAGING_NAME_LEN + 1 &&
+               strspn(name + 1, name_chars) == STAGING_NAME_LEN;
+}
+
+/**
+ * Remove the hidden files left in the staging directory by a daemon that
+ * stopped between their creation and their unlinking. Both daemons skip
+ * hidden names, so nothing else would remove them. Files younger than
+ * STAGING_STALE_AGE may still be in use by the other daemon, and are kept.
+ *
+ * @param st The staging area
+ *
+ * @return The number of files removed
+ */
+static int sweep_stale_files(struct staging *st)
+{
+        struct dirent *entry;
+        time_t now = time(NULL);
+        int removed = 0;
+        DIR *d;
+        int fd;
+
+        fd = openat(st->dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+                return 0;
+        }
+        d = fdopendir(fd);
+        if (!d) {
+                close(fd);
+                return 0;
+        }
+
+        while ((entry = readdir(d)) != NULL) {
+                struct stat sb;
+
+                if (!is_staging_tmpname(entry->d_name)) {
+                        continue;
+                }
+                if (fstatat(st->dirfd, entry->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0 ||
+                    !S_ISREG(sb.st_mode) || now - sb.st_mtime < STAGING_STALE_AGE) {
+                        continue;
+                }
+                if (unlinkat(st->dirfd, entry->d_name, 0) == 0) {
+                        removed++;
+                }
+        }
+        closedir(d);
+
+        return removed;
+}
+
+void staging_init(struct staging *st)
+{
+        memset(st, 0, sizeof(*st));
+        st->dirfd = -1;
+        io_batch_init(&st->io, false);
+}
+
+int staging_open(struct staging *st, const char *dir, enum staging_sync sync,
+                 int interval_ms, bool use_uring)
+{
+        int removed;
+        int fd;
+
+        st->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (st->dirfd < 0) {
+                return -errno;
+        }
+        st->sync = sync;
+        st->interval_ms = interval_ms > 0 ? interval_ms : 0;
+        st->npending = 0;
+        seed_names(st);
+
+        if ((removed = sweep_stale_files(st)) > 0) {
+                telem_log(LOG_INFO, "Removed %d stale staging files from %s\n",
+                          removed, dir);
+        }
+
+        /* Unnamed files are linked through /proc, and not all filesystems
+         * support them */
+        st->use_tmpfile = false;
+        if (access("/proc/self/fd", X_OK) == 0) {
+                fd = openat(st->dirfd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0600);
+                if (fd >= 0) {
+                        st->use_tmpfile = true;
+                        close(fd);
+                }
+        }
+        if (!st->use_tmpfile) {
+                telem_log(LOG_INFO, "O_TMPFILE not available in %s, staging"
+                          " records through hidden files\n", dir);
+        }
+
+        /* Only group syncs have operations to batch */
+        if (sync == STAGING_SYNC_GROUP && !io_batch_uses_uring(&st->io)) {
+                io_batch_init(&st->io, use_uring);
+        }
+
+        return 0;
+}
+
+void staging_close(struct staging *st)
+{
+        if (st->dirfd < 0) {
+                return;
+        }
+
+        staging_flush(st);
+        io_batch_free(&st->io);
+        close(st->dirfd);
+        st->dirfd = -1;
+}
+
+bool staging_is_open(struct staging *st)
+{
+        return st->dirfd >= 0;
+}
+
+int staging_write(struct staging *st, const struct iovec *iov, int iovcnt)
+{
+        struct staging_file file;
+        int ret;
+
+        if (st->dirfd < 0) {
+                return -EBADF;
+        }
+
+        if ((ret = create_file(st, &file)) < 0) {
+                return ret;
+        }
+
+        if ((ret = write_all(file.fd, iov, iovcnt)) < 0) {
+                close_file(st, &file);
+                return ret;
+        }
+
+        switch (st->sync) {
+        case STAGING_SYNC_GROUP:
+                if (st->npending == 0) {
+                        clock_gettime(CLOCK_MONOTONIC, &st->pending_since);
+                }
+                st->pending[st->npending++] = file;
+                if (st->npending == STAGING_GROUP_MAX) {
+                        staging_flush(st);
+                }
+                return 0;
+        case STAGING_SYNC_FDATASYNC:
+                if (fdatasync(file.fd) < 0) {
+                        ret = -errno;
+                        close_file(st, &file);
+                        return ret;
+                }
+                ret = link_file(st, &file);
+                if (ret == 0 && fsync(st->dirfd) < 0) {
+                        telem_perror("Failed to sync staging directory");
+                }
+                break;
+        case STAGING_SYNC_NONE:
+        default:
+                ret = link_file(st, &file);
+                break;
+        }
+
+        close_file(st, &file);
+
+        return ret;
+}
+
+int staging_timeout(struct staging *st, int timeout_ms)
+{
+        struct timespec now;
+        int64_t remaining;
+
+        if (st->npending == 0) {
+                return timeout_ms;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        remaining = st->interval_ms -
+                    ((int64_t)(now.tv_sec - st->pending_since.tv_sec) * 1000 +
+                     (now.tv_nsec - st->pending_since.tv_nsec) / 1000000);
+        if (remaining < 0) {
+                remaining = 0;
+        }
+        if (timeout_ms < 0 || remaining < timeout_ms) {
+                return (int)remaining;
+        }
+
+        return timeout_ms;
+}
+
+void staging_tick(struct staging *st)
+{
+        if (st->npending > 0 && staging_timeout(st, -1) == 0) {
+                staging_flush(st);
+        }
+}
+
+void staging_flush(struct staging *st)
+{
+        struct io_batch *io = &st->io;
+        char paths[STAGING_GROUP_MAX][32];
+        char names[STAGING_GROUP_MAX][STAGING_NAME_LEN + 2];
+        int res[STAGING_GROUP_MAX];
+        size_t linked = 0;
+
+        if (st->npending == 0) {
+                return;
+        }
+
+        /* Records only become visible once their data is on disk, so a
+         * crash leaves either a complete record or none. The syncs are
+         * submitted together, for the disk to serve them at once. */
+        io_batch_reset(io);
+        for (size_t i = 0; i < st->npending; i++) {
+                io_batch_fsync(io, st->pending[i].fd, true);
+        }
+        io_batch_run(io);
+        for (size_t i = 0; i < st->npending; i++) {
+                res[i] = io->ops[i].res;
+        }
+
+        /* Link the synced records, under a first choice of names */
+        io_batch_reset(io);
+        for (size_t i = 0; i < st->npending; i++) {
+                struct staging_file *file = &st->pending[i];
+
+                if (res[i] < 0) {
+                        continue;
+                }
+                final_name(st, names[i]);
+                if (file->tmpname[0] == '\0') {
+                        proc_path(file, paths[i], sizeof(paths[i]));
+                        io_batch_linkat(io, AT_FDCWD, paths[i], st->dirfd,
+                                        names[i], AT_SYMLINK_FOLLOW);
+                } else {
+                        io_batch_linkat(io, st->dirfd, file->tmpname, st->dirfd,
+                                        names[i], 0);
+                }
+        }
+        io_batch_run(io);
+        for (size_t i = 0, op = 0; i < st->npending; i++) {
+                if (res[i] < 0) {
+                        continue;
+                }
+                res[i] = io->ops[op++].res;
+                /* Names in use are rare enough to retry one at a time */
+                if (res[i] == -EEXIST) {
+                        res[i] = link_file(st, &st->pending[i]);
+                }
+        }
+
+        /* Close the records, and remove their hidden names */
+        io_batch_reset(io);
+        for (size_t i = 0; i < st->npending; i++) {
+                struct staging_file *file = &st->pending[i];
+
+                if (res[i] < 0) {
+                        telem_log(LOG_ERR, "Failed to stage record: %s\n",
+                                  strerror(-res[i]));
+                } else {
+                        linked++;
+                }
+                /* Each record takes up to two operations */
+                if (io->nops + 2 > IO_BATCH_MAX) {
+                        io_batch_run(io);
+                        io_batch_reset(io);
+                }
+                if (file->tmpname[0] != '\0') {
+                        io_batch_unlinkat(io, st->dirfd, file->tmpname, 0);
+                }
+                io_batch_close(io, file->fd);
+                file->fd = -1;
+        }
+        io_batch_run(io);
+        io_batch_reset(io);
+        st->npending = 0;
+
+        if (linked > 0 && fsync(st->dirfd) < 0) {
+                telem_perror("Failed to sync staging directory");
+        }
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
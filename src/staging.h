@@ -0,0 +1,160 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "io_batch.h"
+
+/* Length of the random names given to staged records, as with mkstemp() */
+#define STAGING_NAME_LEN 6
+
+/* Records whose sync is pending in group mode. Reaching it forces a sync.
+ * A group is synced and linked in a single batch. */
+#define STAGING_GROUP_MAX 64
+
+/* How staged records are made durable */
+enum staging_sync {
+        /* Left to the kernel's writeback */
+        STAGING_SYNC_NONE,
+        /* Each record is synced before it is linked into the directory */
+        STAGING_SYNC_FDATASYNC,
+        /* Records are synced together, at most every interval_ms */
+        STAGING_SYNC_GROUP
+};
+
+/* A record written, but not linked into the staging directory yet */
+struct staging_file {
+        int fd;
+        /* Hidden name of the file, empty for an O_TMPFILE file */
+        char tmpname[STAGING_NAME_LEN + 2];
+};
+
+/*
+ * Writes records into the staging directory so that they only appear there
+ * once complete. A record is written with a single writev() into an
+ * unnamed O_TMPFILE file, which is then linked into the directory. Where
+ * O_TMPFILE cannot be used, the record is written to a hidden file, which
+ * is linked under its final name and unlinked. Either way the final name is
+ * created with a complete file; telempostd watches for the names being
+ * created, and ignores hidden files. Hidden files left behind by a crash
+ * are removed by staging_open() once they are old enough.
+ *
+ * In group mode, records are kept unlinked until the next group sync, which
+ * syncs them all before linking them, so that a crash never leaves an
+ * incomplete record behind. The syncs, links and closes of a group are each
+ * run as one batch, through io_uring where available.
+ */
+struct staging {
+        /* The staging directory */
+        int dirfd;
+        enum staging_sync sync;
+        int interval_ms;
+        /* Whether O_TMPFILE files can be created and linked */
+        bool use_tmpfile;
+        /* Put in front of the names of records if not '\0' */
+        char prefix;
+        /* State of the generator of file names */
+        uint64_t name_state;
+        /* Records waiting for a group sync, and when the first one came */
+        struct staging_file pending[STAGING_GROUP_MAX];
+        size_t npending;
+        struct timespec pending_since;
+        /* Operations of a group sync */
+        struct io_batch io;
+};
+
+/**
+ * Initialize a staging area with no directory, so that staging_is_open()
+ * is false
+ *
+ * @param st The staging area
+ */
+void staging_init(struct staging *st);
+
+/**
+ * Open the staging directory, and remove the hidden files a crash left in it
+ *
+ * @param st The staging area, initialized with staging_init()
+ * @param dir Path of the staging directory
+ * @param sync How records are made durable
+ * @param interval_ms Longest time a record waits for a group sync
+ * @param use_uring Whether group syncs may go through io_uring
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int staging_open(struct staging *st, const char *dir, enum staging_sync sync,
+                 int interval_ms, bool use_uring);
+
+/**
+ * Sync the records still pending, and close the staging directory
+ *
+ * @param st The staging area
+ */
+void staging_close(struct staging *st);
+
+/**
+ * Tell whether the staging directory is open
+ *
+ * @param st The staging area
+ *
+ * @return true if it is open
+ */
+bool staging_is_open(struct staging *st);
+
+/**
+ * Write a record into the staging directory
+ *
+ * @param st The staging area
+ * @param iov The contents of the record
+ * @param iovcnt The number of entries in iov
+ *
+ * @return 0 on success, or a negative errno-style value on error, in which
+ *    case nothing was added to the directory
+ */
+int staging_write(struct staging *st, const struct iovec *iov, int iovcnt);
+
+/**
+ * Shorten a poll timeout so that the daemon wakes up for the next group
+ * sync
+ *
+ * @param st The staging area
+ * @param timeout_ms The timeout the daemon would use otherwise, in ms
+ *
+ * @return The timeout to use, in ms
+ */
+int staging_timeout(struct staging *st, int timeout_ms);
+
+/**
+ * Sync the pending records if the group interval has elapsed
+ *
+ * @param st The staging area
+ */
+void staging_tick(struct staging *st);
+
+/**
+ * Sync the pending records now
+ *
+ * @param st The staging area
+ */
+void staging_flush(struct staging *st);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
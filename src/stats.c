@@ -0,0 +1,241 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "log.h"
+#include "stats.h"
+
+/* Connections answered per call of stats_serve(), so that a busy client
+ * does not keep the daemon from its records */
+#define STATS_SERVE_BATCH 16
+
+void stats_histogram_add(struct stats_histogram *hist, uint64_t us)
+{
+        size_t i = 0;
+
+        /* Round up to the next power of two */
+        if (us > 1) {
+                i = (size_t)(64 - __builtin_clzll(us - 1));
+        }
+        if (i > STATS_LATENCY_BUCKETS) {
+                i = STATS_LATENCY_BUCKETS;
+        }
+
+        __atomic_add_fetch(&hist->buckets[i], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&hist->sum_us, us, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_now_us(void)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+/**
+ * Fill in the address of an endpoint
+ *
+ * @param dir The spool directory
+ * @param name The name of the socket
+ * @param addr Set to the address
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ */
+static int stats_addr(const char *dir, const char *name,
+                      struct sockaddr_un *addr)
+{
+        int len;
+
+        memset(addr, 0, sizeof(*addr));
+        addr->sun_family = AF_UNIX;
+        len = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%s", dir,
+                       name);
+        if (len < 0 || (size_t)len >= sizeof(addr->sun_path)) {
+                return -ENAMETOOLONG;
+        }
+
+        return 0;
+}
+
+int stats_listen(const char *dir, const char *name)
+{
+        struct sockaddr_un addr;
+        int fd;
+        int ret;
+
+        if ((ret = stats_addr(dir, name, &addr)) < 0) {
+                return ret;
+        }
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                return -errno;
+        }
+
+        /* Only one instance of each daemon runs at a time, so an existing
+         * socket was left behind by one that exited */
+        if (unlink(addr.sun_path) < 0 && errno != ENOENT) {
+                ret = -errno;
+                goto out_close;
+        }
+
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            chmod(addr.sun_path, 0660) < 0 || listen(fd, SOMAXCONN) < 0) {
+                ret = -errno;
+                goto out_close;
+        }
+
+        return fd;
+
+out_close:
+        close(fd);
+        return ret;
+}
+
+void stats_close(int fd, const char *dir, const char *name)
+{
+        struct sockaddr_un addr;
+
+        if (fd < 0) {
+                return;
+        }
+
+        close(fd);
+        if (stats_addr(dir, name, &addr) == 0) {
+                unlink(addr.sun_path);
+        }
+}
+
+void stats_serve(int fd, stats_fn fn, void *arg)
+{
+        struct stats_buf buf = { 0 };
+
+        for (int i = 0; i < STATS_SERVE_BATCH; i++) {
+                ssize_t len;
+                int cfd;
+
+                cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (cfd < 0) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK &&
+                            errno != EINTR) {
+                                telem_perror("Failed to accept stats connection");
+                        }
+                        break;
+                }
+
+                /* Clients connecting together get the same snapshot */
+                if (buf.data == NULL && !buf.truncated) {
+                        fn(arg, &buf);
+                }
+
+                do {
+                        len = send(cfd, buf.data, buf.len,
+                                   MSG_DONTWAIT | MSG_NOSIGNAL);
+                } while (len < 0 && errno == EINTR);
+                if (len < 0 || (size_t)len < buf.len) {
+                        telem_log(LOG_DEBUG, "Stats client did not take all"
+                                  " %zu bytes\n", buf.len);
+                }
+                close(cfd);
+        }
+
+        free(buf.data);
+}
+
+void stats_printf(struct stats_buf *buf, const char *fmt, ...)
+{
+        va_list ap;
+        int len;
+
+        if (buf->truncated) {
+                return;
+        }
+
+        while (1) {
+                size_t room = buf->alloc - buf->len;
+                size_t alloc;
+                char *data;
+
+                va_start(ap, fmt);
+                len = vsnprintf(buf->data ? buf->data + buf->len : NULL, room,
+                                fmt, ap);
+                va_end(ap);
+                if (len < 0) {
+                        buf->truncated = true;
+                        return;
+                }
+                if ((size_t)len < room) {
+                        buf->len += (size_t)len;
+                        return;
+                }
+
+                alloc = buf->alloc ? buf->alloc * 2 : 4096;
+                while (alloc - buf->len <= (size_t)len) {
+                        alloc *= 2;
+                }
+                data = realloc(buf->data, alloc);
+                if (data == NULL) {
+                        /* Whatever fits is still served */
+                        buf->truncated = true;
+                        return;
+                }
+                buf->data = data;
+                buf->alloc = alloc;
+        }
+}
+
+void stats_print_metric(struct stats_buf *buf, const char *name,
+                        const char *type, const char *help, int64_t value)
+{
+        stats_printf(buf, "# HELP %s %s\n# TYPE %s %s\n%s %" PRId64 "\n",
+                     name, help, name, type, name, value);
+}
+
+void stats_print_histogram(struct stats_buf *buf, const char *name,
+                           const char *help, const struct stats_histogram *hist)
+{
+        uint64_t count = 0;
+
+        stats_printf(buf, "# HELP %s %s\n# TYPE %s histogram\n", name, help,
+                     name);
+        for (int i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+                count += stats_load(&hist->buckets[i]);
+                stats_printf(buf, "%s_bucket{le=\"%.6f\"} %" PRIu64 "\n", name,
+                             (double)(1ULL << i) / 1e6, count);
+        }
+        /* The count is summed from the buckets, so that it matches them
+         * while other threads add to the histogram */
+        count += stats_load(&hist->buckets[STATS_LATENCY_BUCKETS]);
+        stats_printf(buf, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, count);
+        stats_printf(buf, "%s_sum %.6f\n%s_count %" PRIu64 "\n", name,
+                     (double)stats_load(&hist->sum_us) / 1e6, name, count);
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
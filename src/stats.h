@@ -0,0 +1,167 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Read-only statistics endpoint of the daemons.
+ *
+ * Each daemon listens on a SOCK_STREAM socket in the spool directory. A
+ * client connects, the daemon writes its counters in the Prometheus text
+ * exposition format and closes the connection; nothing is read from the
+ * client. The daemon builds the text on its event loop, from counters that
+ * the threads processing records update with atomic operations.
+ */
+
+/* Hidden, so that they are skipped by the scans of the spool directory */
+#define STATS_PROBD_SOCKET_NAME ".telemprobd.stats"
+#define STATS_POSTD_SOCKET_NAME ".telempostd.stats"
+
+/* Bucket i of a histogram counts the latencies of at most 2^i us, from 1 us
+ * to about 8 s. The last bucket counts the longer ones. */
+#define STATS_LATENCY_BUCKETS 24
+
+struct stats_histogram {
+        uint64_t buckets[STATS_LATENCY_BUCKETS + 1];
+        /* Sum of the latencies, in us */
+        uint64_t sum_us;
+};
+
+/* Text written to a client of the endpoint */
+struct stats_buf {
+        char *data;
+        size_t len;
+        size_t alloc;
+        /* Set if the text was cut short because memory ran out */
+        bool truncated;
+};
+
+/**
+ * Produce the text of the endpoint
+ *
+ * @param arg The argument given to stats_serve()
+ * @param buf Where the text is written, with stats_printf() and friends
+ */
+typedef void (*stats_fn)(void *arg, struct stats_buf *buf);
+
+/**
+ * Count a latency in a histogram. Safe to call from any thread.
+ *
+ * @param hist The histogram
+ * @param us The latency, in us
+ */
+void stats_histogram_add(struct stats_histogram *hist, uint64_t us);
+
+/**
+ * Read CLOCK_MONOTONIC
+ *
+ * @return The time, in us
+ */
+uint64_t stats_now_us(void);
+
+/**
+ * Create the listening socket of an endpoint, replacing a stale one left by
+ * a previous instance
+ *
+ * @param dir The spool directory
+ * @param name The name of the socket, STATS_PROBD_SOCKET_NAME or
+ *    STATS_POSTD_SOCKET_NAME
+ *
+ * @return The socket, non-blocking, or a negative errno-style value on error
+ */
+int stats_listen(const char *dir, const char *name);
+
+/**
+ * Close the listening socket of an endpoint and remove it, so that clients
+ * are not left connecting to a daemon that exited
+ *
+ * @param fd The socket returned by stats_listen(), or a negative value
+ * @param dir The spool directory
+ * @param name The name of the socket
+ */
+void stats_close(int fd, const char *dir, const char *name);
+
+/**
+ * Accept the connections waiting on an endpoint, and write the text
+ * produced by fn to each of them. Writes never block: a client that does
+ * not have room for the whole text gets it cut short.
+ *
+ * @param fd The socket returned by stats_listen()
+ * @param fn Produces the text
+ * @param arg Passed to fn
+ */
+void stats_serve(int fd, stats_fn fn, void *arg);
+
+/**
+ * Append formatted text
+ *
+ * @param buf The text
+ * @param fmt printf() format
+ */
+void stats_printf(struct stats_buf *buf, const char *fmt, ...)
+        __attribute__((format(printf, 2, 3)));
+
+/**
+ * Append a counter or a gauge, with its HELP and TYPE lines
+ *
+ * @param buf The text
+ * @param name The metric
+ * @param type "counter" or "gauge"
+ * @param help What the metric counts
+ * @param value The value
+ */
+void stats_print_metric(struct stats_buf *buf, const char *name,
+                        const char *type, const char *help, int64_t value);
+
+/**
+ * Append a histogram, with its buckets in seconds
+ *
+ * @param buf The text
+ * @param name The metric
+ * @param help What the histogram measures
+ * @param hist The histogram
+ */
+void stats_print_histogram(struct stats_buf *buf, const char *name,
+                           const char *help, const struct stats_histogram *hist);
+
+/**
+ * Read a counter updated by other threads
+ *
+ * @param counter The counter
+ *
+ * @return Its value
+ */
+static inline uint64_t stats_load(const uint64_t *counter)
+{
+        return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/**
+ * Add to a counter that other threads may update
+ *
+ * @param counter The counter
+ * @param value Added to it
+ */
+static inline void stats_add(uint64_t *counter, uint64_t value)
+{
+        __atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
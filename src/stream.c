@@ -0,0 +1,149 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "stream.h"
+
+/**
+ * Fill in the address of the stream socket
+ *
+ * @param dir The spool directory
+ * @param addr Set to the address
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ */
+static int stream_addr(const char *dir, struct sockaddr_un *addr)
+{
+        int len;
+
+        memset(addr, 0, sizeof(*addr));
+        addr->sun_family = AF_UNIX;
+        len = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%s", dir,
+                       TM_STREAM_SOCKET_NAME);
+        if (len < 0 || (size_t)len >= sizeof(addr->sun_path)) {
+                return -ENAMETOOLONG;
+        }
+
+        return 0;
+}
+
+int stream_listen(const char *dir)
+{
+        struct sockaddr_un addr;
+        int fd;
+        int ret;
+
+        if ((ret = stream_addr(dir, &addr)) < 0) {
+                return ret;
+        }
+
+        fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                return -errno;
+        }
+
+        /* Only one telempostd runs at a time, so an existing socket was left
+         * behind by one that exited */
+        if (unlink(addr.sun_path) < 0 && errno != ENOENT) {
+                ret = -errno;
+                goto out_close;
+        }
+
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            chmod(addr.sun_path, 0660) < 0 || listen(fd, SOMAXCONN) < 0) {
+                ret = -errno;
+                goto out_close;
+        }
+
+        return fd;
+
+out_close:
+        close(fd);
+        return ret;
+}
+
+int stream_connect(const char *dir)
+{
+        struct sockaddr_un addr;
+        int fd;
+        int ret;
+
+        if ((ret = stream_addr(dir, &addr)) < 0) {
+                return ret;
+        }
+
+        fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                return -errno;
+        }
+
+        /* Connecting a unix socket completes at once, or fails with EAGAIN
+         * when the listener's backlog is full */
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+                ret = -errno;
+                close(fd);
+                return ret;
+        }
+
+        return fd;
+}
+
+int stream_send(int fd, const struct iovec *iov, int iovcnt)
+{
+        struct msghdr msg = { 0 };
+        ssize_t len;
+
+        msg.msg_iov = (struct iovec *)iov;
+        msg.msg_iovlen = (size_t)iovcnt;
+
+        do {
+                len = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        } while (len < 0 && errno == EINTR);
+        if (len < 0) {
+                return errno == EWOULDBLOCK ? -EAGAIN : -errno;
+        }
+
+        return 0;
+}
+
+ssize_t stream_recv(int fd, char *buf, size_t size)
+{
+        ssize_t len;
+
+        do {
+                /* MSG_TRUNC returns the full length of the message */
+                len = recv(fd, buf, size - 1, MSG_DONTWAIT | MSG_TRUNC);
+        } while (len < 0 && errno == EINTR);
+        if (len < 0) {
+                return errno == EWOULDBLOCK ? -EAGAIN : -errno;
+        }
+        if ((size_t)len >= size) {
+                return -EMSGSIZE;
+        }
+        buf[len] = '\0';
+
+        return len;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
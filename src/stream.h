@@ -0,0 +1,109 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <limits.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "common.h"
+#include "record_file.h"
+
+/*
+ * Record stream from telemprobd to telempostd.
+ *
+ * telempostd listens on a SOCK_SEQPACKET socket named TM_STREAM_SOCKET_NAME
+ * in the spool directory. telemprobd connects to it and sends each record as
+ * one message, holding the record exactly as it would be staged on disk, in
+ * the binary format of record_file.h.
+ * Sends never block: when telempostd is not running, or has not kept up and
+ * the socket buffer is full, telemprobd stages the record on disk instead,
+ * where telempostd finds it as before. The spool directory remains the
+ * persistence layer for records telempostd could not deliver. Until then a
+ * streamed record is only held in the socket buffer or in telempostd's
+ * memory, and a crash of telempostd loses it, unlike a staged record. When
+ * telempostd exits, it saves the records left in the socket buffer in the
+ * spool directory.
+ */
+
+/* Hidden, so that it is skipped by the scans of the spool directory */
+#define TM_STREAM_SOCKET_NAME ".stream"
+
+/* Starts the names of streamed records that telempostd could not deliver
+ * and saved in the spool directory itself. They were journaled already, so
+ * the file watcher skips them and only the spool scans pick them up. */
+#define TM_STREAM_SPOOL_PREFIX '_'
+
+/* Seconds telemprobd stages records on disk after failing to connect */
+#define TM_STREAM_RETRY_TIME 5
+
+/* Records read from the stream before going back to poll() */
+#define TM_STREAM_BATCH 64
+
+/* Largest record sent on the stream: the header of the record, a cfg path,
+ * the headers assuming 80 bytes each as telemprobd does, the payload, and
+ * the null bytes that follow them. Larger records are staged on disk. */
+#define TM_STREAM_MAX_RECORD (sizeof(struct record_file_header) + PATH_MAX + \
+        NUM_HEADERS * 81 + MAX_PAYLOAD_LENGTH + 2)
+
+/**
+ * Create the listening socket of the stream, replacing a stale one left by
+ * a previous instance
+ *
+ * @param dir The spool directory
+ *
+ * @return The socket, non-blocking, or a negative errno-style value on error
+ */
+int stream_listen(const char *dir);
+
+/**
+ * Connect to the stream
+ *
+ * @param dir The spool directory
+ *
+ * @return The socket, non-blocking, or a negative errno-style value on error.
+ *    -ENOENT or -ECONNREFUSED mean that telempostd is not running.
+ */
+int stream_connect(const char *dir);
+
+/**
+ * Send a record on the stream, without blocking
+ *
+ * @param fd The connected socket
+ * @param iov The contents of the record
+ * @param iovcnt The number of entries in iov
+ *
+ * @return 0 on success, or a negative errno-style value on error. -EAGAIN
+ *    means the reader is behind, and the connection can still be used.
+ */
+int stream_send(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Receive a record from the stream, without blocking
+ *
+ * @param fd The connected socket
+ * @param buf Set to the record, followed by a null byte
+ * @param size Size of buf, at least TM_STREAM_MAX_RECORD + 1
+ *
+ * @return The length of the record, 0 if the peer closed the connection, or
+ *    a negative errno-style value on error. -EAGAIN means no record is
+ *    waiting, and -EMSGSIZE that a record too large was discarded.
+ */
+ssize_t stream_recv(int fd, char *buf, size_t size);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
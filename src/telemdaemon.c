@@ -26,8 +26,9 @@
 #include <string.h>
 #include <fcntl.h>
 #include <time.h>
-#include <malloc.h>
+#include <sys/eventfd.h>
 #include <sys/uio.h>
+#include <sys/socket.h>
 
 #include "iorecord.h"
 #include "telemdaemon.h"
@@ -35,174 +36,733 @@
 #include "util.h"
 #include "log.h"
 #include "configuration.h"
+#include "record_file.h"
+#include "stream.h"
 
-static void process_record(TelemDaemon *daemon, client *cl);
+/*
+ See "tm_send_record" for record retails.
+
+ recv buffer layout:
+         * <uint32_t record_size>    : so recv knows how much to read
+         * <custom cfg file field>   : optional, variable size (string)
+         * <uint32_t header_size>
+         * <headers + Payload>
+         * <null-byte>
+
+ The routine handle_client only cares about "record_size".
+ However, we need to validate if the record_size is reasonable. We assume the
+ worst case scenario would be a record with max cfg file field. There is no
+ exact way to determine header_size, so we assume each line at most 80 chars.
+ 
+*/
+
+#define MAX_RECORD_SIZE (2*sizeof(uint32_t) + CFG_PREFIX_LENGTH + PATH_MAX + \
+        MAX_PAYLOAD_LENGTH + NUM_HEADERS*80)
+/* Initial size of a client's receive buffer. It grows to the size of the
+ * record being received, and goes back to the daemon's buffer pool whenever
+ * the client has no partial record buffered. */
+#define CLIENT_BUF_SIZE BUFFER_POOL_MIN_SIZE
+
+static void process_record(TelemDaemon *daemon, struct staging *staging,
+                           uint8_t *record, size_t size);
+static void submit_record(TelemDaemon *daemon, client *cl, const uint8_t *record,
+                          size_t size);
+static int setup_ring(TelemDaemon *daemon, client *cl);
+static int admit_record(TelemDaemon *daemon, client *cl, size_t size,
+                        bool can_wait);
+static void set_machine_id(TelemDaemon *daemon, const char *machine_id);
 
 void initialize_probe_daemon(TelemDaemon *daemon)
 {
-        client_list_head head;
-        LIST_INIT(&head);
+        daemon->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (daemon->epoll_fd < 0) {
+                telem_perror("Failed to create epoll instance");
+                exit(EXIT_FAILURE);
+        }
         daemon->nfds = 0;
-        daemon->pollfds = NULL;
-        daemon->client_head = head;
+        daemon->clients = NULL;
+        daemon->clients_alloc = 0;
+        daemon->nclients = 0;
+        LIST_INIT(&daemon->dead_clients);
+        LIST_INIT(&daemon->paused_clients);
+        /* No quotas until the caller applies the configuration */
+        peer_table_init(&daemon->peers);
+        daemon->inflight = 0;
+        daemon->inflight_max = 0;
+        daemon->inflight_waiting = false;
+        daemon->drain_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (daemon->drain_efd < 0) {
+                telem_perror("Failed to create eventfd");
+                exit(EXIT_FAILURE);
+        }
+        daemon->ring_record = malloc(TM_RING_SLOT_DATA);
+        if (!daemon->ring_record) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
         daemon->machine_id_override = NULL;
+        set_machine_id(daemon, "0");
+        daemon->machine_id_cached = false;
+        buffer_pool_init(&daemon->pool, MAX_RECORD_SIZE);
+        /* Trimming is enabled by the caller, once the configuration is
+         * loaded */
+        mem_policy_init(&daemon->mem, 0, &daemon->pool);
+        /* Opened when the first record comes in */
+        staging_init(&daemon->staging);
+        daemon->stream_fd = -1;
+        daemon->stream_retry = 0;
+        pthread_mutex_init(&daemon->stream_lock, NULL);
+        pthread_mutex_init(&daemon->machine_id_lock, NULL);
+        /* Records are processed by the event loop until workers are
+         * started */
+        worker_pool_init(&daemon->workers);
+        memset(&daemon->stats, 0, sizeof(daemon->stats));
+        /* The endpoint is opened by the caller */
+        daemon->stats_fd = -1;
 }
 
-client *add_client(client_list_head *client_head, int fd)
+client *add_client(TelemDaemon *daemon, int fd)
 {
         client *cl;
+        size_t old_alloc = daemon->clients_alloc;
+        struct ucred cred;
+        socklen_t cred_len = sizeof(cred);
+
+        assert(fd >= 0);
+
+        /* The table grows to the highest fd seen, which the kernel keeps low
+         * by always handing out the lowest free descriptor */
+        if (!reallocate((void **)&(daemon->clients), &(daemon->clients_alloc),
+                        ((size_t)fd + 1) * sizeof(client *))) {
+                return NULL;
+        }
+        if (daemon->clients_alloc > old_alloc) {
+                memset((char *)daemon->clients + old_alloc, 0,
+                       daemon->clients_alloc - old_alloc);
+        }
+        assert(daemon->clients[fd] == NULL);
+
+        /* Records are accounted to the user of the peer process. A peer
+         * without credentials, which only a socket that is not a unix
+         * socket would be, shares the quotas of the nobody user. */
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0) {
+                telem_log(LOG_ERR, "Failed to get credentials of client %d: %s\n",
+                          fd, strerror(errno));
+                cred.pid = 0;
+                cred.uid = (uid_t)-1;
+        }
 
         cl = (client *)malloc(sizeof(client));
         if (cl) {
+                cl->peer = peer_table_get(&daemon->peers, cred.uid, cred.pid);
+                if (!cl->peer) {
+                        free(cl);
+                        return NULL;
+                }
                 cl->fd = fd;
+                cl->state = CLIENT_READ_SIZE;
                 cl->offset = 0;
+                cl->size = 0;
                 cl->buf = NULL;
-
-                LIST_INSERT_HEAD(client_head, cl, client_ptrs);
+                cl->alloc = 0;
+                cl->pid = cred.pid;
+                cl->uid = cred.uid;
+                cl->paused = false;
+                cl->resume_at = 0;
+                cl->ring.hdr = NULL;
+                cl->ring.efd = -1;
+                cl->sock_watch.type = WATCH_CLIENT;
+                cl->sock_watch.cl = cl;
+                cl->ring_watch.type = WATCH_RING;
+                cl->ring_watch.cl = cl;
+
+                daemon->clients[fd] = cl;
+                daemon->nclients++;
         }
         return cl;
 }
 
-void remove_client(client_list_head *client_head, client *cl)
+client *get_client(TelemDaemon *daemon, int fd)
 {
-        assert(cl);
-        LIST_REMOVE(cl, client_ptrs);
-        if (cl->buf) {
-                free(cl->buf);
+        if (fd < 0 || (size_t)fd >= daemon->clients_alloc / sizeof(client *)) {
+                return NULL;
+        }
+
+        return daemon->clients[fd];
+}
+
+static void free_client(TelemDaemon *daemon, client *cl)
+{
+        if (cl->paused) {
+                LIST_REMOVE(cl, paused_ptrs);
         }
+        peer_table_put(&daemon->peers, cl->peer);
+        buffer_pool_put(&daemon->pool, cl->buf, cl->alloc);
+        shm_ring_detach(&cl->ring);
         if (cl->fd >= 0) {
                 close(cl->fd);
         }
         free(cl);
-        cl = NULL;
 }
 
-bool is_client_list_empty(client_list_head *client_head)
+/**
+ * Take a client out of the client table, without freeing it.
+ *
+ * @param daemon The pointer to the daemon
+ * @param cl Pointer to the client
+ */
+static void unlink_client(TelemDaemon *daemon, client *cl)
 {
-        return (client_head->lh_first == NULL);
+        assert(get_client(daemon, cl->fd) == cl);
+        daemon->clients[cl->fd] = NULL;
+        daemon->nclients--;
 }
 
+void remove_client(TelemDaemon *daemon, client *cl)
+{
+        assert(cl);
+        unlink_client(daemon, cl);
+        free_client(daemon, cl);
+}
 
-static void terminate_client(TelemDaemon *daemon, client *cl, nfds_t index)
+void reap_clients(TelemDaemon *daemon)
 {
-        /* Remove fd from the pollfds array */
-        del_pollfd(daemon, index);
+        client *cl;
+
+        while ((cl = LIST_FIRST(&daemon->dead_clients)) != NULL) {
+                LIST_REMOVE(cl, client_ptrs);
+                free_client(daemon, cl);
+        }
+}
+
+bool is_client_table_empty(TelemDaemon *daemon)
+{
+        return (daemon->nclients == 0);
+}
+
+
+static void terminate_client(TelemDaemon *daemon, client *cl)
+{
+        /* Records the client left in its ring are still processed */
+        close_client_ring(daemon, cl);
+
+        /* Stop watching the connection, which a paused client is not */
+        if (cl->paused) {
+                LIST_REMOVE(cl, paused_ptrs);
+                cl->paused = false;
+        } else {
+                del_epoll_fd(daemon, cl->fd);
+        }
 
         telem_log(LOG_INFO, "Removing client: %d\n", cl->fd);
 
-        /* Remove client from the client list */
-        remove_client(&(daemon->client_head), cl);
+        /* Events for this client may still be pending in the batch being
+         * handled, so it is only freed by reap_clients(). Its fd is closed
+         * now, and set to -1 to mark it as terminated. */
+        unlink_client(daemon, cl);
+        close(cl->fd);
+        cl->fd = -1;
+        LIST_INSERT_HEAD(&daemon->dead_clients, cl, client_ptrs);
 }
 
-/*
- See "tm_send_record" for record retails.
 
- recv buffer layout:
-         * <uint32_t record_size>    : so recv knows how much to read
-         * <custom cfg file field>   : optional, variable size (string)
-         * <uint32_t header_size>
-         * <headers + Payload>
-         * <null-byte>
+/**
+ * Make room for at least size bytes in a client's receive buffer, keeping
+ * the data already buffered.
+ *
+ * @param daemon The pointer to the daemon
+ * @param cl Pointer to the client structure in the client table
+ * @param size Number of bytes needed
+ */
+static void reserve_client_buf(TelemDaemon *daemon, client *cl, size_t size)
+{
+        uint8_t *buf;
+        size_t alloc;
 
- The routine handle_client only cares about "record_size".
- However, we need to validate if the record_size is reasonable. We assume the
- worst case scenario would be a record with max cfg file field. There is no
- exact way to determine header_size, so we assume each line at most 80 chars.
- 
-*/
+        if (cl->alloc >= size) {
+                return;
+        }
 
-#define MAX_RECORD_SIZE (2*sizeof(uint32_t) + CFG_PREFIX_LENGTH + PATH_MAX + \
-        MAX_PAYLOAD_LENGTH + NUM_HEADERS*80)
-bool handle_client(TelemDaemon *daemon, nfds_t index, client *cl)
+        buf = buffer_pool_get(&daemon->pool, size, &alloc);
+        if (!buf) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        if (cl->offset > 0) {
+                memcpy(buf, cl->buf, cl->offset);
+        }
+        buffer_pool_put(&daemon->pool, cl->buf, cl->alloc);
+        cl->buf = buf;
+        cl->alloc = alloc;
+}
+
+/**
+ * Give a client's receive buffer back to the pool while it holds no data,
+ * so that idle connections do not each keep a buffer.
+ *
+ * @param daemon The pointer to the daemon
+ * @param cl Pointer to the client structure in the client table
+ */
+static void release_client_buf(TelemDaemon *daemon, client *cl)
 {
-        /* For now  read data from fd */
-        ssize_t len;
-        size_t buf_size;
-        bool processed = false;
-        uint32_t record_size;
+        if (cl->offset > 0) {
+                return;
+        }
 
-        if (cl->buf != NULL) {
-                free(cl->buf);
-                cl->buf = NULL;
+        buffer_pool_put(&daemon->pool, cl->buf, cl->alloc);
+        cl->buf = NULL;
+        cl->alloc = 0;
+}
+
+/**
+ * Stop reading a client until resume_clients() resumes it
+ *
+ * @param daemon The pointer to the daemon
+ * @param cl Pointer to the client structure in the client table
+ * @param resume_at When to resume the client, in ms of CLOCK_MONOTONIC, or 0
+ *    to resume it once the workers caught up
+ */
+static void pause_client(TelemDaemon *daemon, client *cl, int64_t resume_at)
+{
+        if (!cl->paused) {
+                del_epoll_fd(daemon, cl->fd);
+                if (cl->ring.hdr != NULL) {
+                        del_epoll_fd(daemon, cl->ring.efd);
+                }
+                cl->paused = true;
+                LIST_INSERT_HEAD(&daemon->paused_clients, cl, paused_ptrs);
         }
+        cl->resume_at = resume_at;
 
-        malloc_trim(0);
-        len = recv(cl->fd, &record_size, RECORD_SIZE_LEN, MSG_PEEK | MSG_DONTWAIT);
-        if (len < 0) {
-                telem_log(LOG_ERR, "Failed to talk to client %d: %s\n", cl->fd,
-                          strerror(errno));
-                goto end_client;
-        } else if (len == 0) {
-                /* Connection closed by client, most likely */
-                telem_log(LOG_INFO, "No data to receive from client %d\n",
-                          cl->fd);
-                goto end_client;
+        telem_debug("DEBUG: Client %d (uid %u) paused\n", cl->fd,
+                    (unsigned)cl->uid);
+}
+
+/**
+ * Reserve room for a record in the queue of the worker of a client
+ *
+ * @param daemon The pointer to the daemon
+ * @param cl Pointer to the client structure in the client table
+ *
+ * @return true if room was reserved, false if the client has to wait for
+ *    the worker, which then signals drain_efd
+ */
+static bool reserve_worker(TelemDaemon *daemon, client *cl)
+{
+        if (worker_pool_reserve(&daemon->workers, (unsigned int)cl->fd) == 0) {
+                return true;
         }
 
-        /* Read the record size first */
-        len = recv(cl->fd, &record_size, RECORD_SIZE_LEN, 0);
-        if (len < 0) {
-                telem_log(LOG_ERR, "Failed to receive data from client"
-                                  " %d: %s\n", cl->fd, strerror(errno));
-                goto end_client;
-        } else if (len == 0) {
-                telem_log(LOG_DEBUG, "End of transmission for client"
-                          " %d\n", cl->fd);
-                goto end_client;
+        __atomic_store_n(&daemon->inflight_waiting, true, __ATOMIC_SEQ_CST);
+        /* A worker that made room before seeing the flag does not signal
+         * drain_efd */
+        return worker_pool_reserve(&daemon->workers, (unsigned int)cl->fd) == 0;
+}
+
+/**
+ * Decide whether a record of a client is processed now. A client over the
+ * quotas of its user, or sending while the workers are behind or its
+ * worker's queue is full, is paused instead, and the record waits where it
+ * is. The event loop itself only waits for a worker to take the last records
+ * of a closing ring. Its socket or ring then fills up, which makes
+ * libtelemetry wait and eventually fail, rather than have records dropped.
+ *
+ * @param daemon The pointer to the daemon
+ * @param cl Pointer to the client structure in the client table
+ * @param size Size of the record
+ * @param can_wait false if the client cannot be paused because its
+ *    connection is closing. Its records over the quotas are dropped.
+ *
+ * @return 1 if the record is processed, 0 if the client was paused, or -1 if
+ *    the record must be dropped. With workers, a record to process has room
+ *    reserved in its worker's queue, unless can_wait is false.
+ */
+static int admit_record(TelemDaemon *daemon, client *cl, size_t size,
+                        bool can_wait)
+{
+        bool reserved = false;
+        int64_t now_ms;
+        int64_t wait_ms;
+
+        if (can_wait && daemon->inflight_max > 0 && daemon->workers.nworkers > 0 &&
+            __atomic_load_n(&daemon->inflight, __ATOMIC_SEQ_CST) >= daemon->inflight_max) {
+                __atomic_store_n(&daemon->inflight_waiting, true, __ATOMIC_SEQ_CST);
+                /* Workers that caught up before seeing the flag do not
+                 * signal drain_efd */
+                if (__atomic_load_n(&daemon->inflight, __ATOMIC_SEQ_CST) >=
+                    daemon->inflight_max) {
+                        pause_client(daemon, cl, 0);
+                        return 0;
+                }
         }
 
-        /* Now that we know the record size, allocate a new buffer
-         * for the record body. We don't need to record size itself in the body.
-         */
+        if (can_wait && daemon->workers.nworkers > 0) {
+                if (!reserve_worker(daemon, cl)) {
+                        pause_client(daemon, cl, 0);
+                        return 0;
+                }
+                reserved = true;
+        }
 
-        if (record_size <= RECORD_SIZE_LEN || record_size > MAX_RECORD_SIZE) {
-                telem_log(LOG_ERR, "Record size %u greater tham maximum allowed %lu."
-                                    "Recored ignored\n", record_size,
-                                    MAX_RECORD_SIZE);
-                goto end_client;      
+        now_ms = peer_table_now_ms();
+        wait_ms = peer_admit(cl->peer, size, now_ms);
+        if (wait_ms == 0) {
+                return 1;
+        }
+        if (reserved) {
+                worker_pool_unreserve(&daemon->workers, (unsigned int)cl->fd);
         }
 
-        buf_size = record_size - RECORD_SIZE_LEN;
-        cl->buf = calloc(1, buf_size);
-        if (!cl->buf) {
-                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
-                exit(EXIT_FAILURE);
+        if (!can_wait) {
+                cl->peer->stats.rejected++;
+                telem_log(LOG_WARNING, "Dropped record of client %d (pid %d, uid"
+                          " %u) over its quota\n", cl->fd, (int)cl->pid,
+                          (unsigned)cl->uid);
+                return -1;
         }
-        cl->size = buf_size;
-        cl->offset = 0;
 
-        /* Read the actual record*/
-        do {
-                malloc_trim(0);
-                len = recv(cl->fd, cl->buf + cl->offset, cl->size - cl->offset, 0);
+        pause_client(daemon, cl, now_ms + wait_ms);
+
+        return 0;
+}
+
+/**
+ * Advance a client's framing state machine over the data it has buffered.
+ * The record size field is read first (CLIENT_READ_SIZE), then the rest of
+ * the record (CLIENT_READ_BODY), which is processed as soon as it is
+ * complete.
+ *
+ * @param daemon The pointer to the daemon
+ * @param cl Pointer to the client structure in the client table
+ *
+ * @return 1 if a record or request was consumed, 0 if more data is needed,
+ *    or -1 if the client sent invalid data.
+ */
+static int parse_client_buf(TelemDaemon *daemon, client *cl)
+{
+        uint32_t record_size;
+        size_t consumed;
+
+        switch (cl->state) {
+        case CLIENT_READ_SIZE:
+                if (cl->offset < RECORD_SIZE_LEN) {
+                        return 0;
+                }
+                memcpy(&record_size, cl->buf, RECORD_SIZE_LEN);
+
+                if (record_size == TM_RING_REQUEST) {
+                        if (setup_ring(daemon, cl) < 0) {
+                                return -1;
+                        }
+                        consumed = RECORD_SIZE_LEN;
+                        break;
+                }
+
+                if (record_size <= RECORD_SIZE_LEN || record_size > MAX_RECORD_SIZE) {
+                        telem_log(LOG_ERR, "Record size %u greater tham maximum allowed %lu."
+                                  "Recored ignored\n", record_size,
+                                  MAX_RECORD_SIZE);
+                        return -1;
+                }
+
+                cl->size = record_size;
+                reserve_client_buf(daemon, cl, cl->size);
+                cl->state = CLIENT_READ_BODY;
+                /* fall through */
+        case CLIENT_READ_BODY:
+                if (cl->offset < cl->size) {
+                        return 0;
+                }
+
+                /* A record held back stays buffered until the client is
+                 * resumed */
+                if (admit_record(daemon, cl, cl->size, true) == 0) {
+                        return 0;
+                }
+                daemon->stats.records_received++;
+                daemon->stats.bytes_received += cl->size;
+
+                /* We don't need the record size itself in the body */
+                if (daemon->workers.nworkers > 0) {
+                        submit_record(daemon, cl, cl->buf + RECORD_SIZE_LEN,
+                                      cl->size - RECORD_SIZE_LEN);
+                } else {
+                        process_record(daemon, &daemon->staging,
+                                       cl->buf + RECORD_SIZE_LEN,
+                                       cl->size - RECORD_SIZE_LEN);
+                }
+                telem_debug("DEBUG: Record processed for client %d\n", cl->fd);
+                consumed = cl->size;
+                cl->state = CLIENT_READ_SIZE;
+                break;
+        default:
+                return -1;
+        }
+
+        /* Keep the start of the next record, if it was received already */
+        cl->offset -= consumed;
+        if (cl->offset > 0) {
+                memmove(cl->buf, cl->buf + consumed, cl->offset);
+        }
+
+        return 1;
+}
+
+bool handle_client(TelemDaemon *daemon, client *cl)
+{
+        ssize_t len;
+        bool processed = false;
+        int ret;
+
+        reserve_client_buf(daemon, cl, CLIENT_BUF_SIZE);
+
+        /* Read whatever the socket holds, and resume on the next wakeup when
+         * it runs dry. A client may send several records back to back, so
+         * one read can complete several records.
+         */
+        while (1) {
+                while ((ret = parse_client_buf(daemon, cl)) > 0) {
+                        processed = true;
+                }
+                if (ret < 0) {
+                        goto end_client;
+                }
+                if (cl->paused) {
+                        /* Not read from until resume_clients() */
+                        return true;
+                }
+
+                len = recv(cl->fd, cl->buf + cl->offset, cl->alloc - cl->offset,
+                           MSG_DONTWAIT);
                 if (len < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                                /* Keep the connection for the rest of the data */
+                                telem_debug("DEBUG: Waiting for more data from client %d\n",
+                                            cl->fd);
+                                release_client_buf(daemon, cl);
+                                return true;
+                        }
                         telem_log(LOG_ERR, "Failed to receive data from client"
                                   " %d: %s\n", cl->fd, strerror(errno));
                         goto end_client;
                 } else if (len == 0) {
-                        telem_log(LOG_DEBUG, "End of transmission for client"
-                                  " %d\n", cl->fd);
+                        if (cl->offset > 0) {
+                                telem_log(LOG_ERR, "Client %d closed the connection in"
+                                          " the middle of a record\n", cl->fd);
+                        } else {
+                                /* Connection closed by client, most likely */
+                                telem_log(LOG_DEBUG, "End of transmission for client"
+                                          " %d\n", cl->fd);
+                        }
                         goto end_client;
                 }
 
                 cl->offset += (size_t)len;
-
-                if (cl->offset == cl->size) {
-                        process_record(daemon, cl);
-                        free(cl->buf);
-                        cl->buf = NULL;
-                        processed = true;
-                        telem_debug("DEBUG: Record processed for client %d\n", cl->fd);
-                        break;
-                }
-        } while (len > 0);
+        }
 
 end_client:
         telem_log(LOG_DEBUG, "Processed client %d: %s\n", cl->fd, processed ? "true" : "false");
-        terminate_client(daemon, cl, index);
+        terminate_client(daemon, cl);
         return processed;
 }
 
+/**
+ * Create a shared memory ring for a client that asked for one, and pass the
+ * memfd and eventfd to it over its connection. The ring is bound to the
+ * connection, and its records are accounted to the same peer.
+ *
+ * @param daemon The pointer to the daemon
+ * @param cl Pointer to the client structure in the client list
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ */
+static int setup_ring(TelemDaemon *daemon, client *cl)
+{
+        uint32_t reply = TM_RING_REQUEST;
+        struct iovec iov = { .iov_base = &reply, .iov_len = sizeof(reply) };
+        union {
+                char buf[CMSG_SPACE(2 * sizeof(int))];
+                struct cmsghdr align;
+        } control;
+        struct msghdr msg = { 0 };
+        struct cmsghdr *cmsg;
+        int fds[2];
+        int memfd;
+        int ret;
+
+        if (!shm_transport_enabled_config()) {
+                telem_log(LOG_INFO, "Client %d asked for a ring, but the shared"
+                          " memory transport is disabled\n", cl->fd);
+                return -ENOTSUP;
+        }
+
+        if (cl->ring.hdr != NULL) {
+                telem_log(LOG_ERR, "Client %d already has a ring\n", cl->fd);
+                return -EEXIST;
+        }
+
+        if ((ret = shm_ring_create(&cl->ring, &memfd)) < 0) {
+                telem_log(LOG_ERR, "Failed to create ring for client %d: %s\n",
+                          cl->fd, strerror(-ret));
+                return ret;
+        }
+
+        fds[0] = memfd;
+        fds[1] = cl->ring.efd;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+        ret = 0;
+        if (sendmsg(cl->fd, &msg, MSG_NOSIGNAL) != sizeof(reply)) {
+                ret = -errno;
+                telem_log(LOG_ERR, "Failed to send ring to client %d: %s\n",
+                          cl->fd, strerror(errno));
+                shm_ring_detach(&cl->ring);
+        }
+        /* The daemon's mapping keeps the ring alive */
+        close(memfd);
+
+        if (ret == 0) {
+                add_epoll_fd(daemon, cl->ring.efd, EPOLLIN, &cl->ring_watch);
+                telem_log(LOG_INFO, "Client %d (pid %d, uid %u) uses a shared"
+                          " memory ring\n", cl->fd, (int)cl->pid,
+                          (unsigned)cl->uid);
+        }
+
+        return ret;
+}
+
+/**
+ * Process the records published in a client's ring, up to one full ring.
+ * Each record is copied out of shared memory before it is validated, so the
+ * client cannot change it afterwards. Reading stops early if the client is
+ * paused.
+ *
+ * @param daemon The pointer to the daemon
+ * @param cl Pointer to the client structure in the client list
+ * @param closing true if the ring is being closed, in which case records
+ *    over the client's quotas are dropped instead
+ *
+ * @return The number of records read, or a negative errno-style value if
+ *    the ring holds an invalid record.
+ */
+static int process_ring_records(TelemDaemon *daemon, client *cl, bool closing)
+{
+        int count;
+
+        for (count = 0; count < TM_RING_SLOTS; count++) {
+                const char *data;
+                size_t len;
+                uint32_t record_size;
+                int ret;
+
+                if ((ret = shm_ring_peek(&cl->ring, &data, &len)) <= 0) {
+                        return ret < 0 ? ret : count;
+                }
+
+                if (len <= RECORD_SIZE_LEN) {
+                        return -EBADMSG;
+                }
+                memcpy(&record_size, data, RECORD_SIZE_LEN);
+                if (record_size != len || record_size > MAX_RECORD_SIZE) {
+                        telem_log(LOG_ERR, "Invalid record size %u in ring of"
+                                  " client %d\n", record_size, cl->fd);
+                        return -EBADMSG;
+                }
+
+                /* A record held back stays in the ring */
+                if ((ret = admit_record(daemon, cl, len, !closing)) == 0) {
+                        return count;
+                } else if (ret < 0) {
+                        shm_ring_release(&cl->ring);
+                        continue;
+                }
+                daemon->stats.records_received++;
+                daemon->stats.bytes_received += len;
+
+                /* Either way, the record is copied before it is used. A
+                 * closing ring cannot be held back, so it waits for room in
+                 * its worker's queue, behind the client's earlier records. */
+                if (daemon->workers.nworkers > 0) {
+                        if (closing) {
+                                worker_pool_reserve_wait(&daemon->workers,
+                                                         (unsigned int)cl->fd);
+                        }
+                        submit_record(daemon, cl, (const uint8_t *)data + RECORD_SIZE_LEN,
+                                      len - RECORD_SIZE_LEN);
+                        shm_ring_release(&cl->ring);
+                        continue;
+                }
+
+                memcpy(daemon->ring_record, data + RECORD_SIZE_LEN,
+                       len - RECORD_SIZE_LEN);
+                shm_ring_release(&cl->ring);
+
+                process_record(daemon, &daemon->staging, daemon->ring_record,
+                               len - RECORD_SIZE_LEN);
+        }
+
+        return count;
+}
+
+bool handle_ring(TelemDaemon *daemon, client *cl)
+{
+        int ret;
+
+        shm_ring_clear_wakeup(&cl->ring);
+
+        do {
+                if ((ret = process_ring_records(daemon, cl, false)) < 0) {
+                        telem_log(LOG_ERR, "Corrupted ring for client %d\n", cl->fd);
+                        terminate_client(daemon, cl);
+                        return false;
+                }
+                if (cl->paused) {
+                        /* Read again by resume_clients() */
+                        return true;
+                }
+                if (ret == TM_RING_SLOTS) {
+                        /* Let other clients in; the eventfd stays readable so
+                         * the rest is read on the next epoll_wait() */
+                        uint64_t one = 1;
+                        ssize_t unused __attribute__((unused));
+
+                        unused = write(cl->ring.efd, &one, sizeof(one));
+                        return true;
+                }
+        } while (shm_ring_arm(&cl->ring));
+
+        return true;
+}
+
+void close_client_ring(TelemDaemon *daemon, client *cl)
+{
+        if (cl->ring.hdr == NULL) {
+                return;
+        }
+
+        /* Only the slots already marked published are read, at most one
+         * full ring; a producer that has not published yet is not waited
+         * for, and gets its record back to send again */
+        shm_ring_close(&cl->ring);
+        process_ring_records(daemon, cl, true);
+
+        if (!cl->paused) {
+                del_epoll_fd(daemon, cl->ring.efd);
+        }
+        shm_ring_detach(&cl->ring);
+}
+
 char *read_machine_id_override()
 {
         char *machine_override = NULL;
@@ -249,103 +809,314 @@ char *read_machine_id_override()
         return machine_override;
 }
 
-static void machine_id_replace(char **machine_header, char *machine_id_override)
+/**
+ * Set the machine id written into staged records, and format its header
+ * line.
+ *
+ * @param daemon The pointer to the daemon
+ * @param machine_id The machine id, truncated to TM_MACHINE_ID_LEN
+ */
+static void set_machine_id(TelemDaemon *daemon, const char *machine_id)
 {
-        char machine_id[33] = { 0 };
-        char *old_header;
-        int ret;
+        /* Workers copy the header while staging records */
+        pthread_mutex_lock(&daemon->machine_id_lock);
+        snprintf(daemon->machine_id, sizeof(daemon->machine_id), "%s", machine_id);
+        snprintf(daemon->machine_id_header, sizeof(daemon->machine_id_header),
+                 "%s: %s", TM_MACHINE_ID_STR, daemon->machine_id);
+        pthread_mutex_unlock(&daemon->machine_id_lock);
+}
 
-        if (machine_id_override) {
-                strncpy(machine_id, machine_id_override, sizeof(machine_id)-1);
+bool cache_machine_id(TelemDaemon *daemon)
+{
+        char machine_id[TM_MACHINE_ID_LEN + 1] = { 0 };
+
+        if (daemon->machine_id_override) {
+                set_machine_id(daemon, daemon->machine_id_override);
+                daemon->machine_id_cached = true;
+        } else if (get_machine_id(machine_id)) {
+                set_machine_id(daemon, machine_id);
+                daemon->machine_id_cached = true;
         } else {
-                if (!get_machine_id(machine_id)) {
-                        // TODO: decide if error handling is needed here
-                        machine_id[0] = '0';
-                }
+                // TODO: decide if error handling is needed here
+                set_machine_id(daemon, "0");
+                daemon->machine_id_cached = false;
         }
 
-        old_header = *machine_header;
-        ret = asprintf(machine_header, "%s: %s", TM_MACHINE_ID_STR, machine_id);
+        return daemon->machine_id_cached;
+}
 
-        if (ret == -1) {
-                telem_log(LOG_ERR, "Failed to write machine id header\n");
-                exit(EXIT_FAILURE);
+/**
+ * Split the header block of a record into its NUM_HEADERS lines, in place.
+ * Each line must start with the name of the header expected at its
+ * position. Empty lines are skipped, and the block ends at the first NUL
+ * byte, if any.
+ *
+ * @param block The header block
+ * @param size Size of the header block
+ * @param views Set to the position of each header line in block
+ *
+ * @return true if all headers were found, false otherwise
+ */
+static bool parse_headers(const char *block, size_t size,
+                          struct header_view views[NUM_HEADERS])
+{
+        const char *p = block;
+        const char *end = memchr(block, '\0', size);
+
+        if (end == NULL) {
+                end = block + size;
         }
-        free(old_header);
+
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                size_t name_len = get_header_name_len(i);
+                const char *eol;
+
+                while (p < end && *p == '\n') {
+                        p++;
+                }
+                eol = memchr(p, '\n', (size_t)(end - p));
+                if (eol == NULL) {
+                        eol = end;
+                }
+
+                if ((size_t)(eol - p) < name_len ||
+                    memcmp(p, get_header_name(i), name_len) != 0) {
+                        return false;
+                }
+                views[i].offset = (size_t)(p - block);
+                views[i].len = (size_t)(eol - p);
+                p = eol;
+        }
+
+        return true;
 }
 
-static void stage_record(char *filepath, char *headers[], char *body, char *cfg_file)
+/**
+ * Open the staging directory with the current configuration, if it is not
+ * open already
+ *
+ * @param staging The staging area of the thread processing records
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ */
+static int open_staging(struct staging *staging)
 {
-        int tmpfd;
-        FILE *tmpfile = NULL;
+        const char *mode;
+        enum staging_sync sync = STAGING_SYNC_NONE;
+        int ret;
 
-        telem_debug("DEBUG: filepath:%s\n", filepath);
-        telem_debug("DEBUG: body:%s\n", body);
-        telem_debug("DEBUG: cfg:%s\n", cfg_file);
+        if (staging_is_open(staging)) {
+                return 0;
+        }
 
-        if (filepath == NULL) {
-                telem_log(LOG_ERR, "filepath value must be provided, aborting\n");
-                exit(EXIT_FAILURE);
+        mode = staging_sync_config();
+        if (strcmp(mode, "fdatasync") == 0) {
+                sync = STAGING_SYNC_FDATASYNC;
+        } else if (strcmp(mode, "group") == 0) {
+                sync = STAGING_SYNC_GROUP;
+        }
+
+        ret = staging_open(staging, spool_dir_config(), sync,
+                           staging_sync_interval_config(),
+                           io_uring_enabled_config());
+        if (ret < 0) {
+                telem_log(LOG_ERR, "Failed to open staging directory %s: %s\n",
+                          spool_dir_config(), strerror(-ret));
+        }
+
+        return ret;
+}
+
+static void close_stream_locked(TelemDaemon *daemon)
+{
+        if (daemon->stream_fd >= 0) {
+                close(daemon->stream_fd);
+                daemon->stream_fd = -1;
         }
+        daemon->stream_retry = 0;
+}
 
-        tmpfd = mkstemp(filepath);
-        if (tmpfd < 0) {
-                telem_perror("Error opening staging file");
-                goto clean_exit;
+void close_record_stream(TelemDaemon *daemon)
+{
+        pthread_mutex_lock(&daemon->stream_lock);
+        close_stream_locked(daemon);
+        pthread_mutex_unlock(&daemon->stream_lock);
+}
+
+/**
+ * Hand a record to telempostd over the record stream
+ *
+ * @param daemon The daemon
+ * @param iov The record, as it would be staged on disk
+ * @param iovcnt The number of entries in iov
+ * @param len The length of the record
+ *
+ * @return true if telempostd took the record, false if it must be staged on
+ *    disk
+ */
+static bool stream_record_locked(TelemDaemon *daemon, const struct iovec *iov,
+                                 int iovcnt, size_t len)
+{
+        time_t now;
+        int ret;
+
+        /* Records that must be synced to disk are not streamed */
+        if (!record_stream_enabled_config() ||
+            strcmp(staging_sync_config(), "none") != 0 ||
+            len > TM_STREAM_MAX_RECORD) {
+                return false;
         }
 
-        // access the opened file as a stream
-        tmpfile = fdopen(tmpfd, "a");
-        if (!tmpfile) {
-                telem_perror("Error opening temp stage file");
-                close(tmpfd);
-                if (unlink(filepath)) {
-                        telem_perror("Error deleting temp stage file");
+        if (daemon->stream_fd < 0) {
+                /* telempostd is started when records are staged on disk, so
+                 * try again once it had time to come up */
+                now = time(NULL);
+                if (now < daemon->stream_retry) {
+                        return false;
+                }
+                ret = stream_connect(spool_dir_config());
+                if (ret < 0) {
+                        telem_debug("DEBUG: record stream unavailable: %s\n",
+                                    strerror(-ret));
+                        daemon->stream_retry = now + TM_STREAM_RETRY_TIME;
+                        return false;
                 }
-                goto clean_exit;
+                daemon->stream_fd = ret;
+                telem_log(LOG_INFO, "Connected to the record stream\n");
         }
 
-        // write cfg info if exists
-        if (cfg_file != NULL) {
-                fprintf(tmpfile, "%s%s\n", CFG_PREFIX, cfg_file);
+        ret = stream_send(daemon->stream_fd, iov, iovcnt);
+        if (ret == 0) {
+                return true;
         }
 
-        // write headers
+        /* telempostd is behind: keep the connection for the next record */
+        if (ret == -EAGAIN) {
+                return false;
+        }
+
+        telem_log(LOG_INFO, "Record stream closed: %s\n", strerror(-ret));
+        close_stream_locked(daemon);
+        daemon->stream_retry = time(NULL) + TM_STREAM_RETRY_TIME;
+
+        return false;
+}
+
+static bool stream_record(TelemDaemon *daemon, const struct iovec *iov,
+                          int iovcnt, size_t len)
+{
+        bool ret;
+
+        pthread_mutex_lock(&daemon->stream_lock);
+        ret = stream_record_locked(daemon, iov, iovcnt, len);
+        pthread_mutex_unlock(&daemon->stream_lock);
+
+        return ret;
+}
+
+static void stage_record(TelemDaemon *daemon, struct staging *staging,
+                         const char *block,
+                         const struct header_view views[NUM_HEADERS],
+                         const char *body, const char *cfg_file)
+{
+        char machine_id_header[sizeof(daemon->machine_id_header)];
+        struct iovec fields[RECORD_FIELDS];
+        struct record_file_header hdr;
+        struct iovec iov[RECORD_FILE_IOVS];
+        size_t len;
+        uint64_t start_us;
+        int ret;
+
+        telem_debug("DEBUG: body:%s\n", body);
+        telem_debug("DEBUG: cfg:%s\n", cfg_file);
+
+        pthread_mutex_lock(&daemon->machine_id_lock);
+        memcpy(machine_id_header, daemon->machine_id_header,
+               sizeof(machine_id_header));
+        pthread_mutex_unlock(&daemon->machine_id_lock);
+
+        // cfg file path, if any
+        fields[RECORD_FIELD_CFG] = (struct iovec){ (char *)cfg_file,
+                                                   cfg_file ? strlen(cfg_file) : 0 };
+
+        // headers, with the machine id of this system
         for (int i = 0; i < NUM_HEADERS; i++) {
-                fprintf(tmpfile, "%s\n", headers[i]);
+                if (i == TM_MACHINE_ID) {
+                        fields[RECORD_FIELD_HEADERS + i] = (struct iovec){
+                                machine_id_header, strlen(machine_id_header) };
+                } else {
+                        fields[RECORD_FIELD_HEADERS + i] = (struct iovec){
+                                (char *)block + views[i].offset, views[i].len };
+                }
         }
 
-        // write body
-        fprintf(tmpfile, "%s\n", body);
-        fflush(tmpfile);
-        fclose(tmpfile);
+        fields[RECORD_FIELD_BODY] = (struct iovec){ (char *)body, strlen(body) };
 
-clean_exit:
+        /* Bounded by MAX_RECORD_SIZE, far below the limits of the format */
+        len = record_file_iov(&hdr, fields, iov);
 
-        return;
+        start_us = stats_now_us();
+        if (stream_record(daemon, iov, RECORD_FILE_IOVS, len)) {
+                stats_histogram_add(&daemon->stats.stream_latency,
+                                    stats_now_us() - start_us);
+                stats_add(&daemon->stats.records_streamed, 1);
+                stats_add(&daemon->stats.bytes_streamed, len);
+                return;
+        }
+
+        /* Otherwise, leave the record for telempostd in the spool directory */
+        if (open_staging(staging) < 0) {
+                stats_add(&daemon->stats.stage_errors, 1);
+                return;
+        }
+
+        start_us = stats_now_us();
+        ret = staging_write(staging, iov, RECORD_FILE_IOVS);
+        if (ret < 0) {
+                telem_log(LOG_ERR, "Failed to stage record: %s\n",
+                          strerror(-ret));
+                stats_add(&daemon->stats.stage_errors, 1);
+                return;
+        }
+        stats_histogram_add(&daemon->stats.stage_latency,
+                            stats_now_us() - start_us);
+        stats_add(&daemon->stats.records_staged, 1);
+        stats_add(&daemon->stats.bytes_staged, len);
 }
 
-static void process_record(TelemDaemon *daemon, client *cl)
+/**
+ * Validate a record and stage it, on the event loop or on a worker
+ *
+ * @param daemon The daemon
+ * @param staging The staging area of the thread processing the record
+ * @param record The record, without its size
+ * @param size The length of the record
+ */
+static void process_record(TelemDaemon *daemon, struct staging *staging,
+                           uint8_t *record, size_t size)
 {
-        int i = 0;
-        int ret = 0;
-        char *headers[NUM_HEADERS];
-        char *tok = NULL;
+        struct header_view views[NUM_HEADERS];
         size_t header_size = 0;
         size_t message_size = 0;
-        char *temp_headers = NULL;
         char *msg;
         char *body;
-        char *recordpath = NULL;
         char *cfg_file = NULL;;
         size_t cfg_info_size = 0;
         uint8_t *buf;
+        uint64_t start_us = stats_now_us();
+
+        /* The record arrives in a buffer shared with the records that follow
+         * it, so make sure the strings below cannot run past its end */
+        if (size <= sizeof(uint32_t) || record[size - 1] != '\0') {
+                telem_log(LOG_ERR, "process_record: Record not null terminated\n");
+                goto invalid;
+        }
 
-        buf = cl->buf;
+        buf = record;
 
         /* Check for an optional CFG_PREFIX in the first 32 bits */
         if (*(uint32_t *)buf == CFG_PREFIX_32BIT) {
-                char *cfg  = (char *)cl->buf;
+                char *cfg  = (char *)record;
 
                 cfg_file = cfg + CFG_PREFIX_LENGTH;
                 cfg_info_size = CFG_PREFIX_LENGTH + strlen(cfg_file) + 1;
@@ -355,11 +1126,11 @@ static void process_record(TelemDaemon *daemon, client *cl)
         buf += cfg_info_size;
         header_size = *(uint32_t *)buf;
         /* Header size can not be bigger than buffer size bail out early */
-        if ((uint32_t)header_size >= (uint32_t)cl->size) {
-                return;
+        if ((uint32_t)header_size >= (uint32_t)size) {
+                goto invalid;
         }
-        message_size = cl->size - (cfg_info_size + header_size);
-        telem_debug("DEBUG: cl->size: %ld\n", cl->size);
+        message_size = size - (cfg_info_size + header_size);
+        telem_debug("DEBUG: size: %zu\n", size);
         telem_debug("DEBUG: header_size: %ld\n", header_size);
         telem_debug("DEBUG: message_size: %ld\n", message_size);
         telem_debug("DEBUG: cfg_info_size: %ld\n", cfg_info_size);
@@ -367,84 +1138,302 @@ static void process_record(TelemDaemon *daemon, client *cl)
         /* Check message size bounds */
         if (message_size <= 0 || message_size > MAX_PAYLOAD_LENGTH) {
                 telem_log(LOG_INFO, "Record message size out of bounds\n");
-                return;
+                goto invalid;
         }
         msg = (char *)buf + sizeof(uint32_t);
 
-        /* Copying the headers as strtok modifies the orginal buffer */
-        temp_headers = strndup(msg, header_size);
-        tok = strtok(temp_headers, "\n");
-
-        for (i = 0; i < NUM_HEADERS; i++) {
-                const char *header_name = get_header_name(i);
-
-                if (get_header(tok, header_name, &headers[i])) {
-                        if (strcmp(header_name, TM_MACHINE_ID_STR) == 0) {
-                                machine_id_replace(&headers[i], daemon->machine_id_override);
-                        }
-
-                        tok = strtok(NULL, "\n");
-                } else {
-                        telem_log(LOG_ERR, "process_record: Incorrect headers in record\n");
-                        goto end;
-                }
+        /* The headers are referred to in place, and written out as they are
+         * except for the machine id */
+        if (!parse_headers(msg, header_size, views)) {
+                telem_log(LOG_ERR, "process_record: Incorrect headers in record\n");
+                goto invalid;
         }
         /* TODO : check if the body is within the limits. */
         body = msg + header_size;
 
         /* Save record to stage */
-        ret = asprintf(&recordpath, "%s/XXXXXX", spool_dir_config());
-        if (ret == -1) {
-                telem_log(LOG_ERR, "Failed to allocate memory for record name in staging folder, aborting\n");
+        stage_record(daemon, staging, msg, views, body, cfg_file);
+        stats_histogram_add(&daemon->stats.process_latency,
+                            stats_now_us() - start_us);
+        return;
+
+invalid:
+        stats_add(&daemon->stats.records_invalid, 1);
+}
+
+static void work_record(void *arg, struct staging *staging, uint8_t *record,
+                        size_t size)
+{
+        TelemDaemon *daemon = arg;
+        size_t inflight;
+
+        process_record(daemon, staging, record, size);
+
+        /* The record's cell in the queue is free already */
+        inflight = __atomic_sub_fetch(&daemon->inflight, size, __ATOMIC_SEQ_CST);
+        if ((daemon->inflight_max == 0 || inflight < daemon->inflight_max) &&
+            __atomic_exchange_n(&daemon->inflight_waiting, false, __ATOMIC_SEQ_CST)) {
+                /* Clients wait for room */
+                uint64_t one = 1;
+                ssize_t unused __attribute__((unused));
+
+                unused = write(daemon->drain_efd, &one, sizeof(one));
+        }
+}
+
+/**
+ * Copy a record and queue it for the worker of its client, in the room
+ * reserved for it
+ *
+ * @param daemon The daemon
+ * @param cl The client the record came from
+ * @param record The record, without its size
+ * @param size The length of the record
+ */
+static void submit_record(TelemDaemon *daemon, client *cl, const uint8_t *record,
+                          size_t size)
+{
+        struct record_job *job;
+
+        job = malloc(sizeof(struct record_job) + size);
+        if (!job) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
                 exit(EXIT_FAILURE);
         }
+        job->size = size;
+        memcpy(job->data, record, size);
 
-        stage_record(recordpath, headers, body, cfg_file);
-        free(recordpath);
-end:
-        free(temp_headers);
-        for (int k = 0; k < i; k++)
-                free(headers[k]);
-        return;
+        __atomic_add_fetch(&daemon->inflight, size, __ATOMIC_SEQ_CST);
+        worker_pool_submit(&daemon->workers, (unsigned int)cl->fd, job);
 }
 
-void add_pollfd(TelemDaemon *daemon, int fd, short events)
+int start_workers(TelemDaemon *daemon, int nworkers)
 {
-        assert(daemon);
-        assert(fd >= 0);
+        return worker_pool_start(&daemon->workers, nworkers, work_record, daemon);
+}
 
-        if (!daemon->pollfds) {
-                daemon->pollfds = (struct pollfd *)malloc(sizeof(struct pollfd));
-                if (!daemon->pollfds) {
-                        telem_log(LOG_ERR, "Unable to allocate memory for"
-                                  " pollfds array, exiting\n");
-                        exit(EXIT_FAILURE);
+void stop_workers(TelemDaemon *daemon)
+{
+        worker_pool_stop(&daemon->workers);
+}
+
+void configure_quotas(TelemDaemon *daemon)
+{
+        int64_t byte_rate = peer_byte_rate_config();
+        int64_t inflight_max = inflight_max_size_config();
+
+        /* Both are configured in KiB */
+        peer_table_configure(&daemon->peers, peer_record_rate_config(),
+                             byte_rate > 0 ? byte_rate * 1024 : 0);
+        daemon->inflight_max = inflight_max > 0 ? (size_t)inflight_max * 1024 : 0;
+}
+
+void resume_clients(TelemDaemon *daemon)
+{
+        client_list_head ready;
+        client *cl;
+        client *next;
+        uint64_t count;
+        int64_t now_ms;
+        bool drained;
+
+        /* Clear the wakeup from the workers, if any. Clients waiting for
+         * room in a worker's queue are only resumed after one. */
+        drained = read(daemon->drain_efd, &count, sizeof(count)) == sizeof(count);
+
+        if (LIST_EMPTY(&daemon->paused_clients)) {
+                return;
+        }
+
+        now_ms = peer_table_now_ms();
+        drained = drained || (daemon->inflight_max > 0 &&
+                              __atomic_load_n(&daemon->inflight, __ATOMIC_SEQ_CST) <
+                              daemon->inflight_max);
+
+        /* Clients paused again while they are resumed wait for the next
+         * call */
+        LIST_INIT(&ready);
+        for (cl = LIST_FIRST(&daemon->paused_clients); cl != NULL; cl = next) {
+                next = LIST_NEXT(cl, paused_ptrs);
+                if (cl->resume_at == 0 ? drained : now_ms >= cl->resume_at) {
+                        LIST_REMOVE(cl, paused_ptrs);
+                        LIST_INSERT_HEAD(&ready, cl, paused_ptrs);
                 }
-                daemon->current_alloc = sizeof(struct pollfd);
-        } else {
-                /* Reallocate here */
-                if (!reallocate((void **)&(daemon->pollfds),
-                                &(daemon->current_alloc),
-                                ((daemon->nfds + 1) * sizeof(struct pollfd)))) {
-                        telem_log(LOG_ERR, "Unable to realloc, exiting\n");
-                        exit(EXIT_FAILURE);
+        }
+
+        while ((cl = LIST_FIRST(&ready)) != NULL) {
+                LIST_REMOVE(cl, paused_ptrs);
+                cl->paused = false;
+                add_epoll_fd(daemon, cl->fd, EPOLLIN | EPOLLPRI, &cl->sock_watch);
+                if (cl->ring.hdr != NULL) {
+                        add_epoll_fd(daemon, cl->ring.efd, EPOLLIN, &cl->ring_watch);
+                }
+
+                /* epoll does not report the records buffered already */
+                handle_client(daemon, cl);
+                if (cl->fd >= 0 && !cl->paused && cl->ring.hdr != NULL) {
+                        handle_ring(daemon, cl);
+                }
+        }
+}
+
+int paused_clients_timeout(TelemDaemon *daemon, int timeout_ms)
+{
+        int64_t now_ms;
+        client *cl;
+
+        if (LIST_EMPTY(&daemon->paused_clients)) {
+                return timeout_ms;
+        }
+
+        now_ms = peer_table_now_ms();
+        LIST_FOREACH(cl, &daemon->paused_clients, paused_ptrs) {
+                int64_t wait_ms;
+
+                /* The workers wake up the others through drain_efd */
+                if (cl->resume_at == 0) {
+                        continue;
+                }
+                wait_ms = cl->resume_at > now_ms ? cl->resume_at - now_ms : 0;
+                if (timeout_ms < 0 || wait_ms < timeout_ms) {
+                        timeout_ms = (int)wait_ms;
                 }
         }
 
-        daemon->pollfds[daemon->nfds].fd = fd;
-        daemon->pollfds[daemon->nfds].events = events;
-        daemon->pollfds[daemon->nfds].revents = 0;
+        return timeout_ms;
+}
+
+/**
+ * Write the counters of the daemon for the stats endpoint
+ *
+ * @param arg The daemon
+ * @param buf The text of the endpoint
+ */
+static void print_stats(void *arg, struct stats_buf *buf)
+{
+        TelemDaemon *daemon = arg;
+        struct probe_stats *st = &daemon->stats;
+        uint64_t throttled = 0;
+        uint64_t rejected = 0;
+        size_t npaused = 0;
+        bool stream_connected;
+        struct peer *peer;
+        client *cl;
+
+        pthread_mutex_lock(&daemon->stream_lock);
+        stream_connected = daemon->stream_fd >= 0;
+        pthread_mutex_unlock(&daemon->stream_lock);
+
+        LIST_FOREACH(peer, &daemon->peers.peers, peer_ptrs) {
+                throttled += peer->stats.throttled;
+                rejected += peer->stats.rejected;
+        }
+        LIST_FOREACH(cl, &daemon->paused_clients, paused_ptrs) {
+                npaused++;
+        }
+
+        stats_print_metric(buf, "telemprobd_records_received_total", "counter",
+                           "Records admitted from clients",
+                           (int64_t)st->records_received);
+        stats_print_metric(buf, "telemprobd_bytes_received_total", "counter",
+                           "Size of the records admitted from clients",
+                           (int64_t)st->bytes_received);
+        stats_print_metric(buf, "telemprobd_records_streamed_total", "counter",
+                           "Records sent to telempostd on the record stream",
+                           (int64_t)stats_load(&st->records_streamed));
+        stats_print_metric(buf, "telemprobd_bytes_streamed_total", "counter",
+                           "Size of the records sent on the record stream",
+                           (int64_t)stats_load(&st->bytes_streamed));
+        stats_print_metric(buf, "telemprobd_records_staged_total", "counter",
+                           "Records written to the spool directory",
+                           (int64_t)stats_load(&st->records_staged));
+        stats_print_metric(buf, "telemprobd_bytes_staged_total", "counter",
+                           "Size of the records written to the spool directory",
+                           (int64_t)stats_load(&st->bytes_staged));
+
+        stats_printf(buf, "# HELP telemprobd_records_dropped_total Records"
+                     " dropped, by reason\n"
+                     "# TYPE telemprobd_records_dropped_total counter\n");
+        stats_printf(buf, "telemprobd_records_dropped_total{reason=\"invalid\"}"
+                     " %" PRIu64 "\n", stats_load(&st->records_invalid));
+        stats_printf(buf, "telemprobd_records_dropped_total{reason=\"quota\"}"
+                     " %" PRIu64 "\n", rejected);
+        stats_printf(buf, "telemprobd_records_dropped_total{reason=\"stage_error\"}"
+                     " %" PRIu64 "\n", stats_load(&st->stage_errors));
+
+        stats_print_metric(buf, "telemprobd_throttled_total", "counter",
+                           "Times a client was held back by its quotas",
+                           (int64_t)throttled);
+        stats_print_metric(buf, "telemprobd_clients", "gauge",
+                           "Clients connected", (int64_t)daemon->nclients);
+        stats_print_metric(buf, "telemprobd_paused_clients", "gauge",
+                           "Clients held back by their quotas or by the workers",
+                           (int64_t)npaused);
+        stats_print_metric(buf, "telemprobd_inflight_bytes", "gauge",
+                           "Size of the records queued for the workers",
+                           (int64_t)__atomic_load_n(&daemon->inflight,
+                                                    __ATOMIC_RELAXED));
+        stats_print_metric(buf, "telemprobd_stream_connected", "gauge",
+                           "Whether the record stream to telempostd is open",
+                           stream_connected);
+
+        stats_printf(buf, "# HELP telemprobd_peer_records_total Records admitted,"
+                     " by user\n"
+                     "# TYPE telemprobd_peer_records_total counter\n");
+        LIST_FOREACH(peer, &daemon->peers.peers, peer_ptrs) {
+                stats_printf(buf, "telemprobd_peer_records_total{uid=\"%u\"}"
+                             " %" PRIu64 "\n", (unsigned)peer->uid,
+                             peer->stats.records);
+        }
+        stats_printf(buf, "# HELP telemprobd_peer_throttled_total Times the"
+                     " clients of a user were held back by its quotas\n"
+                     "# TYPE telemprobd_peer_throttled_total counter\n");
+        LIST_FOREACH(peer, &daemon->peers.peers, peer_ptrs) {
+                stats_printf(buf, "telemprobd_peer_throttled_total{uid=\"%u\"}"
+                             " %" PRIu64 "\n", (unsigned)peer->uid,
+                             peer->stats.throttled);
+        }
+
+        stats_print_histogram(buf, "telemprobd_queue_latency_seconds",
+                              "Time records wait for a worker",
+                              &daemon->workers.queue_latency);
+        stats_print_histogram(buf, "telemprobd_process_latency_seconds",
+                              "Time to validate a record and hand it over",
+                              &st->process_latency);
+        stats_print_histogram(buf, "telemprobd_stream_latency_seconds",
+                              "Time to send a record on the record stream",
+                              &st->stream_latency);
+        stats_print_histogram(buf, "telemprobd_stage_latency_seconds",
+                              "Time to write a record to the spool directory",
+                              &st->stage_latency);
+}
+
+void serve_stats(TelemDaemon *daemon)
+{
+        stats_serve(daemon->stats_fd, print_stats, daemon);
+}
+
+void add_epoll_fd(TelemDaemon *daemon, int fd, uint32_t events, daemon_watch *watch)
+{
+        struct epoll_event ev = { .events = events, .data.ptr = watch };
+
+        assert(daemon);
+        assert(fd >= 0);
+
+        if (epoll_ctl(daemon->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                telem_perror("Unable to add fd to epoll instance");
+                exit(EXIT_FAILURE);
+        }
         daemon->nfds++;
 }
 
-void del_pollfd(TelemDaemon *daemon, nfds_t i)
+void del_epoll_fd(TelemDaemon *daemon, int fd)
 {
         assert(daemon);
-        assert(i < daemon->nfds);
 
-        if (i < daemon->nfds - 1) {
-                memmove(&(daemon->pollfds[i]), &(daemon->pollfds[i + 1]),
-                        (sizeof(struct pollfd) * (daemon->nfds - i - 1)));
+        if (epoll_ctl(daemon->epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+                telem_perror("Unable to remove fd from epoll instance");
+                return;
         }
         daemon->nfds--;
 }
@@ -515,11 +1504,12 @@ rand_err:
         return result;
 }
 
-int update_machine_id()
+int update_machine_id(TelemDaemon *daemon)
 {
         int result = 0;
         struct stat buf;
         int ret = 0;
+        bool changed = false;
 
         char *machine_id_filename = TM_MACHINE_ID_FILE;
         ret = stat(machine_id_filename, &buf);
@@ -528,6 +1518,7 @@ int update_machine_id()
                 if (errno == ENOENT) {
                         telem_log(LOG_INFO, "Machine id file does not exist\n");
                         result = generate_machine_id();
+                        changed = true;
                 } else {
                         telem_log(LOG_ERR, "Unable to stat machine id file\n");
                         result = -1;
@@ -538,8 +1529,16 @@ int update_machine_id()
                 if ((current_time - buf.st_mtime) > TM_MACHINE_ID_EXPIRY) {
                         telem_log(LOG_INFO, "Machine id file has expired\n");
                         result = generate_machine_id();
+                        changed = true;
                 }
         }
+
+        /* The id only changes here, so the copy used for records is read
+         * again only then, or if it could not be read before */
+        if (changed || !daemon->machine_id_cached) {
+                cache_machine_id(daemon);
+        }
+
         return result;
 }
 
@@ -18,43 +18,181 @@
 #define _GNU_SOURCE     /* for strchrnul() */
 #define __STDC_FORMAT_MACROS    /* for PRIu64 */
 
-#include <poll.h>
+#include <sys/epoll.h>
 #include <sys/queue.h>
+#include <sys/types.h>
 #include <stdbool.h>
 #include <inttypes.h>
 
+#include "buffer_pool.h"
+#include "common.h"
+#include "mem_policy.h"
+#include "peer_table.h"
+#include "shm_ring.h"
+#include "staging.h"
+#include "stats.h"
+#include "worker_pool.h"
+
 #define TM_MACHINE_ID_EXPIRY (3 /*d*/ * 24 /*h*/ * 60 /*m*/ * 60 /*s*/)
 
 #define TM_MACHINE_ID_FILE LOCALSTATEDIR "/lib/telemetry/machine_id"
 
 #define TM_MACHINE_ID_OVERRIDE "/etc/telemetrics/opt-in-static-machine-id"
 
+#define TM_MACHINE_ID_LEN 32
+
 #define TM_REFRESH_RATE (1 /*h*/ * 60 /*m*/ * 60 /*s*/)
 
 #define TM_RATE_LIMIT_SLOTS (1 /*h*/ * 60 /*m*/)
 
 #define TM_RECORD_COUNTER (1)
 
+struct client;
+
+/* What an epoll event refers to */
+enum watch_type {
+        WATCH_SIGNAL,
+        WATCH_LISTENER,
+        WATCH_CLIENT,
+        WATCH_RING,
+        WATCH_DRAIN,
+        WATCH_STATS
+};
+
+/* Stored in the epoll_data of each registered fd, so that events are
+ * dispatched without looking anything up */
+typedef struct daemon_watch {
+        enum watch_type type;
+        struct client *cl;
+} daemon_watch;
+
+/* Position of a header line within the header block of a record */
+struct header_view {
+        size_t offset;
+        size_t len;
+};
+
+/* Framing state of a client connection */
+enum client_state {
+        /* Waiting for the size field of the next record */
+        CLIENT_READ_SIZE,
+        /* Waiting for the rest of a record whose size is known */
+        CLIENT_READ_BODY
+};
+
 typedef struct client {
         int fd;
+        enum client_state state;
+        /* Receive buffer, taken from the daemon's pool while a record is
+         * being received */
         uint8_t *buf;
+        /* Bytes allocated for buf */
+        size_t alloc;
+        /* Bytes received into buf and not yet processed */
         size_t offset;
+        /* Size of the record being received, in CLIENT_READ_BODY */
         size_t size;
+        /* Credentials of the peer, recorded when it connects */
+        pid_t pid;
+        uid_t uid;
+        /* Accounts the client's records against the quotas of its user */
+        struct peer *peer;
+        /* Set while the client is held back, with its socket and ring left
+         * out of epoll, until resume_at (ms of CLOCK_MONOTONIC), or until
+         * the workers catch up if resume_at is 0 */
+        bool paused;
+        int64_t resume_at;
+        /* Shared memory ring, if the client asked for one */
+        struct shm_ring ring;
+        /* epoll registrations of the socket and of the ring's eventfd */
+        daemon_watch sock_watch;
+        daemon_watch ring_watch;
+        /* Link in the list of terminated clients waiting to be freed */
         LIST_ENTRY(client) client_ptrs;
+        /* Link in the list of paused clients */
+        LIST_ENTRY(client) paused_ptrs;
 } client;
 
 typedef LIST_HEAD (client_list_head, client) client_list_head;
 
+/* Counters of the stats endpoint. Those updated by the workers are only
+ * accessed with stats_add() and stats_load(). */
+struct probe_stats {
+        /* Records admitted from the clients, and their size */
+        uint64_t records_received;
+        uint64_t bytes_received;
+        /* Records handed to telempostd on the record stream */
+        uint64_t records_streamed;
+        uint64_t bytes_streamed;
+        /* Records written to the spool directory */
+        uint64_t records_staged;
+        uint64_t bytes_staged;
+        /* Records dropped because they were invalid, or could not be
+         * staged */
+        uint64_t records_invalid;
+        uint64_t stage_errors;
+        /* Time to validate a record and hand it over, and the part of it
+         * spent sending the record on the stream or writing it to disk */
+        struct stats_histogram process_latency;
+        struct stats_histogram stream_latency;
+        struct stats_histogram stage_latency;
+};
+
 typedef struct TelemDaemon {
-        /* array of fd's being polled */
-        struct pollfd  *pollfds;
-        /* number of fds being polled */
-        nfds_t nfds;
-        /* current number of allocated fds */
-        size_t current_alloc;
-        /* client list head */
-        client_list_head client_head;
+        /* epoll instance for the signalfd, listening socket and clients */
+        int epoll_fd;
+        /* number of fds registered with epoll */
+        size_t nfds;
+        /* clients, indexed by socket fd */
+        client **clients;
+        /* current number of bytes allocated for clients */
+        size_t clients_alloc;
+        /* number of clients in the table */
+        size_t nclients;
+        /* clients terminated while handling events, freed by reap_clients() */
+        client_list_head dead_clients;
+        /* clients held back, resumed by resume_clients() */
+        client_list_head paused_clients;
+        /* Users of the clients, and their quotas */
+        struct peer_table peers;
+        /* Bytes of records queued for the workers, and the most allowed, or
+         * 0 for no limit */
+        size_t inflight;
+        size_t inflight_max;
+        /* Set while clients wait for the workers to catch up, or for room
+         * in a worker's queue. The workers then signal drain_efd once they
+         * are below the limit. */
+        bool inflight_waiting;
+        int drain_efd;
+        /* Where records are copied out of shared memory rings */
+        uint8_t *ring_record;
+        /* Receive buffers not used by any client */
+        struct buffer_pool pool;
+        /* When to trim the heap, and the memory and CPU counters */
+        struct mem_policy mem;
+        /* Where records are written for telempostd */
+        struct staging staging;
+        /* Connection to telempostd's record stream, or -1, and when to try
+         * connecting again */
+        int stream_fd;
+        time_t stream_retry;
+        /* Threads validating and staging records, if any */
+        struct worker_pool workers;
+        /* Counters of the stats endpoint, and its listening socket, or -1 */
+        struct probe_stats stats;
+        int stats_fd;
+        /* Guard the stream connection and the machine id header, which
+         * workers use */
+        pthread_mutex_t stream_lock;
+        pthread_mutex_t machine_id_lock;
         char *machine_id_override;
+        /* Machine id written into staged records, and its header line. They
+         * are read from disk only when the id changes. */
+        char machine_id[TM_MACHINE_ID_LEN + 1];
+        char machine_id_header[sizeof(TM_MACHINE_ID_STR) + 2 + TM_MACHINE_ID_LEN];
+        /* false if machine_id holds a placeholder, because the id could not
+         * be read */
+        bool machine_id_cached;
 } TelemDaemon;
 
 /**
@@ -65,65 +203,144 @@ typedef struct TelemDaemon {
 void initialize_probe_daemon(TelemDaemon *daemon);
 
 /**
- * Add poll fd struct to the array of pollfds.
+ * Register a file descriptor with the daemon's epoll instance.
  *
  * @param daemon The pointer to the daemon struct
  * @param fd The file descriptor to add
- * @param events The events to poll for
+ * @param events The epoll events to wait for
+ * @param watch Returned with the events of fd. It must stay valid until fd is
+ *    removed.
+ *
+ */
+void add_epoll_fd(TelemDaemon *daemon, int fd, uint32_t events, daemon_watch *watch);
+
+/**
+ * Unregister a file descriptor from the daemon's epoll instance.
+ *
+ * @param daemon The pointer to the daemon
+ * @param fd The file descriptor to remove
  *
  */
-void add_pollfd(TelemDaemon *daemon, int fd, short events);
+void del_epoll_fd(TelemDaemon *daemon, int fd);
 
 /**
- *  Delete poll fd struct at index i of the array
+ * Handle data received on a client connection. All complete records
+ * available on the connection are processed. The client is kept open if it
+ * may send more records, and terminated when it closes the connection or an
+ * error occurs. A terminated client stays allocated until reap_clients() is
+ * called, since more of its events may be pending.
  *
  * @param daemon The pointer to the daemon
- * @param i The index of the file decriptor to be deleted
+ * @param cl Pointer to the client structure in the client table
  *
+ * @return true on success, false on failure
  */
-void del_pollfd(TelemDaemon *daemon, nfds_t i);
+bool handle_client(TelemDaemon *daemon, client *cl);
 
 /**
- * Handle data received on a client connection
+ * Handle records published in a client's shared memory ring, after its
+ * eventfd became readable. The client is terminated if the ring holds an
+ * invalid record.
  *
  * @param daemon The pointer to the daemon
- * @param ind The index of the client's file desciptor in the
- *    pollfd array
- * @param cl Pointer to the client structure in the client list
+ * @param cl Pointer to the client structure in the client table
  *
  * @return true on success, false on failure
  */
-bool handle_client(TelemDaemon *daemon, nfds_t ind, client *cl);
+bool handle_ring(TelemDaemon *daemon, client *cl);
+
+/**
+ * Stop reading a client's shared memory ring, after processing the records
+ * published so far, and unregister its eventfd. Does nothing if the client
+ * has no ring. With workers, this waits for room in the queue of the
+ * client's worker, so that the records stay in order.
+ *
+ * @param daemon The pointer to the daemon
+ * @param cl Pointer to the client structure in the client table
+ */
+void close_client_ring(TelemDaemon *daemon, client *cl);
 
 /**
- *  Add a client to the client list
+ *  Add a client to the client table. Its socket is not registered with
+ *  epoll; use add_epoll_fd() with the client's sock_watch for that.
  *
- * @param client_head Pointer to the head of the client list
- *    maintained by the daamon
- * @param fd File descriptor to be added to the client list
+ * @param daemon The pointer to the daemon
+ * @param fd File descriptor of the client's connection
  *
  * @return Pointer to the client struct if successfully added,
  *    NULL otherwise
  */
-client *add_client(client_list_head *client_head, int fd);
+client *add_client(TelemDaemon *daemon, int fd);
+
+/**
+ * Look up a client by the file descriptor of its connection
+ *
+ * @param daemon The pointer to the daemon
+ * @param fd File descriptor of the client's connection
+ *
+ * @return Pointer to the client, or NULL if fd is not a client
+ */
+client *get_client(TelemDaemon *daemon, int fd);
 
 /**
- * Remove client from the client list
+ * Remove a client from the client table, close its connection and free it
  *
- * @param client_head Pointer to the client list head
+ * @param daemon The pointer to the daemon
  * @param cl Pointer to the client to be removed
  *
  */
-void remove_client(client_list_head *client_head, client *cl);
+void remove_client(TelemDaemon *daemon, client *cl);
+
+/**
+ * Free the clients terminated while handling the last batch of events
+ *
+ * @param daemon The pointer to the daemon
+ */
+void reap_clients(TelemDaemon *daemon);
 
 /**
- * Check if the client list is empty
+ * Check if the client table is empty
  *
- * @param client_head Pointer to the head of the client list
+ * @param daemon The pointer to the daemon
  *
  * @return  true if empty
  */
-bool is_client_list_empty(client_list_head *client_head);
+bool is_client_table_empty(TelemDaemon *daemon);
+
+/**
+ * Apply the quotas and the in-flight limit of the configuration
+ *
+ * @param daemon The pointer to the daemon
+ */
+void configure_quotas(TelemDaemon *daemon);
+
+/**
+ * Resume the paused clients whose quota allows their next record, or all
+ * those waiting for the workers once these caught up. Records the clients
+ * buffered are processed right away.
+ *
+ * @param daemon The pointer to the daemon
+ */
+void resume_clients(TelemDaemon *daemon);
+
+/**
+ * Shorten a poll timeout so that the daemon wakes up when the next paused
+ * client can be resumed
+ *
+ * @param daemon The pointer to the daemon
+ * @param timeout_ms The timeout the daemon would use otherwise, in ms
+ *
+ * @return The timeout to use, in ms
+ */
+int paused_clients_timeout(TelemDaemon *daemon, int timeout_ms);
+
+/**
+ * Answer the clients of the stats endpoint, after its socket became
+ * readable
+ *
+ * @param daemon The pointer to the daemon
+ */
+void serve_stats(TelemDaemon *daemon);
 
 /**
  * Get random machine id stored in file
@@ -133,11 +350,50 @@ bool is_client_list_empty(client_list_head *client_head);
 bool get_machine_id(char *machine_id);
 
 /**
- *  Update machine id periodically
+ * Start threads to validate and stage records, instead of the thread calling
+ * handle_client() and handle_ring()
+ *
+ * @param daemon The pointer to the daemon
+ * @param nworkers Number of threads. No thread is started for 0.
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int start_workers(TelemDaemon *daemon, int nworkers);
+
+/**
+ * Wait for the workers to stage the records queued, and stop them
+ *
+ * @param daemon The pointer to the daemon
+ */
+void stop_workers(TelemDaemon *daemon);
+
+/**
+ * Close the connection to telempostd's record stream. The next record
+ * connects again.
+ *
+ * @param daemon The pointer to the daemon
+ */
+void close_record_stream(TelemDaemon *daemon);
+
+/**
+ * Load the machine id used in staged records into the daemon, from the
+ * override if the daemon has one, or from the machine id file otherwise
+ *
+ * @param daemon The pointer to the daemon
+ *
+ * @return true if the id was read, false if a placeholder is used instead
+ */
+bool cache_machine_id(TelemDaemon *daemon);
+
+/**
+ *  Update machine id periodically, and the daemon's copy of it when it
+ *  changes
+ *
+ * @param daemon The pointer to the daemon
  *
  * @return 0 on success, -1 on failure
  */
-int update_machine_id(void);
+int update_machine_id(TelemDaemon *daemon);
 
 /**
  * Reads the machine id from the machine id override file if it exists.
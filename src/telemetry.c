@@ -27,12 +27,20 @@
 #include <errno.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <limits.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <poll.h>
+#include <semaphore.h>
+#include <signal.h>
 
 #include "util.h"
 #include "common.h"
+#include "payload.h"
+#include "mpmc_queue.h"
+#include "shm_ring.h"
 #include "configuration.h"
 #include "telemetry.h"
 #include "log.h"
@@ -86,68 +94,6 @@ static int set_header(char **dest, const char *prefix, char *value, size_t *head
 
 }
 
-/**
- * Sets the severity header.  Severity is clamped to a ranage of 1-4.
- *
- * @param t_ref Reference to a Telemetry record.
- * @param severity Severity of issue this telemetry record pertains to.
- *     Severity is clamped to a range of 1-4.
- *
- * @return 0 if successful, or a negative errno-style value if not.
- *
- */
-static int set_severity_header(struct telem_ref *t_ref, uint32_t severity)
-{
-        char *buf = NULL;
-        int status = 0;
-        int rc = 0;
-
-        /* clamp severity to 1-4 */
-
-        if (severity > 4) {
-                severity = 4;
-        }
-
-        if (severity < 1) {
-                severity = 1;
-        }
-
-        rc = asprintf(&buf, "%" PRIu32, severity);
-
-        if (rc < 0) {
-                return -ENOMEM;
-        } else {
-                status = set_header(&(t_ref->record->headers[TM_SEVERITY]),
-                                    TM_SEVERITY_STR, buf, &(t_ref->record->header_size));
-                free(buf);
-        }
-
-        return status;
-}
-
-/**
- * Sets the classification header.
- *
- * @param t_ref Reference to a Telemetry record.
- * @param classification Classification header is confirmed to
- *     to at least contain two / characters, and should be of the format
- *     <string>/<string>/<string>.
- *
- * @return 0 if successful, or a negative errno-style value if not.
- *
- */
-static int set_classification_header(struct telem_ref *t_ref, char *classification)
-{
-
-        if (validate_classification(classification) == 1) {
-                return -EINVAL;
-        }
-
-        return set_header(&(t_ref->record->headers[TM_CLASSIFICATION]),
-                          TM_CLASSIFICATION_STR, classification,
-                          &(t_ref->record->header_size));
-}
-
 /**
  * Sets the record_format header.The record_format is a constant that
  * defined in common.h, and identifies the format/structure of the
@@ -357,36 +303,6 @@ static int set_machine_id_header(struct telem_ref *t_ref)
         return status;
 }
 
-/**
- * Sets the header reporting the timestamp for the creation of the telemetry
- * record.
- *
- * @param t_ref Telemetry Record reference obtained from tm_create_record.
- *
- * @return 0 if successful, or a negative errno-style value if not.
- *
- */
-static int set_timestamp_header(struct telem_ref *t_ref)
-{
-
-        time_t *t = NULL;
-        char *buf;
-        int rc = 0;
-        int status = 0;
-
-        rc = asprintf(&buf, "%zd", time(t));
-
-        if (rc < 0) {
-                return -ENOMEM;
-        } else {
-                status = set_header(&(t_ref->record->headers[TM_TIMESTAMP]),
-                                    TM_TIMESTAMP_STR, buf, &(t_ref->record->header_size));
-                free(buf);
-        }
-
-        return status;
-}
-
 /**
  * Sets cpu model for telemetry record. The information from cpu is extracted
  * from /proc/cpuinfo, specifically "model name" attribute.
@@ -612,34 +528,6 @@ static int set_bios_version_header(struct telem_ref *t_ref)
         return status;
 }
 
-/**
- * Sets the event_id header, this id is an identifier that multiple
- * records can share. This means that one event can lead to multiple
- * records.
- *
- * @param t_ref Telemetry Record reference obtained from tm_create_record.
- *
- * @return 0 if successful, -1 on failure
- *
- */
-static int set_event_id_header(struct telem_ref *t_ref)
-{
-        int rc = 0;
-        char *buff = NULL;
-
-        rc = get_random_id(&buff);
-
-        if (rc == 0) {
-                rc = set_header(
-                        &(t_ref->record->headers[TM_EVENT_ID]),
-                        TM_EVENT_ID_STR, buff,
-                        &(t_ref->record->header_size));
-        }
-        free(buff);
-
-        return rc;
-}
-
 /**
  * Sets the hosttype header, which is a tuple of three values looked for
  * in the dmi filesystem.  System Vendor (sys_vendor), Product Name
@@ -743,204 +631,358 @@ static int set_kernel_version_header(struct telem_ref *t_ref)
         return status;
 }
 
+int tm_set_config_file(const char *c_file)
+{
+        return set_config_file(c_file);
+}
+
+/* Headers whose values describe the host rather than the record. They are
+ * built once per process and copied into every new record.
+ */
+static const int host_header_ids[] = {
+        TM_RECORD_VERSION,
+        TM_MACHINE_ID,
+        TM_ARCH,
+        TM_HOST_TYPE,
+        TM_SYSTEM_BUILD,
+        TM_KERNEL_VERSION,
+        TM_SYSTEM_NAME,
+        TM_BOARD_NAME,
+        TM_CPU_MODEL,
+        TM_BIOS_VERSION
+};
+
+#define NUM_HOST_HEADERS (sizeof(host_header_ids) / sizeof(host_header_ids[0]))
+
+/* Files whose change invalidates the cached host headers */
+static const char *host_stamp_files[] = {
+        TM_SITE_VERSION_FILE,
+        TM_DIST_VERSION_FILE,
+        "/sys/class/dmi/id"
+};
+
+#define NUM_HOST_STAMPS (sizeof(host_stamp_files) / sizeof(host_stamp_files[0]))
+
+struct file_stamp {
+        bool exists;
+        ino_t ino;
+        struct timespec mtime;
+};
+
+struct host_metadata {
+        struct telem_record record;
+        struct file_stamp stamps[NUM_HOST_STAMPS];
+        bool valid;
+};
+
+static struct host_metadata host_cache;
+static pthread_mutex_t host_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /**
- * Sets the payload format header, which is a probe-specific version number
- * for the format of the payload. This is a hint to the back-end that parses records.
- *
- * @param t_ref Telemetry Record reference obtained from tm_create_record.
- * @param payload_version Version number provided by probe.
+ * Takes a cheap snapshot (inode and mtime) of the files the host headers are
+ * read from, so that a change can be detected without re-reading them.
  *
- * @return 0 if successful, or a negative errno-style value if not.
+ * @param stamps Array of NUM_HOST_STAMPS entries to fill.
  *
  */
-static int set_payload_format_header(struct telem_ref *t_ref, uint32_t payload_version)
+static void get_host_stamps(struct file_stamp *stamps)
 {
-        char *buf = NULL;
-        int rc;
-        int status = 0;
-
-        rc = asprintf(&buf, "%" PRIu32, payload_version);
+        struct stat buf;
+
+        for (size_t i = 0; i < NUM_HOST_STAMPS; i++) {
+                memset(&stamps[i], 0, sizeof(struct file_stamp));
+                if (stat(host_stamp_files[i], &buf) == 0) {
+                        stamps[i].exists = true;
+                        stamps[i].ino = buf.st_ino;
+                        stamps[i].mtime = buf.st_mtim;
+                }
+        }
+}
 
-        if (rc < 0) {
-                return -ENOMEM;
-        } else {
-                status = set_header(
-                        &(t_ref->record->headers[TM_PAYLOAD_VERSION]),
-                        TM_PAYLOAD_VERSION_STR, buf,
-                        &(t_ref->record->header_size));
-                free(buf);
+static bool host_stamps_equal(struct file_stamp *a, struct file_stamp *b)
+{
+        for (size_t i = 0; i < NUM_HOST_STAMPS; i++) {
+                if (a[i].exists != b[i].exists || a[i].ino != b[i].ino ||
+                    a[i].mtime.tv_sec != b[i].mtime.tv_sec ||
+                    a[i].mtime.tv_nsec != b[i].mtime.tv_nsec) {
+                        return false;
+                }
         }
 
-        return status;
+        return true;
 }
 
-int tm_set_config_file(const char *c_file)
+static void free_host_metadata(void)
 {
-        return set_config_file(c_file);
+        for (int k = 0; k < NUM_HEADERS; k++) {
+                free(host_cache.record.headers[k]);
+                host_cache.record.headers[k] = NULL;
+        }
+        host_cache.record.header_size = 0;
+        host_cache.valid = false;
 }
 
 /**
- * Helper function for tm_create_record().  Allocate all of the headers
- * for a new telemetrics record. The parameters are passed through from
- * tm_create_record to this function.
- *
- * @param t_ref Telemetry Record reference obtained from tm_create_record.
- * @param severity Severity field value. Accepted values are in the range 1-4,
- *     with 1 being the lowest severity, and 4 being the highest severity.
- * @param classification Classification field value. It should have the form
- *     DOMAIN/PROBENAME/REST: DOMAIN is the reverse domain to use as a namespace
- *     for the probe (e.g. org.clearlinux); PROBENAME is the name of the probe;
- *     and REST is an arbitrary value that the probe should use to classify the
- *     record.
- * @param payload_version Payload format version. The only supported value right
- *     now is 1, which indicates that the payload is a freely-formatted
- *     (unstructured) string. Values greater than 1 are reserved for future use.
+ * Builds the host headers into the process-wide cache. Must be called with
+ * host_cache_lock held.
  *
+ * @param stamps Snapshot of the source files taken before reading them.
  *
  * @return 0 if successful, or a negative errno-style value if not.
  *
  */
-int allocate_header(struct telem_ref *t_ref, uint32_t severity,
-                    char *classification, uint32_t payload_version)
+static int build_host_metadata(struct file_stamp *stamps)
 {
-
-        int k, i = 0;
+        struct telem_ref ref = { &host_cache.record };
         int ret = 0;
 
-        /* The order we create the headers matters */
-
-        if ((ret = set_record_format_header(t_ref)) < 0) {
-                goto free_and_fail;
+        free_host_metadata();
+
+        if ((ret = set_record_format_header(&ref)) < 0 ||
+            (ret = set_machine_id_header(&ref)) < 0 ||
+            (ret = set_arch_header(&ref)) < 0 ||
+            (ret = set_host_type_header(&ref)) < 0 ||
+            (ret = set_system_build_header(&ref)) < 0 ||
+            (ret = set_kernel_version_header(&ref)) < 0 ||
+            (ret = set_system_name_header(&ref)) < 0 ||
+            (ret = set_board_name_header(&ref)) < 0 ||
+            (ret = set_cpu_model_header(&ref)) < 0 ||
+            (ret = set_bios_version_header(&ref)) < 0) {
+                free_host_metadata();
+                return ret;
         }
 
-        i++;
-
-        if ((ret = set_classification_header(t_ref, classification)) < 0) {
-                goto free_and_fail;
-        }
+        memcpy(host_cache.stamps, stamps, sizeof(host_cache.stamps));
+        host_cache.valid = true;
 
-        i++;
+        return 0;
+}
 
-        if ((ret = set_severity_header(t_ref, severity)) < 0) {
-                goto free_and_fail;
-        }
+/**
+ * Makes sure the cached host headers are up to date, rebuilding them if the
+ * cache is empty or if os-release or the dmi attributes have changed. Must be
+ * called with host_cache_lock held.
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ *
+ */
+static int refresh_host_metadata(void)
+{
+        struct file_stamp stamps[NUM_HOST_STAMPS];
 
-        i++;
+        get_host_stamps(stamps);
 
-        if ((ret = set_machine_id_header(t_ref)) < 0) {
-                goto free_and_fail;
+        if (!host_cache.valid || !host_stamps_equal(host_cache.stamps, stamps)) {
+                return build_host_metadata(stamps);
         }
 
-        i++;
+        return 0;
+}
 
-        if ((ret = set_timestamp_header(t_ref)) < 0) {
-                goto free_and_fail;
-        }
+__attribute__((destructor))
+static void release_host_metadata(void)
+{
+        free_host_metadata();
+}
 
-        i++;
+/* A record, its reference and all of its header strings share one
+ * allocation. The headers are stored back to back in the header block, each
+ * null-terminated, and record->headers[] points into it.
+ */
+struct record_block {
+        struct telem_ref ref;
+        struct telem_record record;
+        char header_block[];
+};
+
+/* Upper bound on the size of the per-record headers (see
+ * format_record_headers), including their null terminators.
+ */
+#define RECORD_HEADERS_MAX (MAX_CLASS_LENGTH + EVENT_ID_LEN + 5 * SMALL_LINE_BUF)
 
-        if ((ret = set_arch_header(t_ref)) < 0) {
-                goto free_and_fail;
-        }
+/* Position of a header inside a header block */
+struct header_span {
+        size_t offset;
+        size_t len;
+};
 
-        i++;
+/**
+ * Appends one "name: value\n" header to a header block under construction.
+ *
+ * @param buf The header block.
+ * @param used Bytes of buf in use. Updated on success.
+ * @param span Set to the position of the new header.
+ * @param prefix Identifies the header.
+ * @param value The value of this particular header.
+ *
+ * @return 0 if successful, or a negative errno-style value if the header does
+ *     not fit in RECORD_HEADERS_MAX bytes.
+ *
+ */
+static int append_header(char *buf, size_t *used, struct header_span *span,
+                         const char *prefix, const char *value)
+{
+        int rc;
 
-        if ((ret = set_host_type_header(t_ref)) < 0) {
-                goto free_and_fail;
+        rc = snprintf(buf + *used, RECORD_HEADERS_MAX - *used, "%s: %s\n",
+                      prefix, value);
+        if (rc < 0 || (size_t)rc >= RECORD_HEADERS_MAX - *used) {
+                return -EINVAL;
         }
 
-        i++;
+        span->offset = *used;
+        span->len = (size_t)rc;
+        *used += (size_t)rc + 1;
 
-        if ((ret = set_system_build_header(t_ref)) < 0) {
-                goto free_and_fail;
-        }
+        return 0;
+}
 
-        i++;
+/**
+ * Helper function for tm_create_record(). Formats the headers that are
+ * specific to a new record into a temporary header block. The parameters are
+ * passed through from tm_create_record to this function. Headers describing
+ * the host come from the process-wide cache instead.
+ *
+ * @param buf Header block of RECORD_HEADERS_MAX bytes.
+ * @param spans Positions of the headers in buf, indexed by header id. Only
+ *     the entries for the per-record headers are set.
+ * @param severity Severity field value. Accepted values are in the range 1-4,
+ *     with 1 being the lowest severity, and 4 being the highest severity.
+ * @param classification Classification field value. It should have the form
+ *     DOMAIN/PROBENAME/REST: DOMAIN is the reverse domain to use as a namespace
+ *     for the probe (e.g. org.clearlinux); PROBENAME is the name of the probe;
+ *     and REST is an arbitrary value that the probe should use to classify the
+ *     record.
+ * @param payload_version Payload format version. The only supported value right
+ *     now is 1, which indicates that the payload is a freely-formatted
+ *     (unstructured) string. Values greater than 1 are reserved for future use.
+ *
+ * @return The number of bytes used in buf, or a negative errno-style value if
+ *     not successful.
+ *
+ */
+static int format_record_headers(char *buf, struct header_span *spans,
+                                 uint32_t severity, char *classification,
+                                 uint32_t payload_version)
+{
+        char value[SMALL_LINE_BUF];
+        char event_id[RANDOM_ID_LEN + 1];
+        size_t used = 0;
+        int ret = 0;
 
-        if ((ret = set_kernel_version_header(t_ref)) < 0) {
-                goto free_and_fail;
+        if (validate_classification(classification) == 1) {
+                return -EINVAL;
         }
 
-        i++;
-
-        if ((ret = set_payload_format_header(t_ref, payload_version)) < 0) {
-                goto free_and_fail;
+        /* clamp severity to 1-4 */
+        if (severity > 4) {
+                severity = 4;
         }
 
-        i++;
-
-        if ((ret = set_system_name_header(t_ref)) < 0) {
-                goto free_and_fail;
+        if (severity < 1) {
+                severity = 1;
         }
 
-        i++;
-
-        if ((ret = set_board_name_header(t_ref)) < 0) {
-                goto free_and_fail;
+        if (format_random_id(event_id) != 0) {
+                return -EIO;
         }
 
-        i++;
-
-        if ((ret = set_cpu_model_header(t_ref)) < 0) {
-                goto free_and_fail;
+        if ((ret = append_header(buf, &used, &spans[TM_CLASSIFICATION],
+                                 TM_CLASSIFICATION_STR, classification)) < 0) {
+                return ret;
         }
 
-        i++;
-
-        if ((ret = set_bios_version_header(t_ref)) < 0) {
-                goto free_and_fail;
+        snprintf(value, sizeof(value), "%" PRIu32, severity);
+        if ((ret = append_header(buf, &used, &spans[TM_SEVERITY],
+                                 TM_SEVERITY_STR, value)) < 0) {
+                return ret;
         }
 
-        i++;
-
-        if ((ret = set_event_id_header(t_ref)) < 0) {
-                goto free_and_fail;
+        snprintf(value, sizeof(value), "%lld", (long long)time(NULL));
+        if ((ret = append_header(buf, &used, &spans[TM_TIMESTAMP],
+                                 TM_TIMESTAMP_STR, value)) < 0) {
+                return ret;
         }
 
-        i++; /* Not necessary, but including for future expansion */
-
-        return ret;
+        snprintf(value, sizeof(value), "%" PRIu32, payload_version);
+        if ((ret = append_header(buf, &used, &spans[TM_PAYLOAD_VERSION],
+                                 TM_PAYLOAD_VERSION_STR, value)) < 0) {
+                return ret;
+        }
 
-free_and_fail:
-        for (k = 0; k < i; k++) {
-                free(t_ref->record->headers[k]);
+        if ((ret = append_header(buf, &used, &spans[TM_EVENT_ID],
+                                 TM_EVENT_ID_STR, event_id)) < 0) {
+                return ret;
         }
-        return ret;
 
+        return (int)used;
 }
 
 int tm_create_record(struct telem_ref **t_ref, uint32_t severity,
                      char *classification, uint32_t payload_version)
 {
+        char record_headers[RECORD_HEADERS_MAX];
+        struct header_span spans[NUM_HEADERS];
+        struct record_block *block = NULL;
+        size_t record_used = 0;
+        size_t host_used = 0;
         int ret = 0;
 
-        *t_ref = (struct telem_ref *)malloc(sizeof(struct telem_ref));
-        if (*t_ref == NULL) {
-                telem_log(LOG_CRIT, "CRIT: Out of memory\n");
-                return -ENOMEM;
+        if ((ret = format_record_headers(record_headers, spans, severity,
+                                         classification, payload_version)) < 0) {
+                return ret;
         }
+        record_used = (size_t)ret;
 
-        (*t_ref)->record = (struct telem_record *)malloc(sizeof(struct telem_record));
-        if ((*t_ref)->record == NULL) {
+        pthread_mutex_lock(&host_cache_lock);
+
+        if ((ret = refresh_host_metadata()) < 0) {
+                goto out;
+        }
+
+        for (size_t i = 0; i < NUM_HOST_HEADERS; i++) {
+                int id = host_header_ids[i];
+
+                spans[id].len = strlen(host_cache.record.headers[id]);
+                spans[id].offset = record_used + host_used;
+                host_used += spans[id].len + 1;
+        }
+
+        block = (struct record_block *)malloc(sizeof(struct record_block) +
+                                              record_used + host_used);
+        if (block == NULL) {
                 telem_log(LOG_CRIT, "CRIT: Out of memory\n");
-                free(*t_ref);
-                return -ENOMEM;
+                ret = -ENOMEM;
+                goto out;
+        }
+
+        memcpy(block->header_block, record_headers, record_used);
+        for (size_t i = 0; i < NUM_HOST_HEADERS; i++) {
+                int id = host_header_ids[i];
+
+                memcpy(block->header_block + spans[id].offset,
+                       host_cache.record.headers[id], spans[id].len + 1);
         }
 
-        // Need to initialize header size, since it is only incremented elsewhere
-        (*t_ref)->record->header_size = 0;
+        block->record.header_size = 0;
+        for (int k = 0; k < NUM_HEADERS; k++) {
+                block->record.headers[k] = block->header_block + spans[k].offset;
+                block->record.header_size += spans[k].len;
+        }
 
         /* tm_set_payload() may not be called (e.g. in our test suite); in this
          * case, initialize the payload member to NULL so that we can properly
          * detect a non-NULL value in tm_free_record().
          */
-        (*t_ref)->record->payload = NULL;
+        block->record.payload = NULL;
+        block->record.payload_size = 0;
+        block->record.payload_borrowed = false;
 
-        /* Set up the headers */
-        if ((ret = allocate_header(*t_ref, severity, classification, payload_version)) < 0) {
-                free((*t_ref)->record);
-                free(*t_ref);
-        }
+        block->ref.record = &block->record;
+        *t_ref = &block->ref;
+
+out:
+        pthread_mutex_unlock(&host_cache_lock);
 
         return ret;
 }
@@ -957,46 +999,46 @@ int tm_create_record(struct telem_ref **t_ref, uint32_t severity,
 
 int payload_is_ascii(char *payload, size_t len)
 {
-        int i = 0;
-        int ret = 0;
-
-        for (i = 0; i < len; i++) {
-                if (!isprint(payload[i]) &&
-                    !isspace(payload[i])) {
-                        ret = -EINVAL;
-                        break;
-                }
-        }
-
-        return ret;
+        return payload_chars_valid(payload, len) ? 0 : -EINVAL;
 }
 
-// TODO: Consider simply setting a pointer to point to data provide in payload instead of copying it?
 int tm_set_payload(struct telem_ref *t_ref, char *payload)
 {
-        size_t payload_len;
-        int ret = 0;
+        return tm_set_payload_len(t_ref, payload, strlen((char *)payload), false);
+}
 
-        payload_len = strlen((char *)payload);
+int tm_set_payload_len(struct telem_ref *t_ref, char *payload, size_t len,
+                       bool borrow)
+{
+        char *data = payload;
 
-        if (payload_len > MAX_PAYLOAD_LENGTH) {
+        if (len > MAX_PAYLOAD_LENGTH) {
                 return -EINVAL;
         }
 
-        if (payload_is_ascii(payload, payload_len) != 0) {
+        if (payload_is_ascii(payload, len) != 0) {
                 return -EINVAL;
         }
 
-        t_ref->record->payload = strdup(payload);
+        if (!borrow) {
+                data = malloc(len + 1);
+                if (!data) {
+                        telem_log(LOG_CRIT, "CRIT: Out of memory\n");
+                        return -ENOMEM;
+                }
+                memcpy(data, payload, len);
+                data[len] = '\0';
+        }
 
-        if (!t_ref->record->payload) {
-                telem_log(LOG_CRIT, "CRIT: Out of memory\n");
-                return -ENOMEM;
+        if (t_ref->record->payload && !t_ref->record->payload_borrowed) {
+                free(t_ref->record->payload);
         }
 
-        t_ref->record->payload_size = payload_len;
+        t_ref->record->payload = data;
+        t_ref->record->payload_size = len;
+        t_ref->record->payload_borrowed = borrow;
 
-        return ret;
+        return 0;
 }
 
 /**
@@ -1038,70 +1080,147 @@ int tm_set_event_id(struct telem_ref *t_ref, char *event_id)
 
         if (!validate_event_id(event_id)) {
                 if (t_ref && t_ref->record) {
-                        // free default id before overriding
-                        free(t_ref->record->headers[TM_EVENT_ID]);
-                        // set new event_id
-                        if (asprintf(&(t_ref->record->headers[TM_EVENT_ID]),
-                                     "%s: %s\n", TM_EVENT_ID_STR, event_id) > 0) {
-                                rc = 0;
-                        }
+                        /* The new id has the same length as the default one,
+                         * so it replaces it in place in the header block.
+                         */
+                        memcpy(t_ref->record->headers[TM_EVENT_ID] +
+                               strlen(TM_EVENT_ID_STR ": "), event_id, EVENT_ID_LEN);
+                        rc = 0;
                 }
         }
 
         return rc;
 }
 
+/* Time to wait for telemprobd to drain the socket */
+#define TM_SOCKET_WRITE_TIMEOUT_MS 1000
+
+/* Waits in a row in which telemprobd reads nothing before giving up. It
+ * holds back clients over their user's quotas, or while its workers catch
+ * up, so a record may have to wait for a while. */
+#define TM_SOCKET_WRITE_RETRIES 30
+
+struct telem_session {
+        int fd;
+};
+
 /**
- * Write nbytes from buf to fd. Used to send records to telemprobd.
+ * Wait until the socket can accept more data.
  *
  * @param fd Socket fd obtained from tm_get_socket.
- * @param buf Data to be written to the socket.
- * @param nbytes Number of bytes to write out of buf.
  *
- * @return 0 if successful, or a negative errno-style value if not.
+ * @return 0 if the socket is writable, or a negative errno-style value if not.
  *
  */
-static int tm_write_socket(int fd, char *buf, size_t nbytes)
+static int tm_wait_writable(int fd)
 {
-        size_t nbytes_out = 0;
-        int k = 0;
-        int ret = 0;
+        struct pollfd pfd = { .fd = fd, .events = POLLOUT, .revents = 0 };
+        int res;
 
-        while (nbytes_out != nbytes) {
-                ssize_t b;
-                b = write(fd, buf + nbytes_out, nbytes - nbytes_out);
+        do {
+                res = poll(&pfd, 1, TM_SOCKET_WRITE_TIMEOUT_MS);
+        } while (res < 0 && errno == EINTR);
 
-                if (b == -1 && errno != EAGAIN) {
-                        ret = -errno;
-                        telem_perror("Error writing to daemon socket");
-                        return ret;
-                } else if (b == -1 &&
-                           (errno == EAGAIN || errno == EWOULDBLOCK)) {
-                        if (++k > 100) {
-                                ret = -errno;
-                                return ret;
-                        }
-                } else {
-                        nbytes_out += (size_t)b;
-                        k = 0;
-                }
+        if (res < 0) {
+                return -errno;
+        } else if (res == 0) {
+                return -ETIMEDOUT;
         }
 
-        return ret;
+        return 0;
 }
 
 /**
- * Obtain a file descriptor for a unix domain socket.
- * Connect to the socket in a non-blocking fashion.
+ * Write the data described by an iovec array to fd with as few system calls
+ * as possible. Used to send records to telemprobd.
  *
- * @return A valid file descriptor, or a negative errno-style value on error.
+ * @param fd Socket fd obtained from tm_get_socket.
+ * @param iov Array of buffers to write, in order. The array is modified to
+ *     track partial writes.
+ * @param iovcnt Number of entries in iov.
+ * @param nwritten If not NULL, set to the number of bytes written, which is
+ *     less than the total only if an error is returned.
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
  *
  */
-static int tm_get_socket(void)
+static int tm_writev_socket(int fd, struct iovec *iov, size_t iovcnt,
+                            size_t *nwritten)
 {
-        int sfd = -1;
+        struct msghdr msg = { 0 };
+        int timeouts = 0;
         int ret = 0;
-        struct sockaddr_un addr;
+
+        if (nwritten != NULL) {
+                *nwritten = 0;
+        }
+
+        /* Skip empty leading buffers so the loop ends when all are written */
+        while (iovcnt > 0 && iov->iov_len == 0) {
+                iov++;
+                iovcnt--;
+        }
+
+        while (iovcnt > 0) {
+                ssize_t b;
+
+                msg.msg_iov = iov;
+                msg.msg_iovlen = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+
+                /* MSG_NOSIGNAL: a daemon that went away must not kill the probe */
+                b = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+                if (b == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                        ret = tm_wait_writable(fd);
+                        if (ret == -ETIMEDOUT && ++timeouts < TM_SOCKET_WRITE_RETRIES) {
+                                ret = 0;
+                        } else if (ret < 0) {
+                                return ret;
+                        }
+                } else if (b == -1 && errno != EINTR) {
+                        ret = -errno;
+                        telem_perror("Error writing to daemon socket");
+                        return ret;
+                } else if (b > 0) {
+                        size_t written = (size_t)b;
+
+                        timeouts = 0;
+
+                        if (nwritten != NULL) {
+                                *nwritten += written;
+                        }
+
+                        while (iovcnt > 0 && written >= iov->iov_len) {
+                                written -= iov->iov_len;
+                                iov++;
+                                iovcnt--;
+                        }
+                        if (written > 0) {
+                                iov->iov_base = (char *)iov->iov_base + written;
+                                iov->iov_len -= written;
+                        }
+                        while (iovcnt > 0 && iov->iov_len == 0) {
+                                iov++;
+                                iovcnt--;
+                        }
+                }
+        }
+
+        return ret;
+}
+
+/**
+ * Obtain a file descriptor for a unix domain socket.
+ * Connect to the socket in a non-blocking fashion.
+ *
+ * @return A valid file descriptor, or a negative errno-style value on error.
+ *
+ */
+static int tm_get_socket(void)
+{
+        int sfd = -1;
+        int ret = 0;
+        struct sockaddr_un addr;
         long sflags = 0;
         int res = 0;
         struct timeval tv;
@@ -1210,29 +1329,41 @@ int tm_is_opted_in(void)
         return 1;
 }
 
-int tm_send_record(struct telem_ref *t_ref)
+/* Maximum number of iovec entries used to describe one record */
+#define TM_RECORD_IOVCNT (NUM_HEADERS + 6)
+
+/* Size fields of a record on the wire, referenced by its iovecs */
+struct tm_frame {
+        uint32_t record_size;
+        uint32_t header_size;
+};
+
+static char tm_record_terminator = '\0';
+
+/**
+ * Describe a record in the layout expected by telemprobd. The iovecs point
+ * directly at the record's headers and payload, so nothing is copied.
+ *
+ * @param t_ref The handle returned by tm_create_record().
+ * @param frame Storage for the size fields. It must outlive the iovecs.
+ * @param iov Array of at least TM_RECORD_IOVCNT entries, filled in on return.
+ * @param record_size Set to the number of bytes described by iov.
+ *
+ * @return The number of iovec entries used, or a negative errno-style value
+ *     if the record cannot be sent.
+ *
+ */
+static int tm_frame_record(struct telem_ref *t_ref, struct tm_frame *frame,
+                           struct iovec *iov, size_t *record_size)
 {
         int i;
-        size_t record_size = 0;
+        int iovcnt = 0;
         size_t total_size = 0;
-        int sfd;
-        char *data = NULL;
-        size_t offset = 0;
-        int ret = 0;
         size_t cfg_file_name_size = 0;
         const char *cfg_file_name = NULL;
 
-        if (tm_is_opted_in() == 0) {
-                // Bail early if opt-in is not existent
-                return -ECONNREFUSED;
-        }
-
-        sfd = tm_get_socket();
-
-        if (sfd < 0) {
-                telem_log(LOG_ERR, "Failed to get socket fd: %s\n",
-                          strerror(-sfd));
-                return sfd;
+        if (t_ref == NULL || t_ref->record == NULL) {
+                return -EINVAL;
         }
 
         total_size = t_ref->record->header_size + t_ref->record->payload_size;
@@ -1263,7 +1394,7 @@ int tm_send_record(struct telem_ref *t_ref)
         telem_debug("DEBUG: Total size : %zu\n", total_size);
 
         /*
-         * Allocating buffer for what we intend to send.  Buffer layout is:
+         * Layout of what we intend to send:
          * <uint32_t record_size>     : so recv knows how much to read
          * <custom cfg file field>    : optional
          * <uint32_t header_size>
@@ -1271,72 +1402,788 @@ int tm_send_record(struct telem_ref *t_ref)
          * <null-byte>
          * The additional char at the end ensures null termination
          */
-        record_size = (2 * sizeof(uint32_t)) + total_size + 1;
-
-        data = calloc(sizeof(char), record_size);
-        if (!data) {
-                telem_log(LOG_CRIT, "CRIT: Out of memory\n");
-                close(sfd);
-                return -ENOMEM;
-        }
+        *record_size = (2 * sizeof(uint32_t)) + total_size + 1;
+        frame->record_size = (uint32_t)*record_size;
+        frame->header_size = (uint32_t)t_ref->record->header_size;
 
-        memcpy(data, &record_size, sizeof(uint32_t));
-        offset += sizeof(uint32_t);
+        iov[iovcnt].iov_base = &frame->record_size;
+        iov[iovcnt++].iov_len = sizeof(uint32_t);
 
         if (cfg_file_name != NULL) {
-                memcpy(data + offset, CFG_PREFIX, CFG_PREFIX_LENGTH);
-                offset += CFG_PREFIX_LENGTH;
-                memcpy(data + offset, cfg_file_name, cfg_file_name_size);
-                offset += cfg_file_name_size;
+                iov[iovcnt].iov_base = CFG_PREFIX;
+                iov[iovcnt++].iov_len = CFG_PREFIX_LENGTH;
+                iov[iovcnt].iov_base = (char *)cfg_file_name;
+                iov[iovcnt++].iov_len = cfg_file_name_size;
         }
 
-        memcpy(data + offset, &t_ref->record->header_size, sizeof(uint32_t));
-        offset += sizeof(uint32_t);
+        iov[iovcnt].iov_base = &frame->header_size;
+        iov[iovcnt++].iov_len = sizeof(uint32_t);
 
-        size_t len = 0;
         for (i = 0; i < NUM_HEADERS; i++) {
-                len = strlen(t_ref->record->headers[i]);
-                memcpy(data + offset, t_ref->record->headers[i], len);
-                offset += len;
+                iov[iovcnt].iov_base = t_ref->record->headers[i];
+                iov[iovcnt++].iov_len = strlen(t_ref->record->headers[i]);
+        }
+
+        iov[iovcnt].iov_base = t_ref->record->payload;
+        iov[iovcnt++].iov_len = t_ref->record->payload_size;
+
+        iov[iovcnt].iov_base = &tm_record_terminator;
+        iov[iovcnt++].iov_len = 1;
+
+        return iovcnt;
+}
+
+/* Time to wait before asking telemprobd for a ring again after a failure */
+#define TM_RING_RETRY_SECS 60
+
+/* Shared memory ring obtained from telemprobd, see shm_ring.h. Senders take
+ * the lock for reading, so they can push concurrently; it is taken for
+ * writing only to set up or tear down the ring. */
+static struct {
+        pthread_rwlock_t lock;
+        struct shm_ring ring;
+        int sfd;                        /* connection the ring is bound to */
+        time_t retry_after;
+} tm_ring = {
+        .lock = PTHREAD_RWLOCK_INITIALIZER,
+        .ring = { .hdr = NULL, .efd = -1 },
+        .sfd = -1,
+        .retry_after = 0,
+};
+
+/**
+ * Check that telemprobd still holds the other end of the ring's connection.
+ * The daemon never writes to it after the handshake, so any event means it
+ * went away.
+ *
+ * @return true if the connection is still open.
+ *
+ */
+static bool tm_ring_alive(void)
+{
+        struct pollfd pfd = { .fd = tm_ring.sfd, .events = POLLIN | POLLRDHUP };
+
+        return poll(&pfd, 1, 0) == 0;
+}
+
+/**
+ * Unmap the ring and close its connection. Called with the lock held for
+ * writing.
+ *
+ */
+static void tm_ring_reset(void)
+{
+        shm_ring_detach(&tm_ring.ring);
+        if (tm_ring.sfd >= 0) {
+                close(tm_ring.sfd);
+                tm_ring.sfd = -1;
+        }
+}
+
+/**
+ * The ring and its connection belong to the parent, which telemprobd
+ * identified with SO_PEERCRED. A forked child asks for its own ring.
+ *
+ */
+static void tm_ring_atfork_child(void)
+{
+        pthread_rwlock_init(&tm_ring.lock, NULL);
+        tm_ring_reset();
+        tm_ring.retry_after = 0;
+}
+
+static void tm_ring_register_atfork(void)
+{
+        pthread_atfork(NULL, NULL, tm_ring_atfork_child);
+}
+
+/**
+ * Ask telemprobd for a ring, and map it. Called with the lock held for
+ * writing.
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ *
+ */
+static int tm_ring_connect(void)
+{
+        static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+        uint32_t request = TM_RING_REQUEST;
+        uint32_t reply = 0;
+        struct iovec iov = { .iov_base = &request, .iov_len = sizeof(request) };
+        union {
+                char buf[CMSG_SPACE(2 * sizeof(int))];
+                struct cmsghdr align;
+        } control;
+        struct msghdr msg = { 0 };
+        struct cmsghdr *cmsg;
+        struct pollfd pfd;
+        int fds[2] = { -1, -1 };
+        ssize_t len;
+        int sfd;
+        int ret;
+
+        pthread_once(&atfork_once, tm_ring_register_atfork);
+
+        if ((sfd = tm_get_socket()) < 0) {
+                return sfd;
+        }
+
+        if ((ret = tm_writev_socket(sfd, &iov, 1, NULL)) < 0) {
+                goto out_close;
+        }
+
+        pfd.fd = sfd;
+        pfd.events = POLLIN;
+        do {
+                ret = poll(&pfd, 1, TM_SOCKET_WRITE_TIMEOUT_MS);
+        } while (ret < 0 && errno == EINTR);
+        if (ret <= 0) {
+                ret = ret < 0 ? -errno : -ETIMEDOUT;
+                goto out_close;
+        }
+
+        iov.iov_base = &reply;
+        iov.iov_len = sizeof(reply);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        len = recvmsg(sfd, &msg, MSG_CMSG_CLOEXEC);
+        if (len < 0) {
+                ret = -errno;
+                goto out_close;
+        }
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int))) {
+                memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        }
+
+        /* A daemon without ring support, or with the transport disabled,
+         * closes the connection instead of answering */
+        if (len != sizeof(reply) || reply != TM_RING_REQUEST || fds[0] < 0) {
+                ret = -EPROTO;
+                goto out_fds;
+        }
+
+        ret = shm_ring_attach(&tm_ring.ring, fds[0], fds[1]);
+        close(fds[0]);
+        if (ret < 0) {
+                close(fds[1]);
+                goto out_close;
+        }
+
+        tm_ring.sfd = sfd;
+        telem_log(LOG_INFO, "Using shared memory ring to send records\n");
+
+        return 0;
+
+out_fds:
+        for (int i = 0; i < 2; i++) {
+                if (fds[i] >= 0) {
+                        close(fds[i]);
+                }
+        }
+out_close:
+        close(sfd);
+        return ret;
+}
+
+/**
+ * Write a framed record into the shared memory ring, setting the ring up
+ * first if needed.
+ *
+ * @param iov Buffers holding the framed record.
+ * @param iovcnt Number of entries in iov.
+ * @param len Total number of bytes described by iov.
+ *
+ * @return 0 if successful, or a negative errno-style value if the record
+ *     has to be sent over the socket instead.
+ *
+ */
+static int tm_ring_send(const struct iovec *iov, int iovcnt, size_t len)
+{
+        int ret = -ENOTCONN;
+
+        if (!shm_transport_enabled_config()) {
+                return -ENOTSUP;
+        }
+
+        if (len > TM_RING_SLOT_DATA) {
+                return -EMSGSIZE;
+        }
+
+        pthread_rwlock_rdlock(&tm_ring.lock);
+        if (tm_ring.ring.hdr != NULL && tm_ring_alive()) {
+                ret = shm_ring_push(&tm_ring.ring, iov, iovcnt, len);
+        }
+        pthread_rwlock_unlock(&tm_ring.lock);
+
+        if (ret != -ENOTCONN && ret != -EPIPE) {
+                return ret;
+        }
+
+        pthread_rwlock_wrlock(&tm_ring.lock);
+
+        /* Another thread may have replaced the ring in the meantime */
+        if (tm_ring.ring.hdr != NULL) {
+                ret = -EPIPE;
+                if (tm_ring_alive()) {
+                        ret = shm_ring_push(&tm_ring.ring, iov, iovcnt, len);
+                }
+                if (ret != -EPIPE) {
+                        goto out;
+                }
+                tm_ring_reset();
+        }
+
+        if (time(NULL) < tm_ring.retry_after) {
+                ret = -ENOTCONN;
+                goto out;
+        }
+
+        if ((ret = tm_ring_connect()) < 0) {
+                telem_log(LOG_INFO, "Shared memory ring not available: %s\n",
+                          strerror(-ret));
+                tm_ring.retry_after = time(NULL) + TM_RING_RETRY_SECS;
+                goto out;
+        }
+
+        ret = shm_ring_push(&tm_ring.ring, iov, iovcnt, len);
+out:
+        pthread_rwlock_unlock(&tm_ring.lock);
+
+        return ret;
+}
+
+int tm_send_record(struct telem_ref *t_ref)
+{
+        int sfd;
+        struct tm_frame frame;
+        struct iovec iov[TM_RECORD_IOVCNT];
+        size_t record_size = 0;
+        int iovcnt;
+        int ret = 0;
+
+        if (tm_is_opted_in() == 0) {
+                // Bail early if opt-in is not existent
+                return -ECONNREFUSED;
+        }
+
+        if ((iovcnt = tm_frame_record(t_ref, &frame, iov, &record_size)) < 0) {
+                return iovcnt;
+        }
+
+        if (tm_ring_send(iov, iovcnt, record_size) == 0) {
+                telem_log(LOG_INFO, "INFO: Successfully sent record over the ring\n");
+                return 0;
         }
 
-        memcpy(data + offset, t_ref->record->payload, t_ref->record->payload_size);
+        sfd = tm_get_socket();
 
-        telem_debug("DEBUG: Data to be sent :\n\n%s\n", data + 2 * sizeof(uint32_t));
-        if ((ret = tm_write_socket(sfd, data, record_size)) == 0) {
+        if (sfd < 0) {
+                telem_log(LOG_ERR, "Failed to get socket fd: %s\n",
+                          strerror(-sfd));
+                return sfd;
+        }
+
+        if ((ret = tm_writev_socket(sfd, iov, (size_t)iovcnt, NULL)) == 0) {
                 telem_log(LOG_INFO, "INFO: Successfully sent record over the socket\n");
         } else {
                 telem_log(LOG_ERR, "Error while writing data to socket\n");
         }
 
         close(sfd);
-        free(data);
 
         return ret;
 }
 
-void tm_free_record(struct telem_ref *t_ref)
+int tm_send_records(struct telem_ref **t_refs, size_t count)
 {
+        struct tm_frame *frames = NULL;
+        struct iovec *iov = NULL;
+        size_t iovcnt = 0;
+        size_t record_size = 0;
+        int sfd;
+        int ret = 0;
 
-        int k;
+        if (t_refs == NULL || count == 0) {
+                return -EINVAL;
+        }
 
-        if (t_ref == NULL) {
+        if (tm_is_opted_in() == 0) {
+                return -ECONNREFUSED;
+        }
+
+        frames = calloc(count, sizeof(struct tm_frame));
+        iov = calloc(count * TM_RECORD_IOVCNT, sizeof(struct iovec));
+        if (frames == NULL || iov == NULL) {
+                telem_log(LOG_CRIT, "CRIT: Out of memory\n");
+                ret = -ENOMEM;
+                goto out;
+        }
+
+        /* Records are framed by their own size field, so the whole batch
+         * goes out as one stream that telemprobd splits back into records.
+         */
+        for (size_t i = 0; i < count; i++) {
+                if ((ret = tm_frame_record(t_refs[i], &frames[i], iov + iovcnt,
+                                           &record_size)) < 0) {
+                        goto out;
+                }
+                iovcnt += (size_t)ret;
+        }
+
+        sfd = tm_get_socket();
+        if (sfd < 0) {
+                telem_log(LOG_ERR, "Failed to get socket fd: %s\n",
+                          strerror(-sfd));
+                ret = sfd;
+                goto out;
+        }
+
+        if ((ret = tm_writev_socket(sfd, iov, iovcnt, NULL)) == 0) {
+                telem_log(LOG_INFO, "INFO: Successfully sent %zu records over the socket\n",
+                          count);
+        } else {
+                telem_log(LOG_ERR, "Error while writing data to socket\n");
+        }
+
+        close(sfd);
+out:
+        free(frames);
+        free(iov);
+
+        return ret;
+}
+
+int tm_open_session(struct telem_session **session)
+{
+        struct telem_session *s = NULL;
+        int sfd;
+
+        if (tm_is_opted_in() == 0) {
+                return -ECONNREFUSED;
+        }
+
+        s = (struct telem_session *)malloc(sizeof(struct telem_session));
+        if (s == NULL) {
+                telem_log(LOG_CRIT, "CRIT: Out of memory\n");
+                return -ENOMEM;
+        }
+
+        sfd = tm_get_socket();
+        if (sfd < 0) {
+                telem_log(LOG_ERR, "Failed to get socket fd: %s\n",
+                          strerror(-sfd));
+                free(s);
+                return sfd;
+        }
+
+        s->fd = sfd;
+        *session = s;
+
+        return 0;
+}
+
+int tm_session_send(struct telem_session *session, struct telem_ref *t_ref)
+{
+        struct tm_frame frame;
+        struct iovec iov[TM_RECORD_IOVCNT];
+        size_t record_size = 0;
+        int iovcnt;
+        int ret = 0;
+
+        if (session == NULL) {
+                return -EINVAL;
+        }
+
+        /* telemprobd may have closed the connection since the last record
+         * (e.g. it exited for recycling while idle), so reconnect once if the
+         * write finds the peer gone. A partially written record is discarded
+         * by the daemon along with the old connection.
+         */
+        for (int attempt = 0; attempt < 2; attempt++) {
+                /* The iovecs are consumed by the write, so frame every attempt */
+                if ((iovcnt = tm_frame_record(t_ref, &frame, iov, &record_size)) < 0) {
+                        return iovcnt;
+                }
+
+                if (session->fd < 0) {
+                        session->fd = tm_get_socket();
+                        if (session->fd < 0) {
+                                ret = session->fd;
+                                telem_log(LOG_ERR, "Failed to get socket fd: %s\n",
+                                          strerror(-ret));
+                                break;
+                        }
+                }
+
+                if ((ret = tm_writev_socket(session->fd, iov, (size_t)iovcnt, NULL)) == 0) {
+                        telem_log(LOG_INFO, "INFO: Successfully sent record over the session\n");
+                        break;
+                }
+
+                close(session->fd);
+                session->fd = -1;
+
+                if (ret != -EPIPE && ret != -ECONNRESET) {
+                        telem_log(LOG_ERR, "Error while writing data to socket\n");
+                        break;
+                }
+        }
+
+        return ret;
+}
+
+void tm_close_session(struct telem_session *session)
+{
+        if (session == NULL) {
                 return;
         }
 
-        if (t_ref->record == NULL) {
+        if (session->fd >= 0) {
+                close(session->fd);
+        }
+
+        free(session);
+}
+
+/* Number of records the asynchronous send ring can hold */
+#define TM_ASYNC_RING_SIZE 256
+
+/* Maximum number of records written to telemprobd in one system call */
+#define TM_ASYNC_BATCH 64
+
+/* The flush thread closes its connection after this long without records */
+#define TM_ASYNC_IDLE_SECS 5
+
+/* A record serialized by tm_send_record_async(), owned by the ring */
+struct async_record {
+        size_t size;
+        char data[];
+};
+
+static struct {
+        struct mpmc_queue ring;
+        sem_t pending;                  /* one count per record in the ring */
+        pthread_mutex_t lock;           /* protects started and drained */
+        pthread_cond_t drained;
+        bool started;
+        int fd;
+        uint64_t enqueued;
+        uint64_t sent;
+        uint64_t dropped;
+        uint64_t overflows;
+} async_ctx = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .drained = PTHREAD_COND_INITIALIZER,
+        .started = false,
+        .fd = -1,
+};
+
+/**
+ * Write a batch of serialized records to telemprobd over the flush thread's
+ * connection, reconnecting once if the daemon closed it. Records that were
+ * completely written before an error are counted as sent.
+ *
+ * @param batch The records to write.
+ * @param count Number of records in batch.
+ *
+ */
+static void async_deliver(struct async_record **batch, size_t count)
+{
+        struct iovec iov[TM_ASYNC_BATCH];
+        size_t first = 0;
+        size_t written = 0;
+        int ret = 0;
+
+        for (int attempt = 0; attempt < 2 && first < count; attempt++) {
+                if (async_ctx.fd < 0) {
+                        async_ctx.fd = tm_get_socket();
+                        if (async_ctx.fd < 0) {
+                                ret = async_ctx.fd;
+                                break;
+                        }
+                }
+
+                for (size_t i = first; i < count; i++) {
+                        iov[i - first].iov_base = batch[i]->data;
+                        iov[i - first].iov_len = batch[i]->size;
+                }
+
+                ret = tm_writev_socket(async_ctx.fd, iov, count - first, &written);
+                while (first < count && written >= batch[first]->size) {
+                        written -= batch[first]->size;
+                        first++;
+                        __atomic_add_fetch(&async_ctx.sent, 1, __ATOMIC_RELAXED);
+                }
+                if (ret == 0) {
+                        break;
+                }
+
+                /* A partially written record is discarded by the daemon
+                 * along with the connection, so it is resent whole.
+                 */
+                close(async_ctx.fd);
+                async_ctx.fd = -1;
+
+                if (ret != -EPIPE && ret != -ECONNRESET) {
+                        break;
+                }
+        }
+
+        if (first < count) {
+                telem_log(LOG_ERR, "Dropped %zu queued records: %s\n",
+                          count - first, strerror(-ret));
+                __atomic_add_fetch(&async_ctx.dropped, count - first, __ATOMIC_RELAXED);
+        }
+}
+
+/**
+ * Body of the background thread that drains the asynchronous send ring.
+ *
+ */
+static void *async_flush_thread(void *unused __attribute__((unused)))
+{
+        struct async_record *batch[TM_ASYNC_BATCH];
+
+        while (1) {
+                struct timespec deadline;
+                size_t count = 0;
+                int ret;
+
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += TM_ASYNC_IDLE_SECS;
+
+                while ((ret = sem_timedwait(&async_ctx.pending, &deadline)) < 0 &&
+                       errno == EINTR) {
+                }
+                if (ret < 0) {
+                        /* Idle: don't keep telemprobd busy with our connection */
+                        if (async_ctx.fd >= 0) {
+                                close(async_ctx.fd);
+                                async_ctx.fd = -1;
+                        }
+                        continue;
+                }
+
+                /* Every count taken from the semaphore matches a record that
+                 * is already published in the ring.
+                 */
+                do {
+                        if (!mpmc_queue_pop(&async_ctx.ring, (void **)&batch[count])) {
+                                break;
+                        }
+                        count++;
+                } while (count < TM_ASYNC_BATCH && sem_trywait(&async_ctx.pending) == 0);
+
+                async_deliver(batch, count);
+
+                for (size_t i = 0; i < count; i++) {
+                        free(batch[i]);
+                }
+
+                pthread_mutex_lock(&async_ctx.lock);
+                pthread_cond_broadcast(&async_ctx.drained);
+                pthread_mutex_unlock(&async_ctx.lock);
+        }
+
+        return NULL;
+}
+
+/**
+ * The flush thread does not survive fork(). Records queued by the parent are
+ * the parent's to send, so the child starts over with an empty ring.
+ *
+ */
+static void async_atfork_child(void)
+{
+        void *record = NULL;
+
+        pthread_mutex_init(&async_ctx.lock, NULL);
+        pthread_cond_init(&async_ctx.drained, NULL);
+
+        if (!async_ctx.started) {
+                return;
+        }
+
+        while (mpmc_queue_pop(&async_ctx.ring, &record)) {
+                free(record);
+        }
+        sem_destroy(&async_ctx.pending);
+        sem_init(&async_ctx.pending, 0, 0);
+
+        if (async_ctx.fd >= 0) {
+                close(async_ctx.fd);
+                async_ctx.fd = -1;
+        }
+        async_ctx.enqueued = 0;
+        async_ctx.sent = 0;
+        async_ctx.dropped = 0;
+        async_ctx.overflows = 0;
+        async_ctx.started = false;
+}
+
+/**
+ * Start the flush thread, allocating the ring the first time.
+ *
+ * @return 0 if successful, or a negative errno-style value if not.
+ *
+ */
+static int async_start(void)
+{
+        static bool atfork_registered = false;
+        pthread_attr_t attr;
+        pthread_t thread;
+        sigset_t all, old;
+        int ret = 0;
+
+        pthread_mutex_lock(&async_ctx.lock);
+
+        if (async_ctx.started) {
+                goto out;
+        }
+
+        if (async_ctx.ring.cells == NULL &&
+            (ret = mpmc_queue_init(&async_ctx.ring, TM_ASYNC_RING_SIZE)) < 0) {
+                goto out;
+        }
+
+        if (!atfork_registered) {
+                if ((ret = -pthread_atfork(NULL, NULL, async_atfork_child)) < 0) {
+                        goto out;
+                }
+                atfork_registered = true;
+        }
+
+        sem_init(&async_ctx.pending, 0, 0);
+
+        /* Signals are for the application's threads, not ours */
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        ret = -pthread_create(&thread, &attr, async_flush_thread, NULL);
+        pthread_attr_destroy(&attr);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+        if (ret < 0) {
+                telem_log(LOG_ERR, "Failed to start flush thread: %s\n",
+                          strerror(-ret));
+                sem_destroy(&async_ctx.pending);
+                goto out;
+        }
+
+        async_ctx.started = true;
+out:
+        pthread_mutex_unlock(&async_ctx.lock);
+
+        return ret;
+}
+
+int tm_send_record_async(struct telem_ref *t_ref)
+{
+        struct tm_frame frame;
+        struct iovec iov[TM_RECORD_IOVCNT];
+        struct async_record *record = NULL;
+        size_t record_size = 0;
+        size_t offset = 0;
+        int iovcnt;
+        int ret = 0;
+
+        if (tm_is_opted_in() == 0) {
+                return -ECONNREFUSED;
+        }
+
+        if ((ret = async_start()) < 0) {
+                return ret;
+        }
+
+        if ((iovcnt = tm_frame_record(t_ref, &frame, iov, &record_size)) < 0) {
+                return iovcnt;
+        }
+
+        /* The caller may free the record as soon as we return, so the ring
+         * holds a serialized copy.
+         */
+        record = malloc(sizeof(struct async_record) + record_size);
+        if (record == NULL) {
+                telem_log(LOG_CRIT, "CRIT: Out of memory\n");
+                return -ENOMEM;
+        }
+        for (int i = 0; i < iovcnt; i++) {
+                memcpy(record->data + offset, iov[i].iov_base, iov[i].iov_len);
+                offset += iov[i].iov_len;
+        }
+        record->size = record_size;
+
+        if (!mpmc_queue_push(&async_ctx.ring, record)) {
+                __atomic_add_fetch(&async_ctx.overflows, 1, __ATOMIC_RELAXED);
+                free(record);
+                return -EAGAIN;
+        }
+
+        __atomic_add_fetch(&async_ctx.enqueued, 1, __ATOMIC_RELAXED);
+        sem_post(&async_ctx.pending);
+
+        return 0;
+}
+
+void tm_get_async_stats(struct tm_async_stats *stats)
+{
+        stats->enqueued = __atomic_load_n(&async_ctx.enqueued, __ATOMIC_RELAXED);
+        stats->sent = __atomic_load_n(&async_ctx.sent, __ATOMIC_RELAXED);
+        stats->dropped = __atomic_load_n(&async_ctx.dropped, __ATOMIC_RELAXED);
+        stats->overflows = __atomic_load_n(&async_ctx.overflows, __ATOMIC_RELAXED);
+}
+
+int tm_flush_async(int timeout_ms)
+{
+        struct timespec deadline;
+        int ret = 0;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock(&async_ctx.lock);
+        while (__atomic_load_n(&async_ctx.sent, __ATOMIC_RELAXED) +
+               __atomic_load_n(&async_ctx.dropped, __ATOMIC_RELAXED) <
+               __atomic_load_n(&async_ctx.enqueued, __ATOMIC_RELAXED)) {
+                ret = -pthread_cond_timedwait(&async_ctx.drained, &async_ctx.lock,
+                                              &deadline);
+                if (ret == -ETIMEDOUT) {
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&async_ctx.lock);
+
+        return ret == -ETIMEDOUT ? ret : 0;
+}
+
+void tm_free_record(struct telem_ref *t_ref)
+{
+        if (t_ref == NULL) {
                 return;
         }
 
-        for (k = 0; k < NUM_HEADERS; k++) {
-                free(t_ref->record->headers[k]);
+        if (t_ref->record == NULL) {
+                return;
         }
 
-        if (t_ref->record->payload) {
+        if (t_ref->record->payload && !t_ref->record->payload_borrowed) {
                 free(t_ref->record->payload);
         }
 
-        free(t_ref->record);
+        /* The reference is the start of the record's single allocation */
         free(t_ref);
 }
 
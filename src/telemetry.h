@@ -48,6 +48,7 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -55,6 +56,8 @@ struct telem_ref {
         struct telem_record *record;
 };
 
+struct telem_session;
+
 /**
  * Set the configuration file name to use
  *
@@ -112,14 +115,115 @@ int tm_set_event_id(struct telem_ref *t_ref, char *event_id);
 int tm_set_payload(struct telem_ref *t_ref, char *payload);
 
 /**
- * Send a record to the telemetrics daemon for delivery
+ * Set the payload field of a telemetrics record from a buffer of known length.
+ * The payload does not need to be null-terminated.
  *
  * @param t_ref The handle returned by tm_create_record()
+ * @param payload The payload to set
+ * @param len The number of bytes in payload
+ * @param borrow If true, the record refers to the caller's buffer instead of
+ *     copying it. The buffer must then remain valid and unchanged until
+ *     tm_free_record() is called.
  *
  * @return 0 on success, or a negative errno-style value on error
  */
+int tm_set_payload_len(struct telem_ref *t_ref, char *payload, size_t len,
+                       bool borrow);
+
+/**
+ * Send a record to the telemetrics daemon for delivery
+ *
+ * @param t_ref The handle returned by tm_create_record()
+ *
+ * @return 0 on success, or a negative errno-style value on error.
+ *     A daemon holding back the caller's records, because its user sent
+ *     more than its quota allows or the daemon is busy, is waited for.
+ *     -ETIMEDOUT means that it read none of the record for 30 seconds, and
+ *     that the record should be sent again later.
+ */
 int tm_send_record(struct telem_ref *t_ref);
 
+/**
+ * Send several records to the telemetrics daemon at once. The records are
+ * written over a single connection with one vectored write, which is much
+ * cheaper than calling tm_send_record() for each of them.
+ *
+ * @param t_refs Array of handles returned by tm_create_record()
+ * @param count Number of handles in t_refs
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int tm_send_records(struct telem_ref **t_refs, size_t count);
+
+/**
+ * Open a session with the telemetrics daemon. A session keeps one connection
+ * open so that many records can be sent without paying the connection setup
+ * cost for each one.
+ *
+ * @param session A pointer to a telem_session struct pointer declared by the
+ *     caller. The session is initialized if the function returns success.
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int tm_open_session(struct telem_session **session);
+
+/**
+ * Send a record to the telemetrics daemon over an open session. If the daemon
+ * closed the connection, the session reconnects once before failing.
+ *
+ * @param session The handle returned by tm_open_session()
+ * @param t_ref The handle returned by tm_create_record()
+ *
+ * @return 0 on success, or a negative errno-style value on error
+ */
+int tm_session_send(struct telem_session *session, struct telem_ref *t_ref);
+
+/**
+ * Close a session and release the memory allocated to it.
+ *
+ * @param session The handle returned by tm_open_session()
+ */
+void tm_close_session(struct telem_session *session);
+
+/**
+ * Queue a record for delivery to the telemetrics daemon and return without
+ * waiting for it to be sent. A background thread drains the queue over a
+ * persistent connection. The record is copied into the queue, so the caller
+ * may free it as soon as this function returns.
+ *
+ * @param t_ref The handle returned by tm_create_record()
+ *
+ * @return 0 if the record was queued, -EAGAIN if the queue is full and the
+ *     record was dropped, or another negative errno-style value on error
+ */
+int tm_send_record_async(struct telem_ref *t_ref);
+
+/* Counters for records sent with tm_send_record_async() */
+struct tm_async_stats {
+        uint64_t enqueued;      /* records accepted into the queue */
+        uint64_t sent;          /* records written to the daemon */
+        uint64_t dropped;       /* queued records that could not be sent */
+        uint64_t overflows;     /* records rejected because the queue was full */
+};
+
+/**
+ * Get the counters for records sent with tm_send_record_async()
+ *
+ * @param stats Filled in with the current counter values
+ */
+void tm_get_async_stats(struct tm_async_stats *stats);
+
+/**
+ * Wait until every record queued by tm_send_record_async() has been sent or
+ * dropped. Records still queued when the process exits are lost, so
+ * applications should call this before exiting.
+ *
+ * @param timeout_ms Maximum time to wait, in milliseconds
+ *
+ * @return 0 once the queue is drained, or -ETIMEDOUT
+ */
+int tm_flush_async(int timeout_ms);
+
 /**
  * Checks if telemetry was opted in
  *
@@ -21,8 +21,12 @@
 #include <assert.h>
 #include <signal.h>
 #include <dirent.h>
-#include <malloc.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <curl/curl.h>
 #include <sys/signalfd.h>
@@ -32,8 +36,28 @@
 #include "spool.h"
 #include "iorecord.h"
 #include "retention.h"
+#include "stream.h"
+#include "post_encoding.h"
 #include "telempostdaemon.h"
 
+/* Errors of the posts, by CURLcode and by HTTP status. They are kept here
+ * since post_record_http() has no daemon to count them in, and a process
+ * runs a single daemon. */
+static uint64_t curl_errors[CURL_LAST];
+static uint64_t http_errors[600];
+/* Connections opened to post records */
+static uint64_t http_connects;
+
+/* libcurl state kept from one post to the next while records flow, so that
+ * posts reuse the connection to the backend, its TLS session and the DNS
+ * lookup, rather than setting them all up again for each record. It is
+ * kept here for the same reason as the counters, and released by
+ * release_post_session() when the daemon goes idle, so that an idle daemon
+ * holds as little memory as possible. */
+static bool post_session;
+static CURL *post_curl;
+static CURLSH *post_share;
+
 /* spool window check */
 static bool inside_direct_spool_window(TelemPostDaemon *daemon, time_t current_time)
 {
@@ -178,8 +202,157 @@ static void initialize_record_delivery(TelemPostDaemon *daemon)
         daemon->record_server_delivery_enabled = record_server_delivery_enabled_config();
 }
 
+static void initialize_record_stream(TelemPostDaemon *daemon)
+{
+        int fd = -1;
+
+        staging_init(&daemon->stream_spool);
+        daemon->stream_spool.prefix = TM_STREAM_SPOOL_PREFIX;
+        daemon->stream_buf = NULL;
+
+        if (record_stream_enabled_config()) {
+                daemon->stream_buf = malloc(TM_STREAM_MAX_RECORD + 1);
+                if (!daemon->stream_buf) {
+                        telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+                fd = stream_listen(spool_dir_config());
+                if (fd < 0) {
+                        /* Records still come through the spool directory */
+                        telem_log(LOG_WARNING, "Unable to create record stream: %s\n",
+                                  strerror(-fd));
+                }
+        }
+
+        /* poll() skips the negative fds */
+        daemon->pollfds[streamfd].fd = fd;
+        daemon->pollfds[streamfd].events = POLLIN;
+        daemon->pollfds[peerfd].fd = -1;
+        daemon->pollfds[peerfd].events = POLLIN;
+}
+
+static void initialize_stats(TelemPostDaemon *daemon)
+{
+        int fd;
+
+        memset(&daemon->stats, 0, sizeof(daemon->stats));
+
+        fd = stats_listen(spool_dir_config(), STATS_POSTD_SOCKET_NAME);
+        if (fd < 0) {
+                /* Not needed to deliver records */
+                telem_log(LOG_WARNING, "Unable to create stats endpoint: %s\n",
+                          strerror(-fd));
+        }
+        daemon->pollfds[statsfd].fd = fd;
+        daemon->pollfds[statsfd].events = POLLIN;
+        daemon->pollfds[statsfd].revents = 0;
+}
+
+/**
+ * Set up libcurl, and the share that holds the connections and the caches
+ * of the posts, unless it was done already
+ */
+static void start_post_session(void)
+{
+        if (post_session) {
+                return;
+        }
+
+        curl_global_init(CURL_GLOBAL_ALL);
+
+        /* The caches live in the share, to be used by any handle */
+        post_share = curl_share_init();
+        if (post_share != NULL) {
+                curl_share_setopt(post_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+                curl_share_setopt(post_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+                curl_share_setopt(post_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+        }
+        post_session = true;
+}
+
+/**
+ * Create an easy handle to post a record with, using the share
+ *
+ * @return The handle
+ */
+static CURL *new_post_handle(void)
+{
+        CURL *curl;
+
+        start_post_session();
+        curl = curl_easy_init();
+        if (!curl) {
+                telem_log(LOG_ERR, "curl_easy_init(): Unable to start libcurl"
+                          " easy session, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        if (post_share != NULL) {
+                curl_easy_setopt(curl, CURLOPT_SHARE, post_share);
+        }
+
+        return curl;
+}
+
+/**
+ * Get the easy handle to post a record with, with its options reset
+ *
+ * @return The handle
+ */
+static CURL *get_post_session(void)
+{
+        if (post_curl == NULL) {
+                post_curl = new_post_handle();
+                return post_curl;
+        }
+
+        /* Options go back to their defaults, but the connections and the
+         * caches are kept */
+        curl_easy_reset(post_curl);
+        if (post_share != NULL) {
+                curl_easy_setopt(post_curl, CURLOPT_SHARE, post_share);
+        }
+
+        return post_curl;
+}
+
+void release_post_session(void)
+{
+        if (!post_session) {
+                return;
+        }
+
+        /* Closes the connections held in the share */
+        if (post_curl != NULL) {
+                curl_easy_cleanup(post_curl);
+        }
+        if (post_share != NULL) {
+                curl_share_cleanup(post_share);
+        }
+        post_curl = NULL;
+        post_share = NULL;
+        post_session = false;
+
+        curl_global_cleanup();
+}
+
+static void release_post_session_idle(void *arg)
+{
+        TelemPostDaemon *daemon = arg;
+
+        /* The handles of the posts in flight use the share */
+        if (post_engine_busy(&daemon->engine)) {
+                return;
+        }
+        post_engine_release(&daemon->engine);
+        release_post_session();
+}
+
+static void post_transfer_done(CURL *curl, CURLcode res, void *arg);
+
 void initialize_post_daemon(TelemPostDaemon *daemon)
 {
+        enum post_encoding encoding = POST_ENCODING_NONE;
+
         assert(daemon);
 
         daemon->bypass_http_post_ts = 0;
@@ -190,18 +363,44 @@ void initialize_post_daemon(TelemPostDaemon *daemon)
                 telem_perror("Error initializing inotify");
                 exit(EXIT_FAILURE);
         }
-        daemon->wd = inotify_add_watch(daemon->fd, spool_dir_config(), IN_CLOSE_WRITE);
+        /* telemprobd writes records out of sight and links them into the
+         * directory once complete, so their names appear with IN_CREATE */
+        daemon->wd = inotify_add_watch(daemon->fd, spool_dir_config(),
+                                       IN_CREATE | IN_MOVED_TO);
 
         initialize_signals(daemon);
         set_pollfd(daemon, daemon->fd, watchfd, POLLIN);
 
         initialize_rate_limit(daemon);
         initialize_record_delivery(daemon);
+        initialize_record_stream(daemon);
+        initialize_stats(daemon);
+        io_batch_init(&daemon->io, io_uring_enabled_config());
         /* Register record retention delete action as a callback to prune entry */
         if (daemon->record_journal != NULL && daemon->record_retention_enabled) {
                 daemon->record_journal->prune_entry_callback = &delete_record_by_id;
         }
         daemon->current_spool_size = 0;
+        daemon->retry_attempt = 0;
+        daemon->next_retry = 0;
+        daemon->next_spool_run = 0;
+        daemon->last_record_received = 0;
+        mem_policy_init(&daemon->mem, idle_trim_time_config(), NULL);
+        mem_policy_set_release(&daemon->mem, release_post_session_idle, daemon);
+        post_engine_init(&daemon->engine, post_parallelism_config(),
+                         post_transfer_done, NULL);
+        daemon->posts_removed = 0;
+        daemon->batch = NULL;
+        daemon->batch_max_records = batch_delivery_enabled_config() ?
+                                    batch_max_records_config() : 0;
+        daemon->batch_max_size = (size_t)batch_max_size_config() * 1024;
+        daemon->batch_max_delay = batch_max_delay_config();
+
+        post_encoding_from_name(post_compression_config(), &encoding);
+        if (encoding != POST_ENCODING_NONE && !post_encoding_supported(encoding)) {
+                telem_log(LOG_WARNING, "Built without %s, posting records"
+                          " uncompressed\n", post_compression_config());
+        }
 }
 
 size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
@@ -210,70 +409,69 @@ size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
         return size * nmemb;
 }
 
-bool post_record_http(char *headers[], char *body, char *cfg)
-{
+// This should be set by probes/libtelemetry in the future
+#define RECORD_CONTENT_TYPE "Content-Type: application/text"
+
+/* A post being set up, run, then checked */
+struct post_request {
         CURL *curl;
-        int res = 0;
-        char *content = "Content-Type: application/text";
-        struct curl_slist *custom_headers = NULL;
+        struct curl_slist *headers;
+        // Errors for any curl_easy_* functions will store nice error messages
+        // in errorbuf, so send log messages with errorbuf contents
         char errorbuf[CURL_ERROR_SIZE];
-        long http_response = 0;
-        const char *cert_file = get_cainfo_config();
-        const char *tid_header = get_tidheader_config();
-        const char *saved_config_file = NULL;
-
-        if (cfg != NULL) {
-                saved_config_file = get_config_file();
-                if (set_config_file(cfg) != 0) {
-                       telem_log(LOG_ERR, "set-config_file(): Failed to set %s\n", cfg);
-                       // If we fail to load the specified config file, do not send the
-                       // record out. We don't want to send the record out with different
-                       // settings than explicitly requested.
-                       // However, report success so the record gets deleted.
-                       res = 0;
-                       goto Done;
-                }
-                reload_config();
-                telem_debug("DEBUG: override server_addr:%s\n", server_addr_config());
-        }
-
-        // Initialize the libcurl global environment once per POST. This lets us
-        // clean up the environment after each POST so that when the daemon is
-        // sitting idle, it will be consuming as little memory as possible.
-        curl_global_init(CURL_GLOBAL_ALL);
+};
 
-        curl = curl_easy_init();
-        if (!curl) {
-                telem_log(LOG_ERR, "curl_easy_init(): Unable to start libcurl"
-                          " easy session, exiting\n");
-                exit(EXIT_FAILURE);
-                /* TODO: check if memory needs to be released */
-        }
+/**
+ * Set the options of the easy handle of a post, for the server of a
+ * configuration. finish_post() must be called once it completes.
+ *
+ * @param req The post, with its handle
+ * @param headers The headers of the record
+ * @param nheaders The number of headers
+ * @param content The Content-Type header of the post
+ * @param body The body of the post, compressed or not, which must stay
+ *    valid until it completes
+ * @param conf The configuration of the record
+ */
+static void prepare_post(struct post_request *req, char *headers[], int nheaders,
+                         const char *content, const struct encoded_body *body,
+                         const struct configuration *conf)
+{
+        const char *encoding = post_encoding_name(body->encoding);
+        CURL *curl = req->curl;
+        const char *cert_file = config_cainfo(conf);
 
-        // Errors for any curl_easy_* functions will store nice error messages
-        // in errorbuf, so send log messages with errorbuf contents
-        curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorbuf);
+        req->headers = NULL;
+
+        curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, req->errorbuf);
 
-        curl_easy_setopt(curl, CURLOPT_URL, server_addr_config());
+        curl_easy_setopt(curl, CURLOPT_URL, config_server_addr(conf));
         curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5L);
         curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
         curl_easy_setopt(curl, CURLOPT_POST, 1);
+        // Notice backends that went away while the connection was kept
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
 #ifdef DEBUG
         curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
 #endif
 
         curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
 
-        for (int i = 0; i < NUM_HEADERS; i++) {
-                custom_headers = curl_slist_append(custom_headers, headers[i]);
+        for (int i = 0; i < nheaders; i++) {
+                req->headers = curl_slist_append(req->headers, headers[i]);
         }
-        custom_headers = curl_slist_append(custom_headers, tid_header);
-        // This should be set by probes/libtelemetry in the future
-        custom_headers = curl_slist_append(custom_headers, content);
+        req->headers = curl_slist_append(req->headers, config_tidheader(conf));
+        req->headers = curl_slist_append(req->headers, content);
+        if (encoding != NULL) {
+                char header[64];
 
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, custom_headers);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, strlen(body));
+                snprintf(header, sizeof(header), "Content-Encoding: %s", encoding);
+                req->headers = curl_slist_append(req->headers, header);
+        }
+
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req->headers);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body->data);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)body->len);
         curl_easy_setopt(curl, CURLOPT_USE_SSL, CURLUSESSL_TRY);
 
         if (strlen(cert_file) > 0) {
@@ -282,17 +480,38 @@ bool post_record_http(char *headers[], char *body, char *cfg)
                         telem_log(LOG_INFO, "cafile was set to %s\n", cert_file);
                 }
         }
+        req->errorbuf[0] = 0;
+}
 
-        telem_log(LOG_DEBUG, "Executing curl operation...\n");
-        errorbuf[0] = 0;
-        res = curl_easy_perform(curl);
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_response);
+/**
+ * Check the outcome of a post, count it and log it
+ *
+ * @param req The post
+ * @param res The result of the transfer
+ *
+ * @return true if the record was sent
+ */
+static bool finish_post(struct post_request *req, CURLcode res)
+{
+        long http_response = 0;
+        long connects = 0;
+        bool sent = false;
+
+        curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &http_response);
+        if (curl_easy_getinfo(req->curl, CURLINFO_NUM_CONNECTS, &connects) == CURLE_OK &&
+            connects > 0) {
+                http_connects += (uint64_t)connects;
+        }
 
         if (res) {
-                size_t len = strlen(errorbuf);
+                size_t len = strlen(req->errorbuf);
+
+                if (res < CURL_LAST) {
+                        curl_errors[res]++;
+                }
                 if (len) {
-                        telem_log(LOG_DEBUG, "Failed sending record: %s%s", errorbuf,
-                                  ((errorbuf[len - 1] != '\n') ? "\n" : ""));
+                        telem_log(LOG_DEBUG, "Failed sending record: %s%s", req->errorbuf,
+                                  ((req->errorbuf[len - 1] != '\n') ? "\n" : ""));
                 } else {
                         telem_log(LOG_DEBUG, "Failed sending record: %s\n",
                                   curl_easy_strerror(res));
@@ -303,29 +522,390 @@ bool post_record_http(char *headers[], char *body, char *cfg)
                  */
                 telem_log(LOG_ERR, "Encountered error %ld on the server\n",
                           http_response);
+                if (http_response > 0 && http_response < 600) {
+                        http_errors[http_response]++;
+                }
                 // We treat HTTP error codes the same as libcurl errors
-                res = 1;
         } else {
                 telem_log(LOG_INFO, "Record sent successfully\n");
+                sent = true;
         }
 
-        curl_slist_free_all(custom_headers);
+        curl_slist_free_all(req->headers);
+        req->headers = NULL;
+
+        return sent;
+}
+
+/**
+ * Set an encoded body to send a body as is
+ *
+ * @param eb The encoded body
+ * @param body The body
+ * @param len The length of the body
+ */
+static void plain_body(struct encoded_body *eb, char *body, size_t len)
+{
+        encoded_body_free(eb);
+        eb->data = body;
+        eb->len = len;
+}
+
+/**
+ * Get the body to post: compressed if it is large enough and compression
+ * is enabled, from the cache of the record if it has one
+ *
+ * @param eb Set to the body to post, to release with body_posted()
+ * @param body The body
+ * @param len The length of the body
+ * @param record_path The path of the record in the spool directory, or NULL
+ *    if it has none
+ * @param conf The configuration the body is posted with, which sets the
+ *    compression
+ */
+static void encode_body(struct encoded_body *eb, char *body, size_t len,
+                        const char *record_path, const struct configuration *conf)
+{
+        enum post_encoding encoding = POST_ENCODING_NONE;
+
+        memset(eb, 0, sizeof(*eb));
+        plain_body(eb, body, len);
+
+        post_encoding_from_name(config_post_compression(conf), &encoding);
+        if (!post_encoding_supported(encoding) ||
+            len < (size_t)config_post_compression_threshold(conf)) {
+                return;
+        }
+
+        if (record_path != NULL &&
+            encoded_body_load(record_path, encoding, body, len, eb) == 0) {
+                return;
+        }
+        /* Sent as is if it does not get smaller */
+        if (post_encode(encoding, body, len, eb) < 0) {
+                plain_body(eb, body, len);
+        }
+}
+
+/**
+ * Release the body of a post once it completed. A record kept in the spool
+ * directory keeps its compressed body in the cache, for its next attempt.
+ *
+ * @param eb The body given by encode_body()
+ * @param body The body before compression
+ * @param len The length of the body
+ * @param record_path The path of the record in the spool directory, or NULL
+ * @param sent Whether the record was sent
+ */
+static void body_posted(struct encoded_body *eb, const char *body, size_t len,
+                        const char *record_path, bool sent)
+{
+        if (record_path != NULL && eb->encoding != POST_ENCODING_NONE) {
+                if (sent && eb->cached) {
+                        encoded_body_remove(record_path);
+                } else if (!sent && !eb->cached) {
+                        encoded_body_save(record_path, body, len, eb);
+                }
+        }
+        encoded_body_free(eb);
+}
+
+const struct configuration *record_config(const char *cfg_file)
+{
+        const struct configuration *conf;
+
+        if (cfg_file == NULL) {
+                return current_config();
+        }
+
+        conf = config_cache_get(cfg_file);
+        if (conf == NULL) {
+                telem_log(LOG_ERR, "Failed to load config file %s\n", cfg_file);
+        } else {
+                telem_debug("DEBUG: override server_addr:%s\n", config_server_addr(conf));
+        }
+
+        return conf;
+}
+
+bool post_record_http(char *headers[], char *body, const struct configuration *conf,
+                      const char *record_path)
+{
+        struct post_request req;
+        struct encoded_body eb;
+        size_t len = strlen(body);
+        bool sent;
+
+        // If the config file of the record cannot be loaded, do not send the
+        // record out with different settings than explicitly requested.
+        // However, report success so the record gets deleted.
+        if (conf == NULL) {
+                return true;
+        }
+
+        req.curl = get_post_session();
+        encode_body(&eb, body, len, record_path, conf);
+        prepare_post(&req, headers, NUM_HEADERS, RECORD_CONTENT_TYPE, &eb, conf);
+
+        telem_log(LOG_DEBUG, "Executing curl operation...\n");
+
+        sent = finish_post(&req, curl_easy_perform(req.curl));
+        body_posted(&eb, body, len, record_path, sent);
+
+        return sent;
+}
+
+/* A post run by the engine, and whom to tell once it completes */
+struct post_transfer {
+        struct post_request req;
+        post_sent_fn sent;
+        void *arg;
+        /* The body of the record, as sent and before compression, and the
+         * path of the record in the spool directory or NULL */
+        struct encoded_body encoded;
+        char *body;
+        size_t body_len;
+        const char *record_path;
+        /* The records of a batch post, and the answer of the backend, or
+         * NULL */
+        struct post_batch *batch;
+};
+
+/**
+ * Tell the records of a batch whether they were sent, and free it
+ *
+ * @param b The batch
+ * @param sent Whether the batch was posted and answered 200
+ */
+static void batch_posted(struct post_batch *b, bool sent)
+{
+        for (int i = 0; i < b->count; i++) {
+                long status = sent ? post_batch_status(b, i) : 0;
+                bool accepted = (status == 201 || status == 200);
+
+                if (sent && !accepted) {
+                        telem_log(LOG_ERR, "Encountered error %ld on the server"
+                                  " for record %d of batch\n", status, i);
+                        if (status > 0 && status < 600) {
+                                http_errors[status]++;
+                        }
+                }
+                b->entries[i].sent(accepted, b->entries[i].arg);
+        }
+        post_batch_free(b);
+}
+
+/**
+ * Complete a post run by the engine
+ *
+ * @param curl The easy handle of the post
+ * @param res The result of the transfer
+ * @param arg Unused
+ */
+static void post_transfer_done(CURL *curl, CURLcode res, void *arg)
+{
+        struct post_transfer *xfer = NULL;
+        bool sent;
+
+        curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&xfer);
+        sent = finish_post(&xfer->req, res);
         curl_easy_cleanup(curl);
+        body_posted(&xfer->encoded, xfer->body, xfer->body_len,
+                    xfer->record_path, sent);
 
-        curl_global_cleanup();
+        if (xfer->batch != NULL) {
+                batch_posted(xfer->batch, sent);
+        } else {
+                xfer->sent(sent, xfer->arg);
+        }
+        free(xfer);
+}
+
+/**
+ * Create a post for the engine, once it has room for it
+ *
+ * @param daemon The daemon
+ *
+ * @return The post, with its handle, to set up with prepare_post()
+ */
+static struct post_transfer *new_transfer(TelemPostDaemon *daemon)
+{
+        struct post_transfer *xfer;
+
+        /* Hold new records back until a post completes */
+        post_engine_wait(&daemon->engine, daemon->engine.max_inflight);
+
+        xfer = calloc(1, sizeof(struct post_transfer));
+        if (!xfer) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        /* Each post in flight has its own handle, and they all use the
+         * connections of the share */
+        xfer->req.curl = new_post_handle();
+
+        return xfer;
+}
+
+/**
+ * Start a post that was set up
+ *
+ * @param daemon The daemon
+ * @param xfer The post
+ */
+static void start_transfer(TelemPostDaemon *daemon, struct post_transfer *xfer)
+{
+        curl_easy_setopt(xfer->req.curl, CURLOPT_PRIVATE, xfer);
+
+        telem_log(LOG_DEBUG, "Starting curl operation...\n");
+        if (post_engine_add(&daemon->engine, xfer->req.curl) < 0) {
+                telem_log(LOG_ERR, "Failed to start post\n");
+                post_transfer_done(xfer->req.curl, CURLE_FAILED_INIT, NULL);
+        }
+}
+
+/**
+ * Post the records gathered in the batch of the daemon, if any
+ *
+ * @param daemon The daemon
+ */
+static void flush_batch(TelemPostDaemon *daemon)
+{
+        struct post_batch *b = daemon->batch;
+        struct post_transfer *xfer;
+
+        if (b == NULL) {
+                return;
+        }
+        daemon->batch = NULL;
+
+        xfer = new_transfer(daemon);
+        xfer->batch = b;
+        /* Batches are made up anew for each attempt, so they are not
+         * cached */
+        encode_body(&xfer->encoded, b->body, b->len, NULL, current_config());
+        prepare_post(&xfer->req, NULL, 0, "Content-Type: " POST_BATCH_CONTENT_TYPE,
+                     &xfer->encoded, current_config());
+        curl_easy_setopt(xfer->req.curl, CURLOPT_WRITEFUNCTION, post_batch_reply);
+        curl_easy_setopt(xfer->req.curl, CURLOPT_WRITEDATA, b);
+
+        telem_log(LOG_DEBUG, "Posting a batch of %d records\n", b->count);
+        start_transfer(daemon, xfer);
+}
 
-Done:
-        if (saved_config_file != NULL) {
-                if (set_config_file(saved_config_file) != 0) {
-                        telem_log(LOG_ERR, "set-config_file(): Failed to set %s",
-                                  saved_config_file);
-                        res = 1;
+/**
+ * Add a record to the batch of the daemon, and post the batch once full
+ *
+ * @param daemon The daemon
+ * @param headers The headers of the record
+ * @param body The body of the record
+ * @param sent Called once the batch is posted
+ * @param arg Passed to sent
+ */
+static void batch_record(TelemPostDaemon *daemon, char *headers[], char *body,
+                         post_sent_fn sent, void *arg)
+{
+        size_t size = post_batch_framed_size(headers, NUM_HEADERS, body);
+
+        /* Posted first if the record would take it over its size */
+        if (daemon->batch != NULL &&
+            daemon->batch->len + size > daemon->batch_max_size) {
+                flush_batch(daemon);
+        }
+
+        if (daemon->batch == NULL) {
+                daemon->batch = post_batch_new();
+                if (!daemon->batch) {
+                        telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                        exit(EXIT_FAILURE);
                 }
-                reload_config();
-                telem_debug("DEBUG: restored server_addr:%s\n", server_addr_config());
+                daemon->batch_deadline_us = stats_now_us() +
+                                            (uint64_t)daemon->batch_max_delay * 1000;
+        }
+        if (post_batch_add(daemon->batch, headers, NUM_HEADERS, body, sent, arg) < 0) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+
+        if (daemon->batch->count >= daemon->batch_max_records ||
+            daemon->batch->len >= daemon->batch_max_size) {
+                flush_batch(daemon);
+        }
+}
+
+/**
+ * Shorten a poll timeout so that the daemon wakes up to post its batch
+ *
+ * @param daemon The daemon
+ * @param timeout_ms The timeout the daemon would use otherwise, in ms
+ *
+ * @return The timeout to use, in ms
+ */
+static int batch_timeout(TelemPostDaemon *daemon, int timeout_ms)
+{
+        uint64_t now = stats_now_us();
+        int64_t remaining;
+
+        if (daemon->batch == NULL) {
+                return timeout_ms;
+        }
+
+        remaining = now >= daemon->batch_deadline_us ? 0 :
+                    (int64_t)((daemon->batch_deadline_us - now + 999) / 1000);
+        if (timeout_ms < 0 || remaining < timeout_ms) {
+                return (int)remaining;
+        }
+
+        return timeout_ms;
+}
+
+void post_record_async(TelemPostDaemon *daemon, char *headers[], char *body,
+                       const struct configuration *conf, const char *record_path,
+                       post_sent_fn sent, void *arg)
+{
+        struct post_transfer *xfer;
+
+        /* Dropped, as post_record_http() does */
+        if (conf == NULL) {
+                sent(true, arg);
+                return;
         }
 
-        return res ? false : true;
+        /* Records with a cfg file of their own may go to another server */
+        if (daemon->batch_max_records > 0 && conf == current_config()) {
+                batch_record(daemon, headers, body, sent, arg);
+                return;
+        }
+
+        xfer = new_transfer(daemon);
+        xfer->sent = sent;
+        xfer->arg = arg;
+        xfer->body = body;
+        xfer->body_len = strlen(body);
+        xfer->record_path = record_path;
+        encode_body(&xfer->encoded, body, xfer->body_len, record_path, conf);
+        prepare_post(&xfer->req, headers, NUM_HEADERS, RECORD_CONTENT_TYPE,
+                     &xfer->encoded, conf);
+        start_transfer(daemon, xfer);
+}
+
+void finish_posts(TelemPostDaemon *daemon)
+{
+        flush_batch(daemon);
+        post_engine_wait(&daemon->engine, 1);
+}
+
+bool concurrent_posts_enabled(const TelemPostDaemon *daemon)
+{
+        return daemon->engine.max_inflight > 1 || daemon->batch_max_records > 0;
+}
+
+bool spool_cache_fits(const TelemPostDaemon *daemon, long disk_size)
+{
+        int64_t max_spool_size = spool_max_size_config();
+
+        return max_spool_size == -1 ||
+               daemon->current_spool_size + disk_size <= max_spool_size * 1024;
 }
 
 static void save_local_copy(TelemPostDaemon *daemon, char *body)
@@ -430,52 +1010,76 @@ static void apply_retention_policies(TelemPostDaemon *daemon, char *body)
         }
 }
 
-/* Deliver record to backend if rate limiting policies are met otherwise
- * spool record for future delivery */
-static bool deliver_record(TelemPostDaemon *daemon, char *headers[], char *body, char* cfg_file)
+/* A record taken up for delivery, and, once its post is in flight, what is
+ * needed to finish with it when the post completes */
+struct record_post {
+        TelemPostDaemon *daemon;
+        struct record_view rec;
+        /* When the record was taken up, and when its post started */
+        uint64_t start_us;
+        uint64_t post_start_us;
+        /* The file of a staged or spooled record, and its size on disk */
+        char *path;
+        long disk_size;
+        /* Whether the record may cache its compressed body */
+        bool cache;
+        /* A copy of a streamed record, which rec points into */
+        char *buf;
+        size_t len;
+        /* Set once the post is in flight, which then owns the record */
+        bool posting;
+};
+
+/**
+ * Count the outcome of the delivery of a record, and decide what to do
+ * with it
+ *
+ * @param daemon The daemon
+ * @param rate_limited Whether the record was held back by the rate limits
+ * @param record_sent Whether the record was sent
+ * @param body_len The length of the body of the record
+ *
+ * @return true if the record was delivered or dropped, false if it must be
+ *    kept in the spool directory
+ */
+static bool delivery_outcome(TelemPostDaemon *daemon, bool rate_limited,
+                             bool record_sent, size_t body_len)
 {
-
-        bool ret = false;
-        int current_minute;
+        bool ret = record_sent;
         bool do_spool = false;
-        bool record_sent = false;
         time_t temp = time(NULL);
         struct tm *tm_s = localtime(&temp);
-        current_minute = tm_s->tm_min;
-        /* Checks flags */
-        bool record_check_passed = true;
-        bool byte_check_passed = true;
+        int current_minute = tm_s->tm_min;
         bool record_burst_enabled = burst_limit_enabled(daemon->record_burst_limit);
         bool byte_burst_enabled =  burst_limit_enabled(daemon->byte_burst_limit);
 
-        /* Perform record and byte rate limiting checks */
-        rate_limit_checks(daemon, &record_check_passed, &byte_check_passed);
-
-        /* Sends record if rate limiting is disabled, or all checks passed */
-        if (!daemon->rate_limit_enabled || (record_check_passed && byte_check_passed)) {
-                /* Send the record as https post */
-                record_sent = post_record_ptr(headers, body, cfg_file);
-                /**
-                 * This is the only point where an error condition could be returned
-                 * if the record was not sent
-                 * */
-                ret = record_sent;
+        if (!rate_limited && !record_sent) {
+                daemon->stats.delivery_failures++;
         }
         // Get rate-limit strategy
         do_spool = spool_strategy_selected(daemon);
 
+        if (rate_limited) {
+                daemon->stats.rate_limited++;
+        }
+
         // Drop record
         if (!record_sent && !do_spool) {
                 // Not an error condition
                 ret = true;
+                daemon->stats.dropped[rate_limited ? DROP_RATE_LIMIT :
+                                      DROP_DELIVERY_FAILED]++;
         }
         // Spool Record
         else if (!record_sent && do_spool) {
+                daemon->stats.spooled++;
                 start_network_bypass(daemon);
                 telem_log(LOG_INFO, "process_record: initializing direct-spool window\n");
                 // False will keep record around
                 ret = false;
         } else {
+                daemon->stats.delivered++;
+                daemon->stats.bytes_delivered += body_len;
                 /* Updates rate limiting arrays if record sent */
                 if (record_burst_enabled) {
                         rate_limit_update(current_minute, daemon->record_window_length,
@@ -490,46 +1094,136 @@ static bool deliver_record(TelemPostDaemon *daemon, char *headers[], char *body,
         return ret;
 }
 
-bool process_staged_record(char *filename, bool is_retry, TelemPostDaemon *daemon)
-{
-        int k;
-        bool ret = false;
-        char *headers[NUM_HEADERS];
-        char *body = NULL;
-        struct stat buf = { 0 };
-        time_t current_time = time(NULL);
-        int64_t max_spool_size = 0;
-        char *cfg_file = NULL;
+static void spool_streamed_record(TelemPostDaemon *daemon, char *buf, size_t len);
 
-        for (k = 0; k < NUM_HEADERS; k++) {
-                headers[k] = NULL;
+/**
+ * Finish with a record once its post completed: remove it or keep it, as
+ * process_staged_record() and process_streamed_record() do with the records
+ * they post themselves
+ *
+ * @param sent Whether the record was sent
+ * @param arg The struct record_post of the record
+ */
+static void record_posted(bool sent, void *arg)
+{
+        struct record_post *rp = arg;
+        TelemPostDaemon *daemon = rp->daemon;
+        bool ret;
+
+        stats_histogram_add(&daemon->stats.post_latency,
+                            stats_now_us() - rp->post_start_us);
+        ret = delivery_outcome(daemon, false, sent, strlen(rp->rec.body));
+
+        if (rp->path != NULL) {
+                if (ret) {
+                        unlink(rp->path);
+                        daemon->current_spool_size -= rp->disk_size;
+                        daemon->posts_removed++;
+                } else if (rp->cache) {
+                        /* As if its compressed body was cached, until the
+                         * next spool scan measures the spool again */
+                        daemon->current_spool_size += rp->disk_size;
+                }
+                telem_log(LOG_DEBUG, "spool_size: %ld\n", daemon->current_spool_size);
+        } else if (!ret) {
+                spool_streamed_record(daemon, rp->buf, rp->len);
         }
+        stats_histogram_add(&daemon->stats.record_latency,
+                            stats_now_us() - rp->start_us);
+
+        release_record(&rp->rec);
+        free(rp->path);
+        free(rp->buf);
+        free(rp);
+        mem_policy_busy(&daemon->mem);
+}
 
-        /** Load record **/
-        if ((ret = read_record(filename, headers, &body, &cfg_file)) == false) {
-                telem_log(LOG_WARNING, "unable to read record\n");
-                ret = true; // Record corrupted? true will remove record
-                goto end_processing_file;
-        }
+/**
+ * Start the post of a record, alongside the posts in flight
+ *
+ * @param daemon The daemon
+ * @param rp The record, which the post takes over
+ */
+static void start_record_post(TelemPostDaemon *daemon, struct record_post *rp)
+{
+        struct record_post *copy = malloc(sizeof(struct record_post));
 
-        /** Get file information  **/
-        if (stat(filename, &buf) == -1) {
-                telem_perror("Processing staged file unable to stat record in spool");
-                ret = true; // true to remove it
-                goto end_processing_file;
+        if (!copy) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
         }
+        *copy = *rp;
+        copy->daemon = daemon;
+        copy->post_start_us = stats_now_us();
+        rp->posting = true;
+
+        post_record_async(daemon, copy->rec.headers, copy->rec.body,
+                          record_config(copy->rec.cfg_file),
+                          copy->cache ? copy->path : NULL,
+                          record_posted, copy);
+}
 
-        /** Update spool directory size **/
-        daemon->current_spool_size += (buf.st_blocks * 512);
+/* Deliver record to backend if rate limiting policies are met otherwise
+ * spool record for future delivery */
+static bool deliver_record(TelemPostDaemon *daemon, struct record_post *rp)
+{
+        char **headers = rp->rec.headers;
+        char *body = rp->rec.body;
+        bool record_sent = false;
+        bool rate_limited = true;
+        /* Checks flags */
+        bool record_check_passed = true;
+        bool byte_check_passed = true;
 
-        /** Check that record is not expired **/
-        if (!S_ISREG(buf.st_mode) ||
-            (current_time - buf.st_mtime > (record_expiry_config() * 60)) ||
-            (buf.st_uid  != getuid())) {
-                ret = true; // Expired, true to remove it
-                goto end_processing_file;
+        /* Perform record and byte rate limiting checks */
+        rate_limit_checks(daemon, &record_check_passed, &byte_check_passed);
+
+        /* Sends record if rate limiting is disabled, or all checks passed */
+        if (!daemon->rate_limit_enabled || (record_check_passed && byte_check_passed)) {
+                uint64_t start_us;
+
+                /* The rest happens once the post completes */
+                if (concurrent_posts_enabled(daemon)) {
+                        start_record_post(daemon, rp);
+                        return false;
+                }
+
+                start_us = stats_now_us();
+                rate_limited = false;
+                /* Send the record as https post */
+                record_sent = post_record_ptr(headers, body,
+                                              record_config(rp->rec.cfg_file),
+                                              rp->cache ? rp->path : NULL);
+                stats_histogram_add(&daemon->stats.post_latency,
+                                    stats_now_us() - start_us);
         }
 
+        /**
+         * This is the only point where an error condition could be returned
+         * if the record was not sent
+         * */
+        return delivery_outcome(daemon, rate_limited, record_sent, strlen(body));
+}
+
+/**
+ * Journal a record and deliver it, or keep it for a later delivery
+ *
+ * @param daemon The daemon
+ * @param current_time When the record is processed
+ * @param rp The record
+ * @param is_retry Whether the record was processed before
+ *
+ * @return true if the record was delivered or dropped, false if it must be
+ *    kept in the spool directory, or if rp->posting is set, that its post is
+ *    in flight
+ */
+static bool handle_record(TelemPostDaemon *daemon, time_t current_time,
+                          struct record_post *rp, bool is_retry)
+{
+        char **headers = rp->rec.headers;
+        char *body = rp->rec.body;
+        int64_t max_spool_size = 0;
+
         /* Retries should not be recorded */
         if (is_retry == false) {
                 /** Journal entry **/
@@ -542,8 +1236,7 @@ bool process_staged_record(char *filename, bool is_retry, TelemPostDaemon *daemo
         if (!daemon->record_server_delivery_enabled) {
                 telem_log(LOG_INFO, "record server delivery disabled\n");
                 // Not an error condition
-                ret = true;
-                goto end_processing_file;
+                return true;
         }
 
         /** Spool policies **/
@@ -555,12 +1248,12 @@ bool process_staged_record(char *filename, bool is_retry, TelemPostDaemon *daemo
                     daemon->current_spool_size >= (max_spool_size * 1024)) {
                         // Drop record
                         telem_log(LOG_INFO, "Spool dir full, dropping record\n");
-                        ret = true;
-                } else {
-                        // Keep record, non error condition
-                        ret = false;
+                        daemon->stats.dropped[DROP_SPOOL_FULL]++;
+                        return true;
                 }
-                goto end_processing_file;
+                // Keep record, non error condition
+                daemon->stats.spooled++;
+                return false;
         }
 
         /** Check window_length **/
@@ -569,41 +1262,292 @@ bool process_staged_record(char *filename, bool is_retry, TelemPostDaemon *daemo
         }
 
         /** Deliver or spool **/
-        ret = deliver_record(daemon, headers, body, cfg_file);
+        return deliver_record(daemon, rp);
+}
+
+bool process_staged_record(char *filename, bool is_retry, TelemPostDaemon *daemon)
+{
+        bool ret = false;
+        struct record_post rp = { 0 };
+        struct stat buf = { 0 };
+        time_t current_time = time(NULL);
+        uint64_t start_us = stats_now_us();
+
+        daemon->stats.records[is_retry ? SOURCE_SPOOL : SOURCE_STAGED]++;
+
+        /** Load record **/
+        if ((ret = read_record(filename, &rp.rec)) == false) {
+                telem_log(LOG_WARNING, "unable to read record\n");
+                ret = true; // Record corrupted? true will remove record
+                daemon->stats.dropped[DROP_CORRUPTED]++;
+                goto end_processing_file;
+        }
+
+        /** Get file information  **/
+        if (stat(filename, &buf) == -1) {
+                telem_perror("Processing staged file unable to stat record in spool");
+                ret = true; // true to remove it
+                daemon->stats.dropped[DROP_CORRUPTED]++;
+                goto end_processing_file;
+        }
+
+        /** Update spool directory size **/
+        daemon->current_spool_size += (buf.st_blocks * 512);
+
+        /** Check that record is not expired **/
+        if (!S_ISREG(buf.st_mode) ||
+            (current_time - buf.st_mtime > (record_expiry_config() * 60)) ||
+            (buf.st_uid  != getuid())) {
+                ret = true; // Expired, true to remove it
+                daemon->stats.dropped[DROP_EXPIRED]++;
+                goto end_processing_file;
+        }
+
+        rp.start_us = start_us;
+        rp.disk_size = buf.st_blocks * 512;
+        rp.cache = spool_cache_fits(daemon, rp.disk_size);
+        rp.path = strdup(filename);
+        if (!rp.path) {
+                telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        ret = handle_record(daemon, current_time, &rp, is_retry);
+        if (rp.posting) {
+                /* Removed once sent, from record_posted() */
+                return false;
+        }
 
 end_processing_file:
         /** Update spool size if record will be removed **/
         if (ret) {
                 daemon->current_spool_size -= (buf.st_blocks * 512);
+        } else if (rp.cache) {
+                daemon->current_spool_size += rp.disk_size;
         }
         telem_log(LOG_DEBUG, "spool_size: %ld\n", daemon->current_spool_size);
-        free(body);
+        stats_histogram_add(&daemon->stats.record_latency,
+                            stats_now_us() - start_us);
+        release_record(&rp.rec);
+        free(rp.path);
+
+        return ret;
+}
 
-        for (k = 0; k < NUM_HEADERS; k++) {
-                free(headers[k]);
+/**
+ * Save a streamed record that could not be delivered in the spool
+ * directory, for the spool scans to send later
+ *
+ * @param daemon The daemon
+ * @param buf The record
+ * @param len The length of the record
+ */
+static void spool_streamed_record(TelemPostDaemon *daemon, char *buf, size_t len)
+{
+        struct iovec iov = { buf, len };
+        int ret;
+
+        if (!staging_is_open(&daemon->stream_spool)) {
+                ret = staging_open(&daemon->stream_spool, spool_dir_config(),
+                                   STAGING_SYNC_NONE, 0, false);
+                if (ret < 0) {
+                        telem_log(LOG_ERR, "Failed to open spool directory: %s\n",
+                                  strerror(-ret));
+                        return;
+                }
         }
 
-        if (cfg_file != NULL) {
-                free(cfg_file);
+        ret = staging_write(&daemon->stream_spool, &iov, 1);
+        if (ret < 0) {
+                telem_log(LOG_ERR, "Failed to spool streamed record: %s\n",
+                          strerror(-ret));
+                return;
         }
+
+        /* Counted in whole blocks, like the st_blocks of staged records */
+        daemon->current_spool_size += (long)((len + 4095) / 4096 * 4096);
+}
+
+bool process_streamed_record(char *buf, size_t len, TelemPostDaemon *daemon)
+{
+        bool ret = false;
+        struct record_post rp = { 0 };
+        uint64_t start_us = stats_now_us();
+
+        daemon->stats.records[SOURCE_STREAM]++;
+
+        /* buf is reused for the next record while the post is in flight */
+        if (concurrent_posts_enabled(daemon)) {
+                rp.buf = malloc(len + 1);
+                if (!rp.buf) {
+                        telem_log(LOG_ERR, "Unable to allocate memory, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+                memcpy(rp.buf, buf, len);
+                rp.buf[len] = '\0';
+                rp.len = len;
+                buf = rp.buf;
+        }
+
+        if (!read_record_buffer(buf, len, &rp.rec)) {
+                telem_log(LOG_WARNING, "unable to read streamed record\n");
+                ret = true; // Corrupted, dropped
+                daemon->stats.dropped[DROP_CORRUPTED]++;
+                goto end_processing;
+        }
+
+        rp.start_us = start_us;
+        ret = handle_record(daemon, time(NULL), &rp, false);
+        if (rp.posting) {
+                /* Saved if it cannot be sent, from record_posted() */
+                return true;
+        }
+        if (!ret) {
+                spool_streamed_record(daemon, buf, len);
+        }
+        stats_histogram_add(&daemon->stats.record_latency,
+                            stats_now_us() - start_us);
+
+end_processing:
+        release_record(&rp.rec);
+        free(rp.buf);
+
         return ret;
 }
 
-static int directory_dot_filter(const struct dirent *entry)
+/**
+ * Accept a connection on the record stream. Only telemprobd connects, so a
+ * new connection replaces the previous one, left by an instance that exited.
+ *
+ * @param daemon The daemon
+ */
+static void accept_stream(TelemPostDaemon *daemon)
 {
-        if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0)) {
-                return 0;
-        } else {
-                return 1;
+        int fd;
+
+        fd = accept4(daemon->pollfds[streamfd].fd, NULL, NULL,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+                telem_perror("Failed to accept record stream connection");
+                return;
+        }
+
+        if (daemon->pollfds[peerfd].fd >= 0) {
+                close(daemon->pollfds[peerfd].fd);
+        }
+        daemon->pollfds[peerfd].fd = fd;
+        daemon->pollfds[peerfd].revents = 0;
+}
+
+/**
+ * Process the records waiting on the record stream, up to TM_STREAM_BATCH
+ * so that signals and the file watcher are not kept waiting
+ *
+ * @param daemon The daemon
+ */
+static void read_stream(TelemPostDaemon *daemon)
+{
+        for (int i = 0; i < TM_STREAM_BATCH; i++) {
+                ssize_t len;
+
+                len = stream_recv(daemon->pollfds[peerfd].fd, daemon->stream_buf,
+                                  TM_STREAM_MAX_RECORD + 1);
+                if (len == -EAGAIN) {
+                        return;
+                }
+                if (len == -EMSGSIZE) {
+                        telem_log(LOG_WARNING, "Dropping streamed record too large\n");
+                        daemon->stats.records[SOURCE_STREAM]++;
+                        daemon->stats.dropped[DROP_CORRUPTED]++;
+                        continue;
+                }
+                if (len <= 0) {
+                        /* telemprobd stages records on disk until it
+                         * connects again */
+                        close(daemon->pollfds[peerfd].fd);
+                        daemon->pollfds[peerfd].fd = -1;
+                        return;
+                }
+
+                process_streamed_record(daemon->stream_buf, (size_t)len, daemon);
+                mem_policy_busy(&daemon->mem);
         }
 }
 
+/**
+ * Save the records left on the record stream in the spool directory, as the
+ * daemon exits. They are not posted, so that exiting does not wait on the
+ * backend. telemprobd stages the records it sends from now on.
+ *
+ * @param daemon The daemon
+ */
+static void drain_stream(TelemPostDaemon *daemon)
+{
+        int fd = daemon->pollfds[peerfd].fd;
+        int saved = 0;
+
+        if (fd < 0) {
+                return;
+        }
+
+        /* The records queued already can still be read */
+        shutdown(fd, SHUT_RD);
+        while (1) {
+                ssize_t len;
+
+                len = stream_recv(fd, daemon->stream_buf, TM_STREAM_MAX_RECORD + 1);
+                if (len == -EMSGSIZE) {
+                        telem_log(LOG_WARNING, "Dropping streamed record too large\n");
+                        daemon->stats.records[SOURCE_STREAM]++;
+                        daemon->stats.dropped[DROP_CORRUPTED]++;
+                        continue;
+                }
+                if (len <= 0) {
+                        break;
+                }
+
+                daemon->stats.records[SOURCE_STREAM]++;
+                daemon->stats.spooled++;
+                spool_streamed_record(daemon, daemon->stream_buf, (size_t)len);
+                saved++;
+        }
+
+        if (saved > 0) {
+                telem_log(LOG_INFO, "Saved %d streamed records in the spool\n", saved);
+        }
+}
+
+/**
+ * Tell whether a name in the staging directory is a complete record. Hidden
+ * files are records still being written, and names starting with '#' are
+ * reported by inotify for unnamed O_TMPFILE files.
+ *
+ * @param name The file name
+ *
+ * @return true if the file is a record to deliver
+ */
+static bool is_record_name(const char *name)
+{
+        return name[0] != '.' && name[0] != '#';
+}
+
+static int directory_dot_filter(const struct dirent *entry)
+{
+        return is_record_name(entry->d_name) ? 1 : 0;
+}
+
 int staging_records_loop(TelemPostDaemon *daemon)
 {
         int ret;
         int processed;
         int numentries;
         struct dirent **namelist;
+        struct io_batch *io = &daemon->io;
+        int posts_removed;
+        int dirfd;
+
+        /* Records whose post is in flight are not to be posted again */
+        finish_posts(daemon);
+        posts_removed = daemon->posts_removed;
 
         numentries = scandir(spool_dir_config(), &namelist, directory_dot_filter, NULL);
         processed = 0;
@@ -616,6 +1560,10 @@ int staging_records_loop(TelemPostDaemon *daemon)
                 return numentries;
         }
 
+        /* Delivered records are removed a batch at a time */
+        dirfd = open(spool_dir_config(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        io_batch_reset(io);
+
         for (int i = 0; i < numentries; i++) {
                 char *record_path;
                 telem_log(LOG_DEBUG, "Processing staged record: %s\n",
@@ -626,53 +1574,259 @@ int staging_records_loop(TelemPostDaemon *daemon)
                         exit(EXIT_FAILURE);
                 }
                 if (process_staged_record(record_path, true, daemon)) {
-                        unlink(record_path);
+                        if (dirfd < 0) {
+                                unlink(record_path);
+                        } else {
+                                if (io_batch_full(io)) {
+                                        io_batch_run(io);
+                                        io_batch_reset(io);
+                                }
+                                io_batch_unlinkat(io, dirfd, namelist[i]->d_name, 0);
+                        }
                         processed++;
                 }
                 free(record_path);
         }
 
+        io_batch_run(io);
+        io_batch_reset(io);
+        if (dirfd >= 0) {
+                close(dirfd);
+        }
+
         for (int i = 0; i < numentries; i++) {
                 free(namelist[i]);
         }
         free(namelist);
 
+        /* Count the records removed once their post completed */
+        finish_posts(daemon);
+        processed += daemon->posts_removed - posts_removed;
+
         return numentries - processed;
 }
 
+/**
+ * Write the counters of the daemon for the stats endpoint
+ *
+ * @param arg The daemon
+ * @param buf The text of the endpoint
+ */
+static void print_stats(void *arg, struct stats_buf *buf)
+{
+        static const char *const sources[RECORD_SOURCES] = {
+                [SOURCE_STAGED] = "staged",
+                [SOURCE_STREAM] = "stream",
+                [SOURCE_SPOOL] = "spool",
+        };
+        static const char *const reasons[DROP_REASONS] = {
+                [DROP_RATE_LIMIT] = "rate_limit",
+                [DROP_DELIVERY_FAILED] = "delivery_failed",
+                [DROP_SPOOL_FULL] = "spool_full",
+                [DROP_EXPIRED] = "expired",
+                [DROP_CORRUPTED] = "corrupted",
+        };
+        TelemPostDaemon *daemon = arg;
+        struct post_stats *st = &daemon->stats;
+        time_t now = time(NULL);
+
+        stats_printf(buf, "# HELP telempostd_records_total Records processed,"
+                     " by source\n"
+                     "# TYPE telempostd_records_total counter\n");
+        for (int i = 0; i < RECORD_SOURCES; i++) {
+                stats_printf(buf, "telempostd_records_total{source=\"%s\"}"
+                             " %" PRIu64 "\n", sources[i], st->records[i]);
+        }
+        stats_print_metric(buf, "telempostd_records_delivered_total", "counter",
+                           "Records sent to the backend",
+                           (int64_t)st->delivered);
+        stats_print_metric(buf, "telempostd_bytes_delivered_total", "counter",
+                           "Size of the records sent to the backend",
+                           (int64_t)st->bytes_delivered);
+        stats_print_metric(buf, "telempostd_records_spooled_total", "counter",
+                           "Times records were kept in the spool directory for"
+                           " a later delivery", (int64_t)st->spooled);
+        stats_printf(buf, "# HELP telempostd_records_dropped_total Records"
+                     " dropped, by reason\n"
+                     "# TYPE telempostd_records_dropped_total counter\n");
+        for (int i = 0; i < DROP_REASONS; i++) {
+                stats_printf(buf, "telempostd_records_dropped_total{reason=\"%s\"}"
+                             " %" PRIu64 "\n", reasons[i], st->dropped[i]);
+        }
+        stats_print_metric(buf, "telempostd_rate_limited_total", "counter",
+                           "Records held back by the rate limits",
+                           (int64_t)st->rate_limited);
+        stats_print_metric(buf, "telempostd_delivery_failures_total", "counter",
+                           "Posts of records that failed",
+                           (int64_t)st->delivery_failures);
+
+        stats_printf(buf, "# HELP telempostd_curl_errors_total Posts that failed"
+                     " in libcurl, by CURLcode\n"
+                     "# TYPE telempostd_curl_errors_total counter\n");
+        for (int i = 0; i < CURL_LAST; i++) {
+                if (curl_errors[i] != 0) {
+                        stats_printf(buf, "telempostd_curl_errors_total{code=\"%d\"}"
+                                     " %" PRIu64 "\n", i, curl_errors[i]);
+                }
+        }
+        stats_print_metric(buf, "telempostd_http_connections_total", "counter",
+                           "Connections opened to the backend, which posts"
+                           " reuse while records flow", (int64_t)http_connects);
+        stats_printf(buf, "# HELP telempostd_http_errors_total Posts refused by"
+                     " the backend, by HTTP status\n"
+                     "# TYPE telempostd_http_errors_total counter\n");
+        for (int i = 0; i < 600; i++) {
+                if (http_errors[i] != 0) {
+                        stats_printf(buf, "telempostd_http_errors_total{status=\"%d\"}"
+                                     " %" PRIu64 "\n", i, http_errors[i]);
+                }
+        }
+
+        stats_print_metric(buf, "telempostd_spool_size_bytes", "gauge",
+                           "Size of the spool directory",
+                           daemon->current_spool_size);
+        stats_print_metric(buf, "telempostd_retry_attempt", "gauge",
+                           "Retry of the delivery of spooled records in"
+                           " progress, or 0", daemon->retry_attempt);
+        stats_print_metric(buf, "telempostd_direct_spool_seconds", "gauge",
+                           "Time left during which records go straight to the"
+                           " spool directory after a failed delivery",
+                           inside_direct_spool_window(daemon, now) ?
+                           (int64_t)(daemon->bypass_http_post_ts +
+                                     NETWORK_BYPASS_DURATION - now) : 0);
+
+        stats_print_histogram(buf, "telempostd_post_latency_seconds",
+                              "Time to post a record to the backend",
+                              &st->post_latency);
+        stats_print_histogram(buf, "telempostd_record_latency_seconds",
+                              "Time to process a record from end to end",
+                              &st->record_latency);
+}
+
+void serve_stats(TelemPostDaemon *daemon)
+{
+        stats_serve(daemon->pollfds[statsfd].fd, print_stats, daemon);
+}
+
+/**
+ * Schedule the next retry of the delivery of spooled records, a longer
+ * wait after each failed attempt
+ *
+ * @param daemon The daemon, with a retry in progress
+ * @param now The current time
+ */
+static void schedule_retry(TelemPostDaemon *daemon, time_t now)
+{
+        int retry_delay = daemon->retry_attempt * daemon->retry_attempt;
+
+        daemon->next_retry = now + retry_delay;
+        telem_log(LOG_INFO, "Record delivery failed will retry in %d seconds",
+                  retry_delay);
+}
+
+void start_daemon_timers(TelemPostDaemon *daemon, time_t now)
+{
+        daemon->next_spool_run = now + spool_process_time_config();
+        daemon->last_record_received = now;
+
+        /* If we failed to send spooled records, indicate we need to retry */
+        if (daemon->bypass_http_post_ts != 0) {
+                daemon->retry_attempt = 1;
+                daemon->bypass_http_post_ts = 0;
+                schedule_retry(daemon, now);
+        }
+}
+
+int daemon_timers_timeout(const TelemPostDaemon *daemon, time_t now)
+{
+        time_t deadline = daemon->next_spool_run;
+
+        if (daemon->retry_attempt > 0 && daemon->next_retry < deadline) {
+                deadline = daemon->next_retry;
+        }
+        if (daemon_recycling_enabled_config() &&
+            daemon->last_record_received + TM_DAEMON_EXIT_TIME < deadline) {
+                deadline = daemon->last_record_received + TM_DAEMON_EXIT_TIME;
+        }
+
+        return deadline > now ? (int)(deadline - now) * 1000 : 0;
+}
+
+bool run_daemon_timers(TelemPostDaemon *daemon, time_t now)
+{
+        /* time to recycle the daemon has elapsed*/
+        if (daemon_recycling_enabled_config() &&
+            difftime(now, daemon->last_record_received) >= TM_DAEMON_EXIT_TIME) {
+                /* Exit */
+                telem_log(LOG_INFO, "Telemetry post daemon exiting for recycling\n");
+                return false;
+        }
+
+        /* Check if this was a retry attempt */
+        if (daemon->retry_attempt > 0 && now >= daemon->next_retry) {
+                /* Stop attempting retries if successful, increment counter if not */
+                mem_policy_busy(&daemon->mem);
+                if (staging_records_loop(daemon) == 0) {
+                        daemon->retry_attempt = 0;
+                } else {
+                        daemon->retry_attempt++;
+                }
+                /* Give up if counter reaches MAX_RETRY_ATTEMPTS */
+                if (daemon->retry_attempt == MAX_RETRY_ATTEMPTS) {
+                        telem_log(LOG_ERR, "Record deliver failed after %d attempts",
+                                  MAX_RETRY_ATTEMPTS);
+                        daemon->retry_attempt = 0;
+                }
+                if (daemon->retry_attempt > 0) {
+                        schedule_retry(daemon, time(NULL));
+                }
+        }
+
+        /* Check spool  */
+        if (now >= daemon->next_spool_run) {
+                spool_records_loop(daemon);
+                daemon->next_spool_run = time(NULL) + spool_process_time_config();
+                mem_policy_busy(&daemon->mem);
+        }
+
+        return true;
+}
+
 void run_daemon(TelemPostDaemon *daemon)
 {
         int ret;
-        /* retry_attempt of zero indicates we don't need to retry */
-        int retry_attempt = 0;
-        int spool_process_time = spool_process_time_config();
-        bool daemon_recycling_enabled = daemon_recycling_enabled_config();
-        time_t last_spool_run_time = time(NULL);
-        time_t last_record_received = time(NULL);
 
         assert(daemon);
         assert(daemon->pollfds);
         assert(daemon->pollfds[signlfd].fd);
         assert(daemon->pollfds[watchfd].fd);
 
-        /* If we failed to send spooled records, indicate we need to retry */
-        if (daemon->bypass_http_post_ts != 0) {
-                retry_attempt = 1;
-        }
+        start_daemon_timers(daemon, time(NULL));
 
         while (1) {
-                int retry_delay = spool_process_time;
-                malloc_trim(0);
-
-                /* check if we need to retry sending spooled records */
-                if (retry_attempt > 0) {
-                        retry_delay = retry_attempt * retry_attempt;
-                        daemon->bypass_http_post_ts = 0;
-                        telem_log(LOG_INFO, "Record delivery failed will retry in %d seconds",
-                                  retry_delay);
+                int timeout;
+                nfds_t nfds;
+
+                /* Sleep until the next spool scan, retry or recycling, and
+                 * wake up early if the heap is due for a trim before then */
+                timeout = daemon_timers_timeout(daemon, time(NULL));
+                timeout = mem_policy_timeout(&daemon->mem, timeout);
+                /* or if libcurl has a timeout to handle for the posts in
+                 * flight, whose sockets are polled after the daemon's */
+                timeout = post_engine_timeout(&daemon->engine, timeout);
+                /* or to post the batch being gathered */
+                timeout = batch_timeout(daemon, timeout);
+                nfds = NFDS + post_engine_pollfds(&daemon->engine,
+                                                  &daemon->pollfds[NFDS],
+                                                  POST_ENGINE_MAX_FDS);
+                ret = poll(daemon->pollfds, nfds, timeout);
+                if (ret >= 0) {
+                        post_engine_dispatch(&daemon->engine, &daemon->pollfds[NFDS],
+                                             nfds - NFDS);
+                        if (batch_timeout(daemon, -1) == 0) {
+                                flush_batch(daemon);
+                        }
                 }
-
-                ret = poll(daemon->pollfds, NFDS, retry_delay * 1000);
                 if (ret == -1) {
                         telem_perror("Failed to poll daemon file descriptors");
                         break;
@@ -711,7 +1865,12 @@ void run_daemon(TelemPostDaemon *daemon)
                                         struct inotify_event *event = (struct inotify_event *)&buffer[i];
 
                                         if (event->len) {
-                                                if (event->mask & IN_CLOSE_WRITE && !(event->mask & IN_ISDIR)) {
+                                                /* Streamed records saved by this
+                                                 * daemon were processed already */
+                                                if ((event->mask & (IN_CREATE | IN_MOVED_TO)) &&
+                                                    !(event->mask & IN_ISDIR) &&
+                                                    is_record_name(event->name) &&
+                                                    event->name[0] != TM_STREAM_SPOOL_PREFIX) {
                                                         char *record_name = NULL;
 
                                                         /* Retrieve foldername from watch id?  */
@@ -725,44 +1884,24 @@ void run_daemon(TelemPostDaemon *daemon)
                                                                 unlink(record_name);
                                                         }
                                                         free(record_name);
-                                                        last_record_received = time(NULL);
+                                                        daemon->last_record_received = time(NULL);
+                                                        mem_policy_busy(&daemon->mem);
                                                 }
                                         }
 
                                         i += (ssize_t)EVENT_SIZE + event->len;
                                 }
+                        } else if (daemon->pollfds[peerfd].revents != 0) {
+                                read_stream(daemon);
+                                daemon->last_record_received = time(NULL);
+                        } else if (daemon->pollfds[streamfd].revents != 0) {
+                                accept_stream(daemon);
+                        } else if (daemon->pollfds[statsfd].revents != 0) {
+                                serve_stats(daemon);
                         }
-                } else {
-                        time_t now = time(NULL);
-                        /* time to recycle the daemon has elapsed*/
-                        if (daemon_recycling_enabled &&
-                            difftime(now, last_record_received) >= TM_DAEMON_EXIT_TIME) {
-                                /* Exit */
-                                telem_log(LOG_INFO, "Telemetry post daemon exiting for recycling\n");
-                                break;
-                        }
-
-                        /* Check if this was a retry attempt */
-                        if (retry_attempt > 0) {
-                                /* Stop attempting retries if successful, increment counter if not */
-                                if (staging_records_loop(daemon) == 0) {
-                                        retry_attempt = 0;
-                                } else {
-                                        retry_attempt++;
-                                }
-                                /* Give up if counter reaches MAX_RETRY_ATTEMPTS */
-                                if (retry_attempt == MAX_RETRY_ATTEMPTS) {
-                                        telem_log(LOG_ERR, "Record deliver failed after %d attempts",
-                                                  MAX_RETRY_ATTEMPTS);
-                                        retry_attempt = 0;
-                                }
-                        }
-
-                        /* Check spool  */
-                        if (difftime(now, last_spool_run_time) >= spool_process_time) {
-                                spool_records_loop(&(daemon->current_spool_size));
-                                last_spool_run_time = time(NULL);
-                        }
+                } else if (!run_daemon_timers(daemon, time(NULL))) {
+                        /* Exit for recycling */
+                        break;
                 }
 
                 /* Check journal records and prune if needed */
@@ -770,11 +1909,19 @@ void run_daemon(TelemPostDaemon *daemon)
                 if (ret != 0) {
                         telem_log(LOG_WARNING, "Unable to prune journal\n");
                 }
+
+                if (mem_policy_idle(&daemon->mem)) {
+                        mem_policy_log_stats(&daemon->mem);
+                }
         }
 }
 
 void close_daemon(TelemPostDaemon *daemon)
 {
+        /* Streamed records whose post fails are saved in the spool, as are
+         * those still on the stream */
+        finish_posts(daemon);
+        drain_stream(daemon);
 
         if (daemon->fd) {
                 if (daemon->wd) {
@@ -783,7 +1930,32 @@ void close_daemon(TelemPostDaemon *daemon)
                 close(daemon->fd);
         }
 
+        if (daemon->pollfds[peerfd].fd >= 0) {
+                close(daemon->pollfds[peerfd].fd);
+        }
+        if (daemon->pollfds[streamfd].fd >= 0) {
+                char *path = NULL;
+
+                /* telemprobd stages records on disk while no one listens */
+                close(daemon->pollfds[streamfd].fd);
+                if (asprintf(&path, "%s/%s", spool_dir_config(),
+                             TM_STREAM_SOCKET_NAME) != -1) {
+                        unlink(path);
+                        free(path);
+                }
+        }
+        staging_close(&daemon->stream_spool);
+        free(daemon->stream_buf);
+        stats_close(daemon->pollfds[statsfd].fd, spool_dir_config(),
+                    STATS_POSTD_SOCKET_NAME);
+
+        io_batch_free(&daemon->io);
+        post_engine_release(&daemon->engine);
+        release_post_session();
+        config_cache_release();
+
         close_journal(daemon->record_journal);
+        mem_policy_log_stats(&daemon->mem);
 }
 
 /* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -16,7 +16,7 @@
 
 #define EVENT_SIZE sizeof(struct inotify_event)
 #define BUFFER_LEN 1024 * (EVENT_SIZE + 16)
-#define NFDS 2
+#define NFDS 5
 #define TM_RATE_LIMIT_SLOTS (1 /*h*/ * 60 /*m*/)
 #define TM_RECORD_COUNTER (1)
 #define MAX_RETRY_ATTEMPTS 8
@@ -29,15 +29,66 @@
 #include "common.h"
 #include "journal/journal.h"
 #include "configuration.h"
+#include "io_batch.h"
+#include "mem_policy.h"
+#include "post_batch.h"
+#include "post_engine.h"
+#include "staging.h"
+#include "stats.h"
 
-enum fdindex {signlfd, watchfd};
+enum fdindex {signlfd, watchfd, streamfd, peerfd, statsfd};
+
+/* Why a record was dropped, counted by the stats endpoint */
+enum drop_reason {
+        /* Over the rate limits, with the drop strategy */
+        DROP_RATE_LIMIT,
+        /* Not delivered, with the drop strategy */
+        DROP_DELIVERY_FAILED,
+        DROP_SPOOL_FULL,
+        DROP_EXPIRED,
+        /* Could not be read */
+        DROP_CORRUPTED,
+        DROP_REASONS
+};
+
+/* Where a record came from */
+enum record_source {
+        /* Staged by telemprobd, seen by the file watcher */
+        SOURCE_STAGED,
+        /* Sent on the record stream */
+        SOURCE_STREAM,
+        /* Found in the spool directory by a retry or a spool scan */
+        SOURCE_SPOOL,
+        RECORD_SOURCES
+};
+
+/* Counters of the stats endpoint */
+struct post_stats {
+        /* Records processed, by source */
+        uint64_t records[RECORD_SOURCES];
+        /* Records sent to the backend, and their size */
+        uint64_t delivered;
+        uint64_t bytes_delivered;
+        /* Records kept in the spool directory for a later delivery */
+        uint64_t spooled;
+        uint64_t dropped[DROP_REASONS];
+        /* Records held back by the rate limits, whatever the strategy */
+        uint64_t rate_limited;
+        /* Posts that failed */
+        uint64_t delivery_failures;
+        /* Time to post a record, and to process one from end to end */
+        struct stats_histogram post_latency;
+        struct stats_histogram record_latency;
+};
 
 typedef struct TelemPostDaemon {
         int fd;
         int wd;
         int sfd;
         char event_buffer[BUFFER_LEN];
-        struct pollfd pollfds[NFDS];
+        /* The daemon's descriptors, then the sockets of the posts in
+         * flight */
+        struct pollfd pollfds[NFDS + POST_ENGINE_MAX_FDS];
         /* Telemetry Journal*/
         TelemJournal *record_journal;
         /* Time of last failed post */
@@ -58,6 +109,36 @@ typedef struct TelemPostDaemon {
         /* Record local copy and delivery  */
         bool record_retention_enabled;
         bool record_server_delivery_enabled;
+        /* When to trim the heap, and the memory and CPU counters */
+        struct mem_policy mem;
+        /* Where records received on the record stream are read, and saved
+         * when they cannot be delivered */
+        char *stream_buf;
+        struct staging stream_spool;
+        /* Retry of the delivery of spooled records in progress, counting
+         * from 1, or 0 */
+        int retry_attempt;
+        /* When the retry in progress runs, when the spool directory is
+         * scanned next, and when a record was last received, in seconds of
+         * time() */
+        time_t next_retry;
+        time_t next_spool_run;
+        time_t last_record_received;
+        struct post_stats stats;
+        /* File operations of the directory scans */
+        struct io_batch io;
+        /* Posts in flight, when records are posted concurrently */
+        struct post_engine engine;
+        /* Staged or spooled records removed once their post completed */
+        int posts_removed;
+        /* Records gathered for a batch post, or NULL, and when to post
+         * them, in us of CLOCK_MONOTONIC */
+        struct post_batch *batch;
+        uint64_t batch_deadline_us;
+        /* Limits of the batches, with no records when they are disabled */
+        int batch_max_records;
+        size_t batch_max_size;
+        int batch_max_delay;
 } TelemPostDaemon;
 
 /**
@@ -88,9 +169,26 @@ void close_daemon(TelemPostDaemon *daemon);
  * @param is_retry a boolean value that indicates if
  *        the record has been previously processed.
  * @param daemon post to telemetry post daemon
+ *
+ * @return true if the record was delivered or dropped, and is to be
+ *         removed, false if it is to be kept, or if its post is in flight,
+ *         in which case it is removed once sent
  */
 bool process_staged_record(char *filename, bool is_retry, TelemPostDaemon *daemon);
 
+/**
+ * Processes a record received on the record stream, and saves it in the
+ * spool directory if it could not be delivered
+ *
+ * @param buf the record, in the same format as on disk
+ * @param len the length of the record
+ * @param daemon pointer to telemetry post daemon
+ *
+ * @return true if the record was delivered or dropped, or if its post is
+ *         in flight, false if it was saved for a later delivery
+ */
+bool process_streamed_record(char *buf, size_t len, TelemPostDaemon *daemon);
+
 /**
  * Scans staging directory to process files that were
  * missed by file watcher
@@ -100,15 +198,122 @@ bool process_staged_record(char *filename, bool is_retry, TelemPostDaemon *daemo
  */
 int staging_records_loop(TelemPostDaemon *daemon);
 
+/**
+ * Starts the timers of the spool scans, the retries and the recycling
+ *
+ * @param daemon a pointer to telemetry post daemon
+ * @param now the current time
+ */
+void start_daemon_timers(TelemPostDaemon *daemon, time_t now);
+
+/**
+ * Gets how long the daemon may sleep until its next timer is due
+ *
+ * @param daemon a pointer to telemetry post daemon
+ * @param now the current time
+ *
+ * @return the time in ms, 0 if a timer is due already
+ */
+int daemon_timers_timeout(const TelemPostDaemon *daemon, time_t now);
+
+/**
+ * Runs the spool scan and the retry whose time came, whichever timeout
+ * woke the daemon up
+ *
+ * @param daemon a pointer to telemetry post daemon
+ * @param now the current time
+ *
+ * @return false if the daemon is to exit for recycling
+ */
+bool run_daemon_timers(TelemPostDaemon *daemon, time_t now);
+
+/**
+ * Answer the clients of the stats endpoint, after its socket became
+ * readable
+ *
+ * @param daemon a pointer to telemetry post daemon
+ */
+void serve_stats(TelemPostDaemon *daemon);
+
+/**
+ * Gets the configuration to deliver a record with
+ *
+ * @param cfg_file the cfg file of the record, or NULL to use the
+ *        configuration of the daemon
+ *
+ * @return the configuration, from the cache of parsed configuration files
+ *         when the record has a cfg file, or NULL if that file cannot be
+ *         loaded
+ */
+const struct configuration *record_config(const char *cfg_file);
+
 /**
  * Posts a record to backend
  *
  * @param headers a pointer to an array with keys and values
  * @param body a pointer to the payload
- * @param cfg_file a pointer to a non-default configuration
- *        file to be used.
+ * @param conf the configuration to post the record with, from
+ *        record_config(). When NULL, the record is not posted but reported
+ *        sent, so that it is removed.
+ * @param record_path the path of the record in the spool directory, whose
+ *        compressed body is cached there, or NULL
+ */
+bool post_record_http(char *headers[], char *body, const struct configuration *conf,
+                      const char *record_path);
+
+/**
+ * Close the connections kept by post_record_http(), and free its libcurl
+ * state. The next post starts afresh.
+ */
+void release_post_session(void);
+
+/**
+ * Starts to post a record to backend, alongside the posts in flight. Waits
+ * for one of them to complete first if the daemon posts as many records at
+ * once as it may. When batches are enabled, records without a cfg file are
+ * gathered into a batch instead, posted once full or after
+ * batch_max_delay.
+ *
+ * @param daemon a pointer to telemetry post daemon
+ * @param headers a pointer to an array with keys and values
+ * @param body a pointer to the payload, which must stay valid until sent is
+ *        called
+ * @param conf the configuration to post the record with, as for
+ *        post_record_http()
+ * @param record_path the path of the record in the spool directory, or
+ *        NULL, which must stay valid until sent is called
+ * @param sent called once the post completed, possibly before returning
+ * @param arg passed to sent
+ */
+void post_record_async(TelemPostDaemon *daemon, char *headers[], char *body,
+                       const struct configuration *conf, const char *record_path,
+                       post_sent_fn sent, void *arg);
+
+/**
+ * Posts the batch being gathered, and waits for all posts to complete
+ *
+ * @param daemon a pointer to telemetry post daemon
+ */
+void finish_posts(TelemPostDaemon *daemon);
+
+/**
+ * Tells whether records are posted concurrently or in batches, with
+ * post_record_async(), rather than one after the other with post_record_ptr
+ *
+ * @param daemon a pointer to telemetry post daemon
+ */
+bool concurrent_posts_enabled(const TelemPostDaemon *daemon);
+
+/**
+ * Tells whether a record in the spool directory may cache its compressed
+ * body: not if the cache could take the spool directory over its maximum
+ * size, which the cache counts against
+ *
+ * @param daemon a pointer to telemetry post daemon
+ * @param disk_size size of the record on disk, which its compressed body
+ *        does not exceed
  */
-bool post_record_http(char *headers[], char *body, char *cfg_file);
+bool spool_cache_fits(const TelemPostDaemon *daemon, long disk_size);
 
 /**
  * Pointer to function to isolate backend call during
@@ -117,7 +322,9 @@ bool post_record_http(char *headers[], char *body, char *cfg_file);
  * @param headers pointer to array of keys
  * @param body a pinter to payload
  * */
-extern bool (*post_record_ptr)(char *headers[], char *body, char *cfg_file);
+extern bool (*post_record_ptr)(char *headers[], char *body,
+                               const struct configuration *conf,
+                               const char *record_path);
 
 /** Helper functions **/
 /* rate limit check */
@@ -16,8 +16,6 @@
 
 #define _GNU_SOURCE
 
-#define RANDOM_ID_LEN 32
-
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
@@ -132,12 +130,12 @@ long get_directory_size(const char *dir_path)
 }
 
 /**
- * Generates a 32 characters random id
+ * Generates a 32 characters random id into a caller provided buffer
  *
- * @param buffer pointer to allocate and copy data
+ * @param buff buffer of at least RANDOM_ID_LEN + 1 bytes
  *
  */
-int get_random_id(char **buff)
+int format_random_id(char *buff)
 {
         int result = -1;
         int frandom = -1;
@@ -149,7 +147,8 @@ int get_random_id(char **buff)
         }
 
         if (read(frandom, &random_id, sizeof(random_id)) == sizeof(random_id)) {
-                if (asprintf(buff, "%.16" PRIx64 "%.16" PRIx64, random_id[0], random_id[1]) == RANDOM_ID_LEN) {
+                if (snprintf(buff, RANDOM_ID_LEN + 1, "%.16" PRIx64 "%.16" PRIx64,
+                             random_id[0], random_id[1]) == RANDOM_ID_LEN) {
                         result = 0;
                 }
         }
@@ -159,6 +158,28 @@ int get_random_id(char **buff)
         return result;
 }
 
+/**
+ * Generates a 32 characters random id
+ *
+ * @param buffer pointer to allocate and copy data
+ *
+ */
+int get_random_id(char **buff)
+{
+        char id[RANDOM_ID_LEN + 1];
+
+        if (format_random_id(id) != 0) {
+                return -1;
+        }
+
+        *buff = strdup(id);
+        if (*buff == NULL) {
+                return -1;
+        }
+
+        return 0;
+}
+
 /**
  * Validate classification value. A valid classification
  * is a string with 2 slashes, with max length of
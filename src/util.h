@@ -18,6 +18,8 @@
 
 #include <stdbool.h>
 
+#define RANDOM_ID_LEN 32
+
 /* Increase memory allocated */
 void *reallocate(void **addr, size_t *allocated, size_t requested);
 
@@ -33,6 +35,9 @@ long get_directory_size(const char *sdir);
 /* Initialize buff and copy generated id */
 int get_random_id(char **buff);
 
+/* Copy generated id to buff, which holds at least RANDOM_ID_LEN + 1 bytes */
+int format_random_id(char *buff);
+
 /* Validates classification value */
 int validate_classification(char *classification);
 
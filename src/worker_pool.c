@@ -0,0 +1,231 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "worker_pool.h"
+
+/**
+ * Wait for a record to be queued, or for the next group sync of the
+ * worker's staged records
+ *
+ * @param w The worker
+ *
+ * @return true if a record was queued, false if the wait timed out
+ */
+static bool wait_for_record(struct worker *w)
+{
+        int timeout_ms = staging_timeout(&w->staging, -1);
+        struct timespec deadline;
+        int ret;
+
+        if (timeout_ms < 0) {
+                while ((ret = sem_wait(&w->queued)) < 0 && errno == EINTR) {
+                }
+                return ret == 0;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+        }
+        while ((ret = sem_timedwait(&w->queued, &deadline)) < 0 && errno == EINTR) {
+        }
+
+        return ret == 0;
+}
+
+static void *worker_main(void *data)
+{
+        struct worker *w = data;
+        struct worker_pool *pool = w->pool;
+
+        while (1) {
+                void *job;
+
+                if (!wait_for_record(w)) {
+                        staging_tick(&w->staging);
+                        continue;
+                }
+
+                /* Every record posts the semaphore once, and stopping posts
+                 * it once more, so an empty queue means the pool stops */
+                if (!mpmc_queue_pop(&w->queue, &job)) {
+                        if (__atomic_load_n(&pool->stopping, __ATOMIC_ACQUIRE)) {
+                                break;
+                        }
+                        continue;
+                }
+                sem_post(&w->free_cells);
+
+                stats_histogram_add(&pool->queue_latency, stats_now_us() -
+                                    ((struct record_job *)job)->queued_us);
+                pool->fn(pool->arg, &w->staging, ((struct record_job *)job)->data,
+                         ((struct record_job *)job)->size);
+                free(job);
+                staging_tick(&w->staging);
+        }
+
+        staging_close(&w->staging);
+
+        return NULL;
+}
+
+/**
+ * Release the resources of the first count workers, whose threads are not
+ * running
+ *
+ * @param pool The pool
+ * @param count Number of workers to release
+ */
+static void free_workers(struct worker_pool *pool, int count)
+{
+        for (int i = 0; i < count; i++) {
+                struct worker *w = &pool->workers[i];
+
+                mpmc_queue_free(&w->queue);
+                sem_destroy(&w->queued);
+                sem_destroy(&w->free_cells);
+        }
+        free(pool->workers);
+        pool->workers = NULL;
+        pool->nworkers = 0;
+}
+
+void worker_pool_init(struct worker_pool *pool)
+{
+        memset(pool, 0, sizeof(*pool));
+}
+
+int worker_pool_start(struct worker_pool *pool, int nworkers, worker_fn fn,
+                      void *arg)
+{
+        int ret = 0;
+        int i;
+
+        if (nworkers <= 0) {
+                return 0;
+        }
+        if (nworkers > WORKER_POOL_MAX) {
+                nworkers = WORKER_POOL_MAX;
+        }
+
+        pool->workers = calloc((size_t)nworkers, sizeof(struct worker));
+        if (pool->workers == NULL) {
+                return -ENOMEM;
+        }
+        pool->fn = fn;
+        pool->arg = arg;
+        pool->stopping = false;
+
+        for (i = 0; i < nworkers; i++) {
+                struct worker *w = &pool->workers[i];
+
+                if ((ret = mpmc_queue_init(&w->queue, WORKER_QUEUE_DEPTH)) < 0) {
+                        break;
+                }
+                sem_init(&w->queued, 0, 0);
+                sem_init(&w->free_cells, 0, WORKER_QUEUE_DEPTH);
+                staging_init(&w->staging);
+                w->pool = pool;
+
+                if ((ret = -pthread_create(&w->thread, NULL, worker_main, w)) < 0) {
+                        mpmc_queue_free(&w->queue);
+                        sem_destroy(&w->queued);
+                        sem_destroy(&w->free_cells);
+                        break;
+                }
+                pool->nworkers++;
+        }
+
+        if (ret < 0) {
+                telem_log(LOG_ERR, "Failed to start worker threads: %s\n",
+                          strerror(-ret));
+                worker_pool_stop(pool);
+                return ret;
+        }
+
+        return 0;
+}
+
+static inline struct worker *key_worker(struct worker_pool *pool,
+                                        unsigned int key)
+{
+        return &pool->workers[key % (unsigned int)pool->nworkers];
+}
+
+int worker_pool_reserve(struct worker_pool *pool, unsigned int key)
+{
+        struct worker *w = key_worker(pool, key);
+        int ret;
+
+        while ((ret = sem_trywait(&w->free_cells)) < 0 && errno == EINTR) {
+        }
+
+        return ret == 0 ? 0 : -EAGAIN;
+}
+
+void worker_pool_reserve_wait(struct worker_pool *pool, unsigned int key)
+{
+        struct worker *w = key_worker(pool, key);
+
+        while (sem_wait(&w->free_cells) < 0 && errno == EINTR) {
+        }
+}
+
+void worker_pool_unreserve(struct worker_pool *pool, unsigned int key)
+{
+        sem_post(&key_worker(pool, key)->free_cells);
+}
+
+void worker_pool_submit(struct worker_pool *pool, unsigned int key,
+                        struct record_job *job)
+{
+        struct worker *w = key_worker(pool, key);
+
+        job->queued_us = stats_now_us();
+        /* The free cell reserved guarantees room in the queue */
+        mpmc_queue_push(&w->queue, job);
+        sem_post(&w->queued);
+}
+
+void worker_pool_stop(struct worker_pool *pool)
+{
+        int count = pool->nworkers;
+
+        if (pool->workers == NULL) {
+                return;
+        }
+
+        __atomic_store_n(&pool->stopping, true, __ATOMIC_RELEASE);
+        for (int i = 0; i < count; i++) {
+                sem_post(&pool->workers[i].queued);
+        }
+        for (int i = 0; i < count; i++) {
+                pthread_join(pool->workers[i].thread, NULL);
+        }
+
+        free_workers(pool, count);
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,159 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mpmc_queue.h"
+#include "staging.h"
+#include "stats.h"
+
+/* Most worker threads a pool runs */
+#define WORKER_POOL_MAX 64
+
+/* Records queued for a worker. The event loop does not wait for room: a
+ * client whose worker's queue is full is held back instead, unless it is
+ * closing its ring. */
+#define WORKER_QUEUE_DEPTH 256
+
+/* A record handed to a worker, which frees it */
+struct record_job {
+        /* When the record was queued, from stats_now_us() */
+        uint64_t queued_us;
+        size_t size;
+        uint8_t data[];
+};
+
+/**
+ * Process a record on a worker thread
+ *
+ * @param arg The argument given to worker_pool_start()
+ * @param staging The worker's own staging area
+ * @param record The record
+ * @param size The length of the record
+ */
+typedef void (*worker_fn)(void *arg, struct staging *staging, uint8_t *record,
+                          size_t size);
+
+struct worker_pool;
+
+struct worker {
+        pthread_t thread;
+        struct mpmc_queue queue;
+        /* Count the records in the queue, and its free cells */
+        sem_t queued;
+        sem_t free_cells;
+        /* Records are staged by the worker, which also runs their group
+         * syncs */
+        struct staging staging;
+        struct worker_pool *pool;
+};
+
+/*
+ * Threads processing the records framed by telemprobd's event loop. Every
+ * worker has its own queue, and the records of a client always go to the
+ * same worker, so they are processed in the order they were received.
+ * Records of different clients are processed in parallel.
+ */
+struct worker_pool {
+        struct worker *workers;
+        int nworkers;
+        worker_fn fn;
+        void *arg;
+        /* Tells the workers to exit once their queue is empty */
+        bool stopping;
+        /* Time records spend in the queues. It is kept across restarts of
+         * the pool. */
+        struct stats_histogram queue_latency;
+};
+
+/**
+ * Initialize a pool with no workers, in which case the caller processes
+ * records itself
+ *
+ * @param pool The pool
+ */
+void worker_pool_init(struct worker_pool *pool);
+
+/**
+ * Start the worker threads
+ *
+ * @param pool The pool, initialized with worker_pool_init() or stopped
+ * @param nworkers Number of threads, up to WORKER_POOL_MAX. No thread is
+ *    started for 0.
+ * @param fn Called for each record
+ * @param arg Passed to fn
+ *
+ * @return 0 on success, or a negative errno-style value on error, in which
+ *    case the pool has no workers
+ */
+int worker_pool_start(struct worker_pool *pool, int nworkers, worker_fn fn,
+                      void *arg);
+
+/**
+ * Reserve room for a record in the queue of the worker of a client, without
+ * waiting. Only one thread may reserve and submit records.
+ *
+ * @param pool The pool, with workers
+ * @param key Identifies the client, whose records must stay in order
+ *
+ * @return 0 if room was reserved, or -EAGAIN if the worker's queue is full
+ */
+int worker_pool_reserve(struct worker_pool *pool, unsigned int key);
+
+/**
+ * Reserve room for a record in the queue of the worker of a client, waiting
+ * for the worker to make some. Only for a client that cannot be held back.
+ *
+ * @param pool The pool, with workers
+ * @param key Identifies the client, whose records must stay in order
+ */
+void worker_pool_reserve_wait(struct worker_pool *pool, unsigned int key);
+
+/**
+ * Give back the room reserved by worker_pool_reserve(), for a record that
+ * is not submitted after all
+ *
+ * @param pool The pool, with workers
+ * @param key Identifies the client
+ */
+void worker_pool_unreserve(struct worker_pool *pool, unsigned int key);
+
+/**
+ * Queue a record for the worker of its client, in the room reserved by
+ * worker_pool_reserve() or worker_pool_reserve_wait()
+ *
+ * @param pool The pool, with workers
+ * @param key Identifies the client, whose records must stay in order
+ * @param job The record, freed by the worker
+ */
+void worker_pool_submit(struct worker_pool *pool, unsigned int key,
+                        struct record_job *job);
+
+/**
+ * Wait for the workers to process the records queued, sync the records
+ * they staged, and stop them
+ *
+ * @param pool The pool
+ */
+void worker_pool_stop(struct worker_pool *pool);
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
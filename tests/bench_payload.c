@@ -0,0 +1,140 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/*
+ * Microbenchmark for payload validation. Compares the isprint()/isspace()
+ * loop that tm_set_payload() used to run with the word-at-a-time and vector
+ * implementations, on payloads shaped like what the probes send.
+ *
+ * Usage: bench_payload [iterations]
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "payload.h"
+
+static bool chars_valid_ctype(const char *payload, size_t len)
+{
+        for (size_t i = 0; i < len; i++) {
+                if (!isprint(payload[i]) && !isspace(payload[i])) {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+static const char *backtrace_lines[] = {
+        "BUG: unable to handle kernel NULL pointer dereference at 0000000000000008\n",
+        "IP: [<ffffffff8137d1a4>] __list_del_entry+0x24/0xc0\n",
+        "Call Trace:\n",
+        " [<ffffffff8137d24d>] list_del+0xd/0x30\n",
+        " [<ffffffff810a4c3e>] process_one_work+0x16e/0x4a0\n",
+        " [<ffffffff810a5021>] worker_thread+0x111/0x480\n",
+        "\tRIP: 0010:[<ffffffff8137d1a4>]  [<ffffffff8137d1a4>] __list_del_entry\n",
+};
+
+static const char *journal_lines[] = {
+        "systemd[1]: Failed to start Network Time Synchronization.\n",
+        "kernel: usb 1-1: device descriptor read/64, error -71\n",
+        "sshd[1022]: error: kex_exchange_identification: Connection closed\n",
+};
+
+static char *build_payload(const char **lines, size_t nlines, size_t size)
+{
+        char *buf = malloc(size + 1);
+        size_t used = 0;
+
+        if (buf == NULL) {
+                exit(EXIT_FAILURE);
+        }
+
+        for (size_t i = 0; used < size; i++) {
+                const char *line = lines[i % nlines];
+                size_t n = strlen(line);
+
+                if (n > size - used) {
+                        n = size - used;
+                }
+                memcpy(buf + used, line, n);
+                used += n;
+        }
+        buf[size] = '\0';
+
+        return buf;
+}
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void run(const char *name, bool (*fn)(const char *, size_t),
+                const char *payload, size_t len, long iterations)
+{
+        volatile bool sink = true;
+        double start, elapsed;
+
+        start = now();
+        for (long i = 0; i < iterations; i++) {
+                sink = fn(payload, len) && sink;
+        }
+        elapsed = now() - start;
+
+        printf("  %-8s %8.1f ns/payload %8.2f GB/s%s\n", name,
+               elapsed * 1e9 / (double)iterations,
+               (double)len * (double)iterations / elapsed / 1e9,
+               sink ? "" : " (rejected)");
+}
+
+int main(int argc, char **argv)
+{
+        long iterations = argc > 1 ? strtol(argv[1], NULL, 10) : 200000;
+        struct {
+                const char *name;
+                char *payload;
+        } cases[] = {
+                { "backtrace 8K", build_payload(backtrace_lines, 7, MAX_PAYLOAD_LENGTH) },
+                { "backtrace 1K", build_payload(backtrace_lines, 7, 1024) },
+                { "journal line", build_payload(journal_lines, 3, 64) },
+                { "journal 8K", build_payload(journal_lines, 3, MAX_PAYLOAD_LENGTH) },
+        };
+
+        for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+                size_t len = strlen(cases[i].payload);
+
+                printf("%s (%zu bytes)\n", cases[i].name, len);
+                run("ctype", chars_valid_ctype, cases[i].payload, len, iterations);
+                run("word", payload_chars_valid_word, cases[i].payload, len, iterations);
+                run("simd", payload_chars_valid, cases[i].payload, len, iterations);
+                free(cases[i].payload);
+        }
+
+        return EXIT_SUCCESS;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
@@ -0,0 +1,174 @@
+/*
+ * This program is part of the Clear Linux Project
+ *
+ * Copyright 2020 Intel Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms and conditions of the GNU Lesser General Public License, as
+ * published by the Free Software Foundation; either version 2.1 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ */
+
+/*
+ * Benchmark for the file operations of staging and spool processing, run
+ * through io_uring and synchronously. Records are staged in group sync mode,
+ * then the directory is scanned with statx() and the records are unlinked,
+ * as telempostd does. Run it on the file systems to compare, e.g. a tmpfs
+ * and a directory on a block device.
+ *
+ * Usage: bench_staging <directory> [records]
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "io_batch.h"
+#include "staging.h"
+
+/* Size of the records, about that of a small crash report */
+#define RECORD_SIZE 2048
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void report(const char *phase, long records, double elapsed)
+{
+        printf("  %-8s %10.0f records/s\n", phase, (double)records / elapsed);
+}
+
+static char **list_records(const char *dir, long records)
+{
+        char **names = calloc((size_t)records, sizeof(char *));
+        struct dirent *entry;
+        long n = 0;
+        DIR *d;
+
+        if (names == NULL || (d = opendir(dir)) == NULL) {
+                perror("Unable to list records");
+                exit(EXIT_FAILURE);
+        }
+        while ((entry = readdir(d)) != NULL && n < records) {
+                if (entry->d_name[0] != '.') {
+                        names[n++] = strdup(entry->d_name);
+                }
+        }
+        closedir(d);
+        if (n != records) {
+                fprintf(stderr, "Found %ld records of %ld\n", n, records);
+                exit(EXIT_FAILURE);
+        }
+
+        return names;
+}
+
+static void run(const char *dir, long records, bool use_uring)
+{
+        static char record[RECORD_SIZE];
+        struct iovec iov = { record, sizeof(record) };
+        struct staging st;
+        struct io_batch io;
+        struct statx *stx;
+        char **names;
+        double start;
+        int dirfd;
+
+        io_batch_init(&io, use_uring);
+        if (use_uring && !io_batch_uses_uring(&io)) {
+                printf("io_uring: not available\n");
+                return;
+        }
+        printf("%s\n", use_uring ? "io_uring" : "synchronous");
+        memset(record, 'r', sizeof(record));
+
+        staging_init(&st);
+        if (staging_open(&st, dir, STAGING_SYNC_GROUP, 1000, use_uring) < 0) {
+                perror("Unable to open staging directory");
+                exit(EXIT_FAILURE);
+        }
+        start = now();
+        for (long i = 0; i < records; i++) {
+                if (staging_write(&st, &iov, 1) < 0) {
+                        perror("Unable to stage record");
+                        exit(EXIT_FAILURE);
+                }
+        }
+        staging_close(&st);
+        report("stage", records, now() - start);
+
+        names = list_records(dir, records);
+        stx = calloc((size_t)records, sizeof(struct statx));
+        dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+        if (stx == NULL || dirfd < 0) {
+                perror("Unable to open directory");
+                exit(EXIT_FAILURE);
+        }
+
+        start = now();
+        for (long i = 0; i < records; i++) {
+                if (io_batch_full(&io)) {
+                        io_batch_run(&io);
+                        io_batch_reset(&io);
+                }
+                io_batch_statx(&io, dirfd, names[i], 0, &stx[i]);
+        }
+        io_batch_run(&io);
+        io_batch_reset(&io);
+        report("statx", records, now() - start);
+
+        start = now();
+        for (long i = 0; i < records; i++) {
+                if (io_batch_full(&io)) {
+                        io_batch_run(&io);
+                        io_batch_reset(&io);
+                }
+                io_batch_unlinkat(&io, dirfd, names[i], 0);
+        }
+        io_batch_run(&io);
+        io_batch_reset(&io);
+        report("unlink", records, now() - start);
+
+        for (long i = 0; i < records; i++) {
+                free(names[i]);
+        }
+        free(names);
+        free(stx);
+        close(dirfd);
+        io_batch_free(&io);
+}
+
+int main(int argc, char **argv)
+{
+        long records;
+
+        if (argc < 2) {
+                fprintf(stderr, "Usage: %s <directory> [records]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+        records = argc > 2 ? strtol(argv[2], NULL, 10) : 20000;
+
+        run(argv[1], records, false);
+        run(argv[1], records, true);
+
+        return EXIT_SUCCESS;
+}
+
+/* vi: set ts=8 sw=8 sts=4 et tw=80 cino=(0: */
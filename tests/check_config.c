@@ -14,7 +14,10 @@
  * details.
  */
 
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <check.h>
 #include "configuration.h"
 #include "configuration_check.h"
@@ -70,6 +73,7 @@ START_TEST(check_default_config)
         ck_assert_str_eq(config.strValues[CONF_RATE_LIMIT_STRATEGY], DEFAULT_RATE_LIMIT_STRATEGY);
         ck_assert_str_eq(config.strValues[CONF_CAINFO], DEFAULT_CAINFO);
         ck_assert_str_eq(config.strValues[CONF_TIDHEADER], DEFAULT_TIDHEADER);
+        ck_assert_str_eq(config.strValues[CONF_STAGING_SYNC], DEFAULT_STAGING_SYNC);
 
         ck_assert_int_eq(config.intValues[CONF_RECORD_EXPIRY], DEFAULT_RECORD_EXPIRY);
         ck_assert_int_eq(config.intValues[CONF_SPOOL_MAX_SIZE], DEFAULT_SPOOL_MAX_SIZE);
@@ -78,11 +82,24 @@ START_TEST(check_default_config)
         ck_assert_int_eq(config.intValues[CONF_BYTE_WINDOW_LENGTH], DEFAULT_BYTE_WINDOW_LENGTH);
         ck_assert_int_eq(config.intValues[CONF_RECORD_BURST_LIMIT], DEFAULT_RECORD_BURST_LIMIT);
         ck_assert_int_eq(config.intValues[CONF_BYTE_BURST_LIMIT], DEFAULT_BYTE_BURST_LIMIT);
+        ck_assert_int_eq(config.intValues[CONF_IDLE_TRIM_TIME], DEFAULT_IDLE_TRIM_TIME);
+        ck_assert_int_eq(config.intValues[CONF_STAGING_SYNC_INTERVAL], DEFAULT_STAGING_SYNC_INTERVAL);
+        ck_assert_int_eq(config.intValues[CONF_WORKER_THREADS], DEFAULT_WORKER_THREADS);
+        ck_assert_int_eq(config.intValues[CONF_PEER_RECORD_RATE], DEFAULT_PEER_RECORD_RATE);
+        ck_assert_int_eq(config.intValues[CONF_PEER_BYTE_RATE], DEFAULT_PEER_BYTE_RATE);
+        ck_assert_int_eq(config.intValues[CONF_INFLIGHT_MAX_SIZE], DEFAULT_INFLIGHT_MAX_SIZE);
+        ck_assert_int_eq(config.intValues[CONF_POST_PARALLELISM], DEFAULT_POST_PARALLELISM);
+        ck_assert_int_eq(config.intValues[CONF_BATCH_MAX_RECORDS], DEFAULT_BATCH_MAX_RECORDS);
+        ck_assert_int_eq(config.intValues[CONF_BATCH_MAX_SIZE], DEFAULT_BATCH_MAX_SIZE);
+        ck_assert_int_eq(config.intValues[CONF_BATCH_MAX_DELAY], DEFAULT_BATCH_MAX_DELAY);
 
         ck_assert(config.boolValues[CONF_RATE_LIMIT_ENABLED] == DEFAULT_RATE_LIMIT_ENABLED);
         ck_assert(config.boolValues[CONF_DAEMON_RECYCLING_ENABLED] == DEFAULT_DAEMON_RECYCLING_ENABLED);
         ck_assert(config.boolValues[CONF_RECORD_RETENTION_ENABLED] == DEFAULT_RECORD_RETENTION_ENABLED);
         ck_assert(config.boolValues[CONF_RECORD_SERVER_DELIVERY_ENABLED] == DEFAULT_RECORD_SERVER_DELIVERY_ENABLED);
+        ck_assert(config.boolValues[CONF_RECORD_STREAM_ENABLED] == DEFAULT_RECORD_STREAM_ENABLED);
+        ck_assert(config.boolValues[CONF_IO_URING_ENABLED] == DEFAULT_IO_URING_ENABLED);
+        ck_assert(config.boolValues[CONF_BATCH_DELIVERY_ENABLED] == DEFAULT_BATCH_DELIVERY_ENABLED);
 
         free_config_struct(&config);
 }
@@ -160,6 +177,89 @@ START_TEST(check_config_initialised)
 }
 END_TEST
 
+/**
+ * Write a configuration file that sets the server address, replacing any
+ * previous one with a new file
+ */
+static void write_server_config(const char *path, const char *server)
+{
+        char tmp[PATH_MAX];
+        FILE *f;
+
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+        f = fopen(tmp, "w");
+        ck_assert(f != NULL);
+        fprintf(f, "[settings]\nserver=%s\n", server);
+        fclose(f);
+        ck_assert(rename(tmp, path) == 0);
+}
+
+START_TEST(check_config_cache)
+{
+        const struct configuration *conf;
+        const struct configuration *example;
+        char path[PATH_MAX];
+
+        set_config_file(ABSTOPSRCDIR "/src/data/example.1.conf");
+
+        /* Files are parsed once, without touching the configuration in
+         * use */
+        example = config_cache_get(ABSTOPSRCDIR "/src/data/example.conf");
+        ck_assert(example != NULL);
+        ck_assert(example != current_config());
+        ck_assert_str_eq(config_server_addr(example), "http://127.0.0.1");
+        ck_assert_str_eq(config_cainfo(example), "/tmp/cacert.crt");
+        ck_assert(config_cache_get(ABSTOPSRCDIR "/src/data/example.conf") == example);
+
+        /* And again once they change */
+        snprintf(path, sizeof(path), "/tmp/check_config_cache_%d.conf", (int)getpid());
+        write_server_config(path, "http://first.example.com");
+        conf = config_cache_get(path);
+        ck_assert(conf != NULL);
+        ck_assert_str_eq(config_server_addr(conf), "http://first.example.com");
+        write_server_config(path, "http://second.example.com");
+        conf = config_cache_get(path);
+        ck_assert(conf != NULL);
+        ck_assert_str_eq(config_server_addr(conf), "http://second.example.com");
+        ck_assert_str_eq(config_tidheader(conf), DEFAULT_TIDHEADER);
+        ck_assert_str_eq(server_addr_config(), "http://127.0.0.1");
+
+        unlink(path);
+        ck_assert(config_cache_get(path) == NULL);
+        ck_assert(config_cache_get("example.conf") == NULL);
+        config_cache_release();
+}
+END_TEST
+
+START_TEST(check_config_names_read_only)
+{
+        const struct configuration *conf;
+        char path[PATH_MAX];
+        FILE *f;
+
+        /* Values are matched ignoring case, and left as they were read */
+        snprintf(path, sizeof(path), "/tmp/check_config_names_%d.conf", (int)getpid());
+        f = fopen(path, "w");
+        ck_assert(f != NULL);
+        fprintf(f, "[settings]\nserver=http://127.0.0.1\nstaging_sync=Group\n"
+                "post_compression=GZip\n");
+        fclose(f);
+
+        conf = config_cache_get(path);
+        ck_assert(conf != NULL);
+        ck_assert_str_eq(config_post_compression(conf), "gzip");
+        ck_assert_str_eq(conf->strValues[CONF_POST_COMPRESSION], "GZip");
+
+        set_config_file(path);
+        ck_assert_str_eq(staging_sync_config(), "group");
+        ck_assert_str_eq(current_config()->strValues[CONF_STAGING_SYNC], "Group");
+        ck_assert_str_eq(post_compression_config(), "gzip");
+
+        unlink(path);
+        config_cache_release();
+}
+END_TEST
+
 Suite *config_suite(void)
 {
         // A suite is comprised of test cases, defined below
@@ -173,6 +273,8 @@ Suite *config_suite(void)
         tcase_add_test(t, check_layered_config);
         tcase_add_test(t, check_read_valid_config_record_retention_delivery);
         tcase_add_test(t, check_config_initialised);
+        tcase_add_test(t, check_config_cache);
+        tcase_add_test(t, check_config_names_read_only);
 
         // add more TCases here
 
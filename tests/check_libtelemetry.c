@@ -16,11 +16,22 @@
 
 #define _GNU_SOURCE
 #include <check.h>
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 #include "common.h"
+#include "mpmc_queue.h"
+#include "payload.h"
+#include "shm_ring.h"
 #include "telemetry.h"
 
 static struct telem_ref *ref = NULL;
@@ -90,6 +101,54 @@ START_TEST(record_create_version)
 }
 END_TEST
 
+START_TEST(record_create_host_headers_cached)
+{
+        struct telem_ref *ref2 = NULL;
+        int ret;
+
+        ret = tm_create_record(&ref2, 2, "t/t/t", 2000);
+        ck_assert_int_eq(ret, 0);
+
+        /* Host headers are shared, per-record headers are not */
+        ck_assert_str_eq(ref->record->headers[TM_ARCH], ref2->record->headers[TM_ARCH]);
+        ck_assert_str_eq(ref->record->headers[TM_KERNEL_VERSION],
+                         ref2->record->headers[TM_KERNEL_VERSION]);
+        ck_assert_str_eq(ref->record->headers[TM_SYSTEM_NAME],
+                         ref2->record->headers[TM_SYSTEM_NAME]);
+        ck_assert_str_eq(ref->record->headers[TM_HOST_TYPE],
+                         ref2->record->headers[TM_HOST_TYPE]);
+        ck_assert(ref->record->headers[TM_ARCH] != ref2->record->headers[TM_ARCH]);
+        ck_assert_str_ne(ref->record->headers[TM_SEVERITY], ref2->record->headers[TM_SEVERITY]);
+        ck_assert_str_ne(ref->record->headers[TM_EVENT_ID], ref2->record->headers[TM_EVENT_ID]);
+        ck_assert_int_eq(ref->record->header_size, ref2->record->header_size);
+
+        tm_free_record(ref2);
+}
+END_TEST
+
+START_TEST(record_create_header_block)
+{
+        size_t total = 0;
+        char *start = ref->record->headers[0];
+        char *end = ref->record->headers[0];
+
+        /* All headers live in one block, each followed by its terminator */
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                char *header = ref->record->headers[i];
+
+                total += strlen(header);
+                if (header < start) {
+                        start = header;
+                }
+                if (header + strlen(header) + 1 > end) {
+                        end = header + strlen(header) + 1;
+                }
+        }
+        ck_assert_int_eq(total, ref->record->header_size);
+        ck_assert_int_eq((size_t)(end - start), total + NUM_HEADERS);
+}
+END_TEST
+
 void create_teardown(void)
 {
         if (ref) {
@@ -248,6 +307,572 @@ void event_id_teardown(void)
         free(original_event_id);
 }
 
+START_TEST(record_set_payload_len_copy)
+{
+        struct telem_ref *t_ref = NULL;
+        char payload[] = "payload with trailing data";
+
+        ck_assert(tm_create_record(&t_ref, 1, "t/t/t", 1) == 0);
+        ck_assert_int_eq(tm_set_payload_len(t_ref, payload, 7, false), 0);
+        ck_assert(t_ref->record->payload != payload);
+        ck_assert_int_eq(t_ref->record->payload_size, 7);
+        ck_assert_str_eq(t_ref->record->payload, "payload");
+        tm_free_record(t_ref);
+}
+END_TEST
+
+START_TEST(record_set_payload_len_borrow)
+{
+        struct telem_ref *t_ref = NULL;
+        char payload[] = "borrowed payload";
+
+        ck_assert(tm_create_record(&t_ref, 1, "t/t/t", 1) == 0);
+        ck_assert_int_eq(tm_set_payload_len(t_ref, payload, strlen(payload), true), 0);
+        ck_assert(t_ref->record->payload == payload);
+        ck_assert_int_eq(t_ref->record->payload_size, strlen(payload));
+
+        /* Replacing a borrowed payload must not free the caller's buffer */
+        ck_assert_int_eq(tm_set_payload(t_ref, "owned payload"), 0);
+        ck_assert(t_ref->record->payload != payload);
+        ck_assert_str_eq(payload, "borrowed payload");
+        tm_free_record(t_ref);
+}
+END_TEST
+
+START_TEST(record_set_payload_len_invalid)
+{
+        struct telem_ref *t_ref = NULL;
+        char payload[] = "bad\x01payload";
+
+        ck_assert(tm_create_record(&t_ref, 1, "t/t/t", 1) == 0);
+        ck_assert_int_eq(tm_set_payload_len(t_ref, payload, strlen(payload), true), -EINVAL);
+        ck_assert_int_eq(tm_set_payload_len(t_ref, payload, MAX_PAYLOAD_LENGTH + 1, false), -EINVAL);
+        ck_assert(t_ref->record->payload == NULL);
+        tm_free_record(t_ref);
+}
+END_TEST
+
+START_TEST(payload_validation_matches_ctype)
+{
+        char buf[80];
+
+        /* Every byte value, at every offset of buffers spanning the vector,
+         * word and byte-at-a-time paths, must be judged like the C locale
+         * isprint() || isspace() would.
+         */
+        for (int c = 0; c < 256; c++) {
+                bool expected = isprint(c) || isspace(c);
+
+                for (size_t len = 1; len <= sizeof(buf); len++) {
+                        for (size_t pos = 0; pos < len; pos++) {
+                                memset(buf, 'a', len);
+                                buf[pos] = (char)c;
+                                ck_assert(payload_chars_valid(buf, len) == expected);
+                                ck_assert(payload_chars_valid_word(buf, len) == expected);
+                        }
+                }
+        }
+
+        ck_assert(payload_chars_valid("", 0));
+        ck_assert(payload_chars_valid_word("", 0));
+}
+END_TEST
+
+/**
+ * Listen on the socket from the example configuration in place of telemprobd
+ */
+static int listen_test_socket(const char *config_file)
+{
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        int lfd;
+
+        ck_assert_int_eq(tm_set_config_file(config_file), 0);
+
+        strncpy(addr.sun_path, "/tmp/test_telem_socket", sizeof(addr.sun_path) - 1);
+        unlink(addr.sun_path);
+        lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        ck_assert(lfd >= 0);
+        ck_assert(bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+        ck_assert(listen(lfd, 1) == 0);
+
+        return lfd;
+}
+
+START_TEST(record_send_batch)
+{
+        struct telem_ref *refs[2] = { NULL, NULL };
+        char buf[2 * 16384];
+        size_t total = 0;
+        size_t offset = 0;
+        int records = 0;
+        ssize_t len;
+        uint32_t size;
+        int lfd, cfd;
+
+        /* Sending requires the opt-in, see the FIXME in create_setup() */
+        if (tm_is_opted_in() == 0) {
+                return;
+        }
+
+        lfd = listen_test_socket(ABSTOPSRCDIR "/src/data/example.conf");
+
+        for (int i = 0; i < 2; i++) {
+                ck_assert(tm_create_record(&refs[i], 1, "t/t/t", 1) == 0);
+                ck_assert(tm_set_payload(refs[i], "batched payload") == 0);
+        }
+
+        ck_assert_int_eq(tm_send_records(refs, 2), 0);
+
+        cfd = accept(lfd, NULL, NULL);
+        ck_assert(cfd >= 0);
+        while ((len = read(cfd, buf + total, sizeof(buf) - total)) > 0) {
+                total += (size_t)len;
+        }
+
+        /* Both records arrive on one connection, each framed by its size */
+        while (offset + sizeof(uint32_t) <= total) {
+                memcpy(&size, buf + offset, sizeof(uint32_t));
+                ck_assert(size > 2 * sizeof(uint32_t));
+                ck_assert(offset + size <= total);
+                ck_assert(buf[offset + size - 1] == '\0');
+                offset += size;
+                records++;
+        }
+        ck_assert_int_eq(offset, total);
+        ck_assert_int_eq(records, 2);
+
+        close(cfd);
+        close(lfd);
+        unlink("/tmp/test_telem_socket");
+        tm_free_record(refs[0]);
+        tm_free_record(refs[1]);
+}
+END_TEST
+
+#define SLOW_READER_RECORDS 64
+
+/* Accepts the connection, and only starts reading after more than one poll
+ * timeout of libtelemetry, as telemprobd does for a client over its quota */
+static void *slow_reader_thread(void *arg)
+{
+        int lfd = *(int *)arg;
+        char buf[16384];
+        size_t *total = malloc(sizeof(size_t));
+        ssize_t len;
+        int cfd;
+
+        ck_assert(total != NULL);
+        *total = 0;
+        cfd = accept(lfd, NULL, NULL);
+        ck_assert(cfd >= 0);
+        usleep(1500000);
+        while ((len = read(cfd, buf, sizeof(buf))) > 0) {
+                *total += (size_t)len;
+        }
+        close(cfd);
+
+        return total;
+}
+
+START_TEST(record_send_waits_for_daemon)
+{
+        struct telem_ref *refs[SLOW_READER_RECORDS];
+        char payload[8000];
+        pthread_t thread;
+        size_t *total;
+        int lfd;
+
+        if (tm_is_opted_in() == 0) {
+                return;
+        }
+
+        lfd = listen_test_socket(ABSTOPSRCDIR "/src/data/example.conf");
+        memset(payload, 'p', sizeof(payload) - 1);
+        payload[sizeof(payload) - 1] = '\0';
+        for (int i = 0; i < SLOW_READER_RECORDS; i++) {
+                ck_assert(tm_create_record(&refs[i], 1, "t/t/t", 1) == 0);
+                ck_assert(tm_set_payload(refs[i], payload) == 0);
+        }
+        ck_assert(pthread_create(&thread, NULL, slow_reader_thread, &lfd) == 0);
+
+        /* More than the socket holds, so the records wait for the reader */
+        ck_assert_int_eq(tm_send_records(refs, SLOW_READER_RECORDS), 0);
+
+        pthread_join(thread, (void **)&total);
+        ck_assert(*total > SLOW_READER_RECORDS * sizeof(payload));
+        free(total);
+        close(lfd);
+        unlink("/tmp/test_telem_socket");
+        for (int i = 0; i < SLOW_READER_RECORDS; i++) {
+                tm_free_record(refs[i]);
+        }
+}
+END_TEST
+
+START_TEST(record_send_batch_invalid)
+{
+        struct telem_ref *refs[1] = { NULL };
+
+        ck_assert_int_eq(tm_send_records(NULL, 1), -EINVAL);
+        ck_assert_int_eq(tm_send_records(refs, 0), -EINVAL);
+}
+END_TEST
+
+START_TEST(record_send_async)
+{
+        struct telem_ref *t_ref = NULL;
+        struct tm_async_stats stats;
+        char buf[3 * 16384];
+        size_t total = 0;
+        size_t offset = 0;
+        int records = 0;
+        uint32_t size;
+        int lfd, cfd;
+
+        /* Sending requires the opt-in, see the FIXME in create_setup() */
+        if (tm_is_opted_in() == 0) {
+                return;
+        }
+
+        lfd = listen_test_socket(ABSTOPSRCDIR "/src/data/example.conf");
+
+        ck_assert(tm_create_record(&t_ref, 1, "t/t/t", 1) == 0);
+        ck_assert(tm_set_payload(t_ref, "async payload") == 0);
+        for (int i = 0; i < 3; i++) {
+                ck_assert_int_eq(tm_send_record_async(t_ref), 0);
+        }
+        /* The queue holds its own copy of the record */
+        tm_free_record(t_ref);
+
+        ck_assert_int_eq(tm_flush_async(5000), 0);
+        tm_get_async_stats(&stats);
+        ck_assert_int_eq(stats.enqueued, 3);
+        ck_assert_int_eq(stats.sent, 3);
+        ck_assert_int_eq(stats.dropped, 0);
+        ck_assert_int_eq(stats.overflows, 0);
+
+        /* The flush thread keeps its connection, so read whole records */
+        cfd = accept(lfd, NULL, NULL);
+        ck_assert(cfd >= 0);
+        while (records < 3) {
+                ssize_t len;
+
+                if (total - offset >= sizeof(uint32_t)) {
+                        memcpy(&size, buf + offset, sizeof(uint32_t));
+                        if (total - offset >= size) {
+                                ck_assert(buf[offset + size - 1] == '\0');
+                                offset += size;
+                                records++;
+                                continue;
+                        }
+                }
+                len = read(cfd, buf + total, sizeof(buf) - total);
+                ck_assert(len > 0);
+                total += (size_t)len;
+        }
+        ck_assert_int_eq(offset, total);
+
+        close(cfd);
+        close(lfd);
+        unlink("/tmp/test_telem_socket");
+}
+END_TEST
+
+START_TEST(queue_push_pop)
+{
+        struct mpmc_queue q;
+        void *data = NULL;
+
+        ck_assert_int_eq(mpmc_queue_init(&q, 3), -EINVAL);
+        ck_assert_int_eq(mpmc_queue_init(&q, 4), 0);
+
+        ck_assert(!mpmc_queue_pop(&q, &data));
+        /* Wrap around the ring a few times */
+        for (uintptr_t lap = 0; lap < 3; lap++) {
+                for (uintptr_t i = 1; i <= 4; i++) {
+                        ck_assert(mpmc_queue_push(&q, (void *)(lap * 4 + i)));
+                }
+                ck_assert(!mpmc_queue_push(&q, (void *)1));
+                for (uintptr_t i = 1; i <= 4; i++) {
+                        ck_assert(mpmc_queue_pop(&q, &data));
+                        ck_assert(data == (void *)(lap * 4 + i));
+                }
+                ck_assert(!mpmc_queue_pop(&q, &data));
+        }
+
+        mpmc_queue_free(&q);
+}
+END_TEST
+
+#define QUEUE_PRODUCERS 4
+#define QUEUE_ITEMS 10000
+
+static void *queue_producer(void *arg)
+{
+        struct mpmc_queue *q = arg;
+
+        for (uintptr_t i = 1; i <= QUEUE_ITEMS; i++) {
+                while (!mpmc_queue_push(q, (void *)i)) {
+                        sched_yield();
+                }
+        }
+
+        return NULL;
+}
+
+START_TEST(queue_concurrent)
+{
+        pthread_t producers[QUEUE_PRODUCERS];
+        struct mpmc_queue q;
+        uint64_t sum = 0;
+        uint64_t popped = 0;
+        void *data = NULL;
+
+        ck_assert_int_eq(mpmc_queue_init(&q, 64), 0);
+        for (int i = 0; i < QUEUE_PRODUCERS; i++) {
+                ck_assert(pthread_create(&producers[i], NULL, queue_producer, &q) == 0);
+        }
+
+        /* Every item pushed is popped exactly once */
+        while (popped < (uint64_t)QUEUE_PRODUCERS * QUEUE_ITEMS) {
+                if (mpmc_queue_pop(&q, &data)) {
+                        sum += (uintptr_t)data;
+                        popped++;
+                } else {
+                        sched_yield();
+                }
+        }
+        for (int i = 0; i < QUEUE_PRODUCERS; i++) {
+                pthread_join(producers[i], NULL);
+        }
+
+        ck_assert(!mpmc_queue_pop(&q, &data));
+        ck_assert(sum == (uint64_t)QUEUE_PRODUCERS * QUEUE_ITEMS * (QUEUE_ITEMS + 1) / 2);
+        mpmc_queue_free(&q);
+}
+END_TEST
+
+START_TEST(ring_push_peek)
+{
+        struct shm_ring consumer, producer;
+        char record[64] = { 0 };
+        char *large = NULL;
+        struct iovec iov[2];
+        const char *data = NULL;
+        size_t len = 0;
+        uint64_t wakeups = 0;
+        int memfd;
+
+        ck_assert_int_eq(shm_ring_create(&consumer, &memfd), 0);
+        ck_assert_int_eq(shm_ring_attach(&producer, memfd, dup(consumer.efd)), 0);
+        close(memfd);
+
+        ck_assert_int_eq(shm_ring_peek(&consumer, &data, &len), 0);
+        ck_assert(!shm_ring_arm(&consumer));
+
+        /* Records are gathered from several buffers, like framed records */
+        iov[0].iov_base = record;
+        iov[0].iov_len = 16;
+        iov[1].iov_base = record + 16;
+        iov[1].iov_len = sizeof(record) - 16;
+        for (int i = 0; i < TM_RING_SLOTS; i++) {
+                record[0] = (char)i;
+                ck_assert_int_eq(shm_ring_push(&producer, iov, 2, sizeof(record)), 0);
+        }
+        ck_assert_int_eq(shm_ring_push(&producer, iov, 2, sizeof(record)), -EAGAIN);
+
+        large = calloc(1, TM_RING_SLOT_DATA + 1);
+        iov[0].iov_base = large;
+        iov[0].iov_len = TM_RING_SLOT_DATA + 1;
+        ck_assert_int_eq(shm_ring_push(&producer, iov, 1, iov[0].iov_len), -EMSGSIZE);
+        free(large);
+
+        /* The consumer was waiting, so the producers woke it up */
+        ck_assert(read(consumer.efd, &wakeups, sizeof(wakeups)) == sizeof(wakeups));
+        ck_assert(wakeups > 0);
+        shm_ring_clear_wakeup(&consumer);
+
+        for (int i = 0; i < TM_RING_SLOTS; i++) {
+                ck_assert_int_eq(shm_ring_peek(&consumer, &data, &len), 1);
+                ck_assert_int_eq(len, sizeof(record));
+                ck_assert_int_eq(data[0], (char)i);
+                shm_ring_release(&consumer);
+        }
+        ck_assert_int_eq(shm_ring_peek(&consumer, &data, &len), 0);
+
+        shm_ring_close(&consumer);
+        iov[0].iov_base = record;
+        iov[0].iov_len = sizeof(record);
+        ck_assert_int_eq(shm_ring_push(&producer, iov, 1, sizeof(record)), -EPIPE);
+
+        shm_ring_detach(&producer);
+        shm_ring_detach(&consumer);
+}
+END_TEST
+
+struct ring_producer {
+        struct shm_ring *ring;
+        size_t pushed;
+};
+
+static void *push_until_closed(void *arg)
+{
+        struct ring_producer *p = arg;
+        /* Full slots keep the producers in the middle of a push longer */
+        static char record[TM_RING_SLOT_DATA];
+        struct iovec iov = { .iov_base = record, .iov_len = sizeof(record) };
+        int ret;
+
+        while ((ret = shm_ring_push(p->ring, &iov, 1, sizeof(record))) != -EPIPE) {
+                if (ret == 0) {
+                        p->pushed++;
+                } else {
+                        sched_yield();
+                }
+        }
+
+        return NULL;
+}
+
+START_TEST(ring_close_race)
+{
+        /* Every push that succeeds is read by the daemon, even when the ring
+         * is closed while it is in flight */
+        for (int round = 0; round < 200; round++) {
+                struct shm_ring consumer, producer;
+                struct ring_producer p[2];
+                pthread_t threads[2];
+                const char *data = NULL;
+                size_t len = 0;
+                size_t nread = 0;
+                int memfd;
+
+                ck_assert_int_eq(shm_ring_create(&consumer, &memfd), 0);
+                ck_assert_int_eq(shm_ring_attach(&producer, memfd, dup(consumer.efd)), 0);
+                close(memfd);
+
+                for (int i = 0; i < 2; i++) {
+                        p[i].ring = &producer;
+                        p[i].pushed = 0;
+                        ck_assert_int_eq(pthread_create(&threads[i], NULL,
+                                                        push_until_closed, &p[i]), 0);
+                }
+
+                for (int i = 0; i < round % 16; i++) {
+                        while (shm_ring_peek(&consumer, &data, &len) == 0) {
+                                sched_yield();
+                        }
+                        shm_ring_release(&consumer);
+                        nread++;
+                }
+                shm_ring_close(&consumer);
+                while (shm_ring_peek(&consumer, &data, &len) == 1) {
+                        ck_assert_int_eq(len, TM_RING_SLOT_DATA);
+                        shm_ring_release(&consumer);
+                        nread++;
+                }
+
+                for (int i = 0; i < 2; i++) {
+                        pthread_join(threads[i], NULL);
+                }
+                ck_assert_uint_eq(nread, p[0].pushed + p[1].pushed);
+
+                shm_ring_detach(&producer);
+                shm_ring_detach(&consumer);
+        }
+}
+END_TEST
+
+struct ring_server {
+        int lfd;
+        int cfd;
+        struct shm_ring ring;
+};
+
+/**
+ * Answer one request for a ring, the way telemprobd does
+ */
+static void *ring_server_thread(void *arg)
+{
+        struct ring_server *server = arg;
+        uint32_t request = 0;
+        struct iovec iov = { .iov_base = &request, .iov_len = sizeof(request) };
+        union {
+                char buf[CMSG_SPACE(2 * sizeof(int))];
+                struct cmsghdr align;
+        } control;
+        struct msghdr msg = { 0 };
+        struct cmsghdr *cmsg;
+        int fds[2];
+
+        server->cfd = accept(server->lfd, NULL, NULL);
+        ck_assert(server->cfd >= 0);
+        ck_assert(read(server->cfd, &request, sizeof(request)) == sizeof(request));
+        ck_assert(request == TM_RING_REQUEST);
+
+        ck_assert_int_eq(shm_ring_create(&server->ring, &fds[0]), 0);
+        fds[1] = server->ring.efd;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+        ck_assert(sendmsg(server->cfd, &msg, 0) == sizeof(request));
+        close(fds[0]);
+
+        return NULL;
+}
+
+START_TEST(record_send_ring)
+{
+        struct telem_ref *t_ref = NULL;
+        struct ring_server server;
+        pthread_t thread;
+        const char *data = NULL;
+        size_t len = 0;
+        uint32_t size;
+
+        /* Sending requires the opt-in, see the FIXME in create_setup() */
+        if (tm_is_opted_in() == 0) {
+                return;
+        }
+
+        server.lfd = listen_test_socket(ABSTOPSRCDIR "/src/data/example.3.conf");
+        ck_assert(pthread_create(&thread, NULL, ring_server_thread, &server) == 0);
+
+        ck_assert(tm_create_record(&t_ref, 1, "t/t/t", 1) == 0);
+        ck_assert(tm_set_payload(t_ref, "ring payload") == 0);
+        ck_assert_int_eq(tm_send_record(t_ref), 0);
+        pthread_join(thread, NULL);
+        ck_assert_int_eq(tm_send_record(t_ref), 0);
+        tm_free_record(t_ref);
+
+        /* Both records are in the ring, framed as on the socket */
+        for (int i = 0; i < 2; i++) {
+                ck_assert_int_eq(shm_ring_peek(&server.ring, &data, &len), 1);
+                memcpy(&size, data, sizeof(uint32_t));
+                ck_assert_int_eq(size, len);
+                ck_assert(data[len - 1] == '\0');
+                ck_assert(memmem(data, len, "ring payload", strlen("ring payload")) != NULL);
+                shm_ring_release(&server.ring);
+        }
+        ck_assert_int_eq(shm_ring_peek(&server.ring, &data, &len), 0);
+
+        /* The second record did not open a connection */
+        ck_assert(fcntl(server.lfd, F_SETFL, O_NONBLOCK) == 0);
+        ck_assert(accept(server.lfd, NULL, NULL) < 0);
+
+        shm_ring_detach(&server.ring);
+        close(server.cfd);
+        close(server.lfd);
+        unlink("/tmp/test_telem_socket");
+}
+END_TEST
+
 Suite *lib_suite(void)
 {
         Suite *s = suite_create("libtelemetry");
@@ -259,6 +884,8 @@ Suite *lib_suite(void)
         tcase_add_test(t, record_create_severity);
         tcase_add_test(t, record_create_classification);
         tcase_add_test(t, record_create_version);
+        tcase_add_test(t, record_create_host_headers_cached);
+        tcase_add_test(t, record_create_header_block);
         suite_add_tcase(s, t);
 
         t = tcase_create("Opt-in");
@@ -284,6 +911,31 @@ Suite *lib_suite(void)
         tcase_add_test(t, record_set_event_id_long);
         suite_add_tcase(s, t);
 
+        t = tcase_create("payload");
+        tcase_add_test(t, record_set_payload_len_copy);
+        tcase_add_test(t, record_set_payload_len_borrow);
+        tcase_add_test(t, record_set_payload_len_invalid);
+        tcase_add_test(t, payload_validation_matches_ctype);
+        suite_add_tcase(s, t);
+
+        t = tcase_create("batch send");
+        tcase_add_test(t, record_send_batch);
+        tcase_add_test(t, record_send_batch_invalid);
+        tcase_add_test(t, record_send_waits_for_daemon);
+        suite_add_tcase(s, t);
+
+        t = tcase_create("async send");
+        tcase_add_test(t, queue_push_pop);
+        tcase_add_test(t, queue_concurrent);
+        tcase_add_test(t, record_send_async);
+        suite_add_tcase(s, t);
+
+        t = tcase_create("shared memory ring");
+        tcase_add_test(t, ring_push_peek);
+        tcase_add_test(t, ring_close_race);
+        tcase_add_test(t, record_send_ring);
+        suite_add_tcase(s, t);
+
         return s;
 }
 
@@ -14,25 +14,47 @@
  * details.
  */
 
+#define _GNU_SOURCE
 #include <check.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <stdlib.h>
 #include <sys/queue.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "configuration.h"
 #include "telempostdaemon.h"
 #include "common.h"
+#include "post_encoding.h"
+#include "record_file.h"
+#include "spool.h"
+#include "stats.h"
+#include "stream.h"
 
 TelemPostDaemon tdaemon;
 
-bool dummy_post(char *headers[], char *body, char *cfg_file)
+bool dummy_post(char *headers[], char *body,
+                const struct configuration *conf,
+                const char *record_path)
 {
         return true;
 }
 
-bool (*post_record_ptr)(char *headers[], char *body, char *cfg_file) = dummy_post;
+bool (*post_record_ptr)(char *headers[], char *body,
+                        const struct configuration *conf,
+                        const char *record_path) = dummy_post;
 
 void setup(void)
 {
@@ -106,6 +128,290 @@ START_TEST(check_process_record_with_incorrect_headers)
 }
 END_TEST
 
+bool failing_post(char *headers[], char *body,
+                  const struct configuration *conf,
+                  const char *record_path)
+{
+        return false;
+}
+
+/* Reads a record file into a buffer */
+static char *read_file(const char *filename, size_t *len)
+{
+        FILE *fp = fopen(filename, "r");
+        char *buf = calloc(1, 4096);
+
+        ck_assert(fp != NULL);
+        ck_assert(buf != NULL);
+        *len = fread(buf, 1, 4095, fp);
+        fclose(fp);
+
+        return buf;
+}
+
+START_TEST(check_process_streamed_record)
+{
+        setup();
+
+        bool success;
+        char *record;
+        size_t len;
+
+        record = read_file(ABSTOPSRCDIR "/tests/telempostd/correct_message", &len);
+        success = process_streamed_record(record, len, &tdaemon);
+        ck_assert(success == true);
+        free(record);
+
+        /* Corrupted records are dropped */
+        record = read_file(ABSTOPSRCDIR "/tests/telempostd/incorrect_headers", &len);
+        success = process_streamed_record(record, len, &tdaemon);
+        ck_assert(success == true);
+        free(record);
+}
+END_TEST
+
+/**
+ * Remove the copies of a record the stream saved in the spool directory
+ *
+ * @return How many there were
+ */
+static int remove_spooled_stream_records(const char *record, size_t len)
+{
+        struct dirent *ent;
+        int found = 0;
+        DIR *dir;
+
+        dir = opendir(spool_dir_config());
+        ck_assert(dir != NULL);
+        while ((ent = readdir(dir)) != NULL) {
+                char path[PATH_MAX];
+                size_t spooled_len;
+                char *spooled;
+
+                if (ent->d_name[0] != TM_STREAM_SPOOL_PREFIX) {
+                        continue;
+                }
+                snprintf(path, sizeof(path), "%s/%s", spool_dir_config(), ent->d_name);
+                spooled = read_file(path, &spooled_len);
+                if (spooled_len == len && memcmp(spooled, record, len) == 0) {
+                        unlink(path);
+                        found++;
+                }
+                free(spooled);
+        }
+        closedir(dir);
+
+        return found;
+}
+
+START_TEST(check_process_streamed_record_spooled)
+{
+        setup();
+
+        bool success;
+        char *record;
+        size_t len;
+
+        /* Records that could not be sent are saved in the spool directory */
+        post_record_ptr = failing_post;
+        record = read_file(ABSTOPSRCDIR "/tests/telempostd/correct_message", &len);
+        success = process_streamed_record(record, len, &tdaemon);
+        ck_assert(success == false);
+
+        ck_assert_msg(remove_spooled_stream_records(record, len) == 1,
+                      "Record was not spooled\n");
+        free(record);
+}
+END_TEST
+
+START_TEST(check_close_daemon_spools_stream)
+{
+        setup();
+
+        struct iovec iov;
+        char *record;
+        size_t len;
+        int sv[2];
+
+        record = read_file(ABSTOPSRCDIR "/tests/telempostd/correct_message", &len);
+        ck_assert(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, sv) == 0);
+        if (tdaemon.pollfds[peerfd].fd >= 0) {
+                close(tdaemon.pollfds[peerfd].fd);
+        }
+        tdaemon.pollfds[peerfd].fd = sv[0];
+
+        /* Records telemprobd streamed before the daemon stopped are kept */
+        iov.iov_base = record;
+        iov.iov_len = len;
+        for (int i = 0; i < 3; i++) {
+                ck_assert_int_eq(stream_send(sv[1], &iov, 1), 0);
+        }
+        close_daemon(&tdaemon);
+        ck_assert_int_eq(remove_spooled_stream_records(record, len), 3);
+        ck_assert_int_eq(tdaemon.stats.spooled, 3);
+
+        /* And the later ones are staged by telemprobd */
+        ck_assert_int_eq(stream_send(sv[1], &iov, 1), -EPIPE);
+
+        close(sv[1]);
+        free(record);
+}
+END_TEST
+
+static char *posted_body;
+static const struct configuration *posted_conf;
+
+bool capturing_post(char *headers[], char *body,
+                    const struct configuration *conf,
+                    const char *record_path)
+{
+        ck_assert_str_eq(headers[TM_EVENT_ID], "event_id: 3a2d799826edc6266d72824d2aac6763");
+        posted_body = strdup(body);
+        posted_conf = conf;
+        return true;
+}
+
+/**
+ * Write the text fixture as a binary record
+ *
+ * @param path Where to write the record
+ * @param body The body of the record, or NULL to keep that of the fixture
+ * @param hdr Set to the header of the record
+ * @param iov Set to the record, which points into hdr and the returned
+ *    buffer
+ * @param record_len Set to the length of the record
+ *
+ * @return The fixture, to be freed once done with iov
+ */
+static char *write_binary_record(const char *path, const char *body,
+                                 struct record_file_header *hdr,
+                                 struct iovec iov[RECORD_FILE_IOVS],
+                                 size_t *record_len)
+{
+        char *text;
+        char *line;
+        char *saveptr = NULL;
+        size_t len;
+        struct iovec fields[RECORD_FIELDS];
+        int fd;
+
+        text = read_file(ABSTOPSRCDIR "/tests/telempostd/correct_message", &len);
+        fields[RECORD_FIELD_CFG] = (struct iovec){ ABSTOPSRCDIR "/src/data/example.conf",
+                                                   strlen(ABSTOPSRCDIR "/src/data/example.conf") };
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                line = strtok_r(i == 0 ? text : NULL, "\n", &saveptr);
+                ck_assert(line != NULL);
+                fields[RECORD_FIELD_HEADERS + i] = (struct iovec){ line, strlen(line) };
+        }
+        line = body ? (char *)body : strtok_r(NULL, "", &saveptr);
+        fields[RECORD_FIELD_BODY] = (struct iovec){ line, strlen(line) };
+        *record_len = record_file_iov(hdr, fields, iov);
+
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        ck_assert(fd >= 0);
+        ck_assert(writev(fd, iov, RECORD_FILE_IOVS) == (ssize_t)*record_len);
+        close(fd);
+
+        return text;
+}
+
+START_TEST(check_process_binary_record)
+{
+        setup();
+
+        char *text;
+        struct record_file_header hdr;
+        struct iovec iov[RECORD_FILE_IOVS];
+        char *record;
+        size_t record_len;
+        size_t off = 0;
+        char path[PATH_MAX];
+
+        /* The fields of the text fixture, in the binary format */
+        snprintf(path, sizeof(path), "%s/binary_record", spool_dir_config());
+        text = write_binary_record(path, NULL, &hdr, iov, &record_len);
+
+        post_record_ptr = capturing_post;
+        ck_assert(process_staged_record(path, false, &tdaemon) == true);
+        ck_assert_str_eq(posted_body, "test message\n");
+        /* Posted with the settings of its cfg file, parsed once */
+        ck_assert(posted_conf != current_config());
+        ck_assert(posted_conf == config_cache_get(ABSTOPSRCDIR "/src/data/example.conf"));
+        free(posted_body);
+        posted_body = NULL;
+
+        /* The same record on the stream, once intact and once damaged */
+        record = malloc(record_len);
+        ck_assert(record != NULL);
+        for (int i = 0; i < RECORD_FILE_IOVS; i++) {
+                memcpy(record + off, iov[i].iov_base, iov[i].iov_len);
+                off += iov[i].iov_len;
+        }
+        ck_assert(process_streamed_record(record, record_len, &tdaemon) == true);
+        ck_assert_str_eq(posted_body, "test message\n");
+        ck_assert(posted_conf == config_cache_get(ABSTOPSRCDIR "/src/data/example.conf"));
+        free(posted_body);
+        posted_body = NULL;
+
+        record[record_len - 2] ^= 1;
+        ck_assert(process_streamed_record(record, record_len, &tdaemon) == true);
+        ck_assert(posted_body == NULL);
+
+        post_record_ptr = dummy_post;
+        unlink(path);
+        free(record);
+        free(text);
+}
+END_TEST
+
+static char *posted_order[3];
+static int posted_count;
+
+bool ordering_post(char *headers[], char *body,
+                   const struct configuration *conf,
+                   const char *record_path)
+{
+        if (posted_count < 3 && strncmp(body, "spooled ", 8) == 0) {
+                posted_order[posted_count++] = strdup(body);
+        }
+        return true;
+}
+
+START_TEST(check_spool_records_loop)
+{
+        setup();
+
+        const char *bodies[3] = { "spooled 0", "spooled 1", "spooled 2" };
+        struct record_file_header hdr;
+        struct iovec iov[RECORD_FILE_IOVS];
+        size_t record_len;
+        char path[PATH_MAX];
+        time_t now = time(NULL);
+
+        /* Named in the opposite order of their age */
+        for (int i = 0; i < 3; i++) {
+                struct timespec times[2] = { { now - 300 + i * 100, 0 },
+                                             { now - 300 + i * 100, 0 } };
+
+                snprintf(path, sizeof(path), "%s/spool_%c", spool_dir_config(), 'c' - i);
+                free(write_binary_record(path, bodies[i], &hdr, iov, &record_len));
+                ck_assert(utimensat(AT_FDCWD, path, times, 0) == 0);
+        }
+
+        /* The oldest records are sent first, and removed once sent */
+        post_record_ptr = ordering_post;
+        spool_records_loop(&tdaemon);
+        post_record_ptr = dummy_post;
+        ck_assert_int_eq(posted_count, 3);
+        for (int i = 0; i < 3; i++) {
+                ck_assert_str_eq(posted_order[i], bodies[i]);
+                free(posted_order[i]);
+                snprintf(path, sizeof(path), "%s/spool_%c", spool_dir_config(), 'c' - i);
+                ck_assert(access(path, F_OK) < 0);
+        }
+}
+END_TEST
+
 START_TEST(check_rate_limit_enabled_functions)
 {
         setup();
@@ -389,6 +695,675 @@ START_TEST(check_strategy_if_record_sent)
 }
 END_TEST
 
+START_TEST(check_stats_endpoint)
+{
+        setup();
+
+        char *record;
+        size_t len;
+        int fd;
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        char text[16384];
+        size_t text_len = 0;
+        ssize_t ret;
+
+        ck_assert_msg(tdaemon.pollfds[statsfd].fd >= 0,
+                      "Failed to create stats endpoint\n");
+
+        post_record_ptr = dummy_post;
+        record = read_file(ABSTOPSRCDIR "/tests/telempostd/correct_message", &len);
+        ck_assert(process_streamed_record(record, len, &tdaemon) == true);
+        free(record);
+        record = read_file(ABSTOPSRCDIR "/tests/telempostd/incorrect_headers", &len);
+        ck_assert(process_streamed_record(record, len, &tdaemon) == true);
+        free(record);
+
+        /* The text is written as soon as the client connects */
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s",
+                 spool_dir_config(), STATS_POSTD_SOCKET_NAME);
+        ck_assert(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+        serve_stats(&tdaemon);
+        while ((ret = read(fd, text + text_len, sizeof(text) - 1 - text_len)) > 0) {
+                text_len += (size_t)ret;
+        }
+        text[text_len] = '\0';
+        close(fd);
+
+        ck_assert(strstr(text, "telempostd_records_total{source=\"stream\"} 2\n") != NULL);
+        ck_assert(strstr(text, "telempostd_records_delivered_total 1\n") != NULL);
+        ck_assert(strstr(text, "telempostd_records_dropped_total{reason=\"corrupted\"} 1\n") != NULL);
+        ck_assert(strstr(text, "telempostd_post_latency_seconds_count 1\n") != NULL);
+        ck_assert(strstr(text, "telempostd_retry_attempt 0\n") != NULL);
+}
+END_TEST
+
+/* A stand-in for the backend, answering posts on a loopback port, and batch
+ * posts in the format described in post_batch.h. It serves several
+ * connections at once, keeping each open for as long as the client does,
+ * and inflates gzip bodies. The counters are read once the server is
+ * stopped. */
+#define TEST_SERVER_CLIENTS 8
+
+struct test_client {
+        int fd;
+        char buf[65536];
+        size_t len;
+};
+
+struct test_server {
+        int fd;
+        int port;
+        pthread_t thread;
+        bool stop;
+        int connections;
+        int requests;
+        /* Most connections open at once */
+        int most_open;
+        /* Records received in batches */
+        int batched;
+        /* Posts whose body was gzip encoded */
+        int encoded;
+        /* Answers 503 to every post while set */
+        bool unavailable;
+};
+
+/**
+ * Inflate a gzip body
+ *
+ * @return The body, to free, of which len is set to the length
+ */
+static char *server_inflate(const char *body, size_t body_len, size_t *len)
+{
+        size_t size = 1 << 20;
+        char *out = malloc(size);
+        z_stream zs;
+
+        ck_assert(out != NULL);
+        memset(&zs, 0, sizeof(zs));
+        ck_assert(inflateInit2(&zs, 15 + 16) == Z_OK);
+        zs.next_in = (Bytef *)body;
+        zs.avail_in = (uInt)body_len;
+        zs.next_out = (Bytef *)out;
+        zs.avail_out = (uInt)size;
+        ck_assert(inflate(&zs, Z_FINISH) == Z_STREAM_END);
+        *len = zs.total_out;
+        inflateEnd(&zs);
+
+        return out;
+}
+
+/**
+ * Answer a batch post, refusing the records whose body mentions "refuse"
+ */
+static void server_reply_batch(struct test_server *srv, int fd,
+                               const char *body, size_t len)
+{
+        char statuses[4 * POST_BATCH_MAX + 1];
+        char reply[sizeof(statuses) + 64];
+        const char *end = body + len;
+        size_t n = 0;
+        int reply_len;
+
+        while (body < end) {
+                char *next;
+                size_t hlen = strtoul(body, &next, 10);
+                size_t blen = strtoul(next, &next, 10);
+                int lines = 0;
+
+                ck_assert(*next == '\n');
+                body = next + 1;
+                for (size_t i = 0; i < hlen; i++) {
+                        lines += body[i] == '\n';
+                }
+                ck_assert_int_eq(lines, NUM_HEADERS);
+                n += (size_t)sprintf(statuses + n, "%s\n",
+                                     memmem(body + hlen, blen, "refuse", 6) ? "400" : "201");
+                body += hlen + blen;
+                srv->batched++;
+        }
+        ck_assert(body == end);
+
+        reply_len = snprintf(reply, sizeof(reply), "HTTP/1.1 200 OK\r\n"
+                             "Content-Length: %zu\r\n\r\n%s", n, statuses);
+        ck_assert(write(fd, reply, (size_t)reply_len) == reply_len);
+}
+
+/**
+ * Answer the whole posts received on a connection
+ *
+ * @return false once the client closed it
+ */
+static bool server_serve(struct test_server *srv, struct test_client *c)
+{
+        static const char reply[] = "HTTP/1.1 201 Created\r\nContent-Length: 0\r\n\r\n";
+        static const char unavailable[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                          "Content-Length: 0\r\n\r\n";
+        ssize_t ret = read(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+        char *end;
+        char *cl;
+        char *decoded;
+        const char *body;
+        size_t body_len;
+        size_t request_len;
+
+        if (ret <= 0) {
+                return false;
+        }
+        c->len += (size_t)ret;
+        c->buf[c->len] = '\0';
+
+        /* Whole requests only: the headers and the body they announce */
+        while ((end = strstr(c->buf, "\r\n\r\n")) != NULL) {
+                request_len = (size_t)(end - c->buf) + 4;
+                cl = strcasestr(c->buf, "Content-Length:");
+                if (cl != NULL && cl < end) {
+                        request_len += strtoul(cl + 15, NULL, 10);
+                }
+                if (request_len > c->len) {
+                        break;
+                }
+                srv->requests++;
+                body = end + 4;
+                body_len = request_len - (size_t)(body - c->buf);
+                decoded = NULL;
+                if (memmem(c->buf, (size_t)(end - c->buf), "Content-Encoding: gzip",
+                           22) != NULL) {
+                        decoded = server_inflate(body, body_len, &body_len);
+                        body = decoded;
+                        srv->encoded++;
+                }
+                if (__atomic_load_n(&srv->unavailable, __ATOMIC_ACQUIRE)) {
+                        ck_assert(write(c->fd, unavailable, sizeof(unavailable) - 1) ==
+                                  (ssize_t)sizeof(unavailable) - 1);
+                } else if (memmem(c->buf, (size_t)(end - c->buf), POST_BATCH_CONTENT_TYPE,
+                                  strlen(POST_BATCH_CONTENT_TYPE)) != NULL) {
+                        server_reply_batch(srv, c->fd, body, body_len);
+                } else {
+                        ck_assert(write(c->fd, reply, sizeof(reply) - 1) ==
+                                  (ssize_t)sizeof(reply) - 1);
+                }
+                free(decoded);
+                memmove(c->buf, c->buf + request_len, c->len - request_len);
+                c->len -= request_len;
+                c->buf[c->len] = '\0';
+        }
+
+        return true;
+}
+
+static void *server_run(void *arg)
+{
+        struct test_server *srv = arg;
+        struct test_client *clients = calloc(TEST_SERVER_CLIENTS, sizeof(struct test_client));
+        struct pollfd pfds[TEST_SERVER_CLIENTS + 1];
+        int open = 0;
+
+        ck_assert(clients != NULL);
+        for (int i = 0; i < TEST_SERVER_CLIENTS; i++) {
+                clients[i].fd = -1;
+        }
+
+        while (!__atomic_load_n(&srv->stop, __ATOMIC_ACQUIRE)) {
+                pfds[0].fd = srv->fd;
+                pfds[0].events = POLLIN;
+                for (int i = 0; i < TEST_SERVER_CLIENTS; i++) {
+                        pfds[i + 1].fd = clients[i].fd;
+                        pfds[i + 1].events = POLLIN;
+                }
+                if (poll(pfds, TEST_SERVER_CLIENTS + 1, 20) <= 0) {
+                        continue;
+                }
+
+                for (int i = 0; i < TEST_SERVER_CLIENTS; i++) {
+                        if (pfds[i + 1].revents == 0 ||
+                            server_serve(srv, &clients[i])) {
+                                continue;
+                        }
+                        close(clients[i].fd);
+                        clients[i].fd = -1;
+                        open--;
+                }
+
+                if (pfds[0].revents != 0 && open < TEST_SERVER_CLIENTS) {
+                        int fd = accept(srv->fd, NULL, NULL);
+                        int i = 0;
+
+                        if (fd < 0) {
+                                continue;
+                        }
+                        while (clients[i].fd >= 0) {
+                                i++;
+                        }
+                        clients[i].fd = fd;
+                        clients[i].len = 0;
+                        srv->connections++;
+                        if (++open > srv->most_open) {
+                                srv->most_open = open;
+                        }
+                }
+        }
+
+        for (int i = 0; i < TEST_SERVER_CLIENTS; i++) {
+                if (clients[i].fd >= 0) {
+                        close(clients[i].fd);
+                }
+        }
+        free(clients);
+
+        return NULL;
+}
+
+static void server_start(struct test_server *srv)
+{
+        struct sockaddr_in addr = { .sin_family = AF_INET };
+        socklen_t addr_len = sizeof(addr);
+
+        memset(srv, 0, sizeof(*srv));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        srv->fd = socket(AF_INET, SOCK_STREAM, 0);
+        ck_assert(srv->fd >= 0);
+        ck_assert(bind(srv->fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+        ck_assert(listen(srv->fd, 8) == 0);
+        ck_assert(getsockname(srv->fd, (struct sockaddr *)&addr, &addr_len) == 0);
+        srv->port = ntohs(addr.sin_port);
+        ck_assert(pthread_create(&srv->thread, NULL, server_run, srv) == 0);
+}
+
+static void server_stop(struct test_server *srv)
+{
+        __atomic_store_n(&srv->stop, true, __ATOMIC_RELEASE);
+        pthread_join(srv->thread, NULL);
+        close(srv->fd);
+}
+
+/**
+ * Write a copy of the example configuration that sends records to a server
+ *
+ * @param path Set to the path of the copy, at least PATH_MAX bytes long
+ * @param port The port of the server
+ * @param extra More settings to append, or NULL
+ */
+static void write_server_config(char *path, int port, const char *extra)
+{
+        char *example;
+        char *line;
+        char *saveptr = NULL;
+        size_t len;
+        FILE *f;
+
+        snprintf(path, PATH_MAX, "/tmp/check_postd_server_%d.conf", (int)getpid());
+        example = read_file(ABSTOPSRCDIR "/src/data/example.conf", &len);
+        f = fopen(path, "w");
+        ck_assert(f != NULL);
+        for (line = strtok_r(example, "\n", &saveptr); line != NULL;
+             line = strtok_r(NULL, "\n", &saveptr)) {
+                if (strncmp(line, "server=", 7) == 0) {
+                        fprintf(f, "server=http://127.0.0.1:%d/\n", port);
+                } else {
+                        fprintf(f, "%s\n", line);
+                }
+        }
+        if (extra != NULL) {
+                fputs(extra, f);
+        }
+        fclose(f);
+        free(example);
+}
+
+START_TEST(check_daemon_timers)
+{
+        setup();
+
+        time_t now = time(NULL);
+        int spool_time = spool_process_time_config();
+        int timeout;
+
+        /* A failed delivery before the daemon started is retried first */
+        tdaemon.bypass_http_post_ts = now;
+        start_daemon_timers(&tdaemon, now);
+        ck_assert_int_eq(tdaemon.retry_attempt, 1);
+        ck_assert_int_eq(daemon_timers_timeout(&tdaemon, now), 1000);
+        ck_assert(run_daemon_timers(&tdaemon, now + 1));
+        ck_assert_int_eq(tdaemon.retry_attempt, 0);
+
+        /* The heap trim is due before the spool scan, and wakes the daemon
+         * up first */
+        mem_policy_init(&tdaemon.mem, 1, NULL);
+        mem_policy_busy(&tdaemon.mem);
+        timeout = mem_policy_timeout(&tdaemon.mem, daemon_timers_timeout(&tdaemon, now + 1));
+        ck_assert(timeout <= 1000);
+        tdaemon.current_spool_size = -1;
+        ck_assert(run_daemon_timers(&tdaemon, now + 2));
+        ck_assert_int_eq(tdaemon.current_spool_size, -1);
+
+        /* The scan still runs on time, rather than a full period later */
+        ck_assert_int_eq(daemon_timers_timeout(&tdaemon, now + spool_time - 1), 1000);
+        ck_assert(run_daemon_timers(&tdaemon, now + spool_time));
+        ck_assert(tdaemon.current_spool_size >= 0);
+
+        /* As does recycling, once no record came for long enough */
+        ck_assert(daemon_recycling_enabled_config());
+        ck_assert(run_daemon_timers(&tdaemon, now + TM_DAEMON_EXIT_TIME - 1));
+        ck_assert(!run_daemon_timers(&tdaemon, now + TM_DAEMON_EXIT_TIME));
+}
+END_TEST
+
+START_TEST(check_post_session_reuse)
+{
+        setup();
+
+        char *headers[NUM_HEADERS];
+        char header_buf[NUM_HEADERS][64];
+        char body[] = "test message\n";
+        char config[PATH_MAX];
+        struct test_server srv;
+
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                snprintf(header_buf[i], sizeof(header_buf[i]), "%s 1",
+                         get_header_name(i));
+                headers[i] = header_buf[i];
+        }
+        /* Only the server is to be reached */
+        unsetenv("http_proxy");
+        unsetenv("HTTP_PROXY");
+        unsetenv("all_proxy");
+        unsetenv("ALL_PROXY");
+
+        server_start(&srv);
+        write_server_config(config, srv.port, NULL);
+
+        /* Records in a row share a connection */
+        for (int i = 0; i < 3; i++) {
+                ck_assert(post_record_http(headers, body, config_cache_get(config), NULL) == true);
+        }
+
+        /* Once released, posting opens a new one */
+        release_post_session();
+        ck_assert(post_record_http(headers, body, config_cache_get(config), NULL) == true);
+        release_post_session();
+
+        server_stop(&srv);
+        unlink(config);
+        ck_assert_int_eq(srv.requests, 4);
+        ck_assert_int_eq(srv.connections, 2);
+}
+END_TEST
+
+START_TEST(check_concurrent_posts)
+{
+        char path[PATH_MAX];
+        char config[PATH_MAX];
+        struct test_server srv;
+        char *record;
+        size_t len;
+
+        unsetenv("http_proxy");
+        unsetenv("HTTP_PROXY");
+        unsetenv("all_proxy");
+        unsetenv("ALL_PROXY");
+
+        server_start(&srv);
+        write_server_config(config, srv.port, "post_parallelism=4\n");
+        set_config_file(config);
+        initialize_post_daemon(&tdaemon);
+        ck_assert(concurrent_posts_enabled(&tdaemon));
+
+        /* Records are handed over without waiting for their post, up to
+         * the limit */
+        record = read_file(ABSTOPSRCDIR "/tests/telempostd/correct_message", &len);
+        for (int i = 0; i < 8; i++) {
+                ck_assert(process_streamed_record(record, len, &tdaemon) == true);
+                ck_assert(tdaemon.engine.inflight <= 4);
+        }
+        ck_assert(post_engine_busy(&tdaemon.engine));
+
+        post_engine_wait(&tdaemon.engine, 1);
+        ck_assert_int_eq(tdaemon.stats.delivered, 8);
+        ck_assert_int_eq(tdaemon.stats.spooled, 0);
+
+        /* So are spooled records, after the first one went through */
+        post_record_ptr = post_record_http;
+        for (int i = 0; i < 6; i++) {
+                FILE *f;
+
+                snprintf(path, sizeof(path), "%s/concurrent_%d", spool_dir_config(), i);
+                f = fopen(path, "w");
+                ck_assert(f != NULL);
+                ck_assert(fwrite(record, 1, len, f) == len);
+                fclose(f);
+        }
+        free(record);
+        spool_records_loop(&tdaemon);
+        post_record_ptr = dummy_post;
+        ck_assert(!post_engine_busy(&tdaemon.engine));
+        ck_assert_int_eq(tdaemon.stats.delivered, 14);
+        for (int i = 0; i < 6; i++) {
+                snprintf(path, sizeof(path), "%s/concurrent_%d", spool_dir_config(), i);
+                ck_assert(access(path, F_OK) < 0);
+        }
+        post_engine_release(&tdaemon.engine);
+        release_post_session();
+
+        server_stop(&srv);
+        unlink(config);
+        ck_assert_int_eq(srv.requests, 14);
+        ck_assert(srv.most_open > 1);
+        ck_assert(srv.most_open <= 4);
+}
+END_TEST
+
+START_TEST(check_batch_posts)
+{
+        const char *body = "test message\n";
+        char config[PATH_MAX];
+        struct test_server srv;
+        char *record;
+        char *refused;
+        size_t len;
+        DIR *dir;
+        struct dirent *ent;
+        int spooled = 0;
+
+        unsetenv("http_proxy");
+        unsetenv("HTTP_PROXY");
+        unsetenv("all_proxy");
+        unsetenv("ALL_PROXY");
+
+        server_start(&srv);
+        write_server_config(config, srv.port, "batch_delivery_enabled=true\n"
+                            "batch_max_records=4\nbatch_max_delay=60000\n");
+        set_config_file(config);
+        initialize_post_daemon(&tdaemon);
+        ck_assert(concurrent_posts_enabled(&tdaemon));
+
+        record = read_file(ABSTOPSRCDIR "/tests/telempostd/correct_message", &len);
+        ck_assert(asprintf(&refused, "%.*srefused\n", (int)(len - strlen(body)),
+                           record) > 0);
+
+        /* A full batch is posted right away, the others once the daemon
+         * finishes with its posts */
+        for (int i = 0; i < 6; i++) {
+                ck_assert(process_streamed_record(record, len, &tdaemon) == true);
+        }
+        ck_assert(process_streamed_record(refused, strlen(refused), &tdaemon) == true);
+        ck_assert(tdaemon.batch != NULL);
+        ck_assert_int_eq(tdaemon.batch->count, 3);
+        finish_posts(&tdaemon);
+        ck_assert(tdaemon.batch == NULL);
+
+        /* The record the backend refused is kept for later */
+        ck_assert_int_eq(tdaemon.stats.delivered, 6);
+        ck_assert_int_eq(tdaemon.stats.spooled, 1);
+        dir = opendir(spool_dir_config());
+        ck_assert(dir != NULL);
+        while ((ent = readdir(dir)) != NULL) {
+                char path[PATH_MAX];
+
+                if (ent->d_name[0] == TM_STREAM_SPOOL_PREFIX) {
+                        snprintf(path, sizeof(path), "%s/%s", spool_dir_config(),
+                                 ent->d_name);
+                        unlink(path);
+                        spooled++;
+                }
+        }
+        closedir(dir);
+        ck_assert_int_eq(spooled, 1);
+
+        post_engine_release(&tdaemon.engine);
+        release_post_session();
+        server_stop(&srv);
+        unlink(config);
+        free(record);
+        free(refused);
+        ck_assert_int_eq(srv.requests, 2);
+        ck_assert_int_eq(srv.batched, 7);
+}
+END_TEST
+
+START_TEST(check_compressed_posts)
+{
+        const char *body = "test message\n";
+        char config[PATH_MAX];
+        char path[PATH_MAX];
+        char cache[PATH_MAX];
+        struct test_server srv;
+        struct stat spooled;
+        struct stat before;
+        struct stat after;
+        char *record;
+        char *large;
+        size_t len;
+        FILE *f;
+
+        unsetenv("http_proxy");
+        unsetenv("HTTP_PROXY");
+        unsetenv("all_proxy");
+        unsetenv("ALL_PROXY");
+
+        server_start(&srv);
+        write_server_config(config, srv.port, "post_compression=gzip\n"
+                            "post_compression_threshold=512\n");
+        set_config_file(config);
+        initialize_post_daemon(&tdaemon);
+        post_record_ptr = post_record_http;
+
+        /* Small records are sent as they are */
+        record = read_file(ABSTOPSRCDIR "/tests/telempostd/correct_message", &len);
+        ck_assert(process_streamed_record(record, len, &tdaemon) == true);
+        ck_assert_int_eq(tdaemon.stats.delivered, 1);
+
+        /* Large ones are compressed, and kept compressed in the spool while
+         * the backend is away */
+        large = malloc(len + 4096);
+        ck_assert(large != NULL);
+        len -= strlen(body);
+        memcpy(large, record, len);
+        for (int i = 0; i < 64; i++) {
+                len += (size_t)sprintf(large + len, "#%d in frame %d of backtrace\n",
+                                       i % 3, i);
+        }
+        snprintf(path, sizeof(path), "%s/compressed", spool_dir_config());
+        snprintf(cache, sizeof(cache), "%s/" POST_ENCODING_CACHE_DIR "/compressed",
+                 spool_dir_config());
+        f = fopen(path, "w");
+        ck_assert(f != NULL);
+        ck_assert(fwrite(large, 1, len, f) == len);
+        fclose(f);
+
+        __atomic_store_n(&srv.unavailable, true, __ATOMIC_RELEASE);
+        ck_assert(process_staged_record(path, true, &tdaemon) == false);
+        ck_assert(stat(cache, &before) == 0);
+        ck_assert((size_t)before.st_size < len);
+
+        /* The next attempts post the cached body */
+        tdaemon.bypass_http_post_ts = 0;
+        ck_assert(process_staged_record(path, true, &tdaemon) == false);
+        ck_assert(stat(cache, &after) == 0);
+        ck_assert(after.st_ino == before.st_ino);
+        ck_assert(after.st_mtim.tv_sec == before.st_mtim.tv_sec &&
+                  after.st_mtim.tv_nsec == before.st_mtim.tv_nsec);
+
+        /* And counts against the size of the spool */
+        ck_assert(stat(path, &spooled) == 0);
+        ck_assert(get_spool_dir_size() >=
+                  (spooled.st_blocks + before.st_blocks) * 512);
+
+        /* Which goes away with the record once it was sent */
+        __atomic_store_n(&srv.unavailable, false, __ATOMIC_RELEASE);
+        tdaemon.bypass_http_post_ts = 0;
+        ck_assert(process_staged_record(path, true, &tdaemon) == true);
+        ck_assert(access(cache, F_OK) < 0);
+
+        /* Near the maximum size of the spool, records are compressed again
+         * rather than cached */
+        __atomic_store_n(&srv.unavailable, true, __ATOMIC_RELEASE);
+        tdaemon.bypass_http_post_ts = 0;
+        tdaemon.current_spool_size = spool_max_size_config() * 1024;
+        ck_assert(process_staged_record(path, true, &tdaemon) == false);
+        ck_assert(access(cache, F_OK) < 0);
+        unlink(path);
+
+        /* Caches left by records removed otherwise are swept */
+        f = fopen(cache, "w");
+        ck_assert(f != NULL);
+        fclose(f);
+        ck_assert_int_eq(encoded_body_sweep(spool_dir_config()), 1);
+        ck_assert(access(cache, F_OK) < 0);
+
+        post_record_ptr = dummy_post;
+        release_post_session();
+        server_stop(&srv);
+        unlink(config);
+        free(record);
+        free(large);
+        ck_assert_int_eq(tdaemon.stats.delivered, 2);
+        ck_assert_int_eq(srv.requests, 5);
+        ck_assert_int_eq(srv.encoded, 4);
+}
+END_TEST
+
+START_TEST(check_record_config_compression)
+{
+        char *headers[NUM_HEADERS];
+        char header_buf[NUM_HEADERS][64];
+        char body[4096];
+        char config[PATH_MAX];
+        struct test_server srv;
+        size_t len = 0;
+
+        setup();
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                snprintf(header_buf[i], sizeof(header_buf[i]), "%s 1",
+                         get_header_name(i));
+                headers[i] = header_buf[i];
+        }
+        for (int i = 0; i < 64; i++) {
+                len += (size_t)sprintf(body + len, "#%d in frame %d of backtrace\n",
+                                       i % 3, i);
+        }
+        unsetenv("http_proxy");
+        unsetenv("HTTP_PROXY");
+        unsetenv("all_proxy");
+        unsetenv("ALL_PROXY");
+
+        server_start(&srv);
+        write_server_config(config, srv.port, "post_compression=gzip\n"
+                            "post_compression_threshold=512\n");
+
+        /* Compressed as the config file of the record says, though the
+         * daemon's own configuration does not compress */
+        ck_assert_str_eq(post_compression_config(), "none");
+        ck_assert(post_record_http(headers, body, config_cache_get(config), NULL) == true);
+        ck_assert_int_eq(srv.encoded, 1);
+
+        release_post_session();
+        server_stop(&srv);
+        unlink(config);
+        ck_assert_int_eq(srv.requests, 1);
+}
+END_TEST
+
 Suite *config_suite(void)
 {
         // A suite is comprised of test cases, defined below
@@ -401,6 +1376,11 @@ Suite *config_suite(void)
         tcase_add_test(t, check_handle_client_with_incorrect_data);
         tcase_add_test(t, check_process_record_with_correct_size_and_data);
         tcase_add_test(t, check_process_record_with_incorrect_headers);
+        tcase_add_test(t, check_process_streamed_record);
+        tcase_add_test(t, check_process_streamed_record_spooled);
+        tcase_add_test(t, check_close_daemon_spools_stream);
+        tcase_add_test(t, check_process_binary_record);
+        tcase_add_test(t, check_spool_records_loop);
         tcase_add_test(t, check_rate_limit_enabled_functions);
         tcase_add_test(t, check_rate_limit_records_that_pass);
         tcase_add_test(t, check_rate_limit_records_that_do_not_pass);
@@ -411,6 +1391,13 @@ Suite *config_suite(void)
         tcase_add_test(t, check_strategy_spool_option);
         tcase_add_test(t, check_strategy_drop_option);
         tcase_add_test(t, check_strategy_if_record_sent);
+        tcase_add_test(t, check_stats_endpoint);
+        tcase_add_test(t, check_daemon_timers);
+        tcase_add_test(t, check_post_session_reuse);
+        tcase_add_test(t, check_concurrent_posts);
+        tcase_add_test(t, check_batch_posts);
+        tcase_add_test(t, check_compressed_posts);
+        tcase_add_test(t, check_record_config_compression);
 
         suite_add_tcase(s, t);
 
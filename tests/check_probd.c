@@ -14,9 +14,18 @@
  * details.
  */
 
+#define _GNU_SOURCE
 #include <check.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/fcntl.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <stdlib.h>
 #include <sys/queue.h>
 #include <unistd.h>
@@ -25,6 +34,10 @@
 #include "configuration_check.h"
 #include "telemdaemon.h"
 #include "common.h"
+#include "io_batch.h"
+#include "record_file.h"
+#include "stats.h"
+#include "stream.h"
 
 TelemDaemon tdaemon;
 
@@ -72,55 +85,47 @@ START_TEST(check_daemon_is_initialized)
         setup();
 
         ck_assert(tdaemon.nfds == 0);
-        ck_assert(tdaemon.pollfds == NULL);
+        ck_assert(tdaemon.epoll_fd >= 0);
+        ck_assert(is_client_table_empty(&tdaemon));
 
         teardown();
 }
 END_TEST
 
-int get_poll_fd(TelemDaemon *tdaemon, nfds_t i)
+START_TEST(check_add_del_epoll_fd)
 {
-        if (i >= 0 && i < tdaemon->nfds) {
-                return tdaemon->pollfds[i].fd;
+        setup();
+
+        int fds[3][2];
+        daemon_watch watches[3];
+        struct epoll_event ev;
+
+        for (int i = 0; i < 3; i++) {
+                ck_assert(pipe(fds[i]) == 0);
+                watches[i].type = WATCH_CLIENT;
+                watches[i].cl = NULL;
+                add_epoll_fd(&tdaemon, fds[i][0], EPOLLIN, &watches[i]);
         }
-        return -1;
-}
+        ck_assert_msg(tdaemon.nfds == 3, "Failed to add epoll fd");
 
-START_TEST(check_add_del_poll_fd)
-{
-        setup();
+        /* Events carry the watch of the fd they are for */
+        ck_assert(write(fds[1][1], "x", 1) == 1);
+        ck_assert(epoll_wait(tdaemon.epoll_fd, &ev, 1, 0) == 1);
+        ck_assert(ev.data.ptr == &watches[1]);
+
+        del_epoll_fd(&tdaemon, fds[1][0]);
+        ck_assert_msg(tdaemon.nfds == 2, "Failed to delete epoll fd");
+        ck_assert(epoll_wait(tdaemon.epoll_fd, &ev, 1, 0) == 0);
 
-        int fd = 1;
-        int short events = 1;
-        add_pollfd(&tdaemon, 1, events);
-        add_pollfd(&tdaemon, 2, events);
-        add_pollfd(&tdaemon, 3, events);
-        ck_assert_msg(tdaemon.nfds == 3, "Failed to add pollfd");
-
-        fd = get_poll_fd(&tdaemon, 0);
-        ck_assert(fd == 1);
-        fd = get_poll_fd(&tdaemon, 1);
-        ck_assert(fd == 2);
-        fd = get_poll_fd(&tdaemon, 2);
-        ck_assert(fd == 3);
-
-        del_pollfd(&tdaemon, 1);
-        ck_assert_msg(tdaemon.nfds == 2, "Failed to delete pollfd");
-        fd = get_poll_fd(&tdaemon, 1);
-        ck_assert(fd == 3);
-
-        del_pollfd(&tdaemon, 1);
-        ck_assert_msg(tdaemon.nfds == 1, "Failed to delete pollfd");
-        fd = get_poll_fd(&tdaemon, 1);
-        ck_assert(fd == -1);
-
-        del_pollfd(&tdaemon, 0);
-        ck_assert_msg(tdaemon.nfds == 0, "Failed to delete pollfd");
-        fd = get_poll_fd(&tdaemon, 0);
-        ck_assert(fd == -1);
-
-        /* Cleaning alloctions */
-        free(tdaemon.pollfds);
+        del_epoll_fd(&tdaemon, fds[0][0]);
+        del_epoll_fd(&tdaemon, fds[2][0]);
+        ck_assert_msg(tdaemon.nfds == 0, "Failed to delete epoll fd");
+
+        for (int i = 0; i < 3; i++) {
+                close(fds[i][0]);
+                close(fds[i][1]);
+        }
+        close(tdaemon.epoll_fd);
         teardown();
 }
 END_TEST
@@ -129,23 +134,27 @@ START_TEST(check_add_remove_client)
 {
         setup();
 
-        client *cl, *cl1, *cl2, *cl3;
-        cl1 = add_client(&(tdaemon.client_head), 1);
-        cl2 = add_client(&(tdaemon.client_head), 2);
-        cl3 = add_client(&(tdaemon.client_head), 3);
-
-        int i = 3;
-        LIST_FOREACH(cl, &(tdaemon.client_head), client_ptrs) {
-                ck_assert_msg((cl->fd == i), "Actual value is %d\n", cl->fd);
-                i--;
-        }
-
-        remove_client(&(tdaemon.client_head), cl1);
-        remove_client(&(tdaemon.client_head), cl2);
-        remove_client(&(tdaemon.client_head), cl3);
-        //ck_assert(tdaemon.client_head.lh_first == NULL);
-        ck_assert_msg(is_client_list_empty(&(tdaemon.client_head)), "Failed to remove clients\n");
-
+        client *cl1, *cl2, *cl3;
+        cl1 = add_client(&tdaemon, 1);
+        cl2 = add_client(&tdaemon, 2);
+        cl3 = add_client(&tdaemon, 3);
+
+        /* Clients are found by their fd */
+        ck_assert(get_client(&tdaemon, 1) == cl1);
+        ck_assert(get_client(&tdaemon, 2) == cl2);
+        ck_assert(get_client(&tdaemon, 3) == cl3);
+        ck_assert(get_client(&tdaemon, 4) == NULL);
+        ck_assert(get_client(&tdaemon, 1000) == NULL);
+        ck_assert(tdaemon.nclients == 3);
+
+        remove_client(&tdaemon, cl2);
+        ck_assert(get_client(&tdaemon, 2) == NULL);
+        ck_assert(get_client(&tdaemon, 3) == cl3);
+        remove_client(&tdaemon, cl1);
+        remove_client(&tdaemon, cl3);
+        ck_assert_msg(is_client_table_empty(&tdaemon), "Failed to remove clients\n");
+
+        free(tdaemon.clients);
         teardown();
 }
 END_TEST
@@ -176,15 +185,20 @@ START_TEST(check_handle_client_with_no_data)
         bool processed;
 
         set_up_socket_pair(&client_fd, &server_fd);
-        cl = add_client(&(tdaemon.client_head), client_fd);
+        cl = add_client(&tdaemon, client_fd);
         ck_assert_msg(cl != NULL, "failed to malloc client");
-        add_pollfd(&tdaemon, client_fd, POLLIN | POLLPRI);
+        add_epoll_fd(&tdaemon, client_fd, EPOLLIN | EPOLLPRI, &cl->sock_watch);
 
-        processed = handle_client(&tdaemon, 0, cl);
+        /* Nothing to read yet: the client is kept until it sends data */
+        processed = handle_client(&tdaemon, cl);
+        ck_assert(processed == true);
+        ck_assert_msg(!is_client_table_empty(&tdaemon), "Client removed while connection is open\n");
+
+        close(server_fd);
+        processed = handle_client(&tdaemon, cl);
         ck_assert(processed == false);
-        ck_assert_msg(is_client_list_empty(&(tdaemon.client_head)), "Failed to remove client with no data\n");
+        ck_assert_msg(is_client_table_empty(&tdaemon), "Failed to remove client with no data\n");
         ck_assert_msg(tdaemon.nfds == 0, "Failed to remove poll fd for client with n data\n");
-        close(server_fd);
 
         teardown();
 }
@@ -201,18 +215,24 @@ START_TEST(check_handle_client_with_incorrect_data)
         bool processed;
 
         set_up_socket_pair(&client_fd, &server_fd);
-        cl = add_client(&(tdaemon.client_head), client_fd);
+        cl = add_client(&tdaemon, client_fd);
         ck_assert_msg(cl != NULL, "failed to malloc client");
-        add_pollfd(&tdaemon, client_fd, POLLIN | POLLPRI);
+        add_epoll_fd(&tdaemon, client_fd, EPOLLIN | EPOLLPRI, &cl->sock_watch);
 
         ssize_t ret = write(server_fd, buf, 2);
         ck_assert(ret == 2);
 
-        processed = handle_client(&tdaemon, 0, cl);
+        /* Half a size field: wait for the rest */
+        processed = handle_client(&tdaemon, cl);
+        ck_assert(processed == true);
+        ck_assert(cl->state == CLIENT_READ_SIZE && cl->offset == 2);
+
+        /* The connection closes in the middle of the record */
+        close(server_fd);
+        processed = handle_client(&tdaemon, cl);
         ck_assert(processed == false);
-        ck_assert_msg(is_client_list_empty(&(tdaemon.client_head)), "Failed to remove client with no data\n");
+        ck_assert_msg(is_client_table_empty(&tdaemon), "Failed to remove client with no data\n");
         ck_assert_msg(tdaemon.nfds == 0, "Failed to remove poll fd for client with n data\n");
-        close(server_fd);
 
         teardown();
 }
@@ -230,20 +250,20 @@ START_TEST(check_handle_client_with_incorrect_size)
         char buf[4096];
 
         set_up_socket_pair(&client_fd, &server_fd);
-        cl = add_client(&(tdaemon.client_head), client_fd);
+        cl = add_client(&tdaemon, client_fd);
         ck_assert_msg(cl != NULL, "failed to malloc client");
-        add_pollfd(&tdaemon, client_fd, POLLIN | POLLPRI);
+        add_epoll_fd(&tdaemon, client_fd, EPOLLIN | EPOLLPRI, &cl->sock_watch);
 
-        int size = 10;
+        int size = 1 << 30;
         memset(buf, 0, 4096);
         memcpy(buf, &size, RECORD_SIZE_LEN);
         memcpy(buf + RECORD_SIZE_LEN, data, sizeof(uint32_t));
-        ssize_t ret = write(server_fd, buf, 2);
-        ck_assert(ret == 2);
+        ssize_t ret = write(server_fd, buf, 8);
+        ck_assert(ret == 8);
 
-        processed = handle_client(&tdaemon, 0, cl);
+        processed = handle_client(&tdaemon, cl);
         ck_assert(processed == false);
-        ck_assert_msg(is_client_list_empty(&(tdaemon.client_head)), "Failed to remove client with no data\n");
+        ck_assert_msg(is_client_table_empty(&tdaemon), "Failed to remove client with no data\n");
         ck_assert_msg(tdaemon.nfds == 0, "Failed to remove poll fd for client with n data\n");
         close(server_fd);
 
@@ -263,9 +283,9 @@ START_TEST(check_handle_client_with_correct_size)
         char buf[256];
 
         set_up_socket_pair(&client_fd, &server_fd);
-        cl = add_client(&(tdaemon.client_head), client_fd);
+        cl = add_client(&tdaemon, client_fd);
         ck_assert_msg(cl != NULL, "failed to malloc client");
-        add_pollfd(&tdaemon, client_fd, POLLIN | POLLPRI);
+        add_epoll_fd(&tdaemon, client_fd, EPOLLIN | EPOLLPRI, &cl->sock_watch);
 
         size_t size = strlen(data);
         memset(buf, 0, 256);
@@ -276,10 +296,10 @@ START_TEST(check_handle_client_with_correct_size)
 
         ssize_t ret = write(server_fd, buf, 2 * sizeof(uint32_t) + size + 1);
         ck_assert(ret != -1);
-        processed = handle_client(&tdaemon, 0, cl);
+        processed = handle_client(&tdaemon, cl);
         ck_assert(processed == true);
 
-        ck_assert_msg(is_client_list_empty(&(tdaemon.client_head)), "Failed to remove client with no data\n");
+        ck_assert_msg(is_client_table_empty(&tdaemon), "Failed to remove client with no data\n");
         ck_assert_msg(tdaemon.nfds == 0, "Failed to remove poll fd for client with n data\n");
         close(server_fd);
 }
@@ -306,17 +326,17 @@ START_TEST(check_process_record_with_correct_size_and_data)
         char *post_body = "test message";
 
         set_up_socket_pair(&client_fd, &server_fd);
-        cl = add_client(&(tdaemon.client_head), client_fd);
+        cl = add_client(&tdaemon, client_fd);
         ck_assert_msg(cl != NULL, "failed to malloc client");
-        add_pollfd(&tdaemon, client_fd, POLLIN | POLLPRI);
+        add_epoll_fd(&tdaemon, client_fd, EPOLLIN | EPOLLPRI, &cl->sock_watch);
 
         record = get_serialized_record(headers, post_body, &record_size);
         ssize_t ret = write(server_fd, record, record_size);
         ck_assert(ret == record_size);
 
-        processed = handle_client(&tdaemon, 0, cl);
+        processed = handle_client(&tdaemon, cl);
         ck_assert(processed == true);
-        ck_assert_msg(is_client_list_empty(&(tdaemon.client_head)), "Failed to remove client with correct data\n");
+        ck_assert_msg(is_client_table_empty(&tdaemon), "Failed to remove client with correct data\n");
         ck_assert_msg(tdaemon.nfds == 0, "Failed to remove poll fd for client with correct data\n");
         close(server_fd);
         free(record);
@@ -338,17 +358,17 @@ START_TEST(check_process_record_with_incorrect_headers)
         char *post_body = "test message";
 
         set_up_socket_pair(&client_fd, &server_fd);
-        cl = add_client(&(tdaemon.client_head), client_fd);
+        cl = add_client(&tdaemon, client_fd);
         ck_assert_msg(cl != NULL, "failed to malloc client");
-        add_pollfd(&tdaemon, client_fd, POLLIN | POLLPRI);
+        add_epoll_fd(&tdaemon, client_fd, EPOLLIN | EPOLLPRI, &cl->sock_watch);
 
         record = get_serialized_record(headers, post_body, &record_size);
         ssize_t ret = write(server_fd, record, record_size);
         ck_assert(ret == record_size);
 
-        processed = handle_client(&tdaemon, 0, cl);
+        processed = handle_client(&tdaemon, cl);
         ck_assert(processed == true);
-        ck_assert_msg(is_client_list_empty(&(tdaemon.client_head)), "Failed to remove client with incorrect headers\n");
+        ck_assert_msg(is_client_table_empty(&tdaemon), "Failed to remove client with incorrect headers\n");
         ck_assert_msg(tdaemon.nfds == 0, "Failed to remove poll fd for client with incorrect headers\n");
         close(server_fd);
         free(record);
@@ -357,6 +377,1309 @@ START_TEST(check_process_record_with_incorrect_headers)
 }
 END_TEST
 
+/* Returns the headers and body of a record, one per line, or NULL if it is
+ * not a valid record */
+static char *render_record(char *data, size_t len)
+{
+        struct record_view view;
+        char *text;
+        size_t size = 1;
+        size_t off = 0;
+
+        if (record_view_parse(&view, data, len) < 0) {
+                return NULL;
+        }
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                size += strlen(view.headers[i]) + 1;
+        }
+        size += view.body_len;
+        text = malloc(size);
+        ck_assert(text != NULL);
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                off += (size_t)sprintf(text + off, "%s\n", view.headers[i]);
+        }
+        memcpy(text + off, view.body, view.body_len + 1);
+
+        return text;
+}
+
+/* Returns the contents of the staged record whose body is body, or NULL */
+static char *read_staged_record(const char *body)
+{
+        DIR *dir;
+        struct dirent *ent;
+        char *found = NULL;
+
+        dir = opendir(spool_dir_config());
+        ck_assert(dir != NULL);
+        while (found == NULL && (ent = readdir(dir)) != NULL) {
+                char path[PATH_MAX];
+                char *data = calloc(1, 8192);
+                char *text;
+                size_t len;
+                FILE *fp;
+
+                snprintf(path, sizeof(path), "%s/%s", spool_dir_config(), ent->d_name);
+                if ((fp = fopen(path, "r")) != NULL) {
+                        len = fread(data, 1, 8191, fp);
+                        text = render_record(data, len);
+                        if (text != NULL && strstr(text, body)) {
+                                found = text;
+                                unlink(path);
+                        } else {
+                                free(text);
+                        }
+                        fclose(fp);
+                }
+                free(data);
+        }
+        closedir(dir);
+
+        return found;
+}
+
+START_TEST(check_process_record_stages_headers)
+{
+        setup();
+
+        client *cl;
+        int server_fd, client_fd;
+        char *record;
+        char *staged;
+        size_t record_size;
+        uint32_t size;
+        char post_body[64];
+        /* Blank lines between headers are ignored */
+        char *headers = "record_format_version: 1\nclassification: crash/kernel/bug\nseverity: 0\n\n"
+                        "machine_id: 1234\ncreation_timestamp: 1418672344\narch:x86_64\n"
+                        "host_type: macbookpro\nbuild: 200\nkernel_version: 3.15\n"
+                        "payload_format_version: 1\n"
+                        "system_name: clear-linux-os\n\n"
+                        "board_name: Qemu|Intel\n"
+                        "cpu_model: Intel(R) Core(TM) i7-5650U CPU @ 2.20GHz\n"
+                        "bios_version: Qemu\n"
+                        "event_id: 3a2d799826edc6266d72824d2aac6763\n";
+
+        snprintf(post_body, sizeof(post_body), "staging test %d", (int)getpid());
+        tdaemon.machine_id_override = "0123456789abcdef0123456789abcdef";
+        ck_assert(cache_machine_id(&tdaemon));
+
+        set_up_socket_pair(&client_fd, &server_fd);
+        cl = add_client(&tdaemon, client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+        add_epoll_fd(&tdaemon, client_fd, EPOLLIN | EPOLLPRI, &cl->sock_watch);
+
+        record = get_serialized_record(headers, post_body, &record_size);
+        size = (uint32_t)record_size;
+        memcpy(record, &size, sizeof(uint32_t));
+        ck_assert(write(server_fd, record, record_size) == record_size);
+        close(server_fd);
+        handle_client(&tdaemon, cl);
+
+        staged = read_staged_record(post_body);
+        ck_assert_msg(staged != NULL, "Record was not staged\n");
+        ck_assert(strstr(staged, "record_format_version: 1\nclassification: crash/kernel/bug\n"
+                             "severity: 0\nmachine_id: 0123456789abcdef0123456789abcdef\n"
+                             "creation_timestamp: 1418672344\narch:x86_64\n") == staged);
+        ck_assert(strstr(staged, "system_name: clear-linux-os\nboard_name: Qemu|Intel\n") != NULL);
+        ck_assert(strstr(staged, "event_id: 3a2d799826edc6266d72824d2aac6763\n") != NULL);
+        ck_assert(strstr(staged, "machine_id: 1234") == NULL);
+
+        free(staged);
+        free(record);
+}
+END_TEST
+
+START_TEST(check_process_record_streams_to_postd)
+{
+        setup();
+
+        client *cl;
+        int server_fd, client_fd;
+        int listen_fd, peer_fd;
+        char *record;
+        char *staged;
+        char *streamed;
+        size_t record_size;
+        uint32_t size;
+        ssize_t len;
+        char post_body[64];
+        char path[PATH_MAX];
+        char *headers = "record_format_version: 1\nclassification: t/t/t\nseverity: 1\n"
+                        "machine_id: 1234\ncreation_timestamp: 1418672344\narch:x86_64\n"
+                        "host_type: macbookpro\nbuild: 200\nkernel_version: 3.15\n"
+                        "payload_format_version: 1\nsystem_name: clear-linux-os\n"
+                        "board_name: Qemu|Intel\ncpu_model: Intel\nbios_version: Qemu\n"
+                        "event_id: 3a2d799826edc6266d72824d2aac6763\n";
+
+        listen_fd = stream_listen(spool_dir_config());
+        ck_assert(listen_fd >= 0);
+
+        /* With telempostd listening, the record goes to it */
+        snprintf(post_body, sizeof(post_body), "stream test %d", (int)getpid());
+        set_up_socket_pair(&client_fd, &server_fd);
+        cl = add_client(&tdaemon, client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+        add_epoll_fd(&tdaemon, client_fd, EPOLLIN | EPOLLPRI, &cl->sock_watch);
+        record = get_serialized_record(headers, post_body, &record_size);
+        size = (uint32_t)record_size;
+        memcpy(record, &size, sizeof(uint32_t));
+        ck_assert(write(server_fd, record, record_size) == record_size);
+        close(server_fd);
+        handle_client(&tdaemon, cl);
+        free(record);
+
+        peer_fd = accept(listen_fd, NULL, NULL);
+        ck_assert(peer_fd >= 0);
+        streamed = malloc(TM_STREAM_MAX_RECORD + 1);
+        ck_assert(streamed != NULL);
+        len = stream_recv(peer_fd, streamed, TM_STREAM_MAX_RECORD + 1);
+        ck_assert(len > 0);
+        staged = render_record(streamed, (size_t)len);
+        ck_assert_msg(staged != NULL, "Streamed record is not valid\n");
+        ck_assert(strstr(staged, "record_format_version: 1\nclassification: t/t/t\n") == staged);
+        ck_assert(strstr(staged, post_body) != NULL);
+        free(staged);
+        ck_assert(read_staged_record(post_body) == NULL);
+
+        /* Once telempostd is gone, records are staged on disk again */
+        close(peer_fd);
+        close(listen_fd);
+        snprintf(path, sizeof(path), "%s/%s", spool_dir_config(), TM_STREAM_SOCKET_NAME);
+        unlink(path);
+
+        snprintf(post_body, sizeof(post_body), "stream fallback %d", (int)getpid());
+        set_up_socket_pair(&client_fd, &server_fd);
+        cl = add_client(&tdaemon, client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+        add_epoll_fd(&tdaemon, client_fd, EPOLLIN | EPOLLPRI, &cl->sock_watch);
+        record = get_serialized_record(headers, post_body, &record_size);
+        size = (uint32_t)record_size;
+        memcpy(record, &size, sizeof(uint32_t));
+        ck_assert(write(server_fd, record, record_size) == record_size);
+        close(server_fd);
+        handle_client(&tdaemon, cl);
+        free(record);
+
+        staged = read_staged_record(post_body);
+        ck_assert_msg(staged != NULL, "Record was not staged\n");
+        ck_assert(tdaemon.stream_fd < 0);
+
+        free(staged);
+        free(streamed);
+}
+END_TEST
+
+/* Last sequence number seen for each key by ordering_fn */
+static int last_seq[3];
+static int seen;
+static bool in_order = true;
+static pthread_mutex_t order_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void ordering_fn(void *arg, struct staging *staging, uint8_t *record,
+                        size_t size)
+{
+        int key, seq;
+
+        ck_assert(size == 2 * sizeof(int));
+        memcpy(&key, record, sizeof(int));
+        memcpy(&seq, record + sizeof(int), sizeof(int));
+
+        pthread_mutex_lock(&order_lock);
+        if (seq != last_seq[key] + 1) {
+                in_order = false;
+        }
+        last_seq[key] = seq;
+        seen++;
+        pthread_mutex_unlock(&order_lock);
+}
+
+START_TEST(check_worker_pool_ordering)
+{
+        struct worker_pool pool;
+
+        worker_pool_init(&pool);
+        ck_assert(worker_pool_start(&pool, 4, ordering_fn, NULL) == 0);
+        ck_assert(pool.nworkers == 4);
+
+        /* More records than the queues hold, interleaved between keys */
+        for (int seq = 1; seq <= 1000; seq++) {
+                for (int key = 0; key < 3; key++) {
+                        struct record_job *job = malloc(sizeof(*job) + 2 * sizeof(int));
+
+                        ck_assert(job != NULL);
+                        job->size = 2 * sizeof(int);
+                        memcpy(job->data, &key, sizeof(int));
+                        memcpy(job->data + sizeof(int), &seq, sizeof(int));
+                        /* Never waits for the worker */
+                        while (worker_pool_reserve(&pool, (unsigned int)key) < 0) {
+                                usleep(100);
+                        }
+                        worker_pool_submit(&pool, (unsigned int)key, job);
+                }
+        }
+
+        /* Stopping waits for the queued records */
+        worker_pool_stop(&pool);
+        ck_assert(pool.nworkers == 0);
+        ck_assert(seen == 3000);
+        ck_assert(in_order);
+        for (int key = 0; key < 3; key++) {
+                ck_assert(last_seq[key] == 1000);
+        }
+}
+END_TEST
+
+START_TEST(check_handle_client_with_workers)
+{
+        setup();
+
+        client *cl[2];
+        int server_fd[2], client_fd;
+        char *record;
+        char *staged;
+        size_t record_size;
+        uint32_t size;
+        char post_body[2][64];
+        char *headers = "record_format_version: 1\nclassification: t/t/t\nseverity: 1\n"
+                        "machine_id: 1234\ncreation_timestamp: 1418672344\narch:x86_64\n"
+                        "host_type: macbookpro\nbuild: 200\nkernel_version: 3.15\n"
+                        "payload_format_version: 1\nsystem_name: clear-linux-os\n"
+                        "board_name: Qemu|Intel\ncpu_model: Intel\nbios_version: Qemu\n"
+                        "event_id: 3a2d799826edc6266d72824d2aac6763\n";
+
+        ck_assert(start_workers(&tdaemon, 2) == 0);
+
+        for (int i = 0; i < 2; i++) {
+                snprintf(post_body[i], sizeof(post_body[i]), "worker test %d %d",
+                         (int)getpid(), i);
+                set_up_socket_pair(&client_fd, &server_fd[i]);
+                cl[i] = add_client(&tdaemon, client_fd);
+                ck_assert_msg(cl[i] != NULL, "failed to malloc client");
+                add_epoll_fd(&tdaemon, client_fd, EPOLLIN | EPOLLPRI, &cl[i]->sock_watch);
+
+                record = get_serialized_record(headers, post_body[i], &record_size);
+                size = (uint32_t)record_size;
+                memcpy(record, &size, sizeof(uint32_t));
+                ck_assert(write(server_fd[i], record, record_size) == record_size);
+                free(record);
+        }
+        for (int i = 0; i < 2; i++) {
+                close(server_fd[i]);
+                handle_client(&tdaemon, cl[i]);
+        }
+
+        /* The records are staged by the workers, at the latest when they
+         * stop */
+        stop_workers(&tdaemon);
+        for (int i = 0; i < 2; i++) {
+                staged = read_staged_record(post_body[i]);
+                ck_assert_msg(staged != NULL, "Record was not staged\n");
+                ck_assert(strstr(staged, "record_format_version: 1\nclassification: t/t/t\n") == staged);
+                free(staged);
+        }
+}
+END_TEST
+
+START_TEST(check_handle_client_with_multiple_records)
+{
+        setup();
+
+        client *cl;
+        int server_fd, client_fd;
+        bool processed;
+        char *record;
+        size_t record_size;
+        uint32_t size;
+        char *headers = "record_format_version: 1\nclassification: crash/kernel/bug\nseverity: 0\n"
+                        "machine_id: 1234\ncreation_timestamp: 1418672344\narch:x86_64\n"
+                        "host_type: macbookpro\nbuild: 200\nkernel_version: 3.15\n"
+                        "payload_format_version: 1\n"
+                        "system_name: clear-linux-os\n"
+                        "board_name: Qemu|Intel\n"
+                        "cpu_model: Intel(R) Core(TM) i7-5650U CPU @ 2.20GHz\n"
+                        "bios_version: Qemu\n"
+                        "event_id: 3a2d799826edc6266d72824d2aac6763\n";
+        char *post_body = "test message";
+
+        set_up_socket_pair(&client_fd, &server_fd);
+        cl = add_client(&tdaemon, client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+        add_epoll_fd(&tdaemon, client_fd, EPOLLIN | EPOLLPRI, &cl->sock_watch);
+
+        /* Two records on the same connection, as sent by a session */
+        record = get_serialized_record(headers, post_body, &record_size);
+        size = (uint32_t)record_size;
+        memcpy(record, &size, sizeof(uint32_t));
+        ck_assert(write(server_fd, record, record_size) == record_size);
+        ck_assert(write(server_fd, record, record_size) == record_size);
+
+        processed = handle_client(&tdaemon, cl);
+        ck_assert(processed == true);
+        ck_assert_msg(!is_client_table_empty(&tdaemon), "Client removed while connection is open\n");
+        ck_assert_msg(tdaemon.nfds == 1, "Poll fd removed while connection is open\n");
+
+        close(server_fd);
+        processed = handle_client(&tdaemon, cl);
+        ck_assert(processed == false);
+        ck_assert_msg(is_client_table_empty(&tdaemon), "Failed to remove client after connection closed\n");
+        ck_assert_msg(tdaemon.nfds == 0, "Failed to remove poll fd after connection closed\n");
+        free(record);
+}
+END_TEST
+
+START_TEST(check_handle_client_with_partial_record)
+{
+        setup();
+
+        client *cl;
+        int server_fd, client_fd;
+        bool processed;
+        char *record;
+        size_t record_size;
+        size_t half;
+        uint32_t size;
+        char *headers = "record_format_version: 1\nclassification: crash/kernel/bug\nseverity: 0\n"
+                        "machine_id: 1234\ncreation_timestamp: 1418672344\narch:x86_64\n"
+                        "host_type: macbookpro\nbuild: 200\nkernel_version: 3.15\n"
+                        "payload_format_version: 1\n"
+                        "system_name: clear-linux-os\n"
+                        "board_name: Qemu|Intel\n"
+                        "cpu_model: Intel(R) Core(TM) i7-5650U CPU @ 2.20GHz\n"
+                        "bios_version: Qemu\n"
+                        "event_id: 3a2d799826edc6266d72824d2aac6763\n";
+        char *post_body = "test message";
+
+        set_up_socket_pair(&client_fd, &server_fd);
+        cl = add_client(&tdaemon, client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+        add_epoll_fd(&tdaemon, client_fd, EPOLLIN | EPOLLPRI, &cl->sock_watch);
+
+        record = get_serialized_record(headers, post_body, &record_size);
+        size = (uint32_t)record_size;
+        memcpy(record, &size, sizeof(uint32_t));
+        half = record_size / 2;
+
+        /* A slow writer: the record arrives in two parts */
+        ck_assert(write(server_fd, record, half) == half);
+        processed = handle_client(&tdaemon, cl);
+        ck_assert(processed == true);
+        ck_assert(cl->state == CLIENT_READ_BODY);
+        ck_assert(cl->offset == half);
+
+        /* The end of the record, and the start of the next one */
+        ck_assert(write(server_fd, record + half, record_size - half) == record_size - half);
+        ck_assert(write(server_fd, record, 3) == 3);
+        processed = handle_client(&tdaemon, cl);
+        ck_assert(processed == true);
+        ck_assert(cl->state == CLIENT_READ_SIZE);
+        ck_assert(cl->offset == 3);
+
+        ck_assert(write(server_fd, record + 3, record_size - 3) == record_size - 3);
+        processed = handle_client(&tdaemon, cl);
+        ck_assert(processed == true);
+        ck_assert(cl->state == CLIENT_READ_SIZE);
+        ck_assert(cl->offset == 0);
+        ck_assert_msg(!is_client_table_empty(&tdaemon), "Client removed while connection is open\n");
+        /* Nothing buffered: the receive buffer went back to the pool */
+        ck_assert(cl->buf == NULL);
+        ck_assert(tdaemon.pool.stats.cached_bytes > 0);
+
+        close(server_fd);
+        processed = handle_client(&tdaemon, cl);
+        ck_assert(processed == false);
+        ck_assert_msg(is_client_table_empty(&tdaemon), "Failed to remove client after connection closed\n");
+        free(record);
+}
+END_TEST
+
+START_TEST(check_buffer_pool)
+{
+        struct buffer_pool pool;
+        size_t alloc, big_alloc, huge_alloc;
+        void *buf, *big, *huge;
+
+        buffer_pool_init(&pool, 3 * BUFFER_POOL_MIN_SIZE);
+        ck_assert(pool.nclasses == 3);
+
+        buf = buffer_pool_get(&pool, 100, &alloc);
+        ck_assert(buf != NULL && alloc == BUFFER_POOL_MIN_SIZE);
+        ck_assert(pool.stats.misses == 1);
+        buffer_pool_put(&pool, buf, alloc);
+        ck_assert(pool.stats.cached_bytes == BUFFER_POOL_MIN_SIZE);
+
+        /* A request of the same class reuses the cached buffer */
+        ck_assert(buffer_pool_get(&pool, BUFFER_POOL_MIN_SIZE, &alloc) == buf);
+        ck_assert(pool.stats.hits == 1 && pool.stats.cached_bytes == 0);
+
+        big = buffer_pool_get(&pool, 2 * BUFFER_POOL_MIN_SIZE + 1, &big_alloc);
+        ck_assert(big != NULL && big_alloc == 4 * BUFFER_POOL_MIN_SIZE);
+
+        /* Larger than the largest class: not cached */
+        huge = buffer_pool_get(&pool, 1 << 20, &huge_alloc);
+        ck_assert(huge != NULL && huge_alloc == 1 << 20);
+        buffer_pool_put(&pool, huge, huge_alloc);
+
+        buffer_pool_put(&pool, buf, alloc);
+        buffer_pool_put(&pool, big, big_alloc);
+        ck_assert(pool.stats.cached_bytes == 5 * BUFFER_POOL_MIN_SIZE);
+
+        ck_assert(buffer_pool_trim(&pool) == 5 * BUFFER_POOL_MIN_SIZE);
+        ck_assert(pool.stats.cached_bytes == 0);
+
+        /* Emptied: the next request allocates again */
+        buf = buffer_pool_get(&pool, 100, &alloc);
+        ck_assert(pool.stats.misses == 4);
+        free(buf);
+}
+END_TEST
+
+static void count_release(void *arg)
+{
+        (*(int *)arg)++;
+}
+
+START_TEST(check_mem_policy_idle)
+{
+        struct buffer_pool pool;
+        struct mem_policy mem;
+        size_t alloc;
+        int releases = 0;
+
+        buffer_pool_init(&pool, BUFFER_POOL_MIN_SIZE);
+        buffer_pool_put(&pool, buffer_pool_get(&pool, 1, &alloc), alloc);
+
+        /* Disabled: never trims, and leaves the timeout alone */
+        mem_policy_init(&mem, 0, &pool);
+        mem_policy_busy(&mem);
+        ck_assert(mem_policy_timeout(&mem, 5000) == 5000);
+        ck_assert(!mem_policy_idle(&mem));
+
+        /* Nothing happened since the start: nothing to trim */
+        mem_policy_init(&mem, 1, &pool);
+        ck_assert(mem_policy_timeout(&mem, 5000) == 5000);
+        ck_assert(!mem_policy_idle(&mem));
+
+        /* Activity: the timeout ends with the idle period */
+        mem_policy_busy(&mem);
+        ck_assert(mem_policy_timeout(&mem, 5000) <= 1000);
+        ck_assert(mem_policy_timeout(&mem, -1) <= 1000);
+        ck_assert(!mem_policy_idle(&mem));
+
+        mem_policy_set_release(&mem, count_release, &releases);
+        sleep(1);
+        ck_assert(mem_policy_idle(&mem));
+        ck_assert(mem.stats.trims == 1);
+        ck_assert(pool.stats.cached_bytes == 0);
+        ck_assert(releases == 1);
+
+        /* Only once per period of activity */
+        ck_assert(!mem_policy_idle(&mem));
+        ck_assert(mem_policy_timeout(&mem, 5000) == 5000);
+
+        mem_policy_sample(&mem);
+        ck_assert(mem.stats.rss_kb > 0);
+}
+END_TEST
+
+/* Counts the records visible in a staging directory, skipping the ones
+ * still being written */
+static int count_staged_records(const char *dir)
+{
+        DIR *d = opendir(dir);
+        struct dirent *entry;
+        int count = 0;
+
+        ck_assert(d != NULL);
+        while ((entry = readdir(d)) != NULL) {
+                if (entry->d_name[0] != '.') {
+                        count++;
+                }
+        }
+        closedir(d);
+
+        return count;
+}
+
+START_TEST(check_staging_group_sync)
+{
+        char dir[] = "/tmp/check_staging_XXXXXX";
+        struct staging st;
+        struct iovec iov[2] = { { "record", 6 }, { "\n", 1 } };
+        DIR *d;
+        struct dirent *entry;
+
+        ck_assert(mkdtemp(dir) != NULL);
+        staging_init(&st);
+        ck_assert(!staging_is_open(&st));
+        ck_assert(staging_open(&st, dir, STAGING_SYNC_GROUP, 50, true) == 0);
+        ck_assert(staging_timeout(&st, 5000) == 5000);
+
+        /* Records only appear once synced */
+        ck_assert(staging_write(&st, iov, 2) == 0);
+        ck_assert(staging_write(&st, iov, 2) == 0);
+        ck_assert(count_staged_records(dir) == 0);
+        ck_assert(staging_timeout(&st, 5000) <= 50);
+        ck_assert(staging_timeout(&st, -1) <= 50);
+
+        usleep(60000);
+        ck_assert(staging_timeout(&st, 5000) == 0);
+        staging_tick(&st);
+        ck_assert(count_staged_records(dir) == 2);
+        ck_assert(staging_timeout(&st, 5000) == 5000);
+
+        /* Without group sync, records appear right away */
+        staging_close(&st);
+        ck_assert(staging_open(&st, dir, STAGING_SYNC_NONE, 0, false) == 0);
+        ck_assert(staging_write(&st, iov, 2) == 0);
+        ck_assert(count_staged_records(dir) == 3);
+        staging_close(&st);
+        ck_assert(!staging_is_open(&st));
+
+        d = opendir(dir);
+        ck_assert(d != NULL);
+        while ((entry = readdir(d)) != NULL) {
+                char path[PATH_MAX];
+                char buf[16];
+                FILE *f;
+
+                if (entry->d_name[0] == '.') {
+                        continue;
+                }
+                snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+                f = fopen(path, "r");
+                ck_assert(f != NULL);
+                ck_assert(fgets(buf, sizeof(buf), f) != NULL);
+                ck_assert_str_eq(buf, "record\n");
+                fclose(f);
+                unlink(path);
+        }
+        closedir(d);
+        rmdir(dir);
+}
+END_TEST
+
+START_TEST(check_staging_sweeps_stale_files)
+{
+        char dir[] = "/tmp/check_staging_XXXXXX";
+        char path[PATH_MAX];
+        struct timespec times[2] = { { 0, 0 }, { 0, 0 } };
+        const char *names[] = { ".aB3xyZ", ".Cd4uvw", ".encoded" };
+        struct staging st;
+        int fd;
+
+        ck_assert(mkdtemp(dir) != NULL);
+        for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+                snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+                fd = open(path, O_WRONLY | O_CREAT, 0600);
+                ck_assert(fd >= 0);
+                close(fd);
+        }
+
+        /* Only the old file with a staging name is removed */
+        snprintf(path, sizeof(path), "%s/%s", dir, names[0]);
+        ck_assert(utimensat(AT_FDCWD, path, times, 0) == 0);
+        snprintf(path, sizeof(path), "%s/%s", dir, names[2]);
+        ck_assert(utimensat(AT_FDCWD, path, times, 0) == 0);
+
+        staging_init(&st);
+        ck_assert(staging_open(&st, dir, STAGING_SYNC_NONE, 0, false) == 0);
+        staging_close(&st);
+
+        for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+                snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+                ck_assert(access(path, F_OK) == (i == 0 ? -1 : 0));
+                unlink(path);
+        }
+        rmdir(dir);
+}
+END_TEST
+
+static void run_io_batch(bool use_uring)
+{
+        char dir[] = "/tmp/check_io_batch_XXXXXX";
+        struct io_batch io;
+        struct statx stx;
+        int dirfd, fd;
+
+        ck_assert(mkdtemp(dir) != NULL);
+        dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+        ck_assert(dirfd >= 0);
+        fd = openat(dirfd, "a", O_WRONLY | O_CREAT, 0600);
+        ck_assert(fd >= 0);
+        ck_assert(write(fd, "record", 6) == 6);
+
+        io_batch_init(&io, use_uring);
+        ck_assert(use_uring || !io_batch_uses_uring(&io));
+
+        ck_assert(io_batch_fsync(&io, fd, true) == 0);
+        ck_assert(io_batch_linkat(&io, dirfd, "a", dirfd, "b", 0) == 1);
+        ck_assert(io_batch_statx(&io, dirfd, "c", 0, &stx) == 2);
+        io_batch_run(&io);
+        ck_assert_int_eq(io.ops[0].res, 0);
+        ck_assert_int_eq(io.ops[1].res, 0);
+        ck_assert_int_eq(io.ops[2].res, -ENOENT);
+        io_batch_reset(&io);
+
+        /* Links never replace a file */
+        io_batch_linkat(&io, dirfd, "a", dirfd, "b", 0);
+        io_batch_statx(&io, dirfd, "b", 0, &stx);
+        io_batch_close(&io, fd);
+        io_batch_run(&io);
+        ck_assert_int_eq(io.ops[0].res, -EEXIST);
+        ck_assert_int_eq(io.ops[1].res, 0);
+        ck_assert(S_ISREG(stx.stx_mode));
+        ck_assert(stx.stx_size == 6);
+        ck_assert_int_eq(io.ops[2].res, 0);
+        io_batch_reset(&io);
+
+        while (!io_batch_full(&io)) {
+                io_batch_unlinkat(&io, dirfd, "b", 0);
+        }
+        io_batch_run(&io);
+        for (size_t i = 1; i < IO_BATCH_MAX; i++) {
+                ck_assert(io.ops[i].res == 0 || io.ops[i].res == -ENOENT);
+        }
+        ck_assert(faccessat(dirfd, "b", F_OK, 0) < 0);
+        io_batch_reset(&io);
+
+        io_batch_free(&io);
+        ck_assert(!io_batch_uses_uring(&io));
+        ck_assert(unlinkat(dirfd, "a", 0) == 0);
+        close(dirfd);
+        ck_assert(rmdir(dir) == 0);
+}
+
+START_TEST(check_io_batch)
+{
+        run_io_batch(true);
+        run_io_batch(false);
+}
+END_TEST
+
+/**
+ * Ask for a ring on a client's connection, and attach to it as
+ * libtelemetry does
+ */
+static void request_ring(client *cl, int server_fd, struct shm_ring *ring)
+{
+        uint32_t request = TM_RING_REQUEST;
+        uint32_t reply = 0;
+        struct iovec iov = { .iov_base = &reply, .iov_len = sizeof(reply) };
+        union {
+                char buf[CMSG_SPACE(2 * sizeof(int))];
+                struct cmsghdr align;
+        } control;
+        struct msghdr msg = { 0 };
+        struct cmsghdr *cmsg;
+        int fds[2];
+
+        /* Ask for a ring, and receive its memfd and eventfd */
+        ck_assert(write(server_fd, &request, sizeof(request)) == sizeof(request));
+        ck_assert(handle_client(&tdaemon, cl) == true);
+        ck_assert_msg(cl->ring.hdr != NULL, "Ring not created\n");
+
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        ck_assert(recvmsg(server_fd, &msg, 0) == sizeof(reply));
+        ck_assert(reply == TM_RING_REQUEST);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        ck_assert(cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS);
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        ck_assert_int_eq(shm_ring_attach(ring, fds[0], fds[1]), 0);
+        close(fds[0]);
+}
+
+START_TEST(check_handle_client_with_ring)
+{
+        client *cl;
+        int server_fd, client_fd;
+        bool processed;
+        char *record;
+        size_t record_size;
+        uint32_t size;
+        char *headers = "record_format_version: 1\nclassification: crash/kernel/bug\nseverity: 0\n"
+                        "machine_id: 1234\ncreation_timestamp: 1418672344\narch:x86_64\n"
+                        "host_type: macbookpro\nbuild: 200\nkernel_version: 3.15\n"
+                        "payload_format_version: 1\n"
+                        "system_name: clear-linux-os\n"
+                        "board_name: Qemu|Intel\n"
+                        "cpu_model: Intel(R) Core(TM) i7-5650U CPU @ 2.20GHz\n"
+                        "bios_version: Qemu\n"
+                        "event_id: 3a2d799826edc6266d72824d2aac6763\n";
+        char *post_body = "test message";
+        struct iovec iov;
+        struct shm_ring ring;
+
+        set_config_file(ABSTOPSRCDIR "/src/data/example.3.conf");
+        initialize_probe_daemon(&tdaemon);
+
+        set_up_socket_pair(&client_fd, &server_fd);
+        cl = add_client(&tdaemon, client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+        add_epoll_fd(&tdaemon, client_fd, EPOLLIN | EPOLLPRI, &cl->sock_watch);
+
+        request_ring(cl, server_fd, &ring);
+        ck_assert_msg(tdaemon.nfds == 2, "Ring eventfd not polled\n");
+
+        /* Publish two records, the way libtelemetry does */
+        record = get_serialized_record(headers, post_body, &record_size);
+        size = (uint32_t)record_size;
+        memcpy(record, &size, sizeof(uint32_t));
+        iov.iov_base = record;
+        iov.iov_len = record_size;
+        ck_assert_int_eq(shm_ring_push(&ring, &iov, 1, record_size), 0);
+        ck_assert_int_eq(shm_ring_push(&ring, &iov, 1, record_size), 0);
+
+        ck_assert(handle_ring(&tdaemon, cl) == true);
+        ck_assert_msg(cl->ring.dequeue_pos == 2, "Ring records not processed\n");
+        ck_assert_msg(ring.hdr->consumer_waiting == 1, "Daemon not waiting for records\n");
+
+        /* Closing the connection releases the ring */
+        close(server_fd);
+        processed = handle_client(&tdaemon, cl);
+        ck_assert(processed == false);
+        ck_assert_msg(is_client_table_empty(&tdaemon), "Failed to remove client after connection closed\n");
+        ck_assert_msg(tdaemon.nfds == 0, "Failed to remove poll fds after connection closed\n");
+        ck_assert_int_eq(shm_ring_push(&ring, &iov, 1, record_size), -EPIPE);
+
+        shm_ring_detach(&ring);
+        free(record);
+}
+END_TEST
+
+START_TEST(check_handle_client_ring_disabled)
+{
+        setup();
+
+        client *cl;
+        int server_fd, client_fd;
+        bool processed;
+        uint32_t request = TM_RING_REQUEST;
+
+        set_up_socket_pair(&client_fd, &server_fd);
+        cl = add_client(&tdaemon, client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+        add_epoll_fd(&tdaemon, client_fd, EPOLLIN | EPOLLPRI, &cl->sock_watch);
+
+        /* The transport is off in example.conf, so the request is refused */
+        ck_assert(write(server_fd, &request, sizeof(request)) == sizeof(request));
+        processed = handle_client(&tdaemon, cl);
+        ck_assert(processed == false);
+        ck_assert_msg(is_client_table_empty(&tdaemon), "Failed to remove client asking for a ring\n");
+        ck_assert_msg(tdaemon.nfds == 0, "Failed to remove poll fd of client asking for a ring\n");
+        close(server_fd);
+}
+END_TEST
+
+START_TEST(check_peer_table)
+{
+        struct peer_table table;
+        struct peer *peer, *other;
+        int64_t now_ms;
+
+        peer_table_init(&table);
+        peer_table_configure(&table, 0, 1000);
+
+        peer = peer_table_get(&table, 1000, 10);
+        ck_assert(peer != NULL);
+        ck_assert(peer_table_get(&table, 1000, 11) == peer);
+        other = peer_table_get(&table, 1001, 12);
+        ck_assert(other != NULL && other != peer);
+        ck_assert(peer->pid == 11);
+        ck_assert_int_eq(peer->stats.clients, 2);
+        ck_assert_int_eq(table.npeers, 2);
+
+        /* One second of bytes is allowed at once, and no more */
+        now_ms = peer_table_now_ms();
+        ck_assert_int_eq(peer_admit(peer, 600, now_ms), 0);
+        ck_assert_int_eq(peer_admit(peer, 400, now_ms), 0);
+        ck_assert(peer_admit(peer, 100, now_ms) > 0);
+        ck_assert(peer_admit(peer, 100, now_ms + 101) == 0);
+        ck_assert_int_eq(peer->stats.records, 3);
+        ck_assert_int_eq(peer->stats.bytes, 1100);
+        ck_assert_int_eq(peer->stats.throttled, 1);
+
+        /* Quotas are per user */
+        ck_assert_int_eq(peer_admit(other, 1000, now_ms), 0);
+
+        /* A record larger than the bucket waits for a full bucket, and the
+         * next records pay for it */
+        ck_assert(peer_admit(other, 5000, now_ms + 500) > 0);
+        ck_assert_int_eq(peer_admit(other, 5000, now_ms + 1000), 0);
+        ck_assert(peer_admit(other, 1, now_ms + 4000) > 0);
+        ck_assert_int_eq(peer_admit(other, 1, now_ms + 5010), 0);
+
+        peer_table_put(&table, peer);
+        peer_table_put(&table, peer);
+        peer_table_put(&table, other);
+        ck_assert_int_eq(peer->stats.clients, 0);
+        /* Kept while the table has room */
+        ck_assert_int_eq(table.npeers, 2);
+        peer_table_free(&table);
+        ck_assert_int_eq(table.npeers, 0);
+}
+END_TEST
+
+START_TEST(check_handle_client_over_quota)
+{
+        setup();
+
+        client *cl;
+        int server_fd, client_fd;
+        char *record;
+        char *staged;
+        size_t record_size;
+        uint32_t size;
+        int timeout_ms;
+        char post_body[3][64];
+        char *headers = "record_format_version: 1\nclassification: t/t/t\nseverity: 1\n"
+                        "machine_id: 1234\ncreation_timestamp: 1418672344\narch:x86_64\n"
+                        "host_type: macbookpro\nbuild: 200\nkernel_version: 3.15\n"
+                        "payload_format_version: 1\nsystem_name: clear-linux-os\n"
+                        "board_name: Qemu|Intel\ncpu_model: Intel\nbios_version: Qemu\n"
+                        "event_id: 3a2d799826edc6266d72824d2aac6763\n";
+
+        /* Two records per second */
+        peer_table_configure(&tdaemon.peers, 2, 0);
+
+        set_up_socket_pair(&client_fd, &server_fd);
+        cl = add_client(&tdaemon, client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+        ck_assert(cl->uid == getuid());
+        ck_assert(cl->pid == getpid());
+        add_epoll_fd(&tdaemon, client_fd, EPOLLIN | EPOLLPRI, &cl->sock_watch);
+
+        for (int i = 0; i < 3; i++) {
+                snprintf(post_body[i], sizeof(post_body[i]), "quota test %d %d",
+                         (int)getpid(), i);
+                record = get_serialized_record(headers, post_body[i], &record_size);
+                size = (uint32_t)record_size;
+                memcpy(record, &size, sizeof(uint32_t));
+                ck_assert(write(server_fd, record, record_size) == record_size);
+                free(record);
+        }
+
+        /* The third record is held back, and the client is not read from */
+        ck_assert(handle_client(&tdaemon, cl) == true);
+        ck_assert(cl->paused);
+        ck_assert_msg(tdaemon.nfds == 0, "Paused client still polled\n");
+        ck_assert_int_eq(cl->peer->stats.records, 2);
+        ck_assert_int_eq(cl->peer->stats.throttled, 1);
+        for (int i = 0; i < 2; i++) {
+                staged = read_staged_record(post_body[i]);
+                ck_assert_msg(staged != NULL, "Record was not staged\n");
+                free(staged);
+        }
+        ck_assert(read_staged_record(post_body[2]) == NULL);
+
+        timeout_ms = paused_clients_timeout(&tdaemon, 5000);
+        ck_assert(timeout_ms > 0 && timeout_ms <= 501);
+        ck_assert(paused_clients_timeout(&tdaemon, 0) == 0);
+        resume_clients(&tdaemon);
+        ck_assert(cl->paused);
+
+        /* Once the quota allows it, the record is processed */
+        usleep((useconds_t)(timeout_ms + 10) * 1000);
+        resume_clients(&tdaemon);
+        ck_assert(!cl->paused);
+        ck_assert_msg(tdaemon.nfds == 1, "Resumed client not polled\n");
+        ck_assert_int_eq(cl->peer->stats.records, 3);
+        staged = read_staged_record(post_body[2]);
+        ck_assert_msg(staged != NULL, "Record was not staged after resuming\n");
+        free(staged);
+
+        close(server_fd);
+        ck_assert(handle_client(&tdaemon, cl) == false);
+        reap_clients(&tdaemon);
+        ck_assert_msg(is_client_table_empty(&tdaemon), "Failed to remove client after connection closed\n");
+        ck_assert_int_eq(LIST_FIRST(&tdaemon.peers.peers)->stats.clients, 0);
+        peer_table_free(&tdaemon.peers);
+}
+END_TEST
+
+START_TEST(check_handle_client_inflight_limit)
+{
+        setup();
+
+        client *cl;
+        int server_fd, client_fd;
+        char *record;
+        char *staged;
+        size_t record_size;
+        uint32_t size;
+        uint64_t count;
+        char post_body[64];
+        char *headers = "record_format_version: 1\nclassification: t/t/t\nseverity: 1\n"
+                        "machine_id: 1234\ncreation_timestamp: 1418672344\narch:x86_64\n"
+                        "host_type: macbookpro\nbuild: 200\nkernel_version: 3.15\n"
+                        "payload_format_version: 1\nsystem_name: clear-linux-os\n"
+                        "board_name: Qemu|Intel\ncpu_model: Intel\nbios_version: Qemu\n"
+                        "event_id: 3a2d799826edc6266d72824d2aac6763\n";
+
+        ck_assert(start_workers(&tdaemon, 1) == 0);
+
+        set_up_socket_pair(&client_fd, &server_fd);
+        cl = add_client(&tdaemon, client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+        add_epoll_fd(&tdaemon, client_fd, EPOLLIN | EPOLLPRI, &cl->sock_watch);
+
+        snprintf(post_body, sizeof(post_body), "inflight test %d", (int)getpid());
+        record = get_serialized_record(headers, post_body, &record_size);
+        size = (uint32_t)record_size;
+        memcpy(record, &size, sizeof(uint32_t));
+        ck_assert(write(server_fd, record, record_size) == record_size);
+        free(record);
+
+        /* The workers are behind, as far as the daemon knows */
+        tdaemon.inflight_max = 4096;
+        tdaemon.inflight = 4096;
+        ck_assert(handle_client(&tdaemon, cl) == true);
+        ck_assert(cl->paused);
+        ck_assert(cl->resume_at == 0);
+        ck_assert(tdaemon.inflight_waiting);
+        ck_assert(paused_clients_timeout(&tdaemon, 5000) == 5000);
+        resume_clients(&tdaemon);
+        ck_assert(cl->paused);
+
+        /* They caught up */
+        tdaemon.inflight = 0;
+        resume_clients(&tdaemon);
+        ck_assert(!cl->paused);
+        stop_workers(&tdaemon);
+        ck_assert(tdaemon.inflight == 0);
+        staged = read_staged_record(post_body);
+        ck_assert_msg(staged != NULL, "Record was not staged after resuming\n");
+        free(staged);
+
+        /* The worker signalled that clients may be resumed */
+        ck_assert(read(tdaemon.drain_efd, &count, sizeof(count)) == sizeof(count));
+        ck_assert(!tdaemon.inflight_waiting);
+
+        close(server_fd);
+        ck_assert(handle_client(&tdaemon, cl) == false);
+        reap_clients(&tdaemon);
+}
+END_TEST
+
+START_TEST(check_handle_client_worker_queue_full)
+{
+        setup();
+
+        client *cl;
+        int server_fd, client_fd;
+        char *record;
+        char *staged;
+        size_t record_size;
+        uint32_t size;
+        uint64_t one = 1;
+        char post_body[64];
+        char *headers = "record_format_version: 1\nclassification: t/t/t\nseverity: 1\n"
+                        "machine_id: 1234\ncreation_timestamp: 1418672344\narch:x86_64\n"
+                        "host_type: macbookpro\nbuild: 200\nkernel_version: 3.15\n"
+                        "payload_format_version: 1\nsystem_name: clear-linux-os\n"
+                        "board_name: Qemu|Intel\ncpu_model: Intel\nbios_version: Qemu\n"
+                        "event_id: 3a2d799826edc6266d72824d2aac6763\n";
+
+        ck_assert(start_workers(&tdaemon, 1) == 0);
+
+        set_up_socket_pair(&client_fd, &server_fd);
+        cl = add_client(&tdaemon, client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+        add_epoll_fd(&tdaemon, client_fd, EPOLLIN | EPOLLPRI, &cl->sock_watch);
+
+        snprintf(post_body, sizeof(post_body), "queue full test %d", (int)getpid());
+        record = get_serialized_record(headers, post_body, &record_size);
+        size = (uint32_t)record_size;
+        memcpy(record, &size, sizeof(uint32_t));
+        ck_assert(write(server_fd, record, record_size) == record_size);
+        free(record);
+
+        /* The worker's queue is full, with no limit on the bytes in flight */
+        for (int i = 0; i < WORKER_QUEUE_DEPTH; i++) {
+                ck_assert(worker_pool_reserve(&tdaemon.workers, 0) == 0);
+        }
+        ck_assert(worker_pool_reserve(&tdaemon.workers, 0) == -EAGAIN);
+
+        /* The client waits, rather than the event loop */
+        ck_assert(handle_client(&tdaemon, cl) == true);
+        ck_assert(cl->paused);
+        ck_assert(cl->resume_at == 0);
+        ck_assert(tdaemon.inflight_waiting);
+        ck_assert(paused_clients_timeout(&tdaemon, 5000) == 5000);
+        resume_clients(&tdaemon);
+        ck_assert(cl->paused);
+
+        /* Room is made, and the worker signals it */
+        for (int i = 0; i < WORKER_QUEUE_DEPTH; i++) {
+                worker_pool_unreserve(&tdaemon.workers, 0);
+        }
+        ck_assert(write(tdaemon.drain_efd, &one, sizeof(one)) == sizeof(one));
+        resume_clients(&tdaemon);
+        ck_assert(!cl->paused);
+
+        stop_workers(&tdaemon);
+        staged = read_staged_record(post_body);
+        ck_assert_msg(staged != NULL, "Record was not staged after resuming\n");
+        free(staged);
+
+        close(server_fd);
+        ck_assert(handle_client(&tdaemon, cl) == false);
+        reap_clients(&tdaemon);
+}
+END_TEST
+
+static bool room_made;
+
+static void *make_room_later(void *arg)
+{
+        usleep(100000);
+        __atomic_store_n(&room_made, true, __ATOMIC_SEQ_CST);
+        for (int i = 0; i < WORKER_QUEUE_DEPTH; i++) {
+                worker_pool_unreserve(&tdaemon.workers, 0);
+        }
+
+        return NULL;
+}
+
+START_TEST(check_close_ring_worker_queue_full)
+{
+        client *cl;
+        int server_fd, client_fd;
+        char *record;
+        char *staged;
+        size_t record_size;
+        uint32_t size;
+        char post_body[64];
+        char *headers = "record_format_version: 1\nclassification: t/t/t\nseverity: 1\n"
+                        "machine_id: 1234\ncreation_timestamp: 1418672344\narch:x86_64\n"
+                        "host_type: macbookpro\nbuild: 200\nkernel_version: 3.15\n"
+                        "payload_format_version: 1\nsystem_name: clear-linux-os\n"
+                        "board_name: Qemu|Intel\ncpu_model: Intel\nbios_version: Qemu\n"
+                        "event_id: 3a2d799826edc6266d72824d2aac6763\n";
+        struct iovec iov;
+        struct shm_ring ring;
+        pthread_t thread;
+
+        set_config_file(ABSTOPSRCDIR "/src/data/example.3.conf");
+        initialize_probe_daemon(&tdaemon);
+        ck_assert(start_workers(&tdaemon, 1) == 0);
+
+        set_up_socket_pair(&client_fd, &server_fd);
+        cl = add_client(&tdaemon, client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+        add_epoll_fd(&tdaemon, client_fd, EPOLLIN | EPOLLPRI, &cl->sock_watch);
+        request_ring(cl, server_fd, &ring);
+
+        snprintf(post_body, sizeof(post_body), "closing ring test %d", (int)getpid());
+        record = get_serialized_record(headers, post_body, &record_size);
+        size = (uint32_t)record_size;
+        memcpy(record, &size, sizeof(uint32_t));
+        iov.iov_base = record;
+        iov.iov_len = record_size;
+        ck_assert_int_eq(shm_ring_push(&ring, &iov, 1, record_size), 0);
+
+        /* The worker's queue is full with the client's earlier records */
+        for (int i = 0; i < WORKER_QUEUE_DEPTH; i++) {
+                ck_assert(worker_pool_reserve(&tdaemon.workers, 0) == 0);
+        }
+        room_made = false;
+        ck_assert(pthread_create(&thread, NULL, make_room_later, NULL) == 0);
+
+        /* The last record of the ring goes behind them, rather than being
+         * staged ahead of them */
+        close(server_fd);
+        ck_assert(handle_client(&tdaemon, cl) == false);
+        ck_assert(__atomic_load_n(&room_made, __ATOMIC_SEQ_CST));
+        pthread_join(thread, NULL);
+
+        stop_workers(&tdaemon);
+        staged = read_staged_record(post_body);
+        ck_assert_msg(staged != NULL, "Record was not staged\n");
+        free(staged);
+
+        reap_clients(&tdaemon);
+        shm_ring_detach(&ring);
+        free(record);
+}
+END_TEST
+
+START_TEST(check_stats_histogram)
+{
+        struct stats_histogram hist = { { 0 } };
+        struct stats_buf buf = { 0 };
+
+        stats_histogram_add(&hist, 0);
+        stats_histogram_add(&hist, 1);
+        stats_histogram_add(&hist, 3);
+        stats_histogram_add(&hist, 4);
+        stats_histogram_add(&hist, 1ULL << 30);
+        ck_assert_int_eq(hist.buckets[0], 2);
+        ck_assert_int_eq(hist.buckets[2], 2);
+        ck_assert_int_eq(hist.buckets[STATS_LATENCY_BUCKETS], 1);
+
+        /* Buckets are cumulative */
+        stats_print_histogram(&buf, "t", "test", &hist);
+        ck_assert(!buf.truncated);
+        ck_assert(strstr(buf.data, "t_bucket{le=\"0.000001\"} 2\n") != NULL);
+        ck_assert(strstr(buf.data, "t_bucket{le=\"0.000002\"} 2\n") != NULL);
+        ck_assert(strstr(buf.data, "t_bucket{le=\"0.000004\"} 4\n") != NULL);
+        ck_assert(strstr(buf.data, "t_bucket{le=\"+Inf\"} 5\n") != NULL);
+        ck_assert(strstr(buf.data, "t_count 5\n") != NULL);
+        free(buf.data);
+}
+END_TEST
+
+START_TEST(check_record_file)
+{
+        struct iovec fields[RECORD_FIELDS];
+        struct record_file_header hdr;
+        struct iovec iov[RECORD_FILE_IOVS];
+        struct record_view view;
+        char headers[NUM_HEADERS][64];
+        char *buf;
+        size_t len;
+        size_t off = 0;
+
+        ck_assert_int_eq(record_file_crc(0, "123456789", 9), 0xe3069283);
+        ck_assert_int_eq(record_file_crc_nibble(0, "123456789", 9), 0xe3069283);
+
+        /* Every alignment and tail length, and CRCs carried over */
+        buf = malloc(256);
+        ck_assert(buf != NULL);
+        for (int i = 0; i < 256; i++) {
+                buf[i] = (char)(i * 37 + 11);
+        }
+        for (size_t start = 0; start < 8; start++) {
+                for (size_t n = 0; start + n <= 256; n += 5) {
+                        uint32_t crc = record_file_crc_nibble(0, buf, start);
+
+                        ck_assert_int_eq(record_file_crc(crc, buf + start, n),
+                                         record_file_crc_nibble(crc, buf + start, n));
+                }
+        }
+        free(buf);
+
+        fields[RECORD_FIELD_CFG] = (struct iovec){ "/etc/t.conf", 11 };
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                snprintf(headers[i], sizeof(headers[i]), "%s: %d",
+                         get_header_name(i), i);
+                fields[RECORD_FIELD_HEADERS + i] = (struct iovec){
+                        headers[i], strlen(headers[i]) };
+        }
+        fields[RECORD_FIELD_BODY] = (struct iovec){ "body\nof the record", 19 };
+
+        len = record_file_iov(&hdr, fields, iov);
+        ck_assert(len > sizeof(hdr));
+        buf = malloc(len);
+        ck_assert(buf != NULL);
+        for (int i = 0; i < RECORD_FILE_IOVS; i++) {
+                memcpy(buf + off, iov[i].iov_base, iov[i].iov_len);
+                off += iov[i].iov_len;
+        }
+        ck_assert_int_eq(off, len);
+
+        /* Fields are read in place */
+        ck_assert(record_file_is_binary(buf, len));
+        ck_assert_int_eq(record_view_parse(&view, buf, len), 0);
+        ck_assert_str_eq(view.cfg_file, "/etc/t.conf");
+        for (int i = 0; i < NUM_HEADERS; i++) {
+                ck_assert_str_eq(view.headers[i], headers[i]);
+                ck_assert(view.headers[i] >= buf && view.headers[i] < buf + len);
+        }
+        ck_assert_str_eq(view.body, "body\nof the record");
+        ck_assert_int_eq(view.body_len, 19);
+
+        /* Damage is caught by the checksum */
+        buf[len - 3] ^= 1;
+        ck_assert_int_eq(record_view_parse(&view, buf, len), -EILSEQ);
+        buf[len - 3] ^= 1;
+        ck_assert_int_eq(record_view_parse(&view, buf, len - 1), -EBADMSG);
+
+        /* Unknown versions are rejected rather than misread */
+        hdr.version = RECORD_FILE_VERSION + 1;
+        memcpy(buf, &hdr, sizeof(hdr));
+        ck_assert_int_eq(record_view_parse(&view, buf, len), -EPROTONOSUPPORT);
+
+        /* Records without a cfg file, and text records */
+        fields[RECORD_FIELD_CFG] = (struct iovec){ NULL, 0 };
+        len = record_file_iov(&hdr, fields, iov);
+        off = 0;
+        for (int i = 0; i < RECORD_FILE_IOVS; i++) {
+                memcpy(buf + off, iov[i].iov_base, iov[i].iov_len);
+                off += iov[i].iov_len;
+        }
+        ck_assert_int_eq(record_view_parse(&view, buf, len), 0);
+        ck_assert(view.cfg_file == NULL);
+        ck_assert(!record_file_is_binary("record_format_version: 1\n", 26));
+
+        free(buf);
+}
+END_TEST
+
+START_TEST(check_stats_endpoint)
+{
+        setup();
+
+        client *cl;
+        int server_fd, client_fd;
+        int fd;
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        char *record;
+        size_t record_size;
+        uint32_t size;
+        char text[16384];
+        size_t len = 0;
+        ssize_t ret;
+        char *headers = "record_format_version: 1\nclassification: t/t/t\nseverity: 1\n"
+                        "machine_id: 1234\ncreation_timestamp: 1418672344\narch:x86_64\n"
+                        "host_type: macbookpro\nbuild: 200\nkernel_version: 3.15\n"
+                        "payload_format_version: 1\nsystem_name: clear-linux-os\n"
+                        "board_name: Qemu|Intel\ncpu_model: Intel\nbios_version: Qemu\n"
+                        "event_id: 3a2d799826edc6266d72824d2aac6763\n";
+
+        tdaemon.stats_fd = stats_listen(spool_dir_config(), STATS_PROBD_SOCKET_NAME);
+        ck_assert_msg(tdaemon.stats_fd >= 0, "Failed to create stats endpoint\n");
+
+        set_up_socket_pair(&client_fd, &server_fd);
+        cl = add_client(&tdaemon, client_fd);
+        ck_assert_msg(cl != NULL, "failed to malloc client");
+        add_epoll_fd(&tdaemon, client_fd, EPOLLIN | EPOLLPRI, &cl->sock_watch);
+        record = get_serialized_record(headers, "stats test", &record_size);
+        size = (uint32_t)record_size;
+        memcpy(record, &size, sizeof(uint32_t));
+        ck_assert(write(server_fd, record, record_size) == record_size);
+        free(record);
+        ck_assert(handle_client(&tdaemon, cl) == true);
+
+        /* The text is written as soon as the client connects */
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s",
+                 spool_dir_config(), STATS_PROBD_SOCKET_NAME);
+        ck_assert(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+        serve_stats(&tdaemon);
+        while ((ret = read(fd, text + len, sizeof(text) - 1 - len)) > 0) {
+                len += (size_t)ret;
+        }
+        text[len] = '\0';
+        close(fd);
+
+        ck_assert(strstr(text, "telemprobd_records_received_total 1\n") != NULL);
+        ck_assert(strstr(text, "telemprobd_process_latency_seconds_count 1\n") != NULL);
+        ck_assert(strstr(text, "telemprobd_records_dropped_total{reason=\"invalid\"} 0\n") != NULL);
+        ck_assert(strstr(text, "telemprobd_clients 1\n") != NULL);
+
+        close(server_fd);
+        ck_assert(handle_client(&tdaemon, cl) == false);
+        reap_clients(&tdaemon);
+        stats_close(tdaemon.stats_fd, spool_dir_config(), STATS_PROBD_SOCKET_NAME);
+        ck_assert(access(addr.sun_path, F_OK) < 0);
+        peer_table_free(&tdaemon.peers);
+}
+END_TEST
+
 Suite *config_suite(void)
 {
         // A suite is comprised of test cases, defined below
@@ -364,7 +1687,7 @@ Suite *config_suite(void)
 
         // Individual unit tests are added to "test cases"
         TCase *t = tcase_create("probd");
-        tcase_add_test(t, check_add_del_poll_fd);
+        tcase_add_test(t, check_add_del_epoll_fd);
         tcase_add_test(t, check_daemon_is_initialized);
         tcase_add_test(t, check_add_remove_client);
         tcase_add_test(t, check_handle_client_with_no_data);
@@ -373,6 +1696,27 @@ Suite *config_suite(void)
         tcase_add_test(t, check_handle_client_with_correct_size);
         tcase_add_test(t, check_process_record_with_correct_size_and_data);
         tcase_add_test(t, check_process_record_with_incorrect_headers);
+        tcase_add_test(t, check_process_record_stages_headers);
+        tcase_add_test(t, check_process_record_streams_to_postd);
+        tcase_add_test(t, check_handle_client_with_multiple_records);
+        tcase_add_test(t, check_handle_client_with_partial_record);
+        tcase_add_test(t, check_handle_client_with_ring);
+        tcase_add_test(t, check_handle_client_ring_disabled);
+        tcase_add_test(t, check_buffer_pool);
+        tcase_add_test(t, check_mem_policy_idle);
+        tcase_add_test(t, check_staging_group_sync);
+        tcase_add_test(t, check_staging_sweeps_stale_files);
+        tcase_add_test(t, check_io_batch);
+        tcase_add_test(t, check_worker_pool_ordering);
+        tcase_add_test(t, check_handle_client_with_workers);
+        tcase_add_test(t, check_peer_table);
+        tcase_add_test(t, check_handle_client_over_quota);
+        tcase_add_test(t, check_handle_client_inflight_limit);
+        tcase_add_test(t, check_handle_client_worker_queue_full);
+        tcase_add_test(t, check_close_ring_worker_queue_full);
+        tcase_add_test(t, check_stats_histogram);
+        tcase_add_test(t, check_record_file);
+        tcase_add_test(t, check_stats_endpoint);
 
         suite_add_tcase(s, t);
 
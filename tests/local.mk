@@ -47,6 +47,10 @@ endif
 	%D%/check_probd.c \
 	src/telemdaemon.c \
 	src/telemdaemon.h \
+	src/worker_pool.c \
+	src/worker_pool.h \
+	src/peer_table.c \
+	src/peer_table.h \
 	src/iorecord.h \
 	src/iorecord.c \
 	src/journal/journal.c \
@@ -59,7 +63,9 @@ endif
 %C%_check_probd_LDADD = \
 	@CHECK_LIBS@ \
 	@CURL_LIBS@ \
-	$(top_builddir)/src/libtelem-shared.la
+	$(top_builddir)/src/libtelem-daemon.la \
+	$(top_builddir)/src/libtelem-shared.la \
+	-lpthread
 
 if LOG_SYSTEMD
 if HAVE_SYSTEMD_JOURNAL
@@ -77,6 +83,12 @@ endif
 	src/retention.c \
         src/telempostdaemon.c \
         src/telempostdaemon.h \
+        src/post_batch.c \
+        src/post_batch.h \
+        src/post_engine.c \
+        src/post_engine.h \
+        src/post_encoding.c \
+        src/post_encoding.h \
         src/journal/journal.c \
         src/journal/journal.h
 
@@ -89,11 +101,17 @@ EXTRA_DIST += \
 %C%_check_postd_CFLAGS = \
         $(AM_CFLAGS) \
         @CHECK_CFLAGS@ \
-        @CURL_CFLAGS@
+        @CURL_CFLAGS@ \
+        @ZLIB_CFLAGS@ \
+        @ZSTD_CFLAGS@
 %C%_check_postd_LDADD = \
         @CHECK_LIBS@ \
         @CURL_LIBS@ \
-        $(top_builddir)/src/libtelem-shared.la
+        @ZLIB_LIBS@ \
+        @ZSTD_LIBS@ \
+        $(top_builddir)/src/libtelem-daemon.la \
+        $(top_builddir)/src/libtelem-shared.la \
+        -lpthread
 
 if LOG_SYSTEMD
 if HAVE_SYSTEMD_JOURNAL
@@ -200,6 +218,29 @@ if LOG_SYSTEMD
 endif
 endif
 
+# Microbenchmarks are not run by "make check"; build them on demand with
+# e.g. "make tests/bench_payload"
+EXTRA_PROGRAMS = \
+	%D%/bench_payload \
+	%D%/bench_staging
+
+%C%_bench_payload_SOURCES = \
+	%D%/bench_payload.c
+
+%C%_bench_payload_CFLAGS = \
+	$(AM_CFLAGS)
+%C%_bench_payload_LDADD = \
+	$(top_builddir)/src/libtelem-shared.la
+
+%C%_bench_staging_SOURCES = \
+	%D%/bench_staging.c
+
+%C%_bench_staging_CFLAGS = \
+	$(AM_CFLAGS)
+%C%_bench_staging_LDADD = \
+	$(top_builddir)/src/libtelem-daemon.la \
+	$(top_builddir)/src/libtelem-shared.la
+
 @VALGRIND_CHECK_RULES@
 VALGRIND_SUPPRESSIONS_FILES = %D%/telemetrics-client.supp
 VALGRIND_FLAGS = \